@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "arena.h"
+#include "utils.h"
+
+typedef struct arena_blk_s {
+	struct arena_blk_s *next;
+	size_t size, used; // used may overshoot size when allocations race at the end
+} arena_blk_t;
+
+#define ARENA_ALIGN 16
+#define ARENA_HDR ((sizeof(arena_blk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct bwa_arena_s {
+	arena_blk_t *head, *cur; // blocks after cur are kept from earlier rounds
+	size_t blk_size;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+static arena_blk_t *arena_blk_init(size_t size)
+{
+	arena_blk_t *b = (arena_blk_t*)malloc(ARENA_HDR + size);
+	xassert(b, "out of memory.");
+	b->next = 0; b->size = size; b->used = 0;
+	return b;
+}
+
+bwa_arena_t *bwa_arena_init(size_t blk_size)
+{
+	bwa_arena_t *a = (bwa_arena_t*)calloc(1, sizeof(bwa_arena_t));
+	a->blk_size = blk_size;
+	a->head = a->cur = arena_blk_init(blk_size);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&a->lock, 0);
+#endif
+	return a;
+}
+
+void bwa_arena_destroy(bwa_arena_t *a)
+{
+	arena_blk_t *b, *next;
+	if (a == 0) return;
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&a->lock);
+#endif
+	free(a);
+}
+
+void bwa_arena_reset(bwa_arena_t *a)
+{
+	a->cur = a->head;
+	a->head->used = 0; // the others are cleared when they are reached
+}
+
+// moves on from the full block b to one with room for size bytes
+static void arena_next(bwa_arena_t *a, arena_blk_t *b, size_t size)
+{
+	arena_blk_t *p, *q;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&a->lock);
+#endif
+	if (a->cur == b) { // else another thread has moved on already
+		for (p = b; p->next && p->next->size < size; p = p->next); // kept blocks too small are skipped
+		if (p->next) {
+			q = p->next;
+			q->used = 0;
+		} else {
+			q = arena_blk_init(size > a->blk_size? size : a->blk_size);
+			p->next = q;
+		}
+		__sync_synchronize();
+		a->cur = q;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+void *bwa_arena_alloc(bwa_arena_t *a, size_t size)
+{
+	size = size? (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : ARENA_ALIGN;
+	for (;;) {
+		arena_blk_t *b = *(arena_blk_t *volatile*)&a->cur;
+		size_t off = __sync_fetch_and_add(&b->used, size);
+		if (off + size <= b->size) return (uint8_t*)b + ARENA_HDR + off;
+		arena_next(a, b, size);
+	}
+}
+
+void *bwa_arena_calloc(bwa_arena_t *a, size_t n, size_t size)
+{
+	void *p = bwa_arena_alloc(a, n * size);
+	memset(p, 0, n * size);
+	return p;
+}
+
+void *bwa_arena_memdup(bwa_arena_t *a, const void *p, size_t size)
+{
+	return memcpy(bwa_arena_alloc(a, size), p, size);
+}
+
+char *bwa_arena_strdup(bwa_arena_t *a, const char *s)
+{
+	return (char*)bwa_arena_memdup(a, s, strlen(s) + 1);
+}
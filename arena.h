@@ -0,0 +1,31 @@
+#ifndef BWA_ARENA_H
+#define BWA_ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator for objects that die together, such as the reads of a
+ * batch with their CIGARs and MD strings. Allocating from the current block
+ * is lock-free, so the workers of a pool can allocate for their reads at
+ * the same time; a lock is only taken to move on to the next block. Objects
+ * are never freed one by one: bwa_arena_reset() drops all of them in O(1)
+ * and keeps the blocks for the next batch. */
+
+typedef struct bwa_arena_s bwa_arena_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	bwa_arena_t *bwa_arena_init(size_t blk_size);
+	void bwa_arena_destroy(bwa_arena_t *a);
+	void bwa_arena_reset(bwa_arena_t *a); // no other thread may be allocating
+	void *bwa_arena_alloc(bwa_arena_t *a, size_t size); // 16-byte aligned and not cleared
+	void *bwa_arena_calloc(bwa_arena_t *a, size_t n, size_t size);
+	void *bwa_arena_memdup(bwa_arena_t *a, const void *p, size_t size);
+	char *bwa_arena_strdup(bwa_arena_t *a, const char *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
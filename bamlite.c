@@ -114,3 +114,59 @@ int bam_read1(bamFile fp, bam1_t *b)
 	if (bam_is_be) swap_endian_data(c, b->data_len, b->data);
 	return 4 + block_len;
 }
+
+void bam_header_write(bamFile fp, const bam_header_t *header)
+{
+	int32_t i, x;
+	bam_is_be = is_big_endian();
+	bam_write(fp, "BAM\1", 4);
+	x = header->l_text;
+	if (bam_is_be) swap_endian_4p(&x);
+	bam_write(fp, &x, 4);
+	if (header->l_text) bam_write(fp, header->text, header->l_text);
+	x = header->n_targets;
+	if (bam_is_be) swap_endian_4p(&x);
+	bam_write(fp, &x, 4);
+	for (i = 0; i < header->n_targets; ++i) {
+		int32_t name_len = strlen(header->target_name[i]) + 1;
+		x = name_len;
+		if (bam_is_be) swap_endian_4p(&x);
+		bam_write(fp, &x, 4);
+		bam_write(fp, header->target_name[i], name_len);
+		x = header->target_len[i];
+		if (bam_is_be) swap_endian_4p(&x);
+		bam_write(fp, &x, 4);
+	}
+}
+
+void bam_encode1(bam1_t *b, kstring_t *s)
+{
+	const bam1_core_t *c = &b->core;
+	int32_t block_len = b->data_len + sizeof(bam1_core_t), i;
+	uint32_t x[8];
+	x[0] = c->tid; x[1] = c->pos;
+	x[2] = (uint32_t)c->bin<<16 | c->qual<<8 | c->l_qname;
+	x[3] = (uint32_t)c->flag<<16 | c->n_cigar;
+	x[4] = c->l_qseq;
+	x[5] = c->mtid; x[6] = c->mpos; x[7] = c->isize;
+	if (bam_is_be) {
+		swap_endian_4p(&block_len);
+		for (i = 0; i < 8; ++i) swap_endian_4p(x + i);
+		swap_endian_data(c, b->data_len, b->data);
+	}
+	kputsn((char*)&block_len, 4, s);
+	kputsn((char*)x, sizeof(bam1_core_t), s);
+	kputsn((char*)b->data, b->data_len, s);
+	if (bam_is_be) swap_endian_data(c, b->data_len, b->data); // back to the host order
+}
+
+int bam_reg2bin(uint32_t beg, uint32_t end)
+{
+	--end;
+	if (beg>>14 == end>>14) return 4681 + (beg>>14);
+	if (beg>>17 == end>>17) return  585 + (beg>>17);
+	if (beg>>20 == end>>20) return   73 + (beg>>20);
+	if (beg>>23 == end>>23) return    9 + (beg>>23);
+	if (beg>>26 == end>>26) return    1 + (beg>>26);
+	return 0;
+}
@@ -2,13 +2,15 @@
 #define BAMLITE_H_
 
 #include <stdint.h>
-#include <zlib.h>
+#include "bgzf.h"
+#include "kstring.h"
 
-typedef gzFile bamFile;
-#define bam_open(fn, mode) gzopen(fn, mode)
-#define bam_dopen(fd, mode) gzdopen(fd, mode)
-#define bam_close(fp) gzclose(fp)
-#define bam_read(fp, buf, size) gzread(fp, buf, size)
+typedef bgzf_t *bamFile;
+#define bam_open(fn, n_threads) bgzf_open(fn, n_threads)
+#define bam_close(fp) bgzf_close(fp)
+#define bam_read(fp, buf, size) bgzf_read(fp, buf, size)
+#define bam_open_w(fn, n_threads) bgzf_open_w(fn, n_threads)
+#define bam_write(fp, buf, size) bgzf_write(fp, buf, size)
 
 typedef struct {
 	int32_t n_targets;
@@ -86,6 +88,9 @@ extern "C" {
 	void bam_header_destroy(bam_header_t *header);
 	bam_header_t *bam_header_read(bamFile fp);
 	int bam_read1(bamFile fp, bam1_t *b);
+	void bam_header_write(bamFile fp, const bam_header_t *header);
+	void bam_encode1(bam1_t *b, kstring_t *s); // append b to s as it is laid out in the file
+	int bam_reg2bin(uint32_t beg, uint32_t end); // the bin of [beg,end) in the BAM index
 
 #ifdef __cplusplus
 }
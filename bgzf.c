@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "bgzf.h"
+#include "threadblock.h"
+#include "utils.h"
+
+#define BGZF_MAX_BLOCK  0x10000 // both compressed and inflated
+#define BGZF_HDR_SIZE   18 // gzip header with a single 'BC' extra subfield
+#define BGZF_BLOCK_DATA 0xff00 // inflated bytes per written block; even a stored block fits
+#define BGZF_PER_THREAD 4 // blocks per thread in a batch
+
+typedef struct {
+	uint8_t cdata[BGZF_MAX_BLOCK], udata[BGZF_MAX_BLOCK];
+	int c_len, u_len, ok;
+} bgzf_block_t;
+
+struct __bgzf_t {
+	gzFile gz; // set unless the file is BGZF and read with several threads
+	FILE *fp;
+	int is_write;
+	threadpool_t *tp;
+	// batch[cur] is being consumed (filled) while the other one is inflated (deflated)
+	bgzf_block_t *batch[2];
+	int max_blocks, n[2], cur, pending;
+	int i, off; // position in batch[cur] on reading
+};
+
+static inline int bgzf_u16(const uint8_t *p)
+{
+	return p[0] | p[1]<<8;
+}
+
+static inline uint32_t bgzf_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline void bgzf_put_u32(uint8_t *p, uint32_t x)
+{
+	p[0] = x; p[1] = x>>8; p[2] = x>>16; p[3] = x>>24;
+}
+
+// the total size of the block that starts with h, or 0 if h is not a BGZF header
+static int bgzf_block_size(const uint8_t *h)
+{
+	if (h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3]&4) == 0) return 0;
+	if (bgzf_u16(h + 10) != 6 || h[12] != 'B' || h[13] != 'C' || bgzf_u16(h + 14) != 2) return 0;
+	return bgzf_u16(h + 16) + 1;
+}
+
+// read the next compressed block; return 0 at the end of the file
+static int bgzf_read_block(FILE *fp, bgzf_block_t *b)
+{
+	size_t n = fread(b->cdata, 1, BGZF_HDR_SIZE, fp);
+	if (n == 0) return 0;
+	if (n != BGZF_HDR_SIZE || (b->c_len = bgzf_block_size(b->cdata)) < BGZF_HDR_SIZE + 8)
+		err_fatal_simple("truncated or malformed BGZF block.");
+	if (fread(b->cdata + BGZF_HDR_SIZE, 1, b->c_len - BGZF_HDR_SIZE, fp) != (size_t)(b->c_len - BGZF_HDR_SIZE))
+		err_fatal_simple("truncated BGZF block.");
+	return 1;
+}
+
+static void bgzf_inflate(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
+	bgzf_block_t *b = (bgzf_block_t*)data;
+	for (; beg < end; ++beg) {
+		bgzf_block_t *p = b + beg;
+		z_stream zs;
+		memset(&zs, 0, sizeof(z_stream));
+		zs.next_in = p->cdata + BGZF_HDR_SIZE; zs.avail_in = p->c_len - BGZF_HDR_SIZE - 8;
+		zs.next_out = p->udata; zs.avail_out = BGZF_MAX_BLOCK;
+		p->ok = 0;
+		if (inflateInit2(&zs, -15) != Z_OK) continue; // raw deflate
+		if (inflate(&zs, Z_FINISH) == Z_STREAM_END) {
+			p->u_len = zs.total_out;
+			p->ok = (uint32_t)p->u_len == bgzf_u32(p->cdata + p->c_len - 4)
+				&& crc32(crc32(0L, Z_NULL, 0), p->udata, p->u_len) == bgzf_u32(p->cdata + p->c_len - 8);
+		}
+		inflateEnd(&zs);
+	}
+}
+
+// read the next batch into batch[which] and start inflating it
+static void bgzf_fill(bgzf_t *fp, int which)
+{
+	bgzf_block_t *b = fp->batch[which];
+	int n = 0;
+	while (n < fp->max_blocks && bgzf_read_block(fp->fp, b + n)) ++n;
+	fp->n[which] = n;
+	fp->pending = n > 0;
+	if (n) threadpool_start(fp->tp, n, 1, bgzf_inflate, b);
+}
+
+// switch to the batch being inflated and start on the next one; return 0 at the end of the file
+static int bgzf_next_batch(bgzf_t *fp)
+{
+	int i;
+	if (!fp->pending) return 0;
+	threadpool_wait(fp->tp);
+	fp->cur ^= 1; fp->i = fp->off = 0;
+	for (i = 0; i < fp->n[fp->cur]; ++i)
+		if (!fp->batch[fp->cur][i].ok) err_fatal_simple("corrupted BGZF block.");
+	bgzf_fill(fp, fp->cur ^ 1);
+	return 1;
+}
+
+static bgzf_t *bgzf_init(bgzf_t *fp, int n_threads)
+{
+	fp->tp = threadpool_create(n_threads);
+	fp->max_blocks = threadpool_size(fp->tp) * BGZF_PER_THREAD;
+	fp->batch[0] = (bgzf_block_t*)malloc(fp->max_blocks * sizeof(bgzf_block_t));
+	fp->batch[1] = (bgzf_block_t*)malloc(fp->max_blocks * sizeof(bgzf_block_t));
+	return fp;
+}
+
+bgzf_t *bgzf_open(const char *fn, int n_threads)
+{
+	bgzf_t *fp = (bgzf_t*)calloc(1, sizeof(bgzf_t));
+	if (n_threads > 1 && strcmp(fn, "-") != 0) {
+		uint8_t h[BGZF_HDR_SIZE];
+		fp->fp = xopen(fn, "rb");
+		if (fread(h, 1, BGZF_HDR_SIZE, fp->fp) == BGZF_HDR_SIZE && bgzf_block_size(h)) {
+			rewind(fp->fp);
+			bgzf_init(fp, n_threads);
+			fp->cur = 1; // empty; the first read switches to batch[0]
+			bgzf_fill(fp, 0);
+			return fp;
+		}
+		fclose(fp->fp); fp->fp = 0;
+	}
+	fp->gz = xzopen(fn, "r");
+	return fp;
+}
+
+int bgzf_read(bgzf_t *fp, void *buf, int len)
+{
+	uint8_t *out = (uint8_t*)buf;
+	int n = 0;
+	if (fp->gz) return gzread(fp->gz, buf, len);
+	while (n < len) {
+		bgzf_block_t *b;
+		int l;
+		if (fp->i == fp->n[fp->cur]) {
+			if (!bgzf_next_batch(fp)) break;
+			continue;
+		}
+		b = &fp->batch[fp->cur][fp->i];
+		if (fp->off == b->u_len) { // the empty EOF marker block goes here too
+			++fp->i; fp->off = 0;
+			continue;
+		}
+		l = len - n < b->u_len - fp->off? len - n : b->u_len - fp->off;
+		memcpy(out + n, b->udata + fp->off, l);
+		n += l; fp->off += l;
+	}
+	return n;
+}
+
+static void bgzf_deflate(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
+	static const uint8_t hdr[BGZF_HDR_SIZE - 2] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0 };
+	bgzf_block_t *b = (bgzf_block_t*)data;
+	for (; beg < end; ++beg) {
+		bgzf_block_t *p = b + beg;
+		int level, ret;
+		for (level = Z_DEFAULT_COMPRESSION;; level = Z_NO_COMPRESSION) {
+			z_stream zs;
+			memset(&zs, 0, sizeof(z_stream));
+			zs.next_in = p->udata; zs.avail_in = p->u_len;
+			zs.next_out = p->cdata + BGZF_HDR_SIZE; zs.avail_out = BGZF_MAX_BLOCK - BGZF_HDR_SIZE - 8;
+			if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				err_fatal_simple("failed to initialize zlib.");
+			ret = deflate(&zs, Z_FINISH);
+			p->c_len = BGZF_HDR_SIZE + zs.total_out + 8;
+			deflateEnd(&zs);
+			if (ret == Z_STREAM_END) break;
+			xassert(level != Z_NO_COMPRESSION, "failed to deflate a BGZF block.");
+		}
+		memcpy(p->cdata, hdr, BGZF_HDR_SIZE - 2);
+		p->cdata[16] = (p->c_len - 1) & 0xff; p->cdata[17] = (p->c_len - 1) >> 8;
+		bgzf_put_u32(p->cdata + p->c_len - 8, crc32(crc32(0L, Z_NULL, 0), p->udata, p->u_len));
+		bgzf_put_u32(p->cdata + p->c_len - 4, p->u_len);
+	}
+}
+
+// write out the batch being deflated and start deflating the current one
+static void bgzf_flush(bgzf_t *fp)
+{
+	int i, other = fp->cur ^ 1;
+	if (fp->pending) {
+		threadpool_wait(fp->tp);
+		for (i = 0; i < fp->n[other]; ++i) {
+			bgzf_block_t *p = &fp->batch[other][i];
+			if (fwrite(p->cdata, 1, p->c_len, fp->fp) != (size_t)p->c_len)
+				err_fatal_simple("failed to write BGZF output.");
+		}
+		fp->pending = 0;
+	}
+	if (fp->n[fp->cur]) {
+		threadpool_start(fp->tp, fp->n[fp->cur], 1, bgzf_deflate, fp->batch[fp->cur]);
+		fp->pending = 1;
+		fp->cur = other; fp->n[fp->cur] = 0;
+	}
+}
+
+bgzf_t *bgzf_open_w(const char *fn, int n_threads)
+{
+	bgzf_t *fp = (bgzf_t*)calloc(1, sizeof(bgzf_t));
+	fp->is_write = 1;
+	fp->fp = strcmp(fn, "-") == 0? stdout : xopen(fn, "wb");
+	return bgzf_init(fp, n_threads);
+}
+
+void bgzf_write(bgzf_t *fp, const void *buf, int len)
+{
+	const uint8_t *in = (const uint8_t*)buf;
+	while (len > 0) {
+		bgzf_block_t *b;
+		int l;
+		if (fp->n[fp->cur] == 0 || fp->batch[fp->cur][fp->n[fp->cur] - 1].u_len == BGZF_BLOCK_DATA) {
+			if (fp->n[fp->cur] == fp->max_blocks) bgzf_flush(fp);
+			fp->batch[fp->cur][fp->n[fp->cur]++].u_len = 0;
+		}
+		b = &fp->batch[fp->cur][fp->n[fp->cur] - 1];
+		l = len < BGZF_BLOCK_DATA - b->u_len? len : BGZF_BLOCK_DATA - b->u_len;
+		memcpy(b->udata + b->u_len, in, l);
+		b->u_len += l; in += l; len -= l;
+	}
+}
+
+void bgzf_close(bgzf_t *fp)
+{
+	static const uint8_t eof[28] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (fp == 0) return;
+	if (fp->gz) gzclose(fp->gz);
+	else {
+		if (fp->is_write) {
+			bgzf_flush(fp); // start on the last batch
+			bgzf_flush(fp); // and write it
+			if (fwrite(eof, 1, 28, fp->fp) != 28) err_fatal_simple("failed to write BGZF output.");
+		}
+		threadpool_destroy(fp->tp); // waits for the batch in flight
+		if (fp->fp == stdout) fflush(fp->fp);
+		else fclose(fp->fp);
+		free(fp->batch[0]); free(fp->batch[1]);
+	}
+	free(fp);
+}
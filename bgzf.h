@@ -0,0 +1,27 @@
+#ifndef BWA_BGZF_H
+#define BWA_BGZF_H
+
+/* A stream over BGZF files. BGZF files (BAM, or FASTQ compressed with
+ * bgzip) are made of independent deflate blocks of at most 64KB, which
+ * are inflated or deflated n_threads at a time in the background while
+ * the caller consumes or fills the neighbouring ones. On reading, other
+ * files, and any file opened with a single thread, go through zlib as
+ * before. */
+
+typedef struct __bgzf_t bgzf_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	bgzf_t *bgzf_open(const char *fn, int n_threads); // "-" for stdin
+	int bgzf_read(bgzf_t *fp, void *buf, int len); // the number of bytes read; 0 at the end of file
+	bgzf_t *bgzf_open_w(const char *fn, int n_threads); // "-" for stdout
+	void bgzf_write(bgzf_t *fp, const void *buf, int len);
+	void bgzf_close(bgzf_t *fp); // writes the end-of-file marker block after the rest
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
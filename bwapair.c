@@ -102,7 +102,7 @@ static void pairing_aux(const pairing_param_t *param, pairing_internals_t *pint,
     const isize_info_t *ii = param->ii;
 
     // here v>=u. When ii is set, we check insert size with ii; otherwise with opt->max_isize
-    bwtint_t l;
+    uint64_t l; // positions are global across the dbset, so this may exceed bwtint_t
     // if both remapped and on same seqid
     if (u->remapped_pos != u->pos && v->remapped_pos != v->pos
         && u->dbidx == v->dbidx
@@ -10,15 +10,21 @@
 #include "bwasw.h"
 #include "bwtaln.h"
 #include "bwtcache.h"
+#include "bwtgap.h"
 #include "dbset.h"
 #include "khash.h"
+#include "rng.h"
 #include "kvec.h"
 #include "saiset.h"
+#include "samout.h"
 #include "stdaln.h"
 #include "threadblock.h"
 #include "utils.h"
 #include "filter_alignments.h"
 
+#define PE_THREAD_CHUNK 64 // pairs claimed at a time by a worker
+#define PE_PRINT_CHUNK 1024 // pairs formatted into one output buffer
+
 KHASH_MAP_INIT_INT64(64, bwtcache_itm_t)
 
 typedef struct {
@@ -32,28 +38,35 @@ typedef kvec_t(bwt_aln1_t) aln_buf_t;
 
 typedef struct {
     dbset_t *dbs;
-    const alngrp_t **buf[2];
+    saiset_t *saiset;
+    alngrp_t **buf[2];
     int n_seqs;
     bwa_seq_t *seqs[2];
     isize_info_t *ii;
     const pe_opt_t *opt;
     const gap_opt_t *gopt;
     int *cnt_chg;
+    coord_buf_t *cbuf; // per thread
 } cal_pac_pos_params_t;
 
+typedef struct {
+    const dbset_t *dbs;
+    bwa_seq_t *seqs[2];
+    int n_seqs;
+    const pe_opt_t *opt;
+    const gap_opt_t *gopt;
+    samout_t **buf; // buf[i] takes chunk beg+i
+    int beg;
+} print_params_t;
+
 #include "ksort.h"
 KSORT_INIT_GENERIC(uint64_t)
 
-#define MIN_HASH_WIDTH 1000
-
 #define UNMAP_READ(s) \
     do { \
         (s)->type = BWA_TYPE_NO_MATCH; \
         (s)->pos = (s)->remapped_pos = (s)->sa = (s)->c1 = (s)->c2 = 0; \
-        if ((s)->cigar) { \
-            free((s)->cigar); \
-            (s)->cigar = NULL; \
-        } \
+        (s)->cigar = NULL; \
     } while (0)
 
 
@@ -64,10 +77,10 @@ void bwase_initialize();
 void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_main, int n_multi);
 void bwa_aln2seq(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s);
 int bwa_approx_mapQ(const bwa_seq_t *p, int mm);
-void bwa_print_sam1(const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2);
+void bwa_print_sam1(samout_t *o, const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2);
 void bwa_refine_gapped(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs);
 bntseq_t *bwa_open_nt(const char *prefix);
-void bwa_print_sam_PG();
+void bwa_sam_PG(kstring_t *s);
 
 pe_opt_t *bwa_init_pe_opt()
 {
@@ -191,10 +204,10 @@ static int infer_isize(int n_seqs, bwa_seq_t *seqs[2], isize_info_t *ii, double
     for (y = 1.0; y < 10.0; y += 0.01)
         if (.5 * erfc(y / M_SQRT2) < ap_prior / L * (y * ii->std + ii->avg)) break;
     ii->high_bayesian = (bwtint_t)(y * ii->std + ii->avg + .499);
-    fprintf(stderr, "[infer_isize] low and high boundaries: %d and %d for estimating avg and std\n", ii->low, ii->high);
+    fprintf(stderr, "[infer_isize] low and high boundaries: %d and %d for estimating avg and std\n", (int)ii->low, (int)ii->high);
     fprintf(stderr, "[infer_isize] inferred external isize from %d pairs: %.3lf +/- %.3lf\n", n, ii->avg, ii->std);
     fprintf(stderr, "[infer_isize] skewness: %.3lf; kurtosis: %.3lf; ap_prior: %.2e\n", skewness, kurtosis, ii->ap_prior);
-    fprintf(stderr, "[infer_isize] inferred maximum insert size: %d (%.2lf sigma)\n", ii->high_bayesian, y);
+    fprintf(stderr, "[infer_isize] inferred maximum insert size: %d (%.2lf sigma)\n", (int)ii->high_bayesian, y);
     return 0;
 }
 
@@ -235,29 +248,27 @@ static uint64_t __remap(const uint64_t pos, uint64_t len, int strand, uint32_t g
     } while (0);
 
 
-static void bwa_cal_pac_pos_pe_thread(uint32_t idx, uint32_t size, void *data)
+static void bwa_cal_pac_pos_pe_thread(uint32_t tid, uint32_t beg, uint32_t end, void *data)
 {
     cal_pac_pos_params_t const *tdata = (cal_pac_pos_params_t*)data;
     const dbset_t *dbs = tdata->dbs;
-    const alngrp_t **buf[2] = {tdata->buf[0], tdata->buf[1]};
-    int n_seqs = tdata->n_seqs;
+    alngrp_t **buf[2] = {tdata->buf[0], tdata->buf[1]};
     bwa_seq_t *seqs[2] = {tdata->seqs[0], tdata->seqs[1]};
     isize_info_t *ii = tdata->ii;
     const pe_opt_t *opt = tdata->opt;
     const gap_opt_t *gopt = tdata->gopt;
     alngrp_t aln[2] = {{0,0}, {0,0}};
-    pos_arr_t arr = {0};
+    coord_buf_t *cbuf = &tdata->cbuf[tid];
     int i,j;
 
-    tdata->cnt_chg[idx] = 0;
-    for (i = idx; i < n_seqs; i += size) {
+    for (i = beg; i < end; ++i) {
         bwa_seq_t *p[2];
         for (j = 0; j < 2; ++j) {
             p[j] = seqs[j] + i;
             aln[j] = *buf[j][i];
         }
 
-        compute_seq_coords_and_counts(dbs, opt->remapping, aln, &arr, p);
+        compute_seq_coords_and_counts(dbs, opt->remapping, aln, cbuf, p);
         for (j = 0; j < 2; ++j) {
             int max_diff = gopt->fnr > 0.0? bwa_cal_maxdiff(p[j]->len, BWA_AVG_ERR, gopt->fnr) : gopt->max_diff;
             if (p[j]->c1 || p[j]->c2)
@@ -277,8 +288,8 @@ static void bwa_cal_pac_pos_pe_thread(uint32_t idx, uint32_t size, void *data)
 */
 
             {
-                pairing_param_t pairing_param = { p, &arr, aln, opt, gopt->s_mm, ii };
-                tdata->cnt_chg[idx] += find_optimal_pair(&pairing_param);
+                pairing_param_t pairing_param = { p, &cbuf->arr, aln, opt, gopt->s_mm, ii };
+                tdata->cnt_chg[tid] += find_optimal_pair(&pairing_param);
             }
         }
 
@@ -293,10 +304,9 @@ static void bwa_cal_pac_pos_pe_thread(uint32_t idx, uint32_t size, void *data)
             }
         }
     }
-    kv_destroy(arr);
 }
 
-static void select_sai_ibwa(dbset_t* dbs, const alngrp_t *ag, bwa_seq_t *s, int *main_idx, int max_diff, int remapping) {
+static void select_sai_ibwa(const dbset_t* dbs, const alngrp_t *ag, bwa_seq_t *s, int *main_idx, int max_diff, int remapping) {
     int i, cnt, best;
 
     if (ag->n == 0) {
@@ -314,9 +324,9 @@ static void select_sai_ibwa(dbset_t* dbs, const alngrp_t *ag, bwa_seq_t *s, int
             const bwt_aln1_t *p = &ag->a[i].aln;
             int naln = p->l - p->k + 1;
             if (p->score > best) break;
-            if (drand48() * (p->l - p->k + 1 + cnt) > (double)cnt) {
+            if (bwa_rng_drand(&s->rng) * (p->l - p->k + 1 + cnt) > (double)cnt) {
                 *main_idx = i;
-                rngCache = drand48();
+                rngCache = bwa_rng_drand(&s->rng);
             }
             cnt += naln;
         }
@@ -368,43 +378,51 @@ static void select_sai_ibwa(dbset_t* dbs, const alngrp_t *ag, bwa_seq_t *s, int
     }
 }
 
+static void bwa_cal_pac_pos_se_thread(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
+    cal_pac_pos_params_t const *tdata = (cal_pac_pos_params_t*)data;
+    const gap_opt_t *gopt = tdata->gopt;
+    uint64_t seed = tdata->dbs->db[0]->bns->bns->seed;
+    int i, j;
+
+    for (i = beg; i < end; ++i) {
+        for (j = 0; j < 2; ++j) {
+            bwa_seq_t *p = tdata->seqs[j] + i;
+            int main_idx = 0, max_diff;
+            p->n_multi = 0;
+            p->extra_flag |= SAM_FPD | (j == 0? SAM_FR1 : SAM_FR2);
+            tdata->buf[j][i] = alngrp_create(tdata->dbs, tdata->saiset, j, i);
+            bwa_rng_init(&p->rng, seed, p->id<<1 | j); // the two ends share their id
+            // generate SE alignment and mapping quality
+            max_diff = gopt->fnr > 0.0? bwa_cal_maxdiff(p->len, BWA_AVG_ERR, gopt->fnr) : gopt->max_diff;
+            select_sai_ibwa(tdata->dbs, tdata->buf[j][i], p, &main_idx, max_diff, tdata->opt->remapping);
+        }
+    }
+}
+
 int bwa_cal_pac_pos_pe(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs[2], saiset_t *saiset, isize_info_t *ii,
                        const pe_opt_t *opt, const gap_opt_t *gopt, const isize_info_t *last_ii)
 {
-    int i, j, cnt_chg = 0;
+    int i, cnt_chg = 0;
     alngrp_t **aln_buf[2];
     cal_pac_pos_params_t tp;
+    threadpool_t *pool = threadpool_shared(opt->n_threads);
 
     aln_buf[0] = (alngrp_t**)calloc(n_seqs, sizeof(alngrp_t*));
     aln_buf[1] = (alngrp_t**)calloc(n_seqs, sizeof(alngrp_t*));
-
-    // SE
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *p[2];
-        for (j = 0; j < 2; ++j) {
-            int main_idx = 0;
-            int max_diff;
-            p[j] = seqs[j] + i;
-            p[j]->n_multi = 0;
-            p[j]->extra_flag |= SAM_FPD | (j == 0? SAM_FR1 : SAM_FR2);
-            aln_buf[j][i] = alngrp_create(dbs, saiset, j);
-
-            // generate SE alignment and mapping quality
-            max_diff = gopt->fnr > 0.0? bwa_cal_maxdiff(p[j]->len, BWA_AVG_ERR, gopt->fnr) : gopt->max_diff;
-            select_sai_ibwa(dbs, aln_buf[j][i], p[j], &main_idx, max_diff, opt->remapping);
-
-/* // MOVED to select_sai_ibwa
-            if (p[j]->type == BWA_TYPE_UNIQUE || p[j]->type == BWA_TYPE_REPEAT) {
-                alignment_t *main_aln = &aln_buf[j][i]->a[main_idx];
-                int max_diff = gopt->fnr > 0.0? bwa_cal_maxdiff(p[j]->len, BWA_AVG_ERR, gopt->fnr) : gopt->max_diff;
-                p[j]->pos = bwtdb_sa2seq(dbs->db[main_aln->dbidx], p[j]->strand, p[j]->sa, p[j]->len);
-                remap(p[j], dbs, main_aln->dbidx, opt->remapping);
-                p[j]->seQ = p[j]->mapQ = bwa_approx_mapQ(p[j], max_diff);
-
-            }
-*/
-        }
+    for (i = 0; i < 2; ++i) {
+        tp.dbs = dbs;
+        tp.buf[i] = aln_buf[i];
+        tp.seqs[i] = seqs[i];
     }
+    tp.saiset = saiset;
+    tp.n_seqs = n_seqs;
+    tp.ii = ii;
+    tp.opt = opt;
+    tp.gopt = gopt;
+
+    // SE: each worker decodes and places the alignments of its own pairs
+    threadpool_exec(pool, n_seqs, PE_THREAD_CHUNK, &bwa_cal_pac_pos_se_thread, &tp);
 
     // infer isize
     infer_isize(n_seqs, seqs, ii, opt->ap_prior, dbs->total_bwt_seq_len[0]);
@@ -415,23 +433,18 @@ int bwa_cal_pac_pos_pe(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs[2], saiset_t *s
     }
 
     // PE
-    for (i = 0; i < 2; ++i) {
-        tp.dbs = dbs;
-        tp.buf[i] = (const alngrp_t**)aln_buf[i];
-        tp.seqs[i] = seqs[i];
-    }
-    tp.n_seqs = n_seqs;
-    tp.ii = ii;
-    tp.opt = opt;
-    tp.gopt = gopt;
-    tp.cnt_chg = calloc(opt->n_threads, sizeof(int));
-    threadblock_exec(opt->n_threads, &bwa_cal_pac_pos_pe_thread, &tp);
+    tp.cnt_chg = calloc(threadpool_size(pool), sizeof(int));
+    tp.cbuf = calloc(threadpool_size(pool), sizeof(coord_buf_t));
+    threadpool_exec(pool, n_seqs, PE_THREAD_CHUNK, &bwa_cal_pac_pos_pe_thread, &tp);
 
-    for (i = 0; i < opt->n_threads; ++i)
+    for (i = 0; i < threadpool_size(pool); ++i) {
         cnt_chg += tp.cnt_chg[i];
+        coord_buf_destroy(&tp.cbuf[i]);
+    }
 
     // free
     free(tp.cnt_chg);
+    free(tp.cbuf);
     for (i = 0; i < n_seqs; ++i) {
         alngrp_destroy(aln_buf[0][i]);
         alngrp_destroy(aln_buf[1][i]);
@@ -440,39 +453,124 @@ int bwa_cal_pac_pos_pe(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs[2], saiset_t *s
     return cnt_chg;
 }
 
+static void bwa_print_pe_thread(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
+    const print_params_t *tdata = (const print_params_t*)data;
+    const pe_opt_t *popt = tdata->opt;
+    const gap_opt_t *gopt = tdata->gopt;
+
+    for (; beg < end; ++beg) {
+        samout_t *out = tdata->buf[beg];
+        int i = (tdata->beg + beg) * PE_PRINT_CHUNK;
+        int e = i + PE_PRINT_CHUNK < tdata->n_seqs? i + PE_PRINT_CHUNK : tdata->n_seqs;
+        for (; i < e; ++i) {
+            bwa_seq_t *p[2];
+            p[0] = tdata->seqs[0] + i; p[1] = tdata->seqs[1] + i;
+            if (p[0]->bc[0] || p[1]->bc[0]) {
+                strcat(p[0]->bc, p[1]->bc);
+                strcpy(p[1]->bc, p[0]->bc);
+            }
+
+            // use remapped coords for printing
+            if (popt->remapping) {
+                uint64_t tmp;
+                tmp = p[0]->pos; p[0]->pos = p[0]->remapped_pos; p[0]->remapped_pos = tmp;
+                tmp = p[1]->pos; p[1]->pos = p[1]->remapped_pos; p[1]->remapped_pos = tmp;
+            } else {
+                p[0]->remapped_pos = p[0]->pos;
+                p[1]->remapped_pos = p[1]->pos;
+            }
+
+            bwa_print_sam1(out, tdata->dbs, p[0], p[1], gopt->mode, gopt->max_top2);
+            bwa_print_sam1(out, tdata->dbs, p[1], p[0], gopt->mode, gopt->max_top2);
+        }
+    }
+}
+
+/* Format the pairs chunk by chunk into buf[], a window of n_buf/2 chunks at
+ * a time, and write each window out in order while the next one is
+ * formatted. */
+static void bwa_print_pe(threadpool_t *tp, samout_t *out, samout_t **buf, int n_buf, print_params_t *pp)
+{
+    int n_chunks = (pp->n_seqs + PE_PRINT_CHUNK - 1) / PE_PRINT_CHUNK;
+    int w = n_buf / 2, beg, i, prev = -1;
+
+    for (beg = 0; beg < n_chunks; beg += w) {
+        int n = n_chunks - beg < w? n_chunks - beg : w;
+        pp->buf = buf + (beg / w & 1) * w;
+        pp->beg = beg;
+        threadpool_start(tp, n, 1, &bwa_print_pe_thread, pp);
+        if (prev >= 0) // the previous window is written out while this one is formatted
+            for (i = 0; i < w && prev + i < n_chunks; ++i)
+                samout_append(out, buf[(prev / w & 1) * w + i]);
+        threadpool_wait(tp);
+        prev = beg;
+    }
+    if (prev >= 0)
+        for (i = 0; i < w && prev + i < n_chunks; ++i)
+            samout_append(out, buf[(prev / w & 1) * w + i]);
+}
+
 //void bwa_sai2sam_pe_core(const char *prefix, char *const fn_sa[2], char *const fn_fa[2], pe_opt_t *popt)
-void bwa_sai2sam_pe_core(pe_inputs_t* inputs, pe_opt_t *popt)
+/* with aln_opt, the reads are aligned here against the BWTs of the dbset
+ * instead of being looked up in .sai files */
+void bwa_sai2sam_pe_core(pe_inputs_t* inputs, pe_opt_t *popt, const gap_opt_t *aln_opt)
 {
-    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
+    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa, int n_threads);
     int i, j, n_seqs, tot_seqs = 0;
     bwa_seq_t *seqs[2];
     bwa_seqio_t *ks[2];
     clock_t t;
+    uint64_t sa_calls, sa_steps;
     isize_info_t last_ii; // this is for the last batch of reads
     dbset_t *dbs = NULL;
     saiset_t *saiset = NULL;
     gap_opt_t *gopt = NULL;
     gap_opt_t *gopt0 = NULL;
+    samout_t *out, **buf;
+    bwt_t *(*bwt)[2] = 0;
+    int n_buf;
+    print_params_t pp;
+    threadpool_t *tp = threadpool_shared(popt->n_threads);
+    gap_ws_t **ws = 0; // with aln_opt, per thread of tp for the whole run
+    kstring_t hdr = { 0, 0, 0 };
 
     // initialization
     bwase_initialize(); // initialize g_log_n[] in bwase.c
     for (i = 1; i != 256; ++i) g_log_n[i] = (int)(4.343 * log(i) + 0.5);
 
-    saiset = saiset_create(inputs->count, inputs->sai_pair.a);
+    if (aln_opt) {
+        saiset = saiset_init(inputs->count, aln_opt);
+        ws = (gap_ws_t**)calloc(threadpool_size(tp), sizeof(gap_ws_t*));
+        for (i = 0; i < (int)threadpool_size(tp); ++i) ws[i] = gap_ws_init();
+    } else saiset = saiset_create(inputs->count, inputs->sai_pair.a);
     gopt0 = &saiset->opt[0];
     gopt = &saiset->opt[1];
 
     last_ii.avg = -1.0;
 
-    ks[0] = bwa_open_reads(gopt0->mode, inputs->fq[0]);
-    ks[1] = bwa_open_reads(gopt->mode, inputs->fq[1]);
+    ks[0] = bwa_open_reads(gopt0->mode, inputs->fq[0], popt->n_threads);
+    ks[1] = bwa_open_reads(gopt->mode, inputs->fq[1], popt->n_threads);
 
-    dbs = dbset_restore(inputs->count, inputs->prefixes.a, gopt->mode, popt->is_preload, popt->remapping);
-    srand48(dbs->db[0]->bns->bns->seed);
+    dbs = dbset_restore(inputs->count, inputs->prefixes.a, gopt->mode, popt->is_preload, popt->remapping, popt->load_flags);
+    dbset_cache_limit(dbs, popt->cache_size);
+    if (aln_opt) { // the dbset holds both BWTs of every index already
+        bwt = (bwt_t *(*)[2])calloc(dbs->count, sizeof(bwt_t*[2]));
+        for (i = 0; i < dbs->count; ++i) {
+            bwt[i][0] = dbs->db[i]->bwt[0];
+            bwt[i][1] = dbs->db[i]->bwt[1];
+        }
+    }
 
     // core loop
-    dbset_print_sam_SQ(dbs);
-    bwa_print_sam_PG();
+    out = samout_open("-", popt->is_bam, popt->n_threads);
+    dbset_sam_SQ(dbs, &hdr);
+    bwa_sam_PG(&hdr);
+    samout_header(out, hdr.s);
+    free(hdr.s);
+    n_buf = 4 * threadpool_size(tp); // two windows of two chunks per thread
+    buf = (samout_t**)calloc(n_buf, sizeof(samout_t*));
+    for (i = 0; i < n_buf; ++i) buf[i] = samout_buffer(out);
     while ((seqs[0] = bwa_read_seq(ks[0], 0x40000, &n_seqs, gopt0->mode, gopt0->trim_qual)) != 0) {
         int cnt_chg;
         isize_info_t ii;
@@ -481,10 +579,27 @@ void bwa_sai2sam_pe_core(pe_inputs_t* inputs, pe_opt_t *popt)
         tot_seqs += n_seqs;
         t = clock();
 
+        if (aln_opt) {
+            fprintf(stderr, "[bwa_sai2sam_pe_core] calculate SA coordinate... ");
+            for (j = 0; j < 2; ++j)
+                bwa_aln_seqs(tp, dbs->count, (bwt_t *const (*)[2])bwt, n_seqs, seqs[j], aln_opt, ws);
+            saiset_attach(saiset, n_seqs, seqs);
+            fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
+        } else saiset_fetch(saiset, n_seqs, tp); // the .sai blocks of the batch are loaded on the pool
+
         fprintf(stderr, "[bwa_sai2sam_pe_core] convert to sequence coordinate... \n");
+        bwt_sa_stat(&sa_calls, &sa_steps);
         cnt_chg = bwa_cal_pac_pos_pe(dbs, n_seqs, seqs, saiset, &ii, popt, gopt, &last_ii);
         fprintf(stderr, "[bwa_sai2sam_pe_core] time elapses: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
         fprintf(stderr, "[bwa_sai2sam_pe_core] changing coordinates of %d alignments.\n", cnt_chg);
+        {
+            uint64_t calls, steps;
+            int sa_intv = dbs->db[0]->bwt[0]->sa_intv;
+            bwt_sa_stat(&calls, &steps);
+            calls -= sa_calls; steps -= sa_steps;
+            fprintf(stderr, "[bwa_sai2sam_pe_core] %llu SA lookups took %.2f LF steps on average (SA interval %d; %d expected).\n",
+                    (unsigned long long)calls, calls? (double)steps / calls : 0.0, sa_intv, sa_intv - 1);
+        }
 
         fprintf(stderr, "[bwa_sai2sam_pe_core] align unmapped mate...\n");
         bwa_paired_sw(dbs, n_seqs, seqs, popt, &ii);
@@ -507,27 +622,11 @@ void bwa_sai2sam_pe_core(pe_inputs_t* inputs, pe_opt_t *popt)
         fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
 
         fprintf(stderr, "[bwa_sai2sam_pe_core] print alignments... ");
-        for (i = 0; i < n_seqs; ++i) {
-            bwa_seq_t *p[2];
-            p[0] = seqs[0] + i; p[1] = seqs[1] + i;
-            if (p[0]->bc[0] || p[1]->bc[0]) {
-                strcat(p[0]->bc, p[1]->bc);
-                strcpy(p[1]->bc, p[0]->bc);
-            }
-
-            // use remapped coords for printing
-            if (popt->remapping) {
-                uint64_t tmp;
-                tmp = p[0]->pos; p[0]->pos = p[0]->remapped_pos; p[0]->remapped_pos = tmp;
-                tmp = p[1]->pos; p[1]->pos = p[1]->remapped_pos; p[1]->remapped_pos = tmp;
-            } else {
-                p[0]->remapped_pos = p[0]->pos;
-                p[1]->remapped_pos = p[1]->pos;
-            }
-            
-            bwa_print_sam1(dbs, p[0], p[1], gopt->mode, gopt->max_top2);
-            bwa_print_sam1(dbs, p[1], p[0], gopt->mode, gopt->max_top2);
-        }
+        pp.dbs = dbs;
+        pp.seqs[0] = seqs[0]; pp.seqs[1] = seqs[1];
+        pp.n_seqs = n_seqs;
+        pp.opt = popt; pp.gopt = gopt;
+        bwa_print_pe(tp, out, buf, n_buf, &pp);
         fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
 
         for (j = 0; j < 2; ++j)
@@ -537,8 +636,16 @@ void bwa_sai2sam_pe_core(pe_inputs_t* inputs, pe_opt_t *popt)
     }
 
     // destroy
+    for (i = 0; i < n_buf; ++i) samout_close(buf[i]);
+    free(buf);
+    samout_close(out);
+    free(bwt);
     dbset_destroy(dbs);
     saiset_destroy(saiset);
+    if (ws) {
+        for (i = 0; i < (int)threadpool_size(tp); ++i) gap_ws_destroy(ws[i]);
+        free(ws);
+    }
 
     for (i = 0; i < 2; ++i) {
         bwa_seq_close(ks[i]);
@@ -600,53 +707,77 @@ static void dump_pe_inputs(const pe_inputs_t *inputs)
     }
 }
 
+// a sampe option; 1 if c was one, 0 if not, -1 if its argument is bad
+static int pe_parse_opt(pe_opt_t *popt, int c, const char *arg)
+{
+    extern int bwa_set_rg(const char *s);
+    switch (c) {
+    case 'C':
+        if ((popt->cache_size = bwa_parse_size(arg)) == 0) {
+            fprintf(stderr, "[%s] malformated size '%s'\n", __func__, arg);
+            return -1;
+        }
+        break;
+    case 'r':
+        if (bwa_set_rg(arg) < 0) {
+            fprintf(stderr, "[%s] malformated @RG line\n", __func__);
+            return -1;
+        }
+        break;
+    case 'a': popt->max_isize = atoi(arg); break;
+    case 'o': popt->max_occ = atoi(arg); break;
+    case 's': popt->is_sw = 0; break;
+    case 'P': popt->is_preload = 1; break;
+    case 'n': popt->n_multi = atoi(arg); break;
+    case 'N': popt->N_multi = atoi(arg); break;
+    case 't': popt->n_threads = atoi(arg); break;
+    case 'c': popt->ap_prior = atof(arg); break;
+    case 'f': xreopen(arg, "w", stdout); break;
+    case 'A': popt->force_isize = 1; break;
+    case 'R': popt->remapping = 1; break;
+    case 'Z': popt->load_flags = bwt_load_flags(atoi(arg)); break;
+    case 'b': popt->is_bam = 1; break;
+    default: return 0;
+    }
+    return 1;
+}
+
+#define PE_OPTS "a:o:sPn:N:c:f:ARr:t:Z:bC:"
+
+static void pe_usage_opts(const pe_opt_t *popt)
+{
+    fprintf(stderr, "Options: -a INT   maximum insert size [%d]\n", popt->max_isize);
+    fprintf(stderr, "         -o INT   maximum occurrences for one end [%d]\n", popt->max_occ);
+    fprintf(stderr, "         -n INT   maximum hits to output for paired reads [%d]\n", popt->n_multi);
+    fprintf(stderr, "         -N INT   maximum hits to output for discordant pairs [%d]\n", popt->N_multi);
+    fprintf(stderr, "         -t INT   number of threads [%d]\n", popt->n_threads);
+    fprintf(stderr, "         -c FLOAT prior of chimeric rate (lower bound) [%.1le]\n", popt->ap_prior);
+    fprintf(stderr, "         -f FILE  sam file to output results to [stdout]\n");
+    fprintf(stderr, "         -b       output BAM instead of SAM\n");
+    fprintf(stderr, "         -r STR   read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
+    fprintf(stderr, "         -P       preload index into memory (for base-space reads only)\n");
+    fprintf(stderr, "         -Z INT   index loading: 0 read into memory, 1 mmap, 2 mmap and prefetch [0]\n");
+    fprintf(stderr, "         -C SIZE  memory for cached positions of repeats, e.g. 4G [no limit]\n");
+    fprintf(stderr, "         -s       disable Smith-Waterman for the unmapped mate\n");
+    fprintf(stderr, "         -A       disable insert size estimate (force -s)\n\n");
+    fprintf(stderr, "         -R       enable compound sequence remapping\n");
+}
+
 int bwa_sai2sam_pe(int argc, char *argv[])
 {
     extern char *bwa_rg_line, *bwa_rg_id;
-    extern int bwa_set_rg(const char *s);
     pe_inputs_t *inputs;
     int c;
     pe_opt_t *popt;
     popt = bwa_init_pe_opt();
-    while ((c = getopt(argc, argv, "a:o:sPn:N:c:f:ARr:t:")) >= 0) {
-        switch (c) {
-        case 'r':
-            if (bwa_set_rg(optarg) < 0) {
-                fprintf(stderr, "[%s] malformated @RG line\n", __func__);
-                return 1;
-            }
-            break;
-        case 'a': popt->max_isize = atoi(optarg); break;
-        case 'o': popt->max_occ = atoi(optarg); break;
-        case 's': popt->is_sw = 0; break;
-        case 'P': popt->is_preload = 1; break;
-        case 'n': popt->n_multi = atoi(optarg); break;
-        case 'N': popt->N_multi = atoi(optarg); break;
-        case 't': popt->n_threads = atoi(optarg); break;
-        case 'c': popt->ap_prior = atof(optarg); break;
-        case 'f': xreopen(optarg, "w", stdout); break;
-        case 'A': popt->force_isize = 1; break;
-        case 'R': popt->remapping = 1; break;
-        default: return 1;
-        }
-    }
+    while ((c = getopt(argc, argv, PE_OPTS)) >= 0)
+        if (pe_parse_opt(popt, c, optarg) <= 0) return 1;
 
     if (optind + 5 > argc) {
         fprintf(stderr, "\n");
         fprintf(stderr, "Usage:   bwa sampe [options] <prefix> <in1.sai> <in2.sai> <in1.fq> <in2.fq> "
                         "[<prefix2> <in2,1.sai> <in2,2.sai> <prefix3> ...]\n\n");
-        fprintf(stderr, "Options: -a INT   maximum insert size [%d]\n", popt->max_isize);
-        fprintf(stderr, "         -o INT   maximum occurrences for one end [%d]\n", popt->max_occ);
-        fprintf(stderr, "         -n INT   maximum hits to output for paired reads [%d]\n", popt->n_multi);
-        fprintf(stderr, "         -N INT   maximum hits to output for discordant pairs [%d]\n", popt->N_multi);
-        fprintf(stderr, "         -t INT   number of threads [%d]\n", popt->n_threads);
-        fprintf(stderr, "         -c FLOAT prior of chimeric rate (lower bound) [%.1le]\n", popt->ap_prior);
-        fprintf(stderr, "         -f FILE  sam file to output results to [stdout]\n");
-        fprintf(stderr, "         -r STR   read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
-        fprintf(stderr, "         -P       preload index into memory (for base-space reads only)\n");
-        fprintf(stderr, "         -s       disable Smith-Waterman for the unmapped mate\n");
-        fprintf(stderr, "         -A       disable insert size estimate (force -s)\n\n");
-        fprintf(stderr, "         -R       enable compound sequence remapping\n");
+        pe_usage_opts(popt);
         fprintf(stderr, "Notes: 1. For SOLiD reads, <in1.fq> corresponds R3 reads and <in2.fq> to F3.\n");
         fprintf(stderr, "       2. For reads shorter than 30bp, applying a smaller -o is recommended to\n");
         fprintf(stderr, "          to get a sensible speed at the cost of pairing accuracy.\n");
@@ -657,10 +788,95 @@ int bwa_sai2sam_pe(int argc, char *argv[])
     inputs = pe_inputs_parse(argc-optind, &argv[optind]);
     dump_pe_inputs(inputs);
 
-    bwa_sai2sam_pe_core(inputs, popt);
+    bwa_sai2sam_pe_core(inputs, popt, 0);
 
     pe_inputs_destroy(inputs);
     free(bwa_rg_line); free(bwa_rg_id);
     free(popt);
     return 0;
 }
+
+/* aln of both ends and sampe in one process: the reads are parsed once, the
+ * index is loaded once and the alignments never go through .sai files. The
+ * aln options that clash with those of sampe take other letters. */
+int bwa_alnpe(int argc, char *argv[])
+{
+    extern char *bwa_rg_line, *bwa_rg_id;
+    pe_inputs_t *inputs;
+    int c, i, opte = -1;
+    pe_opt_t *popt;
+    gap_opt_t *gopt;
+    popt = bwa_init_pe_opt();
+    gopt = gap_init_opt();
+    while ((c = getopt(argc, argv, PE_OPTS "D:g:e:i:d:l:k:m:M:O:E:T:q:LIB:")) >= 0) {
+        switch (c) {
+        case 'D':
+            if (strstr(optarg, ".")) gopt->fnr = atof(optarg), gopt->max_diff = -1;
+            else gopt->max_diff = atoi(optarg), gopt->fnr = -1.0;
+            break;
+        case 'g': gopt->max_gapo = atoi(optarg); break;
+        case 'e': opte = atoi(optarg); break;
+        case 'i': gopt->indel_end_skip = atoi(optarg); break;
+        case 'd': gopt->max_del_occ = atoi(optarg); break;
+        case 'l': gopt->seed_len = atoi(optarg); break;
+        case 'k': gopt->max_seed_diff = atoi(optarg); break;
+        case 'm': gopt->max_entries = atoi(optarg); break;
+        case 'M': gopt->s_mm = atoi(optarg); break;
+        case 'O': gopt->s_gapo = atoi(optarg); break;
+        case 'E': gopt->s_gape = atoi(optarg); break;
+        case 'T': gopt->max_top2 = atoi(optarg); break;
+        case 'q': gopt->trim_qual = atoi(optarg); break;
+        case 'L': gopt->mode |= BWA_MODE_LOGGAP; break;
+        case 'I': gopt->mode |= BWA_MODE_IL13; break;
+        case 'B': gopt->mode |= atoi(optarg) << 24; break;
+        default:
+            if (pe_parse_opt(popt, c, optarg) <= 0) return 1;
+        }
+    }
+    if (opte > 0) {
+        gopt->max_gape = opte;
+        gopt->mode &= ~BWA_MODE_GAPE;
+    }
+
+    if (optind + 3 > argc) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Usage:   bwa alnpe [options] <prefix> <in1.fq> <in2.fq> [<prefix2> <prefix3> ...]\n\n");
+        pe_usage_opts(popt);
+        fprintf(stderr, "Alignment options, as those of aln:\n");
+        fprintf(stderr, "         -D NUM   max #diff (int) or missing prob under %.2f err rate (float) [%.2f] (aln -n)\n",
+                BWA_AVG_ERR, gopt->fnr);
+        fprintf(stderr, "         -g INT   maximum number or fraction of gap opens [%d] (aln -o)\n", gopt->max_gapo);
+        fprintf(stderr, "         -e INT   maximum number of gap extensions, -1 for disabling long gaps [-1]\n");
+        fprintf(stderr, "         -i INT   do not put an indel within INT bp towards the ends [%d]\n", gopt->indel_end_skip);
+        fprintf(stderr, "         -d INT   maximum occurrences for extending a long deletion [%d]\n", gopt->max_del_occ);
+        fprintf(stderr, "         -l INT   seed length [%d]\n", gopt->seed_len);
+        fprintf(stderr, "         -k INT   maximum differences in the seed [%d]\n", gopt->max_seed_diff);
+        fprintf(stderr, "         -m INT   maximum entries in the queue [%d]\n", gopt->max_entries);
+        fprintf(stderr, "         -M INT   mismatch penalty [%d]\n", gopt->s_mm);
+        fprintf(stderr, "         -O INT   gap open penalty [%d]\n", gopt->s_gapo);
+        fprintf(stderr, "         -E INT   gap extension penalty [%d]\n", gopt->s_gape);
+        fprintf(stderr, "         -T INT   stop searching when there are >INT equally best hits [%d] (aln -R)\n", gopt->max_top2);
+        fprintf(stderr, "         -q INT   quality threshold for read trimming down to %dbp [%d]\n", BWA_MIN_RDLEN, gopt->trim_qual);
+        fprintf(stderr, "         -B INT   length of barcode\n");
+        fprintf(stderr, "         -L       log-scaled gap penalty for long deletions\n");
+        fprintf(stderr, "         -I       the input is in the Illumina 1.3+ FASTQ-like format\n");
+        fprintf(stderr, "\n");
+        free(gopt); free(popt);
+        return 1;
+    }
+
+    inputs = calloc(1, sizeof(pe_inputs_t));
+    inputs->fq[0] = argv[optind + 1];
+    inputs->fq[1] = argv[optind + 2];
+    kv_push(const char*, inputs->prefixes, argv[optind]);
+    for (i = optind + 3; i < argc; ++i)
+        kv_push(const char*, inputs->prefixes, argv[i]);
+    inputs->count = inputs->prefixes.n;
+
+    bwa_sai2sam_pe_core(inputs, popt, gopt);
+
+    pe_inputs_destroy(inputs);
+    free(bwa_rg_line); free(bwa_rg_id);
+    free(gopt); free(popt);
+    return 0;
+}
@@ -12,6 +12,8 @@
 #include "kstring.h"
 #include "dbset.h"
 #include "translate_cigar.h"
+#include "samout.h"
+#include "sai.h"
 
 typedef struct {
 	int count;
@@ -23,7 +25,7 @@ typedef struct {
 int g_log_n[256];
 char *bwa_rg_line, *bwa_rg_id;
 
-void bwa_print_sam_PG();
+void bwa_sam_PG(kstring_t *s);
 void bwa_cs2nt_core(bwa_seq_t *p, dbset_t *dbs);
 
 void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_main, int n_multi)
@@ -40,10 +42,10 @@ void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_ma
 		for (i = cnt = 0; i < n_aln; ++i) {
 			const bwt_aln1_t *p = aln + i;
 			if (p->score > best) break;
-			if (drand48() * (p->l - p->k + 1 + cnt) > (double)cnt) {
+			if (bwa_rng_drand(&s->rng) * (p->l - p->k + 1 + cnt) > (double)cnt) {
 				s->n_mm = p->n_mm; s->n_gapo = p->n_gapo; s->n_gape = p->n_gape; s->strand = p->a;
 				s->score = p->score;
-				s->sa = p->k + (bwtint_t)((p->l - p->k + 1) * drand48());
+				s->sa = p->k + (bwtint_t)((p->l - p->k + 1) * bwa_rng_drand(&s->rng));
 			}
 			cnt += p->l - p->k + 1;
 		}
@@ -59,7 +61,6 @@ void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_ma
 			const bwt_aln1_t *q = aln + k;
 			n_occ += q->l - q->k + 1;
 		}
-		if (s->multi) free(s->multi);
 		if (n_occ > n_multi + 1) { // if there are too many hits, generate none of them
 			s->multi = 0; s->n_multi = 0;
 			return;
@@ -69,7 +70,7 @@ void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_ma
 		 * simply output all hits, but the following samples "rest"
 		 * number of random hits. */
 		rest = n_occ > n_multi + 1? n_multi + 1 : n_occ; // find one additional for ->sa
-		s->multi = calloc(rest, sizeof(bwt_multi1_t));
+		s->multi = bwa_arena_calloc(s->arena, rest, sizeof(bwt_multi1_t));
 		for (k = 0; k < n_aln; ++k) {
 			const bwt_aln1_t *q = aln + k;
 			if (q->l - q->k + 1 <= rest) {
@@ -84,7 +85,7 @@ void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_ma
 			} else { // Random sampling (http://code.activestate.com/recipes/272884/). In fact, we never come here. 
 				int j, i, k;
 				for (j = rest, i = q->l - q->k + 1, k = 0; j > 0; --j) {
-					double p = 1.0, x = drand48();
+					double p = 1.0, x = bwa_rng_drand(&s->rng);
 					while (x < p) p -= p * j / (i--);
 					s->multi[z].pos = q->l - i;
 					s->multi[z].gap = q->n_gapo + q->n_gape;
@@ -166,7 +167,7 @@ void bwa_cal_pac_pos(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs, int max_mm, floa
  * coordinate. This happens only for color-converted alignment. */
 static bwa_cigar_t *refine_gapped_core(dbset_t *dbs, seq_t **bns, uint32_t dbidx, int32_t seqid,
                                        int len, const ubyte_t *seq, uint64_t *_pos,
-									   int ext, int *n_cigar, int is_end_correct)
+									   int ext, int *n_cigar, int is_end_correct, bwa_arena_t *arena)
 {
 	bwa_cigar_t *cigar = 0;
 	ubyte_t *ref_seq;
@@ -237,11 +238,16 @@ static bwa_cigar_t *refine_gapped_core(dbset_t *dbs, seq_t **bns, uint32_t dbidx
         cigar = cig;
     }
 
+	if (cigar) { // move it to the arena of the read
+		bwa_cigar_t *tmp = cigar;
+		cigar = (bwa_cigar_t*)bwa_arena_memdup(arena, tmp, *n_cigar * sizeof(bwa_cigar_t));
+		free(tmp);
+	}
 	return cigar;
 }
 
 char *bwa_cal_md1(int n_cigar, bwa_cigar_t *cigar, int len, bwtint_t pos, ubyte_t *seq,
-				  dbset_t *dbs, seq_t **bns, kstring_t *str, int *_nm)
+				  dbset_t *dbs, seq_t **bns, kstring_t *str, int *_nm, bwa_arena_t *arena)
 {
 	bwtint_t x, y, l_pac = dbs->l_pac;
 	int z, u, nm = 0;
@@ -256,7 +262,7 @@ char *bwa_cal_md1(int n_cigar, bwa_cigar_t *cigar, int len, bwtint_t pos, ubyte_
 				for (z = 0; z < l && x+z < l_pac; ++z) {
 					dbset_extract_sequence(dbs, bns, &c, x+z, 1);
 					if (c > 3 || seq[y+z] > 3 || c != seq[y+z]) {
-						ksprintf(str, "%d", u);
+						kputw(u, str);
 						kputc("ACGTN"[c], str);
 						++nm;
 						u = 0;
@@ -268,7 +274,7 @@ char *bwa_cal_md1(int n_cigar, bwa_cigar_t *cigar, int len, bwtint_t pos, ubyte_
 				y += l;
 				if (__cigar_op(cigar[k]) == FROM_I) nm += l;
 			} else if (__cigar_op(cigar[k]) == FROM_D) {
-				ksprintf(str, "%d", u);
+				kputw(u, str);
 				kputc('^', str);
 				for (z = 0; z < l && x+z < l_pac; ++z) {
 					dbset_extract_sequence(dbs, bns, &c, x+z, 1);
@@ -282,16 +288,16 @@ char *bwa_cal_md1(int n_cigar, bwa_cigar_t *cigar, int len, bwtint_t pos, ubyte_
 		for (z = u = 0; z < (bwtint_t)len; ++z) {
 			dbset_extract_sequence(dbs, bns, &c, x+z, 1);
 			if (c > 3 || seq[y+z] > 3 || c != seq[y+z]) {
-				ksprintf(str, "%d", u);
+				kputw(u, str);
 				kputc("ACGTN"[c], str);
 				++nm;
 				u = 0;
 			} else ++u;
 		}
 	}
-	ksprintf(str, "%d", u);
+	kputw(u, str);
 	*_nm = nm;
-	return strdup(str->s);
+	return bwa_arena_strdup(arena, str->s);
 }
 
 void bwa_correct_trimmed(bwa_seq_t *s)
@@ -303,11 +309,12 @@ void bwa_correct_trimmed(bwa_seq_t *s)
 		} else {
 			if (s->cigar == 0) {
 				s->n_cigar = 2;
-				s->cigar = calloc(s->n_cigar, sizeof(bwa_cigar_t));
+				s->cigar = bwa_arena_alloc(s->arena, s->n_cigar * sizeof(bwa_cigar_t));
 				s->cigar[0] = __cigar_create(0, s->len);
 			} else {
-				++s->n_cigar;
-				s->cigar = realloc(s->cigar, s->n_cigar * sizeof(bwa_cigar_t));
+				bwa_cigar_t *cigar = bwa_arena_alloc(s->arena, (s->n_cigar + 1) * sizeof(bwa_cigar_t));
+				memcpy(cigar, s->cigar, s->n_cigar * sizeof(bwa_cigar_t));
+				s->cigar = cigar; ++s->n_cigar;
 			}
 			s->cigar[s->n_cigar-1] = __cigar_create(3, (s->full_len - s->len));
 		}
@@ -317,12 +324,12 @@ void bwa_correct_trimmed(bwa_seq_t *s)
 		} else {
 			if (s->cigar == 0) {
 				s->n_cigar = 2;
-				s->cigar = calloc(s->n_cigar, sizeof(bwa_cigar_t));
+				s->cigar = bwa_arena_alloc(s->arena, s->n_cigar * sizeof(bwa_cigar_t));
 				s->cigar[1] = __cigar_create(0, s->len);
 			} else {
-				++s->n_cigar;
-				s->cigar = realloc(s->cigar, s->n_cigar * sizeof(bwa_cigar_t));
-				memmove(s->cigar + 1, s->cigar, (s->n_cigar-1) * sizeof(bwa_cigar_t));
+				bwa_cigar_t *cigar = bwa_arena_alloc(s->arena, (s->n_cigar + 1) * sizeof(bwa_cigar_t));
+				memcpy(cigar + 1, s->cigar, s->n_cigar * sizeof(bwa_cigar_t));
+				s->cigar = cigar; ++s->n_cigar;
 			}
 			s->cigar[0] = __cigar_create(3, (s->full_len - s->len));
 		}
@@ -352,7 +359,7 @@ void bwa_refine_gapped(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs)
 			int n_cigar;
 			if (q->gap == 0) continue;
 			q->cigar = refine_gapped_core(dbs, dbs->bns, q->dbidx, q->remapped_seqid, s->len, q->strand? s->rseq : s->seq, &q->pos,
-										  (q->strand? 1 : -1) * q->gap, &n_cigar, 1);
+										  (q->strand? 1 : -1) * q->gap, &n_cigar, 1, s->arena);
 			q->n_cigar = n_cigar;
 		}
 		if (s->type == BWA_TYPE_NO_MATCH || s->type == BWA_TYPE_MATESW 
@@ -361,7 +368,7 @@ void bwa_refine_gapped(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs)
             continue;
         }
 		s->cigar = refine_gapped_core(dbs, dbs->bns, s->dbidx, s->remapped_seqid, s->len, s->strand? s->rseq : s->seq, &s->pos,
-									  (s->strand? 1 : -1) * (s->n_gapo + s->n_gape), &s->n_cigar, 1);
+									  (s->strand? 1 : -1) * (s->n_gapo + s->n_gape), &s->n_cigar, 1, s->arena);
 	}
 
 	if (dbs->color_space) { 
@@ -374,15 +381,13 @@ void bwa_refine_gapped(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs)
 				bwt_multi1_t *q = s->multi + j;
 				int n_cigar;
 				if (q->gap == 0) continue;
-				free(q->cigar);
 				q->cigar = refine_gapped_core(dbs, dbs->ntbns, q->dbidx, s->remapped_seqid, s->len, q->strand? s->rseq : s->seq, &q->pos,
-											  (q->strand? 1 : -1) * q->gap, &n_cigar, 0);
+											  (q->strand? 1 : -1) * q->gap, &n_cigar, 0, s->arena);
 				q->n_cigar = n_cigar;
 			}
 			if (s->type != BWA_TYPE_NO_MATCH && s->cigar) { // update cigar again
-				free(s->cigar);
 				s->cigar = refine_gapped_core(dbs, dbs->ntbns, s->dbidx, s->remapped_seqid, s->len, s->strand? s->rseq : s->seq, &s->pos,
-											  (s->strand? 1 : -1) * (s->n_gapo + s->n_gape), &s->n_cigar, 0);
+											  (s->strand? 1 : -1) * (s->n_gapo + s->n_gape), &s->n_cigar, 0, s->arena);
 			}
 		}
 	}
@@ -395,11 +400,11 @@ void bwa_refine_gapped(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs)
 			int nm;
 /*
 			s->md = bwa_cal_md1(s->n_cigar, s->cigar, s->len, s->pos, s->strand? s->rseq : s->seq,
-								dbs, dbs->color_space ? dbs->ntbns : dbs->bns, str, &nm);
+								dbs, dbs->color_space ? dbs->ntbns : dbs->bns, str, &nm, s->arena);
 */
             /* let's try simple remapping... */
 			s->md = bwa_cal_md1(s->n_cigar, s->cigar, s->len, s->remapped_pos, s->strand? s->rseq : s->seq,
-								dbs, dbs->color_space ? dbs->ntbns : dbs->bns, str, &nm);
+								dbs, dbs->color_space ? dbs->ntbns : dbs->bns, str, &nm, s->arena);
 
 			s->nm = nm;
 		}
@@ -448,11 +453,38 @@ static int64_t pos_5(const bwa_seq_t *p)
 	return -1;
 }
 
-void bwa_print_sam1(const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2)
+// the reference sequence a position is on
+typedef struct {
+	const bntseq_t *bns;
+	uint64_t offset;
+	int32_t seqid;
+} sam_coor_t;
+
+// the mate and the other hits of a read are mostly on the sequence looked up last
+static inline void sam_coor(const dbset_t *dbs, int64_t pos, sam_coor_t *c)
+{
+	if (c->bns) {
+		const bntann1_t *a = c->bns->anns + c->seqid;
+		if (pos >= (int64_t)(c->offset + a->offset) && pos < (int64_t)(c->offset + a->offset + a->len)) return;
+	}
+	c->seqid = dbset_seq_for_pos(dbs, pos, &c->bns, &c->offset);
+}
+
+static void sam_put_cigar(kstring_t *s, int n_cigar, const bwa_cigar_t *cigar)
+{
+	int k;
+	for (k = 0; k < n_cigar; ++k) {
+		kputw(__cigar_len(cigar[k]), s);
+		kputc("MIDSN"[__cigar_op(cigar[k])], s);
+	}
+}
+
+void bwa_print_sam1(samout_t *o, const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2)
 {
 	const bntseq_t* bns;
 	int j;
 	uint64_t bnsoffset = 0;
+	sam_coor_t c;
 	if (p->type != BWA_TYPE_NO_MATCH || (mate && mate->type != BWA_TYPE_NO_MATCH)) {
 		int seqid, nn, am = 0, flag = p->extra_flag;
 		char XT;
@@ -467,6 +499,7 @@ void bwa_print_sam1(const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int
 
 		// get seqid
 		nn = dbset_coor_pac2real(dbs, p->pos, j, &seqid, &bns, &bnsoffset);
+		c.bns = bns; c.offset = bnsoffset; c.seqid = seqid;
 		if (p->type != BWA_TYPE_NO_MATCH &&
 			p->pos + j - (bns->anns[seqid].offset + bnsoffset) > bns->anns[seqid].len)
 		{
@@ -480,103 +513,96 @@ void bwa_print_sam1(const dbset_t *dbs, bwa_seq_t *p, const bwa_seq_t *mate, int
 				if (mate->strand) flag |= SAM_FMR;
 			} else flag |= SAM_FMU;
 		}
-		printf("%s\t%d\t%s\t", p->name, flag, bns->anns[seqid].name);
-		printf("%d\t%d\t", (int)(p->pos - (bns->anns[seqid].offset+bnsoffset) + 1), p->mapQ);
+		samout_begin(o, p->name, flag, bns->anns[seqid].name,
+					 (int)(p->pos - (bns->anns[seqid].offset+bnsoffset) + 1), p->mapQ);
 
 		// print CIGAR
-		if (p->cigar) {
-			for (j = 0; j != p->n_cigar; ++j)
-				printf("%d%c", __cigar_len(p->cigar[j]), "MIDSN"[__cigar_op(p->cigar[j])]);
-		} else if (p->type == BWA_TYPE_NO_MATCH) printf("*");
-		else printf("%dM", p->len);
+		if (p->cigar) samout_cigar(o, p->n_cigar, p->cigar);
+		else if (p->type == BWA_TYPE_NO_MATCH) samout_cigar(o, 0, 0);
+		else {
+			bwa_cigar_t c = __cigar_create(FROM_M, p->len);
+			samout_cigar(o, 1, &c);
+		}
 
 		// print mate coordinate
 		if (mate && mate->type != BWA_TYPE_NO_MATCH) {
-			int m_seqid, m_is_N;
-			uint64_t m_bnsoffset;
 			long long isize;
 			int mate_on_same_seq;
 			am = mate->seQ < p->seQ? mate->seQ : p->seQ; // smaller single-end mapping quality
-			// redundant calculation here, but should not matter too much
-			m_is_N = dbset_coor_pac2real(dbs, mate->pos, mate->len, &m_seqid, &bns, &m_bnsoffset);
-			mate_on_same_seq = (seqid == m_seqid && bnsoffset == m_bnsoffset);
-			printf("\t%s\t", mate_on_same_seq ? "=" : bns->anns[m_seqid].name);
+			sam_coor(dbs, mate->pos, &c);
+			mate_on_same_seq = (seqid == c.seqid && bnsoffset == c.offset);
 			isize = mate_on_same_seq ? pos_5(mate) - pos_5(p) : 0;
 			if (p->type == BWA_TYPE_NO_MATCH) isize = 0;
-			printf("%d\t%lld\t", (int)(mate->pos - (bns->anns[m_seqid].offset + m_bnsoffset) + 1), isize);
-		} else if (mate) printf("\t=\t%d\t0\t", (int)(p->pos - (bns->anns[seqid].offset + bnsoffset) + 1));
-		else printf("\t*\t0\t0\t");
+			samout_mate(o, mate_on_same_seq ? "=" : c.bns->anns[c.seqid].name,
+						(int)(mate->pos - (c.bns->anns[c.seqid].offset + c.offset) + 1), isize);
+		} else if (mate) samout_mate(o, "=", (int)(p->pos - (bns->anns[seqid].offset + bnsoffset) + 1), 0);
+		else samout_mate(o, "*", 0, 0);
 
 		// print sequence and quality
-		if (p->strand == 0)
-			for (j = 0; j != p->full_len; ++j) putchar("ACGTN"[(int)p->seq[j]]);
-		else for (j = 0; j != p->full_len; ++j) putchar("TGCAN"[p->seq[p->full_len - 1 - j]]);
-		putchar('\t');
-		if (p->qual) {
-			if (p->strand) seq_reverse(p->len, p->qual, 0); // reverse quality
-			printf("%s", p->qual);
-		} else printf("*");
-
-		if (bwa_rg_id) printf("\tRG:Z:%s", bwa_rg_id);
-		if (p->bc[0]) printf("\tBC:Z:%s", p->bc);
-		if (p->clip_len < p->full_len) printf("\tXC:i:%d", p->clip_len);
+		if (p->qual && p->strand) seq_reverse(p->len, p->qual, 0); // reverse quality
+		samout_seq(o, p->full_len, p->seq, p->strand, (const char*)p->qual);
+
+		if (bwa_rg_id) samout_tag_Z(o, "RG", bwa_rg_id);
+		if (p->bc[0]) samout_tag_Z(o, "BC", p->bc);
+		if (p->clip_len < p->full_len) samout_tag_i(o, "XC", p->clip_len);
 		if (p->type != BWA_TYPE_NO_MATCH) {
 			int i;
 			// calculate XT tag
 			XT = "NURM"[p->type];
 			if (nn > 10) XT = 'N';
 			// print tags
-			printf("\tXT:A:%c\t%s:i:%d", XT, (mode & BWA_MODE_COMPREAD)? "NM" : "CM", p->nm);
-			if (nn) printf("\tXN:i:%d", nn);
-			if (mate) printf("\tSM:i:%d\tAM:i:%d", p->seQ, am);
+			samout_tag_A(o, "XT", XT);
+			samout_tag_i(o, (mode & BWA_MODE_COMPREAD)? "NM" : "CM", p->nm);
+			if (nn) samout_tag_i(o, "XN", nn);
+			if (mate) {
+				samout_tag_i(o, "SM", p->seQ);
+				samout_tag_i(o, "AM", am);
+			}
 			if (p->type != BWA_TYPE_MATESW) { // X0 and X1 are not available for this type of alignment
-				printf("\tX0:i:%d", p->c1);
-				if (p->c1 <= max_top2) printf("\tX1:i:%d", p->c2);
+				samout_tag_i(o, "X0", p->c1);
+				if (p->c1 <= max_top2) samout_tag_i(o, "X1", p->c2);
 			}
-			printf("\tXM:i:%d\tXO:i:%d\tXG:i:%d", p->n_mm, p->n_gapo, p->n_gapo+p->n_gape);
-			if (p->md) printf("\tMD:Z:%s", p->md);
+			samout_tag_i(o, "XM", p->n_mm);
+			samout_tag_i(o, "XO", p->n_gapo);
+			samout_tag_i(o, "XG", p->n_gapo+p->n_gape);
+			if (p->md) samout_tag_Z(o, "MD", p->md);
 			// print multiple hits
 			if (p->n_multi) {
-				printf("\tXA:Z:");
+				kstring_t *xa = samout_tmp(o);
 				for (i = 0; i < p->n_multi; ++i) {
 					bwt_multi1_t *q = p->multi + i;
-					int k;
-					j = pos_end_multi(q, p->len) - q->pos;
-					nn = dbset_coor_pac2real(dbs, q->pos, j, &seqid, &bns, &bnsoffset);
-					printf("%s,%c%d,", bns->anns[seqid].name, q->strand? '-' : '+',
-						   (int)(q->pos - (bns->anns[seqid].offset + bnsoffset) + 1));
-					if (q->cigar) {
-						for (k = 0; k < q->n_cigar; ++k)
-							printf("%d%c", __cigar_len(q->cigar[k]), "MIDSN"[__cigar_op(q->cigar[k])]);
-					} else printf("%dM", p->len);
-					printf(",%d;", q->gap + q->mm);
+					sam_coor(dbs, q->pos, &c);
+					kputs(c.bns->anns[c.seqid].name, xa); kputc(',', xa);
+					kputc(q->strand? '-' : '+', xa);
+					kputw((int)(q->pos - (c.bns->anns[c.seqid].offset + c.offset) + 1), xa); kputc(',', xa);
+					if (q->cigar) sam_put_cigar(xa, q->n_cigar, q->cigar);
+					else { kputw(p->len, xa); kputc('M', xa); }
+					kputc(',', xa); kputw(q->gap + q->mm, xa); kputc(';', xa);
 				}
+				samout_tag_Z(o, "XA", xa->s);
 			}
 		}
         if (p->pos != p->remapped_pos) {
-            int remapped_seqid;
-            nn = dbset_coor_pac2real(dbs, p->remapped_pos, j, &remapped_seqid, &bns, &bnsoffset);
-            printf("\tZR:Z:%s,%d", 
-                bns->anns[remapped_seqid].name,
-                (int)(p->remapped_pos - (bns->anns[remapped_seqid].offset + bnsoffset) + 1)
-                );
+            kstring_t *zr = samout_tmp(o);
+            sam_coor(dbs, p->remapped_pos, &c);
+            kputs(c.bns->anns[c.seqid].name, zr); kputc(',', zr);
+            kputw((int)(p->remapped_pos - (c.bns->anns[c.seqid].offset + c.offset) + 1), zr);
+            samout_tag_Z(o, "ZR", zr->s);
         }
-		putchar('\n');
+		samout_end(o);
 	} else { // this read has no match
 		ubyte_t *s = p->strand? p->rseq : p->seq;
 		int flag = p->extra_flag | SAM_FSU;
 		if (mate && mate->type == BWA_TYPE_NO_MATCH) flag |= SAM_FMU;
-		printf("%s\t%d\t*\t0\t0\t*\t*\t0\t0\t", p->name, flag);
-		for (j = 0; j != p->len; ++j) putchar("ACGTN"[(int)s[j]]);
-		putchar('\t');
-		if (p->qual) {
-			if (p->strand) seq_reverse(p->len, p->qual, 0); // reverse quality
-			printf("%s", p->qual);
-		} else printf("*");
-		if (bwa_rg_id) printf("\tRG:Z:%s", bwa_rg_id);
-		if (p->bc[0]) printf("\tBC:Z:%s", p->bc);
-		if (p->clip_len < p->full_len) printf("\tXC:i:%d", p->clip_len);
-		putchar('\n');
+		samout_begin(o, p->name, flag, "*", 0, 0);
+		samout_cigar(o, 0, 0);
+		samout_mate(o, "*", 0, 0);
+		if (p->qual && p->strand) seq_reverse(p->len, p->qual, 0); // reverse quality
+		samout_seq(o, p->len, s, 0, (const char*)p->qual);
+		if (bwa_rg_id) samout_tag_Z(o, "RG", bwa_rg_id);
+		if (p->bc[0]) samout_tag_Z(o, "BC", p->bc);
+		if (p->clip_len < p->full_len) samout_tag_i(o, "XC", p->clip_len);
+		samout_end(o);
 	}
 }
 
@@ -640,31 +666,35 @@ int bwa_set_rg(const char *s)
 	return 0;
 }
 
-void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_fa, int n_occ)
+void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_fa, int n_occ, int load_flags, int is_bam, int n_threads)
 {
-	extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
+	extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa, int n_threads);
 	int i, n_seqs, tot_seqs = 0, m_aln;
 	bwt_aln1_t *aln = 0;
 	bwa_seq_t *seqs;
 	bwa_seqio_t *ks;
 	clock_t t;
-	FILE *fp_sa;
+	sai_t *sai;
 	gap_opt_t opt;
 	dbset_t *dbs;
+	samout_t *out;
+	kstring_t hdr = { 0, 0, 0 };
 
 	// initialization
 	bwase_initialize();
-	fp_sa = xopen(fn_sa, "r");
+	sai = sai_open(fn_sa);
+	opt = sai->opt;
 
 	m_aln = 0;
-	fread(&opt, sizeof(gap_opt_t), 1, fp_sa);
-	dbs = dbset_restore(1, &prefix, opt.mode, 0, 0);
-	srand48(dbs->bns[0]->bns->seed);
+	dbs = dbset_restore(1, &prefix, opt.mode, 0, 0, load_flags);
 
-	dbset_print_sam_SQ(dbs);
-	bwa_print_sam_PG();
+	out = samout_open("-", is_bam, n_threads);
+	dbset_sam_SQ(dbs, &hdr);
+	bwa_sam_PG(&hdr);
+	samout_header(out, hdr.s);
+	free(hdr.s);
 	// set ks
-	ks = bwa_open_reads(opt.mode, fn_fa);
+	ks = bwa_open_reads(opt.mode, fn_fa, 1);
 	// core loop
 	while ((seqs = bwa_read_seq(ks, 0x40000, &n_seqs, opt.mode, opt.trim_qual)) != 0) {
 		tot_seqs += n_seqs;
@@ -673,13 +703,9 @@ void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_f
 		// read alignment
 		for (i = 0; i < n_seqs; ++i) {
 			bwa_seq_t *p = seqs + i;
-			int n_aln;
-			fread(&n_aln, 4, 1, fp_sa);
-			if (n_aln > m_aln) {
-				m_aln = n_aln;
-				aln = (bwt_aln1_t*)realloc(aln, sizeof(bwt_aln1_t) * m_aln);
-			}
-			fread(aln, sizeof(bwt_aln1_t), n_aln, fp_sa);
+			int n_aln = sai_read1(sai, &aln, &m_aln);
+			if (n_aln < 0) err_fatal(__func__, "%s has fewer reads than the input.", fn_sa);
+			bwa_rng_init(&p->rng, dbs->bns[0]->bns->seed, p->id);
 			bwa_aln2seq_core(n_aln, aln, p, 1, n_occ);
 		}
 
@@ -693,7 +719,7 @@ void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_f
 
 		fprintf(stderr, "[bwa_aln_core] print alignments... ");
 		for (i = 0; i < n_seqs; ++i)
-			bwa_print_sam1(dbs, seqs + i, 0, opt.mode, opt.max_top2);
+			bwa_print_sam1(out, dbs, seqs + i, 0, opt.mode, opt.max_top2);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
 
 		bwa_free_read_seq(n_seqs, seqs);
@@ -701,16 +727,17 @@ void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_f
 	}
 
 	// destroy
+	samout_close(out);
 	bwa_seq_close(ks);
 	dbset_destroy(dbs);
-	fclose(fp_sa);
+	sai_close(sai);
 	free(aln);
 }
 
 int bwa_sai2sam_se(int argc, char *argv[])
 {
-	int c, n_occ = 3;
-	while ((c = getopt(argc, argv, "hn:f:r:")) >= 0) {
+	int c, n_occ = 3, load_flags = 0, is_bam = 0, n_threads = 1;
+	while ((c = getopt(argc, argv, "hn:f:r:Z:bt:")) >= 0) {
 		switch (c) {
 		case 'h': break;
 		case 'r':
@@ -721,6 +748,9 @@ int bwa_sai2sam_se(int argc, char *argv[])
 			break;
 		case 'n': n_occ = atoi(optarg); break;
 		case 'f': xreopen(optarg, "w", stdout); break;
+		case 'Z': load_flags = bwt_load_flags(atoi(optarg)); break;
+		case 'b': is_bam = 1; break;
+		case 't': n_threads = atoi(optarg); break;
 		default: return 1;
 		}
 	}
@@ -729,12 +759,15 @@ int bwa_sai2sam_se(int argc, char *argv[])
 		fprintf(stderr, "Usage: bwa samse [options] <in.fq> <prefix> <in.sai> [<prefix2> <in.sai2> ...]\n");
 		fprintf(stderr, "Options: -n INT   max_occ [%d]\n", n_occ);
 		fprintf(stderr, "         -f FILE  sam file to output results to [stdout]\n");
+		fprintf(stderr, "         -b       output BAM instead of SAM\n");
+		fprintf(stderr, "         -t INT   number of threads compressing BAM output [%d]\n", n_threads);
 		fprintf(stderr, "         -r STR   read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
+		fprintf(stderr, "         -Z INT   index loading: 0 read into memory, 1 mmap, 2 mmap and prefetch [0]\n");
 		
 		return 1;
 	}
 	
-	bwa_sai2sam_se_core(argv[optind], argv[optind+1], argv[optind+2], n_occ);
+	bwa_sai2sam_se_core(argv[optind], argv[optind+1], argv[optind+2], n_occ, load_flags, is_bam, n_threads);
 	free(bwa_rg_line); free(bwa_rg_id);
 	return 0;
 }
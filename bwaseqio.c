@@ -3,41 +3,82 @@
 #include "bwtaln.h"
 #include "utils.h"
 #include "bamlite.h"
+#include "bgzf.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "kseq.h"
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(bgzf_t*, bgzf_read)
 
 extern unsigned char nst_nt4_table[256];
 static char bam_nt16_nt4_table[] = { 4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4 };
 
+/* Each batch of reads lives in an arena, which bwa_free_read_seq() or
+ * bwa_seqbatch_destroy() resets and keeps for a later batch. Pipelines
+ * hold a few batches at once. */
+#define BATCH_ARENA_BLOCK 0x400000
+#define BATCH_ARENA_KEEP  4
+
+static bwa_arena_t *batch_arena[BATCH_ARENA_KEEP];
+static int n_batch_arena;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t batch_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static bwa_arena_t *batch_arena_get()
+{
+	bwa_arena_t *a = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&batch_arena_lock);
+#endif
+	if (n_batch_arena) a = batch_arena[--n_batch_arena];
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&batch_arena_lock);
+#endif
+	return a? a : bwa_arena_init(BATCH_ARENA_BLOCK);
+}
+
+static void batch_arena_put(bwa_arena_t *a)
+{
+	bwa_arena_reset(a);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&batch_arena_lock);
+#endif
+	if (n_batch_arena < BATCH_ARENA_KEEP) batch_arena[n_batch_arena++] = a, a = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&batch_arena_lock);
+#endif
+	bwa_arena_destroy(a);
+}
+
 struct __bwa_seqio_t {
 	// for BAM input
 	int is_bam, which; // 1st bit: read1, 2nd bit: read2, 3rd: SE
 	bamFile fp;
 	// for fastq input
 	kseq_t *ks;
+	uint64_t n_read; // reads returned so far
 };
 
-bwa_seqio_t *bwa_bam_open(const char *fn, int which)
+bwa_seqio_t *bwa_bam_open(const char *fn, int which, int n_threads)
 {
 	bwa_seqio_t *bs;
 	bam_header_t *h;
 	bs = (bwa_seqio_t*)calloc(1, sizeof(bwa_seqio_t));
 	bs->is_bam = 1;
 	bs->which = which;
-	bs->fp = bam_open(fn, "r");
+	bs->fp = bam_open(fn, n_threads);
 	h = bam_header_read(bs->fp);
 	bam_header_destroy(h);
 	return bs;
 }
 
-bwa_seqio_t *bwa_seq_open(const char *fn)
+bwa_seqio_t *bwa_seq_open(const char *fn, int n_threads)
 {
-	gzFile fp;
 	bwa_seqio_t *bs;
 	bs = (bwa_seqio_t*)calloc(1, sizeof(bwa_seqio_t));
-	fp = xzopen(fn, "r");
-	bs->ks = kseq_init(fp);
+	bs->ks = kseq_init(bgzf_open(fn, n_threads));
 	return bs;
 }
 
@@ -46,7 +87,7 @@ void bwa_seq_close(bwa_seqio_t *bs)
 	if (bs == 0) return;
 	if (bs->is_bam) bam_close(bs->fp);
 	else {
-		gzclose(bs->ks->f->f);
+		bgzf_close(bs->ks->f->f);
 		kseq_destroy(bs->ks);
 	}
 	free(bs);
@@ -86,12 +127,12 @@ int bwa_trim_read(int trim_qual, bwa_seq_t *p)
 	return p->full_len - p->len;
 }
 
-static bwa_seq_t *bwa_read_bam(bwa_seqio_t *bs, int n_needed, int *n, int is_comp, int trim_qual)
+static bwa_seq_t *bwa_read_bam(bwa_seqio_t *bs, int n_needed, int *n, int is_comp, int trim_qual, long *n_trimmed, long *n_tot)
 {
 	bwa_seq_t *seqs, *p;
 	int n_seqs, l, i;
-	long n_trimmed = 0, n_tot = 0;
 	bam1_t *b;
+	bwa_arena_t *arena = batch_arena_get();
 
 	b = bam_init1();
 	n_seqs = 0;
@@ -105,13 +146,15 @@ static bwa_seq_t *bwa_read_bam(bwa_seqio_t *bs, int n_needed, int *n, int is_com
 		if (go == 0) continue;
 		l = b->core.l_qseq;
 		p = &seqs[n_seqs++];
+		p->id = bs->n_read++;
+		p->arena = arena;
 		p->tid = -1; // no assigned to a thread
 		p->qual = 0;
 		p->full_len = p->clip_len = p->len = l;
-		n_tot += p->full_len;
+		*n_tot += p->full_len;
 		s = bam1_seq(b); q = bam1_qual(b);
-		p->seq = (ubyte_t*)calloc(p->len + 1, 1);
-		p->qual = (ubyte_t*)calloc(p->len + 1, 1);
+		p->seq = (ubyte_t*)bwa_arena_calloc(arena, p->len + 1, 1);
+		p->qual = (ubyte_t*)bwa_arena_calloc(arena, p->len + 1, 1);
 		for (i = 0; i != p->full_len; ++i) {
 			p->seq[i] = bam_nt16_nt4_table[(int)bam1_seqi(s, i)];
 			p->qual[i] = q[i] + 33 < 126? q[i] + 33 : 126;
@@ -120,19 +163,18 @@ static bwa_seq_t *bwa_read_bam(bwa_seqio_t *bs, int n_needed, int *n, int is_com
 			seq_reverse(p->len, p->seq, 1);
 			seq_reverse(p->len, p->qual, 0);
 		}
-		if (trim_qual >= 1) n_trimmed += bwa_trim_read(trim_qual, p);
-		p->rseq = (ubyte_t*)calloc(p->full_len, 1);
+		if (trim_qual >= 1) *n_trimmed += bwa_trim_read(trim_qual, p);
+		p->rseq = (ubyte_t*)bwa_arena_calloc(arena, p->full_len, 1);
 		memcpy(p->rseq, p->seq, p->len);
 		seq_reverse(p->len, p->seq, 0); // *IMPORTANT*: will be reversed back in bwa_refine_gapped()
 		seq_reverse(p->len, p->rseq, is_comp);
-		p->name = strdup((const char*)bam1_qname(b));
+		p->name = bwa_arena_strdup(arena, (const char*)bam1_qname(b));
 		if (n_seqs == n_needed) break;
 	}
 	*n = n_seqs;
-	if (n_seqs && trim_qual >= 1)
-		fprintf(stderr, "[bwa_read_seq] %.1f%% bases are trimmed.\n", 100.0f * n_trimmed/n_tot);
 	if (n_seqs == 0) {
 		free(seqs);
+		batch_arena_put(arena);
 		bam_destroy1(b);
 		return 0;
 	}
@@ -142,18 +184,19 @@ static bwa_seq_t *bwa_read_bam(bwa_seqio_t *bs, int n_needed, int *n, int is_com
 
 #define BARCODE_LOW_QUAL 13
 
-bwa_seq_t *bwa_read_seq(bwa_seqio_t *bs, int n_needed, int *n, int mode, int trim_qual)
+static bwa_seq_t *bwa_read_seq_core(bwa_seqio_t *bs, int n_needed, int *n, int mode, int trim_qual, long *n_trimmed, long *n_tot)
 {
 	bwa_seq_t *seqs, *p;
 	kseq_t *seq = bs->ks;
 	int n_seqs, l, i, is_comp = mode&BWA_MODE_COMPREAD, is_64 = mode&BWA_MODE_IL13, l_bc = mode>>24;
-	long n_trimmed = 0, n_tot = 0;
+	bwa_arena_t *arena;
 
 	if (l_bc > 15) {
-		fprintf(stderr, "[%s] the maximum barcode length is 15.\n", __func__);
+		fprintf(stderr, "[bwa_read_seq] the maximum barcode length is 15.\n");
 		return 0;
 	}
-	if (bs->is_bam) return bwa_read_bam(bs, n_needed, n, is_comp, trim_qual); // l_bc has no effect for BAM input
+	if (bs->is_bam) return bwa_read_bam(bs, n_needed, n, is_comp, trim_qual, n_trimmed, n_tot); // l_bc has no effect for BAM input
+	arena = batch_arena_get();
 	n_seqs = 0;
 	seqs = (bwa_seq_t*)calloc(n_needed, sizeof(bwa_seq_t));
 	while ((l = kseq_read(seq)) >= 0) {
@@ -161,6 +204,8 @@ bwa_seq_t *bwa_read_seq(bwa_seqio_t *bs, int n_needed, int *n, int mode, int tri
 			for (i = 0; i < seq->qual.l; ++i) seq->qual.s[i] -= 31;
 		if (seq->seq.l <= l_bc) continue; // sequence length equals or smaller than the barcode length
 		p = &seqs[n_seqs++];
+		p->id = bs->n_read++;
+		p->arena = arena;
 		if (l_bc) { // then trim barcode
 			for (i = 0; i < l_bc; ++i)
 				p->bc[i] = (seq->qual.l && seq->qual.s[i]-33 < BARCODE_LOW_QUAL)? tolower(seq->seq.s[i]) : toupper(seq->seq.s[i]);
@@ -178,19 +223,19 @@ bwa_seq_t *bwa_read_seq(bwa_seqio_t *bs, int n_needed, int *n, int mode, int tri
 		p->tid = -1; // no assigned to a thread
 		p->qual = 0;
 		p->full_len = p->clip_len = p->len = l;
-		n_tot += p->full_len;
-		p->seq = (ubyte_t*)calloc(p->len, 1);
+		*n_tot += p->full_len;
+		p->seq = (ubyte_t*)bwa_arena_alloc(arena, p->len);
 		for (i = 0; i != p->full_len; ++i)
 			p->seq[i] = nst_nt4_table[(int)seq->seq.s[i]];
 		if (seq->qual.l) { // copy quality
-			p->qual = (ubyte_t*)strdup((char*)seq->qual.s);
-			if (trim_qual >= 1) n_trimmed += bwa_trim_read(trim_qual, p);
+			p->qual = (ubyte_t*)bwa_arena_strdup(arena, seq->qual.s);
+			if (trim_qual >= 1) *n_trimmed += bwa_trim_read(trim_qual, p);
 		}
-		p->rseq = (ubyte_t*)calloc(p->full_len, 1);
+		p->rseq = (ubyte_t*)bwa_arena_calloc(arena, p->full_len, 1);
 		memcpy(p->rseq, p->seq, p->len);
 		seq_reverse(p->len, p->seq, 0); // *IMPORTANT*: will be reversed back in bwa_refine_gapped()
 		seq_reverse(p->len, p->rseq, is_comp);
-		p->name = strdup((const char*)seq->name.s);
+		p->name = bwa_arena_strdup(arena, seq->name.s);
 		{ // trim /[12]$
 			int t = strlen(p->name);
 			if (t > 2 && p->name[t-2] == '/' && (p->name[t-1] == '1' || p->name[t-1] == '2')) p->name[t-2] = '\0';
@@ -198,25 +243,112 @@ bwa_seq_t *bwa_read_seq(bwa_seqio_t *bs, int n_needed, int *n, int mode, int tri
 		if (n_seqs == n_needed) break;
 	}
 	*n = n_seqs;
-	if (n_seqs && trim_qual >= 1)
-		fprintf(stderr, "[bwa_read_seq] %.1f%% bases are trimmed.\n", 100.0f * n_trimmed/n_tot);
 	if (n_seqs == 0) {
 		free(seqs);
+		batch_arena_put(arena);
 		return 0;
 	}
 	return seqs;
 }
 
+bwa_seq_t *bwa_read_seq(bwa_seqio_t *bs, int n_needed, int *n, int mode, int trim_qual)
+{
+	long n_trimmed = 0, n_tot = 0;
+	bwa_seq_t *seqs = bwa_read_seq_core(bs, n_needed, n, mode, trim_qual, &n_trimmed, &n_tot);
+	if (seqs && trim_qual >= 1)
+		fprintf(stderr, "[bwa_read_seq] %.1f%% bases are trimmed.\n", 100.0f * n_trimmed/n_tot);
+	return seqs;
+}
+
 void bwa_free_read_seq(int n_seqs, bwa_seq_t *seqs)
 {
-	int i, j;
+	int i;
 	for (i = 0; i != n_seqs; ++i) {
 		bwa_seq_t *p = seqs + i;
-		for (j = 0; j < p->n_multi; ++j)
-			if (p->multi[j].cigar) free(p->multi[j].cigar);
-		free(p->name);
-		free(p->seq); free(p->rseq); free(p->qual); free(p->aln); free(p->md); free(p->multi);
-		free(p->cigar);
+		free(p->aln); free(p->n_aln_db);
 	}
+	if (n_seqs) batch_arena_put(seqs->arena);
 	free(seqs);
 }
+
+bwa_seqbatch_t *bwa_seqbatch_init(int is_comp)
+{
+	bwa_seqbatch_t *b = (bwa_seqbatch_t*)calloc(1, sizeof(bwa_seqbatch_t));
+	b->is_comp = is_comp;
+	b->arena = batch_arena_get();
+	return b;
+}
+
+void bwa_seqbatch_add(bwa_seqbatch_t *b, int n_seqs, const bwa_seq_t *seqs)
+{
+	int i, j;
+	if (b->n + n_seqs > b->m) {
+		b->m = b->n + n_seqs;
+		kroundup32(b->m);
+		b->len = (uint32_t*)realloc(b->len, b->m * sizeof(uint32_t));
+		b->off = (uint64_t*)realloc(b->off, b->m * sizeof(uint64_t));
+		b->n_aln = (int*)realloc(b->n_aln, b->m * sizeof(int));
+		b->aln = (bwt_aln1_t**)realloc(b->aln, b->m * sizeof(bwt_aln1_t*));
+		b->n_aln_db = (int**)realloc(b->n_aln_db, b->m * sizeof(int*));
+	}
+	for (i = 0; i < n_seqs; ++i) {
+		const bwa_seq_t *p = seqs + i;
+		size_t l = (p->len + 1) >> 1;
+		uint8_t *q;
+		if (b->l_nt + l > b->m_nt) {
+			if (b->m_nt == 0) b->m_nt = 0x10000;
+			while (b->m_nt < b->l_nt + l) b->m_nt <<= 1;
+			b->nt = (uint8_t*)realloc(b->nt, b->m_nt);
+		}
+		q = b->nt + b->l_nt;
+		for (j = 0; j + 1 < p->len; j += 2)
+			*q++ = p->seq[j] | p->seq[j+1] << 4;
+		if (j < p->len) *q = p->seq[j];
+		b->len[b->n] = p->len;
+		b->off[b->n] = b->l_nt;
+		b->n_aln[b->n] = 0; b->aln[b->n] = 0; b->n_aln_db[b->n] = 0;
+		if (b->max_len < p->len) b->max_len = p->len;
+		b->l_nt += l; ++b->n;
+	}
+}
+
+void bwa_seqbatch_get(const bwa_seqbatch_t *b, int i, ubyte_t *seq, ubyte_t *rseq)
+{
+	const uint8_t *q = b->nt + b->off[i];
+	int j, len = b->len[i];
+	for (j = 0; j < len; ++j)
+		seq[j] = q[j>>1] >> ((j&1) << 2) & 0xf;
+	if (rseq == 0) return;
+	if (b->is_comp) {
+		for (j = 0; j < len; ++j)
+			rseq[j] = seq[j] < 4? 3 - seq[j] : seq[j];
+	} else memcpy(rseq, seq, len);
+}
+
+void bwa_seqbatch_destroy(bwa_seqbatch_t *b)
+{
+	if (b == 0) return;
+	batch_arena_put(b->arena);
+	free(b->len); free(b->off); free(b->nt);
+	free(b->n_aln); free(b->aln); free(b->n_aln_db); free(b->stat);
+	free(b);
+}
+
+#define SEQBATCH_CHUNK 0x1000 // reads parsed into bwa_seq_t at a time
+
+bwa_seqbatch_t *bwa_read_seqbatch(bwa_seqio_t *bs, int n_needed, int mode, int trim_qual)
+{
+	bwa_seqbatch_t *b = 0;
+	long n_trimmed = 0, n_tot = 0;
+	while (b == 0 || b->n < n_needed) {
+		int n, m = b? n_needed - b->n : n_needed;
+		bwa_seq_t *seqs = bwa_read_seq_core(bs, m < SEQBATCH_CHUNK? m : SEQBATCH_CHUNK, &n, mode, trim_qual, &n_trimmed, &n_tot);
+		if (seqs == 0) break;
+		if (b == 0) b = bwa_seqbatch_init(mode & BWA_MODE_COMPREAD);
+		bwa_seqbatch_add(b, n, seqs);
+		bwa_free_read_seq(n, seqs);
+	}
+	if (b && trim_qual >= 1)
+		fprintf(stderr, "[bwa_read_seq] %.1f%% bases are trimmed.\n", 100.0f * n_trimmed/n_tot);
+	return b;
+}
@@ -9,6 +9,7 @@
 
 #define SW_MIN_MATCH_LEN 20
 #define SW_MIN_MAPQ 17
+#define SW_THREAD_CHUNK 16 // pairs claimed at a time by a worker
 
 typedef struct {
     uint64_t n_tot[2];
@@ -142,20 +143,18 @@ static void set_left_coordinate(
         *end = ref->remapped_pos;
 }
 
-static void bwa_paired_sw_thread(uint32_t idx, uint32_t size, void* data)
+static void bwa_paired_sw_thread(uint32_t tid, uint32_t beg, uint32_t end, void* data)
 {
     bwa_paired_sw_data_t *d = (bwa_paired_sw_data_t*)data;
     dbset_t *dbs = d->dbs;
-    int n_seqs = d->n_seqs;
     bwa_seq_t *seqs[2] = { d->seqs[0], d->seqs[1] };
     const pe_opt_t *popt = d->popt;;
     const isize_info_t *ii = d->ii;;
-    bwa_paired_sw_out_t *out = &d->out[idx];
+    bwa_paired_sw_out_t *out = &d->out[tid];
     int i;
 
     // perform mate alignment
-    out->n_tot[0] = out->n_tot[1] = out->n_mapped[0] = out->n_mapped[1] = 0;
-    for (i = idx; i < n_seqs; i += size) {
+    for (i = beg; i < end; ++i) {
         bwa_seq_t *p[2];
         p[0] = seqs[0] + i; p[1] = seqs[1] + i;
         if ((p[0]->mapQ >= SW_MIN_MAPQ || p[1]->mapQ >= SW_MIN_MAPQ) && (p[0]->extra_flag&SAM_FPP) == 0) { // unpaired and one read has high mapQ
@@ -257,7 +256,7 @@ static void bwa_paired_sw_thread(uint32_t idx, uint32_t size, void* data)
                     if (p[k]->seQ > mq_adjust[k]) p[k]->seQ = mq_adjust[k];
                 }
                 // update CIGAR
-                free(p[k]->cigar); p[k]->cigar = cigar[k]; cigar[k] = 0;
+                p[k]->cigar = (bwa_cigar_t*)bwa_arena_memdup(p[k]->arena, cigar[k], n_cigar[k] * sizeof(bwa_cigar_t));
                 p[k]->n_cigar = n_cigar[k];
                 // update the rest of information
                 __set_fixed(p[1-k], p[k], beg[k], cnt[k]);
@@ -273,6 +272,7 @@ void bwa_paired_sw(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs[2], const pe_opt_t
     uint64_t n_tot[2] = {0,0};
     uint64_t n_mapped[2] = {0,0};
     bwa_paired_sw_data_t td;
+    threadpool_t *pool;
 
     dbset_load_pac(dbs);
 
@@ -283,10 +283,11 @@ void bwa_paired_sw(dbset_t *dbs, int n_seqs, bwa_seq_t *seqs[2], const pe_opt_t
         td.seqs[1] = seqs[1];
         td.popt = popt;
         td.ii = ii;
-        td.out = calloc(popt->n_threads, sizeof(bwa_paired_sw_out_t));
-        threadblock_exec(popt->n_threads, &bwa_paired_sw_thread, &td);
+        pool = threadpool_shared(popt->n_threads);
+        td.out = calloc(threadpool_size(pool), sizeof(bwa_paired_sw_out_t));
+        threadpool_exec(pool, n_seqs, SW_THREAD_CHUNK, &bwa_paired_sw_thread, &td);
 
-        for (i = 0; i < popt->n_threads; ++i) {
+        for (i = 0; i < threadpool_size(pool); ++i) {
             n_tot[0] += td.out[i].n_tot[0];
             n_tot[1] += td.out[i].n_tot[1];
             n_mapped[0] += td.out[i].n_mapped[0];
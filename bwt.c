@@ -32,6 +32,10 @@
 #include <stdint.h>
 #include "utils.h"
 #include "bwt.h"
+#include "bwtocc.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 void bwt_gen_cnt_table(bwt_t *bwt)
 {
@@ -44,12 +48,22 @@ void bwt_gen_cnt_table(bwt_t *bwt)
 	}
 }
 
+// allocate bwt_t::bwt with Occ, aligned so that each Occ block sits in one cache line
+uint32_t *bwt_alloc_occ(bwtint_t size)
+{
+	void *p = 0;
+	if (posix_memalign(&p, OCC_LINE_BYTES, (size_t)size * 4) != 0)
+		err_fatal(__func__, "fail to allocate %llu bytes for the BWT.", (unsigned long long)size * 4);
+	return (uint32_t*)p;
+}
+
 // bwt->bwt and bwt->occ must be precalculated
 void bwt_cal_sa(bwt_t *bwt, int intv)
 {
 	bwtint_t isa, sa, i; // S(isa) = sa
 
 	xassert(bwt->bwt, "bwt_t::bwt is not initialized.");
+	xassert(bwt->sa_mm == 0, "bwt_t::sa is memory-mapped and cannot be recalculated.");
 
 	if (bwt->sa) free(bwt->sa);
 	bwt->sa_intv = intv;
@@ -66,6 +80,85 @@ void bwt_cal_sa(bwt_t *bwt, int intv)
 	bwt->sa[0] = (bwtint_t)-1; // before this line, bwt->sa[0] = bwt->seq_len
 }
 
+// re-sample bwt->sa at intv; the current samples are reused if intv is a multiple of bwt->sa_intv
+void bwt_resample_sa(bwt_t *bwt, int intv)
+{
+	bwtint_t i, n_sa, r, *sa;
+
+	xassert(bwt->sa, "bwt_t::sa is not initialized.");
+	xassert(bwt->sa_mm == 0, "bwt_t::sa is memory-mapped and cannot be re-sampled.");
+	if (intv % bwt->sa_intv != 0) {
+		bwt_cal_sa(bwt, intv);
+		return;
+	}
+	r = intv / bwt->sa_intv;
+	n_sa = (bwt->seq_len + intv) / intv;
+	sa = (bwtint_t*)calloc(n_sa, sizeof(bwtint_t));
+	for (i = 0; i < n_sa; ++i) sa[i] = bwt->sa[i * r]; // sa[0] stays (bwtint_t)-1
+	free(bwt->sa);
+	bwt->sa = sa; bwt->sa_intv = intv; bwt->n_sa = n_sa;
+}
+
+/* bwt_sa() counts into counters of its own thread, so that the threads
+ * share nothing in the loop; bwt_sa_stat() adds them up. The counts of a
+ * thread that exits are moved to sa_retired. */
+typedef struct sa_cnt_s {
+	uint64_t calls, steps;
+	struct sa_cnt_s *next;
+} sa_cnt_t;
+
+static sa_cnt_t sa_retired, *sa_cnt_list;
+#ifdef HAVE_PTHREAD
+static __thread sa_cnt_t *sa_cnt;
+static pthread_mutex_t sa_cnt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sa_cnt_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sa_cnt_key;
+
+static void sa_cnt_exit(void *data)
+{
+	sa_cnt_t *c = (sa_cnt_t*)data, **p;
+	pthread_mutex_lock(&sa_cnt_lock);
+	for (p = &sa_cnt_list; *p != c; p = &(*p)->next);
+	*p = c->next;
+	sa_retired.calls += c->calls; sa_retired.steps += c->steps;
+	pthread_mutex_unlock(&sa_cnt_lock);
+	free(c);
+}
+
+static void sa_cnt_init_key()
+{
+	pthread_key_create(&sa_cnt_key, sa_cnt_exit);
+}
+
+static sa_cnt_t *sa_cnt_init()
+{
+	sa_cnt_t *c = (sa_cnt_t*)calloc(1, sizeof(sa_cnt_t));
+	pthread_once(&sa_cnt_once, sa_cnt_init_key);
+	pthread_setspecific(sa_cnt_key, c);
+	pthread_mutex_lock(&sa_cnt_lock);
+	c->next = sa_cnt_list; sa_cnt_list = c;
+	pthread_mutex_unlock(&sa_cnt_lock);
+	return c;
+}
+#else
+static sa_cnt_t *sa_cnt = &sa_retired;
+#endif
+
+void bwt_sa_stat(uint64_t *n_calls, uint64_t *n_steps)
+{
+	sa_cnt_t *c;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&sa_cnt_lock);
+#endif
+	*n_calls = sa_retired.calls; *n_steps = sa_retired.steps;
+	for (c = sa_cnt_list; c; c = c->next) {
+		*n_calls += c->calls; *n_steps += c->steps;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&sa_cnt_lock);
+#endif
+}
+
 bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
 {
 	bwtint_t sa = 0;
@@ -73,47 +166,30 @@ bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
 		++sa;
 		k = bwt_invPsi(bwt, k);
 	}
+#ifdef HAVE_PTHREAD
+	if (sa_cnt == 0) sa_cnt = sa_cnt_init();
+#endif
+	++sa_cnt->calls; sa_cnt->steps += sa;
 	/* without setting bwt->sa[0] = -1, the following line should be
 	   changed to (sa + bwt->sa[k/bwt->sa_intv]) % (bwt->seq_len + 1) */
 	return sa + bwt->sa[k/bwt->sa_intv];
 }
 
-static inline int __occ_aux(uint64_t y, int c)
+bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c)
 {
-	// reduce nucleotide counting to bits counting
-	y = ((c&2)? y : ~y) >> 1 & ((c&1)? y : ~y) & 0x5555555555555555ull;
-	// count the number of 1s in y
-	y = (y & 0x3333333333333333ull) + (y >> 2 & 0x3333333333333333ull);
-	return ((y + (y >> 4)) & 0xf0f0f0f0f0f0f0full) * 0x101010101010101ull >> 56;
-}
-
-inline bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c)
-{
-	bwtint_t n, l, j;
 	uint32_t *p;
 
 	if (k == bwt->seq_len) return bwt->L2[c+1] - bwt->L2[c];
 	if (k == (bwtint_t)(-1)) return 0;
 	if (k >= bwt->primary) --k; // because $ is not in bwt
 
-	// retrieve Occ at k/OCC_INTERVAL
-	n = (p = bwt_occ_intv(bwt, k))[c];
-	p += 4; // jump to the start of the first BWT cell
-
-	// calculate Occ up to the last k/32
-	j = k >> 5 << 5;
-	for (l = k/OCC_INTERVAL*OCC_INTERVAL; l < j; l += 32, p += 2)
-		n += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-
-	// calculate Occ
-	n += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~k&31)<<1)) - 1), c);
-	if (c == 0) n -= ~k&31; // corrected for the masked bits
-
-	return n;
+	// retrieve Occ at k/OCC_INTERVAL and count the rest of the block up to k
+	p = bwt_occ_intv(bwt, k);
+	return ((bwtint_t*)p)[c] + bwt_occ_kernel->occ(p + OCC_CNT_WORDS, k % OCC_INTERVAL + 1, c);
 }
 
 // an analogy to bwt_occ() but more efficient, requiring k <= l
-inline void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol)
+void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol)
 {
 	bwtint_t _k, _l;
 	if (k == l) {
@@ -126,55 +202,32 @@ inline void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint
 		*ok = bwt_occ(bwt, k, c);
 		*ol = bwt_occ(bwt, l, c);
 	} else {
-		bwtint_t m, n, i, j;
 		uint32_t *p;
-		if (k >= bwt->primary) --k;
-		if (l >= bwt->primary) --l;
-		n = (p = bwt_occ_intv(bwt, k))[c];
-		p += 4;
-		// calculate *ok
-		j = k >> 5 << 5;
-		for (i = k/OCC_INTERVAL*OCC_INTERVAL; i < j; i += 32, p += 2)
-			n += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-		m = n;
-		n += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~k&31)<<1)) - 1), c);
-		if (c == 0) n -= ~k&31; // corrected for the masked bits
-		*ok = n;
-		// calculate *ol
-		j = l >> 5 << 5;
-		for (; i < j; i += 32, p += 2)
-			m += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-		m += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~l&31)<<1)) - 1), c);
-		if (c == 0) m -= ~l&31; // corrected for the masked bits
-		*ol = m;
+		int x[2];
+		p = bwt_occ_intv(bwt, _k);
+		bwt_occ_kernel->occ_kl(p + OCC_CNT_WORDS, _k % OCC_INTERVAL + 1, _l % OCC_INTERVAL + 1, c, x);
+		*ok = ((bwtint_t*)p)[c] + x[0];
+		*ol = ((bwtint_t*)p)[c] + x[1];
 	}
 }
 
-#define __occ_aux4(bwt, b)											\
-	((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]		\
-	 + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
-
-inline void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
+void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
 {
-	bwtint_t l, j, x;
 	uint32_t *p;
+	int x[4];
 	if (k == (bwtint_t)(-1)) {
 		memset(cnt, 0, 4 * sizeof(bwtint_t));
 		return;
 	}
 	if (k >= bwt->primary) --k; // because $ is not in bwt
 	p = bwt_occ_intv(bwt, k);
-	memcpy(cnt, p, 16);
-	p += 4;
-	j = k >> 4 << 4;
-	for (l = k / OCC_INTERVAL * OCC_INTERVAL, x = 0; l < j; l += 16, ++p)
-		x += __occ_aux4(bwt, *p);
-	x += __occ_aux4(bwt, *p & ~((1U<<((~k&15)<<1)) - 1)) - (~k&15);
-	cnt[0] += x&0xff; cnt[1] += x>>8&0xff; cnt[2] += x>>16&0xff; cnt[3] += x>>24;
+	memcpy(cnt, p, 4 * sizeof(bwtint_t));
+	bwt_occ_kernel->occ4(p + OCC_CNT_WORDS, k % OCC_INTERVAL + 1, x);
+	cnt[0] += x[0]; cnt[1] += x[1]; cnt[2] += x[2]; cnt[3] += x[3];
 }
 
 // an analogy to bwt_occ4() but more efficient, requiring k <= l
-inline void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
+void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
 {
 	bwtint_t _k, _l;
 	if (k == l) {
@@ -188,28 +241,14 @@ inline void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4]
 		bwt_occ4(bwt, k, cntk);
 		bwt_occ4(bwt, l, cntl);
 	} else {
-		bwtint_t i, j, x, y;
 		uint32_t *p;
-		int cl[4];
-		if (k >= bwt->primary) --k; // because $ is not in bwt
-		if (l >= bwt->primary) --l;
-		cl[0] = cl[1] = cl[2] = cl[3] = 0;
-		p = bwt_occ_intv(bwt, k);
+		int x[4], y[4];
+		p = bwt_occ_intv(bwt, _k);
 		memcpy(cntk, p, 4 * sizeof(bwtint_t));
-		p += 4;
-		// prepare cntk[]
-		j = k >> 4 << 4;
-		for (i = k / OCC_INTERVAL * OCC_INTERVAL, x = 0; i < j; i += 16, ++p)
-			x += __occ_aux4(bwt, *p);
-		y = x;
-		x += __occ_aux4(bwt, *p & ~((1U<<((~k&15)<<1)) - 1)) - (~k&15);
-		// calculate cntl[] and finalize cntk[]
-		j = l >> 4 << 4;
-		for (; i < j; i += 16, ++p) y += __occ_aux4(bwt, *p);
-		y += __occ_aux4(bwt, *p & ~((1U<<((~l&15)<<1)) - 1)) - (~l&15);
-		memcpy(cntl, cntk, 16);
-		cntk[0] += x&0xff; cntk[1] += x>>8&0xff; cntk[2] += x>>16&0xff; cntk[3] += x>>24;
-		cntl[0] += y&0xff; cntl[1] += y>>8&0xff; cntl[2] += y>>16&0xff; cntl[3] += y>>24;
+		memcpy(cntl, p, 4 * sizeof(bwtint_t));
+		bwt_occ_kernel->occ4_kl(p + OCC_CNT_WORDS, _k % OCC_INTERVAL + 1, _l % OCC_INTERVAL + 1, x, y);
+		cntk[0] += x[0]; cntk[1] += x[1]; cntk[2] += x[2]; cntk[3] += x[3];
+		cntl[0] += y[0]; cntl[1] += y[1]; cntl[2] += y[2]; cntl[3] += y[3];
 	}
 }
 
@@ -248,3 +287,48 @@ int bwt_match_exact_alt(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t
 	*k0 = k; *l0 = l;
 	return l - k + 1;
 }
+
+#define BWT_BATCH_WINDOW 16 // searches in flight; enough to cover the memory latency
+
+int bwt_match_exact_batch(int n, bwt_search_t *s)
+{
+	int i, j, n_act, n_hits = 0, act[BWT_BATCH_WINDOW];
+	for (i = 0; i < n; i += BWT_BATCH_WINDOW) {
+		// start a window of searches and prefetch their first Occ lines
+		for (j = i, n_act = 0; j < n && j < i + BWT_BATCH_WINDOW; ++j) {
+			bwt_search_t *p = s + j;
+			if (p->k > p->l) continue;
+			if (p->len == 0) ++n_hits;
+			else {
+				bwt_prefetch_2occ(p->bwt, p->k - 1, p->l);
+				act[n_act++] = j;
+			}
+		}
+		// advance each search by one base per round; a line is prefetched a full round before it is used
+		while (n_act) {
+			int m = 0;
+			for (j = 0; j < n_act; ++j) {
+				bwt_search_t *p = s + act[j];
+				const bwt_t *bwt = p->bwt;
+				bwtint_t ok, ol;
+				ubyte_t c = p->str[--p->len];
+				if (c > 3) { // there is an N here. no match
+					p->k = p->l + 1;
+					continue;
+				}
+				bwt_2occ(bwt, p->k - 1, p->l, c, &ok, &ol);
+				p->k = bwt->L2[c] + ok + 1;
+				p->l = bwt->L2[c] + ol;
+				if (p->k > p->l) continue; // no match
+				if (p->len == 0) {
+					++n_hits;
+					continue;
+				}
+				bwt_prefetch_2occ(bwt, p->k - 1, p->l);
+				act[m++] = act[j];
+			}
+			n_act = m;
+		}
+	}
+	return n_hits;
+}
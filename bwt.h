@@ -29,15 +29,17 @@
 #define BWA_BWT_H
 
 #include <stdint.h>
-
-// requirement: (OCC_INTERVAL%16 == 0)
-#define OCC_INTERVAL 0x80
+#include <stddef.h>
 
 #ifndef BWA_UBYTE
 #define BWA_UBYTE
 typedef unsigned char ubyte_t;
 #endif
+#ifdef BWA_64BIT
+typedef uint64_t bwtint_t; // index files of this build are not compatible with 32-bit builds
+#else
 typedef uint32_t bwtint_t;
+#endif
 
 typedef struct {
 	bwtint_t primary; // S^{-1}(0), or the primary index of BWT
@@ -51,16 +53,57 @@ typedef struct {
 	int sa_intv;
 	bwtint_t n_sa;
 	bwtint_t *sa;
+	// set if bwt/sa point into mmap()'ed index files rather than the heap
+	void *bwt_mm, *sa_mm;
+	size_t bwt_mm_len, sa_mm_len;
 } bwt_t;
 
-#define bwt_bwt(b, k) ((b)->bwt[(k)/OCC_INTERVAL*12 + 4 + (k)%OCC_INTERVAL/16])
+// flags for bwt_restore_bwt_core() and bwt_restore_sa_core()
+#define BWT_LOAD_MMAP     0x1 // map the file read-only and share it through the page cache
+#define BWT_LOAD_POPULATE 0x2 // prefault the mapping (MAP_POPULATE/MADV_WILLNEED); implies BWT_LOAD_MMAP
+
+/* Each OCC_INTERVAL block of bwt_t::bwt fills exactly one 64-byte cache
+ * line: four bwtint_t Occ counts followed by the BWT of the next
+ * OCC_INTERVAL bases. bwt_t::bwt is aligned to the line size, so an Occ
+ * lookup touches a single line. requirement: (OCC_INTERVAL%32 == 0) */
+#define OCC_LINE_BYTES  64
+#ifdef BWA_64BIT
+#define OCC_INTERVAL    0x80 // 32 bytes of counts and 128 bases
+#else
+#define OCC_INTERVAL    0xc0 // 16 bytes of counts and 192 bases
+#endif
+#define OCC_CNT_WORDS   (sizeof(bwtint_t)) // 4 * sizeof(bwtint_t) / sizeof(uint32_t)
+#define OCC_BLOCK_WORDS (OCC_LINE_BYTES / 4) // == OCC_CNT_WORDS + OCC_INTERVAL/16
+
+// number of uint32_t in bwt_t::bwt once Occ has been interleaved
+#define bwt_occ_size(len) ((((bwtint_t)(len) + OCC_INTERVAL - 1) / OCC_INTERVAL + 1) * OCC_BLOCK_WORDS)
+// false for the raw BWT written by bwt_gen and pac2bwt
+#define bwt_has_occ(b) ((b)->bwt_size != ((b)->seq_len + 15) >> 4)
+
+#define bwt_bwt(b, k) ((b)->bwt[(k)/OCC_INTERVAL*OCC_BLOCK_WORDS + OCC_CNT_WORDS + (k)%OCC_INTERVAL/16])
 
 /* retrieve a character from the $-removed BWT string. Note that
  * bwt_t::bwt is not exactly the BWT string and therefore this macro is
  * called bwt_B0 instead of bwt_B */
 #define bwt_B0(b, k) (bwt_bwt(b, k)>>((~(k)&0xf)<<1)&3)
 
-#define bwt_occ_intv(b, k) ((b)->bwt + (k)/OCC_INTERVAL*12)
+#define bwt_occ_intv(b, k) ((b)->bwt + (k)/OCC_INTERVAL*OCC_BLOCK_WORDS)
+
+// prefetch the Occ lines that bwt_2occ()/bwt_2occ4() will read for [k+1,l]
+static inline void bwt_prefetch_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l)
+{
+	if (k != (bwtint_t)(-1)) __builtin_prefetch(bwt_occ_intv(bwt, k >= bwt->primary? k - 1 : k));
+	if (l != (bwtint_t)(-1)) __builtin_prefetch(bwt_occ_intv(bwt, l >= bwt->primary? l - 1 : l));
+}
+
+/* One backward search for bwt_match_exact_batch(): str[0..len-1] is matched
+ * from str[len-1] down to str[0], starting from the SA interval [k,l]. */
+typedef struct {
+	const bwt_t *bwt;
+	const ubyte_t *str;
+	int len;
+	bwtint_t k, l;
+} bwt_search_t;
 
 // inverse Psi function
 #define bwt_invPsi(bwt, k)												\
@@ -78,25 +121,39 @@ extern "C" {
 
 	bwt_t *bwt_restore_bwt(const char *fn);
 	void bwt_restore_sa(const char *fn, bwt_t *bwt);
+	bwt_t *bwt_restore_bwt_core(const char *fn, int flags);
+	void bwt_restore_sa_core(const char *fn, bwt_t *bwt, int flags);
+	int bwt_load_flags(int level); // convert the -Z command line level to BWT_LOAD_* flags
 
 	void bwt_destroy(bwt_t *bwt);
 
 	void bwt_bwtgen(const char *fn_pac, const char *fn_bwt); // from BWT-SW
 	void bwt_cal_sa(bwt_t *bwt, int intv);
+	void bwt_resample_sa(bwt_t *bwt, int intv);
 
 	void bwt_bwtupdate_core(bwt_t *bwt);
+	uint32_t *bwt_alloc_occ(bwtint_t size);
 
-	inline bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c);
-	inline void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
+	bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c);
+	void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
 	bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k);
+	/* bwt_sa() calls so far and the LF steps they took, over all threads; to
+	 * be called while no thread is in bwt_sa(). The SA is sampled at every
+	 * sa_intv-th suffix, not text position, so a step lands on a sample with
+	 * probability 1/sa_intv: sa_intv-1 steps per call are expected. */
+	void bwt_sa_stat(uint64_t *n_calls, uint64_t *n_steps);
 
 	// more efficient version of bwt_occ/bwt_occ4 for retrieving two close Occ values
 	void bwt_gen_cnt_table(bwt_t *bwt);
-	inline void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol);
-	inline void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
+	void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol);
+	void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
 
 	int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_begin, bwtint_t *sa_end);
 	int bwt_match_exact_alt(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *k0, bwtint_t *l0);
+	/* bwt_match_exact_alt() on n independent searches, advanced together so
+	 * that their Occ lookups overlap; return the number of hits. A search
+	 * without a hit ends with k > l. */
+	int bwt_match_exact_batch(int n, bwt_search_t *s);
 
 #ifdef __cplusplus
 }
@@ -28,11 +28,11 @@
 #include "bwt_gen.h"
 #include "QSufSort.h"
 
-static unsigned int TextLengthFromBytePacked(unsigned int bytePackedLength, unsigned int bitPerChar,
-											 unsigned int lastByteLength)
+static bgint_t TextLengthFromBytePacked(bgint_t bytePackedLength, unsigned int bitPerChar,
+										unsigned int lastByteLength)
 {
-	if (bytePackedLength > ALL_ONE_MASK / (BITS_IN_BYTE / bitPerChar)) {
-		fprintf(stderr, "TextLengthFromBytePacked(): text length > 2^32!\n");
+	if (bytePackedLength > (bgint_t)-1 / (BITS_IN_BYTE / bitPerChar)) {
+		fprintf(stderr, "TextLengthFromBytePacked(): text length > 2^%d! Please build with BWA_64BIT.\n", (int)sizeof(bgint_t) * 8);
 		exit(1);
 	}
 	return (bytePackedLength - 1) * (BITS_IN_BYTE / bitPerChar) + lastByteLength;
@@ -60,25 +60,25 @@ static void GenerateDNAOccCountTable(unsigned int *dnaDecodeTable)
 
 }
 // for BWTIncCreate()
-static unsigned int BWTOccValueMajorSizeInWord(const unsigned int numChar)
+static bgint_t BWTOccValueMajorSizeInWord(const bgint_t numChar)
 {
-	unsigned int numOfOccValue;
+	bgint_t numOfOccValue;
 	unsigned int numOfOccIntervalPerMajor;
 	numOfOccValue = (numChar + OCC_INTERVAL - 1) / OCC_INTERVAL + 1; // Value at both end for bi-directional encoding
 	numOfOccIntervalPerMajor = OCC_INTERVAL_MAJOR / OCC_INTERVAL;
 	return (numOfOccValue + numOfOccIntervalPerMajor - 1) / numOfOccIntervalPerMajor * ALPHABET_SIZE;
 }
 // for BWTIncCreate()
-static unsigned int BWTOccValueMinorSizeInWord(const unsigned int numChar)
+static bgint_t BWTOccValueMinorSizeInWord(const bgint_t numChar)
 {
-	unsigned int numOfOccValue;
+	bgint_t numOfOccValue;
 	numOfOccValue = (numChar + OCC_INTERVAL - 1) / OCC_INTERVAL + 1;		// Value at both end for bi-directional encoding
 	return (numOfOccValue + OCC_VALUE_PER_WORD - 1) / OCC_VALUE_PER_WORD * ALPHABET_SIZE;
 }
 // for BWTIncCreate()
-static unsigned int BWTResidentSizeInWord(const unsigned int numChar) {
+static bgint_t BWTResidentSizeInWord(const bgint_t numChar) {
 
-	unsigned int numCharRoundUpToOccInterval;
+	bgint_t numCharRoundUpToOccInterval;
 
 	// The $ in BWT at the position of inverseSa0 is not encoded
 	numCharRoundUpToOccInterval = (numChar + OCC_INTERVAL - 1) / OCC_INTERVAL * OCC_INTERVAL;
@@ -89,7 +89,7 @@ static unsigned int BWTResidentSizeInWord(const unsigned int numChar) {
 
 static void BWTIncSetBuildSizeAndTextAddr(BWTInc *bwtInc)
 {
-	unsigned int maxBuildSize;
+	bgint_t maxBuildSize;
 
 	if (bwtInc->bwt->textLength == 0) {
 		// initial build
@@ -128,6 +128,12 @@ static void BWTIncSetBuildSizeAndTextAddr(BWTInc *bwtInc)
 
 	bwtInc->buildSize = bwtInc->buildSize / CHAR_PER_WORD * CHAR_PER_WORD;
 
+	// absolute ranks may exceed 32 bits, so they are kept outside workingMemory
+	if (bwtInc->sortedRankSize < bwtInc->buildSize + 1) {
+		bwtInc->sortedRankSize = bwtInc->buildSize + 1;
+		bwtInc->sortedRank = (bgint_t*)realloc(bwtInc->sortedRank, bwtInc->sortedRankSize * sizeof(bgint_t));
+	}
+
 	bwtInc->packedText = bwtInc->workingMemory + 2 * (bwtInc->buildSize + 1);
 	bwtInc->textBuffer = (unsigned char*)(bwtInc->workingMemory + bwtInc->buildSize + 1);
 
@@ -186,7 +192,7 @@ static unsigned int BitPerWordPackedChar(const unsigned int alphabetSize)
 }
 
 static void ConvertBytePackedToWordPacked(const unsigned char *input, unsigned int *output, const unsigned int alphabetSize,
-										  const unsigned int textLength)
+										  const bgint_t textLength)
 {
 	unsigned int i, j, k;
 	unsigned int c;
@@ -250,7 +256,7 @@ static void ConvertBytePackedToWordPacked(const unsigned char *input, unsigned i
 	output[wordProcessed] = c;
 }
 
-BWT *BWTCreate(const unsigned int textLength, unsigned int *decodeTable)
+BWT *BWTCreate(const bgint_t textLength, unsigned int *decodeTable)
 {
 	BWT *bwt;
 
@@ -259,8 +265,7 @@ BWT *BWTCreate(const unsigned int textLength, unsigned int *decodeTable)
 	bwt->textLength = 0;
 	bwt->inverseSa = 0;
 
-	bwt->cumulativeFreq = (unsigned*)calloc((ALPHABET_SIZE + 1), sizeof(unsigned int*));
-	initializeVAL(bwt->cumulativeFreq, ALPHABET_SIZE + 1, 0);
+	bwt->cumulativeFreq = (bgint_t*)calloc((ALPHABET_SIZE + 1), sizeof(bgint_t));
 
 	bwt->bwtSizeInWord = 0;
 	bwt->saValueOnBoundary = NULL;
@@ -274,7 +279,7 @@ BWT *BWTCreate(const unsigned int textLength, unsigned int *decodeTable)
 	}
 
 	bwt->occMajorSizeInWord = BWTOccValueMajorSizeInWord(textLength);
-	bwt->occValueMajor = (unsigned*)calloc(bwt->occMajorSizeInWord, sizeof(unsigned int));
+	bwt->occValueMajor = (bgint_t*)calloc(bwt->occMajorSizeInWord, sizeof(bgint_t));
 
 	bwt->occSizeInWord = 0;
 	bwt->occValue = NULL;
@@ -290,8 +295,8 @@ BWT *BWTCreate(const unsigned int textLength, unsigned int *decodeTable)
 	return bwt;
 }
 
-BWTInc *BWTIncCreate(const unsigned int textLength, const float targetNBit,
-					 const unsigned int initialMaxBuildSize, const unsigned int incMaxBuildSize)
+BWTInc *BWTIncCreate(const bgint_t textLength, const float targetNBit,
+					 const bgint_t initialMaxBuildSize, const bgint_t incMaxBuildSize)
 {
 	BWTInc *bwtInc;
 	unsigned int i;
@@ -317,7 +322,7 @@ BWTInc *BWTIncCreate(const unsigned int textLength, const float targetNBit,
 	}
 
 	bwtInc->targetTextLength = textLength;
-	bwtInc->availableWord = (unsigned int)((textLength + OCC_INTERVAL - 1) / OCC_INTERVAL * OCC_INTERVAL / BITS_IN_WORD * bwtInc->targetNBit);
+	bwtInc->availableWord = (bgint_t)((textLength + OCC_INTERVAL - 1) / OCC_INTERVAL * OCC_INTERVAL / BITS_IN_WORD * bwtInc->targetNBit);
 	if (bwtInc->availableWord < BWTResidentSizeInWord(textLength) + BWTOccValueMinorSizeInWord(textLength)) {
 		fprintf(stderr, "BWTIncCreate() : targetNBit is too low!\n");
 		exit(1);
@@ -474,10 +479,10 @@ static void BWTIncBuildPackedBwt(const unsigned int *relativeRank, unsigned int*
 	}
 }
 
-static inline unsigned int BWTOccValueExplicit(const BWT *bwt, const unsigned int occIndexExplicit,
-											   const unsigned int character)
+static inline bgint_t BWTOccValueExplicit(const BWT *bwt, const bgint_t occIndexExplicit,
+										  const unsigned int character)
 {
-	unsigned int occIndexMajor;
+	bgint_t occIndexMajor;
 
 	occIndexMajor = occIndexExplicit * OCC_INTERVAL / OCC_INTERVAL_MAJOR;
 
@@ -557,10 +562,10 @@ static unsigned int BackwardDNAOccCount(const unsigned int*  dna, const unsigned
 
 }
 
-unsigned int BWTOccValue(const BWT *bwt, unsigned int index, const unsigned int character) {
+bgint_t BWTOccValue(const BWT *bwt, bgint_t index, const unsigned int character) {
 
-	unsigned int occValue;
-	unsigned int occExplicitIndex, occIndex;
+	bgint_t occValue;
+	bgint_t occExplicitIndex, occIndex;
 
 	// $ is supposed to be positioned at inverseSa0 but it is not encoded
 	// therefore index is subtracted by 1 for adjustment
@@ -584,11 +589,11 @@ unsigned int BWTOccValue(const BWT *bwt, unsigned int index, const unsigned int
 
 }
 
-static unsigned int BWTIncGetAbsoluteRank(BWT *bwt, unsigned int* __restrict absoluteRank, unsigned int* __restrict seq,
+static unsigned int BWTIncGetAbsoluteRank(BWT *bwt, bgint_t* __restrict absoluteRank, unsigned int* __restrict seq,
 										  const unsigned int *packedText, const unsigned int numChar,
 										  const unsigned int* cumulativeCount, const unsigned int firstCharInLastIteration)
 {
-	unsigned int saIndex;
+	bgint_t saIndex;
 	unsigned int lastWord;
 	unsigned int packedMask;
 	unsigned int i, j;
@@ -636,7 +641,7 @@ static unsigned int BWTIncGetAbsoluteRank(BWT *bwt, unsigned int* __restrict abs
 	return seqIndexFromStart[firstCharInLastIteration];
 }
 
-static void BWTIncSortKey(unsigned int* __restrict key, unsigned int* __restrict seq, const unsigned int numItem)
+static void BWTIncSortKey(bgint_t* __restrict key, unsigned int* __restrict seq, const unsigned int numItem)
 {
 	#define EQUAL_KEY_THRESHOLD	4	// Partition for equal key if data array size / the number of data with equal value with pivot < EQUAL_KEY_THRESHOLD
 
@@ -645,7 +650,8 @@ static void BWTIncSortKey(unsigned int* __restrict key, unsigned int* __restrict
 	int lowStack[32], highStack[32];
 	int stackDepth;
 	int i, j;
-	unsigned int tempSeq, tempKey;
+	unsigned int tempSeq;
+	bgint_t tempKey;
 	int numberOfEqualKey;
 
 	if (numItem < 2) return;
@@ -814,13 +820,14 @@ static void BWTIncSortKey(unsigned int* __restrict key, unsigned int* __restrict
 }
 
 
-static void BWTIncBuildRelativeRank(unsigned int* __restrict sortedRank, unsigned int* __restrict seq,
+static void BWTIncBuildRelativeRank(bgint_t* __restrict sortedRank, unsigned int* __restrict seq,
 									unsigned int* __restrict relativeRank, const unsigned int numItem,
-									unsigned int oldInverseSa0, const unsigned int *cumulativeCount)
+									bgint_t oldInverseSa0, const unsigned int *cumulativeCount)
 {
 	unsigned int i, c;
-	unsigned int s, r;
-	unsigned int lastRank, lastIndex;
+	unsigned int s;
+	bgint_t r, lastRank;
+	unsigned int lastIndex;
 	unsigned int oldInverseSa0RelativeRank = 0;
 	unsigned int freq;
 
@@ -893,15 +900,17 @@ static void BWTIncBuildBwt(unsigned int*  seq, const unsigned int *relativeRank,
 	}
 }
 
-static void BWTIncMergeBwt(const unsigned int *sortedRank, const unsigned int* oldBwt, const unsigned int *insertBwt,
-						   unsigned int* __restrict mergedBwt, const unsigned int numOldBwt, const unsigned int numInsertBwt)
+static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt, const unsigned int *insertBwt,
+						   unsigned int* __restrict mergedBwt, const bgint_t numOldBwt, const unsigned int numInsertBwt)
 {
 	unsigned int bitsInWordMinusBitPerChar;
 	unsigned int leftShift, rightShift;
-	unsigned int o;
-	unsigned int oIndex, iIndex, mIndex;
-	unsigned int mWord, mChar, oWord, oChar;
-	unsigned int numInsert;
+	bgint_t o;
+	bgint_t oIndex, mIndex;
+	unsigned int iIndex;
+	bgint_t mWord, oWord;
+	unsigned int mChar, oChar;
+	bgint_t numInsert;
 
 	bitsInWordMinusBitPerChar = BITS_IN_WORD - BIT_PER_CHAR;
 
@@ -1008,9 +1017,9 @@ static void BWTIncMergeBwt(const unsigned int *sortedRank, const unsigned int* o
 
 void BWTClearTrailingBwtCode(BWT *bwt)
 {
-	unsigned int bwtResidentSizeInWord;
-	unsigned int wordIndex, offset;
-	unsigned int i;
+	bgint_t bwtResidentSizeInWord;
+	bgint_t wordIndex, i;
+	unsigned int offset;
 
 	bwtResidentSizeInWord = BWTResidentSizeInWord(bwt->textLength);
 
@@ -1031,16 +1040,16 @@ void BWTClearTrailingBwtCode(BWT *bwt)
 
 
 void BWTGenerateOccValueFromBwt(const unsigned int*  bwt, unsigned int* __restrict occValue,
-								unsigned int* __restrict occValueMajor,
-								const unsigned int textLength, const unsigned int*  decodeTable)
+								bgint_t* __restrict occValueMajor,
+								const bgint_t textLength, const unsigned int*  decodeTable)
 {
-	unsigned int numberOfOccValueMajor, numberOfOccValue;
+	bgint_t numberOfOccValueMajor, numberOfOccValue;
 	unsigned int wordBetweenOccValue;
 	unsigned int numberOfOccIntervalPerMajor;
 	unsigned int c;
 	unsigned int i, j;
-	unsigned int occMajorIndex;
-	unsigned int occIndex, bwtIndex;
+	bgint_t occMajorIndex;
+	bgint_t occIndex, bwtIndex;
 	unsigned int sum;
 	unsigned int tempOccValue0[ALPHABET_SIZE], tempOccValue1[ALPHABET_SIZE];
 
@@ -1246,11 +1255,13 @@ void BWTGenerateOccValueFromBwt(const unsigned int*  bwt, unsigned int* __restri
 static void BWTIncConstruct(BWTInc *bwtInc, const unsigned int numChar)
 {
 	unsigned int i;
-	unsigned int mergedBwtSizeInWord, mergedOccSizeInWord;
+	bgint_t mergedBwtSizeInWord, mergedOccSizeInWord;
 	unsigned int firstCharInThisIteration;
 
-	unsigned int *relativeRank, *seq, *sortedRank, *insertBwt, *mergedBwt;
-	unsigned int newInverseSa0RelativeRank, oldInverseSa0RelativeRank, newInverseSa0;
+	unsigned int *relativeRank, *seq, *insertBwt, *mergedBwt;
+	bgint_t *sortedRank;
+	unsigned int newInverseSa0RelativeRank, oldInverseSa0RelativeRank;
+	bgint_t newInverseSa0;
 
 	#ifdef DEBUG
 	if (numChar > bwtInc->buildSize) {
@@ -1291,8 +1302,8 @@ static void BWTIncConstruct(BWTInc *bwtInc, const unsigned int numChar)
 
 	} else {		// Incremental build
 		// Set address
-		sortedRank = bwtInc->workingMemory;
-		seq = sortedRank + bwtInc->buildSize + 1;
+		sortedRank = bwtInc->sortedRank;
+		seq = bwtInc->workingMemory + bwtInc->buildSize + 1;
 		insertBwt = seq;
 		relativeRank = seq + bwtInc->buildSize + 1;
 
@@ -1388,14 +1399,14 @@ static void BWTIncConstruct(BWTInc *bwtInc, const unsigned int numChar)
 }
 
 BWTInc *BWTIncConstructFromPacked(const char *inputFileName, const float targetNBit,
-								  const unsigned int initialMaxBuildSize, const unsigned int incMaxBuildSize)
+								  const bgint_t initialMaxBuildSize, const bgint_t incMaxBuildSize)
 {
 
 	FILE *packedFile;
-	unsigned int packedFileLen;
-	unsigned int totalTextLength;
-	unsigned int textToLoad, textSizeInByte;
-	unsigned int processedTextLength;
+	long packedFileLen;
+	bgint_t totalTextLength;
+	bgint_t textToLoad, textSizeInByte;
+	bgint_t processedTextLength;
 	unsigned char lastByteLength;
 
 	BWTInc *bwtInc;
@@ -1409,7 +1420,7 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, const float targetN
 
 	fseek(packedFile, -1, SEEK_END);
 	packedFileLen = ftell(packedFile);
-	if ((int)packedFileLen < 0) {
+	if (packedFileLen < 0) {
 		fprintf(stderr, "BWTIncConstructFromPacked: Cannot determine file length!\n");
 		exit(1);
 	}
@@ -1428,9 +1439,9 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, const float targetN
 	textSizeInByte = textToLoad / CHAR_PER_BYTE;	// excluded the odd byte
 
 	fseek(packedFile, -2, SEEK_CUR);
-	fseek(packedFile, -((int)textSizeInByte), SEEK_CUR);
+	fseek(packedFile, -((long)textSizeInByte), SEEK_CUR);
 	fread(bwtInc->textBuffer, sizeof(unsigned char), textSizeInByte + 1, packedFile);
-	fseek(packedFile, -((int)textSizeInByte + 1), SEEK_CUR);
+	fseek(packedFile, -((long)textSizeInByte + 1), SEEK_CUR);
 
 	ConvertBytePackedToWordPacked(bwtInc->textBuffer, bwtInc->packedText, ALPHABET_SIZE, textToLoad);
 	BWTIncConstruct(bwtInc, textToLoad);
@@ -1443,15 +1454,15 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, const float targetN
 			textToLoad = totalTextLength - processedTextLength;
 		}
 		textSizeInByte = textToLoad / CHAR_PER_BYTE;
-		fseek(packedFile, -((int)textSizeInByte), SEEK_CUR);
+		fseek(packedFile, -((long)textSizeInByte), SEEK_CUR);
 		fread(bwtInc->textBuffer, sizeof(unsigned char), textSizeInByte, packedFile);
-		fseek(packedFile, -((int)textSizeInByte), SEEK_CUR);
+		fseek(packedFile, -((long)textSizeInByte), SEEK_CUR);
 		ConvertBytePackedToWordPacked(bwtInc->textBuffer, bwtInc->packedText, ALPHABET_SIZE, textToLoad);
 		BWTIncConstruct(bwtInc, textToLoad);
 		processedTextLength += textToLoad;
 		if (bwtInc->numberOfIterationDone % 10 == 0) {
-			printf("[BWTIncConstructFromPacked] %u iterations done. %u characters processed.\n",
-				   bwtInc->numberOfIterationDone, processedTextLength);
+			printf("[BWTIncConstructFromPacked] %u iterations done. %llu characters processed.\n",
+				   bwtInc->numberOfIterationDone, (unsigned long long)processedTextLength);
 		}
 	}
 	return bwtInc;
@@ -1477,10 +1488,11 @@ void BWTIncFree(BWTInc *bwtInc)
 	if (bwtInc == 0) return;
 	free(bwtInc->bwt);
 	free(bwtInc->workingMemory);
+	free(bwtInc->sortedRank);
 	free(bwtInc);
 }
 
-static unsigned int BWTFileSizeInWord(const unsigned int numChar)
+static bgint_t BWTFileSizeInWord(const bgint_t numChar)
 {
 	// The $ in BWT at the position of inverseSa0 is not encoded
 	return (numChar + CHAR_PER_WORD - 1) / CHAR_PER_WORD;
@@ -1490,7 +1502,7 @@ void BWTSaveBwtCodeAndOcc(const BWT *bwt, const char *bwtFileName, const char *o
 {
 	FILE *bwtFile;
 /*	FILE *occValueFile; */
-	unsigned int bwtLength;
+	bgint_t bwtLength;
 
 	bwtFile = (FILE*)fopen(bwtFileName, "wb");
 	if (bwtFile == NULL) {
@@ -1498,8 +1510,8 @@ void BWTSaveBwtCodeAndOcc(const BWT *bwt, const char *bwtFileName, const char *o
 		exit(1);
 	}
 
-	fwrite(&bwt->inverseSa0, sizeof(unsigned int), 1, bwtFile);
-	fwrite(bwt->cumulativeFreq + 1, sizeof(unsigned int), ALPHABET_SIZE, bwtFile);
+	fwrite(&bwt->inverseSa0, sizeof(bgint_t), 1, bwtFile);
+	fwrite(bwt->cumulativeFreq + 1, sizeof(bgint_t), ALPHABET_SIZE, bwtFile);
 	bwtLength = BWTFileSizeInWord(bwt->textLength);
 	fwrite(bwt->bwtCode, sizeof(unsigned int), bwtLength, bwtFile);
 	fclose(bwtFile);
@@ -25,6 +25,8 @@
 #ifndef BWT_GEN_H
 #define BWT_GEN_H
 
+#include <stdint.h>
+
 #define ALPHABET_SIZE				4
 #define BIT_PER_CHAR				2
 #define CHAR_PER_WORD				16
@@ -56,20 +58,27 @@
 #define truncateRight(value, offset)			( (value) >> (offset) << (offset) )
 #define DNA_OCC_SUM_EXCEPTION(sum)			((sum & 0xfefefeff) == 0)
 
+// text positions and ranks; must have the same width as bwtint_t in bwt.h
+#ifdef BWA_64BIT
+typedef uint64_t bgint_t;
+#else
+typedef unsigned int bgint_t;
+#endif
+
 typedef struct SaIndexRange {
 	unsigned int startSaIndex;
 	unsigned int endSaIndex;
 } SaIndexRange;
 
 typedef struct BWT {
-	unsigned int textLength;			// length of the text
+	bgint_t textLength;					// length of the text
 	unsigned int saInterval;			// interval between two SA values stored explicitly
 	unsigned int inverseSaInterval;		// interval between two inverse SA stored explicitly
-	unsigned int inverseSa0;			// SA-1[0]
-	unsigned int *cumulativeFreq;		// cumulative frequency
+	bgint_t inverseSa0;					// SA-1[0]
+	bgint_t *cumulativeFreq;			// cumulative frequency
 	unsigned int *bwtCode;				// BWT code
 	unsigned int *occValue;				// Occurrence values stored explicitly
-	unsigned int *occValueMajor;		// Occurrence values stored explicitly
+	bgint_t *occValueMajor;				// Occurrence values stored explicitly
 	unsigned int *saValue;				// SA values stored explicitly
 	unsigned int *inverseSa;			// Inverse SA stored explicitly
 	SaIndexRange *saIndexRange;			// SA index range
@@ -77,9 +86,9 @@ typedef struct BWT {
 	unsigned int *saValueOnBoundary;	// Pre-calculated frequently referred data
 	unsigned int *decodeTable;			// For decoding BWT by table lookup
 	unsigned int decodeTableGenerated;	// == TRUE if decode table is generated on load and will be freed
-	unsigned int bwtSizeInWord;			// Temporary variable to hold the memory allocated
-	unsigned int occSizeInWord;			// Temporary variable to hold the memory allocated
-	unsigned int occMajorSizeInWord;	// Temporary variable to hold the memory allocated
+	bgint_t bwtSizeInWord;				// Temporary variable to hold the memory allocated
+	bgint_t occSizeInWord;				// Temporary variable to hold the memory allocated
+	bgint_t occMajorSizeInWord;			// Temporary variable to hold the memory allocated
 	unsigned int saValueSize;			// Temporary variable to hold the memory allocated
 	unsigned int inverseSaSize;			// Temporary variable to hold the memory allocated
 	unsigned int saIndexRangeSize;		// Temporary variable to hold the memory allocated
@@ -89,17 +98,19 @@ typedef struct BWTInc {
 	BWT *bwt;
 	unsigned int numberOfIterationDone;
 	unsigned int *cumulativeCountInCurrentBuild;
-	unsigned int availableWord;
-	unsigned int targetTextLength;
+	bgint_t availableWord;
+	bgint_t targetTextLength;
 	float targetNBit;
-	unsigned int buildSize;
-	unsigned int initialMaxBuildSize;
-	unsigned int incMaxBuildSize;
+	bgint_t buildSize;
+	bgint_t initialMaxBuildSize;
+	bgint_t incMaxBuildSize;
 	unsigned int firstCharInLastIteration;
 	unsigned int *workingMemory;
 	unsigned int *packedText;
 	unsigned char *textBuffer;
 	unsigned int *packedShift;
+	bgint_t *sortedRank;				// absolute ranks of the suffixes in the current build
+	bgint_t sortedRankSize;
 } BWTInc;
 
 #endif
@@ -10,14 +10,15 @@
 #endif
 #include "bwtaln.h"
 #include "bwtgap.h"
+#include "sai.h"
 #include "utils.h"
-
+#include "threadblock.h"
 #ifdef HAVE_PTHREAD
-#define THREAD_BLOCK_SIZE 1024
 #include <pthread.h>
-static pthread_mutex_t g_seq_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+#define THREAD_BLOCK_SIZE 64 // reads claimed at a time by a worker
+
 gap_opt_t *gap_init_opt()
 {
 	gap_opt_t *o;
@@ -27,7 +28,7 @@ gap_opt_t *gap_init_opt()
 	o->s_mm = 3; o->s_gapo = 11; o->s_gape = 4;
 	o->max_diff = -1; o->max_gapo = 1; o->max_gape = 6;
 	o->indel_end_skip = 5; o->max_del_occ = 10; o->max_entries = 2000000;
-	o->mode = BWA_MODE_GAPE | BWA_MODE_COMPREAD;
+	o->mode = BWA_MODE_GAPE | BWA_MODE_COMPREAD | BWA_MODE_BWTINT;
 	o->seed_len = 32; o->max_seed_diff = 2;
 	o->fnr = 0.04;
 	o->n_threads = 1;
@@ -36,6 +37,13 @@ gap_opt_t *gap_init_opt()
 	return o;
 }
 
+void bwa_check_sai_opt(const gap_opt_t *opt, const char *fn_sa)
+{
+	if ((opt->mode & BWA_MODE_64BIT) != BWA_MODE_BWTINT)
+		err_fatal(__func__, "'%s' was generated by a %d-bit build of `aln' but this build uses %d-bit bwtint_t.",
+				  fn_sa, (opt->mode & BWA_MODE_64BIT)? 64 : 32, (int)sizeof(bwtint_t) * 8);
+}
+
 int bwa_cal_maxdiff(int l, double err, double thres)
 {
 	double elambda = exp(-l * err);
@@ -50,113 +58,164 @@ int bwa_cal_maxdiff(int l, double err, double thres)
 	return 2;
 }
 
-// width must be filled as zero
-static int bwt_cal_width(const bwt_t *rbwt, int len, const ubyte_t *str, bwt_width_t *width)
+#define CAL_WIDTH_MAX 4
+
+/* width[j] of str[j][0..len[j]-1] against rbwt[j] for n <= CAL_WIDTH_MAX
+ * independent strings. The strings are walked together so that the Occ
+ * lookup of one overlaps the cache misses of the others. */
+static void bwt_cal_width(int n, const bwt_t *const rbwt[], const int len[], const ubyte_t *const str[], bwt_width_t *const width[])
 {
-	bwtint_t k, l, ok, ol;
-	int i, bid;
-	bid = 0;
-	k = 0; l = rbwt->seq_len;
-	for (i = 0; i < len; ++i) {
-		ubyte_t c = str[i];
-		if (c < 4) {
-			bwt_2occ(rbwt, k - 1, l, c, &ok, &ol);
-			k = rbwt->L2[c] + ok + 1;
-			l = rbwt->L2[c] + ol;
-		}
-		if (k > l || c > 3) { // then restart
-			k = 0;
-			l = rbwt->seq_len;
-			++bid;
+	bwtint_t k[CAL_WIDTH_MAX], l[CAL_WIDTH_MAX], ok, ol;
+	int i, j, max_len = 0, bid[CAL_WIDTH_MAX];
+	for (j = 0; j < n; ++j) {
+		bid[j] = 0;
+		k[j] = 0; l[j] = rbwt[j]->seq_len;
+		if (max_len < len[j]) max_len = len[j];
+	}
+	for (i = 0; i < max_len; ++i) {
+		for (j = 0; j < n; ++j) {
+			const bwt_t *bwt = rbwt[j];
+			ubyte_t c;
+			if (i >= len[j]) continue;
+			c = str[j][i];
+			if (c < 4) {
+				bwt_2occ(bwt, k[j] - 1, l[j], c, &ok, &ol);
+				k[j] = bwt->L2[c] + ok + 1;
+				l[j] = bwt->L2[c] + ol;
+			}
+			if (k[j] > l[j] || c > 3) { // then restart
+				k[j] = 0;
+				l[j] = bwt->seq_len;
+				++bid[j];
+			}
+			width[j][i].w = l[j] - k[j] + 1;
+			width[j][i].bid = bid[j];
+			if (i + 1 < len[j]) bwt_prefetch_2occ(bwt, k[j] - 1, l[j]);
 		}
-		width[i].w = l - k + 1;
-		width[i].bid = bid;
 	}
-	width[len].w = 0;
-	width[len].bid = ++bid;
-	return bid;
+	for (j = 0; j < n; ++j) {
+		width[j][len[j]].w = 0;
+		width[j][len[j]].bid = ++bid[j];
+	}
 }
 
-void bwa_cal_sa_reg_gap(int tid, bwt_t *const bwt[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt)
+/* With n_db > 1, each read is aligned against every index in turn while it
+ * is hot, and aln[i] holds the hits of all of them. max_diff follows the
+ * longest read of the whole batch, so that all parts of a batch are aligned
+ * alike. */
+static void bwa_cal_sa_reg_gap_core(int n_db, bwt_t *const (*bwt)[2], bwa_seqbatch_t *b, int beg, int end, const gap_opt_t *opt, gap_ws_t *ws)
 {
-	int i, max_l = 0, max_len;
-	gap_stack_t *stack;
-	bwt_width_t *w[2], *seed_w[2];
-	const ubyte_t *seq[2];
+	int i, j;
 	gap_opt_t local_opt = *opt;
 
-	// initiate priority stack
-	for (i = max_len = 0; i != n_seqs; ++i)
-		if (seqs[i].len > max_len) max_len = seqs[i].len;
-	if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(max_len, BWA_AVG_ERR, opt->fnr);
+	if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(b->max_len, BWA_AVG_ERR, opt->fnr);
 	if (local_opt.max_diff < local_opt.max_gapo) local_opt.max_gapo = local_opt.max_diff;
-	stack = gap_init_stack(local_opt.max_diff, local_opt.max_gapo, local_opt.max_gape, &local_opt);
-
-	seed_w[0] = (bwt_width_t*)calloc(opt->seed_len+1, sizeof(bwt_width_t));
-	seed_w[1] = (bwt_width_t*)calloc(opt->seed_len+1, sizeof(bwt_width_t));
-	w[0] = w[1] = 0;
-	for (i = 0; i != n_seqs; ++i) {
-		bwa_seq_t *p = seqs + i;
-#ifdef HAVE_PTHREAD
-		if (opt->n_threads > 1) {
-			pthread_mutex_lock(&g_seq_lock);
-			if (p->tid < 0) { // unassigned
-				int j;
-				for (j = i; j < n_seqs && j < i + THREAD_BLOCK_SIZE; ++j)
-					seqs[j].tid = tid;
-			} else if (p->tid != tid) {
-				pthread_mutex_unlock(&g_seq_lock);
-				continue;
+	gap_ws_reserve(ws, b->max_len, opt->seed_len, &local_opt);
+	for (i = beg; i < end; ++i) {
+		int len = b->len[i];
+		bwa_seqbatch_get(b, i, ws->seq[0], ws->seq[1]);
+		if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(len, BWA_AVG_ERR, opt->fnr);
+		local_opt.seed_len = opt->seed_len < len? opt->seed_len : 0x7fffffff;
+		if (n_db > 1) b->n_aln_db[i] = (int*)bwa_arena_alloc(b->arena, n_db * sizeof(int));
+		ws->n_aln = 0;
+		memset(&ws->stat, 0, sizeof(gap_stat_t));
+		for (j = 0; j < n_db; ++j) {
+			int n_aln, off = len > opt->seed_len? len - opt->seed_len : 0;
+			{ // the widths of the read and of its seed on both strands
+				const bwt_t *wb[CAL_WIDTH_MAX] = { bwt[j][0], bwt[j][1], bwt[j][0], bwt[j][1] };
+				const ubyte_t *str[CAL_WIDTH_MAX] = { ws->seq[0], ws->seq[1], ws->seq[0] + off, ws->seq[1] + off };
+				bwt_width_t *ww[CAL_WIDTH_MAX] = { ws->w[0], ws->w[1], ws->seed_w[0], ws->seed_w[1] };
+				int wl[CAL_WIDTH_MAX] = { len, len, opt->seed_len, opt->seed_len };
+				bwt_cal_width(off? 4 : 2, wb, wl, str, ww);
 			}
-			pthread_mutex_unlock(&g_seq_lock);
-		}
-#endif
-		p->sa = 0; p->type = BWA_TYPE_NO_MATCH; p->c1 = p->c2 = 0; p->n_aln = 0; p->aln = 0;
-		seq[0] = p->seq; seq[1] = p->rseq;
-		if (max_l < p->len) {
-			max_l = p->len;
-			w[0] = (bwt_width_t*)realloc(w[0], (max_l + 1) * sizeof(bwt_width_t));
-			w[1] = (bwt_width_t*)realloc(w[1], (max_l + 1) * sizeof(bwt_width_t));
-			memset(w[0], 0, (max_l + 1) * sizeof(bwt_width_t));
-			memset(w[1], 0, (max_l + 1) * sizeof(bwt_width_t));
+			// core function
+			n_aln = bwt_match_gap(bwt[j], len, (const ubyte_t**)ws->seq, ws->w, len <= opt->seed_len? 0 : ws->seed_w, &local_opt, ws);
+			if (n_db > 1) b->n_aln_db[i][j] = n_aln;
 		}
-		bwt_cal_width(bwt[0], p->len, seq[0], w[0]);
-		bwt_cal_width(bwt[1], p->len, seq[1], w[1]);
-		if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(p->len, BWA_AVG_ERR, opt->fnr);
-		local_opt.seed_len = opt->seed_len < p->len? opt->seed_len : 0x7fffffff;
-		if (p->len > opt->seed_len) {
-			bwt_cal_width(bwt[0], opt->seed_len, seq[0] + (p->len - opt->seed_len), seed_w[0]);
-			bwt_cal_width(bwt[1], opt->seed_len, seq[1] + (p->len - opt->seed_len), seed_w[1]);
-		}
-		// core function
-		p->aln = bwt_match_gap(bwt, p->len, seq, w, p->len <= opt->seed_len? 0 : seed_w, &local_opt, &p->n_aln, stack);
-		// store the alignment
-		free(p->name); free(p->seq); free(p->rseq); free(p->qual);
-		p->name = 0; p->seq = p->rseq = p->qual = 0;
+		b->n_aln[i] = ws->n_aln;
+		b->aln[i] = ws->n_aln? (bwt_aln1_t*)bwa_arena_memdup(b->arena, ws->aln, ws->n_aln * sizeof(bwt_aln1_t)) : 0;
+		if (b->stat) b->stat[i] = ws->stat;
 	}
-	free(seed_w[0]); free(seed_w[1]);
-	free(w[0]); free(w[1]);
-	gap_destroy_stack(stack);
 }
 
-#ifdef HAVE_PTHREAD
+// the search of each read, one line per read in input order, for tuning -m and -R
+typedef struct {
+	FILE *fp;
+	uint64_t n_reads, n_entries, n_top2; // reads, and those stopped by -m and by -R
+	uint32_t max_entries;
+} aln_report_t;
+
 typedef struct {
-	int tid;
-	bwt_t *bwt[2];
-	int n_seqs;
-	bwa_seq_t *seqs;
+	int n_db;
+	bwt_t *(*bwt)[2]; // the BWT and reverse BWT of each index
+	bwa_seqbatch_t *b;
 	const gap_opt_t *opt;
+	sai_writer_t **sai; // one per index
+	aln_report_t *report; // or NULL
+	int n_ws;
+	gap_ws_t *const *ws; // per thread
 } thread_aux_t;
 
-static void *worker(void *data)
+static void worker(uint32_t tid, uint32_t beg, uint32_t end, void *data)
 {
 	thread_aux_t *d = (thread_aux_t*)data;
-	bwa_cal_sa_reg_gap(d->tid, d->bwt, d->n_seqs, d->seqs, d->opt);
-	return 0;
+	bwa_cal_sa_reg_gap_core(d->n_db, (bwt_t *const (*)[2])d->bwt, d->b, beg, end, d->opt, d->ws[tid]);
+}
+
+static void aux_init_ws(thread_aux_t *aux, int n)
+{
+	gap_ws_t **ws = (gap_ws_t**)calloc(n, sizeof(gap_ws_t*));
+	int i;
+	for (i = 0; i < n; ++i) ws[i] = gap_ws_init();
+	aux->n_ws = n; aux->ws = ws;
 }
-#endif
 
-bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa)
+static void aux_destroy_ws(thread_aux_t *aux)
+{
+	int i;
+	for (i = 0; i < aux->n_ws; ++i) gap_ws_destroy(aux->ws[i]);
+	free((gap_ws_t**)aux->ws);
+}
+
+// aligns seqs through a batch and hands the hits back to them; tp may be NULL
+static void bwa_aln_seqs_core(threadpool_t *tp, int n_db, bwt_t *const (*bwt)[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt,
+							  gap_ws_t *const *ws)
+{
+	thread_aux_t aux;
+	int i;
+	memset(&aux, 0, sizeof(thread_aux_t));
+	aux.n_db = n_db; aux.bwt = (bwt_t *(*)[2])bwt; aux.opt = opt; aux.ws = ws;
+	aux.b = bwa_seqbatch_init(opt->mode & BWA_MODE_COMPREAD);
+	bwa_seqbatch_add(aux.b, n_seqs, seqs);
+	if (tp) threadpool_exec(tp, n_seqs, THREAD_BLOCK_SIZE, worker, &aux);
+	else worker(0, 0, n_seqs, &aux);
+	for (i = 0; i < n_seqs; ++i) { // the hits outlive the batch
+		bwa_seq_t *p = seqs + i;
+		p->sa = 0; p->type = BWA_TYPE_NO_MATCH; p->c1 = p->c2 = 0;
+		p->n_aln = aux.b->n_aln[i];
+		p->aln = p->n_aln? (bwt_aln1_t*)malloc(p->n_aln * sizeof(bwt_aln1_t)) : 0;
+		if (p->n_aln) memcpy(p->aln, aux.b->aln[i], p->n_aln * sizeof(bwt_aln1_t));
+		p->n_aln_db = 0;
+		if (n_db > 1) {
+			p->n_aln_db = (int*)malloc(n_db * sizeof(int));
+			memcpy(p->n_aln_db, aux.b->n_aln_db[i], n_db * sizeof(int));
+		}
+	}
+	bwa_seqbatch_destroy(aux.b);
+}
+
+void bwa_cal_sa_reg_gap(bwt_t *const bwt[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt, gap_ws_t *ws)
+{
+	bwa_aln_seqs_core(0, 1, (bwt_t *const (*)[2])bwt, n_seqs, seqs, opt, &ws);
+}
+
+void bwa_aln_seqs(threadpool_t *tp, int n_db, bwt_t *const (*bwt)[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt,
+				  gap_ws_t *const *ws)
+{
+	bwa_aln_seqs_core(tp, n_db, bwt, n_seqs, seqs, opt, ws);
+}
+
+bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa, int n_threads)
 {
 	bwa_seqio_t *ks;
 	if (mode & BWA_MODE_BAM) { // open BAM
@@ -165,88 +224,217 @@ bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa)
 		if (mode & BWA_MODE_BAM_READ1) which |= 1;
 		if (mode & BWA_MODE_BAM_READ2) which |= 2;
 		if (which == 0) which = 7; // then read all reads
-		ks = bwa_bam_open(fn_fa, which);
-	} else ks = bwa_seq_open(fn_fa);
+		ks = bwa_bam_open(fn_fa, which, n_threads);
+	} else ks = bwa_seq_open(fn_fa, n_threads);
 	return ks;
 }
 
-void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt)
+static void bwa_aln_write_report(aln_report_t *r, const bwa_seqbatch_t *b)
+{
+	static const char *stop_str[] = { "-", "m", "R", "mR" };
+	int i;
+	for (i = 0; i < b->n; ++i) {
+		const gap_stat_t *s = b->stat + i;
+		fprintf(r->fp, "%llu\t%u\t%u\t%s\n", (unsigned long long)++r->n_reads, s->n_push, s->max_entries, stop_str[s->stop&3]);
+		if (s->stop & GAP_STOP_ENTRIES) ++r->n_entries;
+		if (s->stop & GAP_STOP_TOP2) ++r->n_top2;
+		if (r->max_entries < s->max_entries) r->max_entries = s->max_entries;
+	}
+}
+
+static void bwa_aln_write(int n_db, sai_writer_t **sai, aln_report_t *report, const bwa_seqbatch_t *b)
 {
-	int i, n_seqs, tot_seqs = 0;
-	bwa_seq_t *seqs;
+	int i, j, off;
+	if (report) bwa_aln_write_report(report, b);
+	for (i = 0; i < b->n; ++i) {
+		if (n_db == 1) {
+			sai_write1(sai[0], b->n_aln[i], b->aln[i]);
+			continue;
+		}
+		for (j = off = 0; j < n_db; off += b->n_aln_db[i][j++])
+			sai_write1(sai[j], b->n_aln_db[i][j], b->aln[i] + off);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+#define PIPE_DEPTH 2 // batches that may wait between two stages
+
+/* the pipelined mode: a reader thread, the alignment pool driven by the
+ * calling thread and a writer thread, with bounded queues in between so
+ * that parsing/decompression and output overlap with the alignment. The
+ * queues are FIFOs and there is one thread per stage, so batches are
+ * written in input order and the output is that of the serial loop. */
+typedef struct {
 	bwa_seqio_t *ks;
-	clock_t t;
-	bwt_t *bwt[2];
+	const gap_opt_t *opt;
+	threadqueue_t *q;
+} aln_reader_t;
 
-	// initialization
-	ks = bwa_open_reads(opt->mode, fn_fa);
+typedef struct {
+	threadqueue_t *q;
+	int n_db;
+	sai_writer_t **sai;
+	aln_report_t *report;
+} aln_writer_t;
 
-	{ // load BWT
-		char *str = (char*)calloc(strlen(prefix) + 10, 1);
-		strcpy(str, prefix); strcat(str, ".bwt");  bwt[0] = bwt_restore_bwt(str);
-		strcpy(str, prefix); strcat(str, ".rbwt"); bwt[1] = bwt_restore_bwt(str);
-		free(str);
+static void *aln_reader(void *data)
+{
+	aln_reader_t *r = (aln_reader_t*)data;
+	bwa_seqbatch_t *b;
+	while ((b = bwa_read_seqbatch(r->ks, 0x40000, r->opt->mode, r->opt->trim_qual)) != 0)
+		threadqueue_push(r->q, b);
+	threadqueue_close(r->q);
+	return 0;
+}
+
+static void *aln_writer(void *data)
+{
+	aln_writer_t *w = (aln_writer_t*)data;
+	bwa_seqbatch_t *b;
+	int tot_seqs = 0;
+	while ((b = (bwa_seqbatch_t*)threadqueue_pop(w->q)) != 0) {
+		clock_t t = clock();
+		bwa_aln_write(w->n_db, w->sai, w->report, b);
+		tot_seqs += b->n;
+		fprintf(stderr, "[bwa_aln_core] write to the disk... %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		fprintf(stderr, "[bwa_aln_core] %d sequences have been processed.\n", tot_seqs);
+		bwa_seqbatch_destroy(b);
 	}
+	return 0;
+}
 
-	// core loop
-	fwrite(opt, sizeof(gap_opt_t), 1, stdout);
-	while ((seqs = bwa_read_seq(ks, 0x40000, &n_seqs, opt->mode, opt->trim_qual)) != 0) {
-		tot_seqs += n_seqs;
-		t = clock();
+static void bwa_aln_pipeline(bwa_seqio_t *ks, threadpool_t *tp, thread_aux_t *aux)
+{
+	pthread_t reader_tid, writer_tid;
+	aln_reader_t reader;
+	aln_writer_t writer;
+	bwa_seqbatch_t *b;
+	threadqueue_t *q_in = threadqueue_create(PIPE_DEPTH), *q_out = threadqueue_create(PIPE_DEPTH);
 
-		fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... ");
+	reader.ks = ks; reader.opt = aux->opt; reader.q = q_in;
+	writer.q = q_out; writer.n_db = aux->n_db; writer.sai = aux->sai; writer.report = aux->report;
+	if (pthread_create(&reader_tid, 0, aln_reader, &reader) != 0 || pthread_create(&writer_tid, 0, aln_writer, &writer) != 0)
+		err_fatal_simple("thread creation failed.");
+	while ((b = (bwa_seqbatch_t*)threadqueue_pop(q_in)) != 0) {
+		clock_t t = clock();
+		aux->b = b;
+		if (aux->report) b->stat = (gap_stat_t*)calloc(b->n, sizeof(gap_stat_t));
+		threadpool_exec(tp, b->n, THREAD_BLOCK_SIZE, worker, aux);
+		fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		threadqueue_push(q_out, b);
+	}
+	threadqueue_close(q_out);
+	pthread_join(reader_tid, 0);
+	pthread_join(writer_tid, 0);
+	threadqueue_destroy(q_in); threadqueue_destroy(q_out);
+}
+#endif /* HAVE_PTHREAD */
 
-#ifdef HAVE_PTHREAD
-		if (opt->n_threads <= 1) { // no multi-threading at all
-			bwa_cal_sa_reg_gap(0, bwt, n_seqs, seqs, opt);
-		} else {
-			pthread_t *tid;
-			pthread_attr_t attr;
-			thread_aux_t *data;
-			int j;
-			pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-			data = (thread_aux_t*)calloc(opt->n_threads, sizeof(thread_aux_t));
-			tid = (pthread_t*)calloc(opt->n_threads, sizeof(pthread_t));
-			for (j = 0; j < opt->n_threads; ++j) {
-				data[j].tid = j; data[j].bwt[0] = bwt[0]; data[j].bwt[1] = bwt[1];
-				data[j].n_seqs = n_seqs; data[j].seqs = seqs; data[j].opt = opt;
-				pthread_create(&tid[j], &attr, worker, data + j);
-			}
-			for (j = 0; j < opt->n_threads; ++j) pthread_join(tid[j], 0);
-			free(data); free(tid);
-		}
-#else
-		bwa_cal_sa_reg_gap(0, bwt, n_seqs, seqs, opt);
-#endif
+static void bwa_aln_serial(bwa_seqio_t *ks, threadpool_t *tp, thread_aux_t *aux)
+{
+	int tot_seqs = 0;
+	bwa_seqbatch_t *b;
+	clock_t t;
+	const gap_opt_t *opt = aux->opt;
+
+	b = bwa_read_seqbatch(ks, 0x40000, opt->mode, opt->trim_qual);
+	while (b != 0) {
+		bwa_seqbatch_t *next;
+		tot_seqs += b->n;
+		t = clock();
 
+		fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... ");
+		aux->b = b;
+		if (aux->report) b->stat = (gap_stat_t*)calloc(b->n, sizeof(gap_stat_t));
+		threadpool_start(tp, b->n, THREAD_BLOCK_SIZE, worker, aux);
+		next = bwa_read_seqbatch(ks, 0x40000, opt->mode, opt->trim_qual); // while the pool aligns b
+		threadpool_wait(tp);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
 
 		t = clock();
 		fprintf(stderr, "[bwa_aln_core] write to the disk... ");
-		for (i = 0; i < n_seqs; ++i) {
-			bwa_seq_t *p = seqs + i;
-			fwrite(&p->n_aln, 4, 1, stdout);
-			if (p->n_aln) fwrite(p->aln, sizeof(bwt_aln1_t), p->n_aln, stdout);
-		}
+		bwa_aln_write(aux->n_db, aux->sai, aux->report, b);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC); t = clock();
 
-		bwa_free_read_seq(n_seqs, seqs);
+		bwa_seqbatch_destroy(b);
 		fprintf(stderr, "[bwa_aln_core] %d sequences have been processed.\n", tot_seqs);
+		b = next;
 	}
+}
+
+/* the reads are read once and aligned against the n_db indices prefix[];
+ * the hits against prefix[i] go to fn_out[i], or to stdout if fn_out is
+ * NULL and there is one index. With fn_report, how the search of each
+ * read went is written there. */
+void bwa_aln_core(int n_db, const char **prefix, const char *fn_fa, const char **fn_out, const char *fn_report,
+				  const gap_opt_t *opt, int load_flags, int pipeline, int sai_flags)
+{
+	bwa_seqio_t *ks;
+	threadpool_t *tp;
+	thread_aux_t aux;
+	aln_report_t report;
+	FILE **fp;
+	int j;
+
+	// initialization
+	ks = bwa_open_reads(opt->mode, fn_fa, opt->n_threads);
+	aux.n_db = n_db; aux.opt = opt;
+	aux.bwt = (bwt_t *(*)[2])calloc(n_db, sizeof(bwt_t*[2]));
+	aux.sai = (sai_writer_t**)calloc(n_db, sizeof(sai_writer_t*));
+	aux.report = 0;
+	if (fn_report) {
+		memset(&report, 0, sizeof(aln_report_t));
+		report.fp = xopen(fn_report, "w");
+		fprintf(report.fp, "#read\tpushed\tmax_queue\tstop\n");
+		aux.report = &report;
+	}
+	fp = (FILE**)calloc(n_db, sizeof(FILE*));
+
+	for (j = 0; j < n_db; ++j) { // load BWT
+		char *str = (char*)calloc(strlen(prefix[j]) + 10, 1);
+		strcpy(str, prefix[j]); strcat(str, ".bwt");  aux.bwt[j][0] = bwt_restore_bwt_core(str, load_flags);
+		strcpy(str, prefix[j]); strcat(str, ".rbwt"); aux.bwt[j][1] = bwt_restore_bwt_core(str, load_flags);
+		free(str);
+		fp[j] = fn_out? xopen(fn_out[j], "wb") : stdout;
+		aux.sai[j] = sai_open_w(fp[j], opt, sai_flags);
+	}
+
+	// core loop
+	tp = threadpool_create(opt->n_threads);
+	aux_init_ws(&aux, threadpool_size(tp));
+#ifdef HAVE_PTHREAD
+	if (pipeline) bwa_aln_pipeline(ks, tp, &aux);
+	else
+#endif /* HAVE_PTHREAD */
+	bwa_aln_serial(ks, tp, &aux);
 
 	// destroy
-	bwt_destroy(bwt[0]); bwt_destroy(bwt[1]);
+	for (j = 0; j < n_db; ++j) {
+		sai_close_w(aux.sai[j]);
+		if (fp[j] != stdout) fclose(fp[j]);
+		bwt_destroy(aux.bwt[j][0]); bwt_destroy(aux.bwt[j][1]);
+	}
+	free(aux.sai); free(aux.bwt); free(fp);
+	aux_destroy_ws(&aux);
+	if (aux.report) {
+		fprintf(stderr, "[bwa_aln_core] %llu reads: %llu stopped at -m %d, %llu at -R %d; largest queue %u\n",
+				(unsigned long long)report.n_reads, (unsigned long long)report.n_entries, opt->max_entries,
+				(unsigned long long)report.n_top2, opt->max_top2, report.max_entries);
+		fclose(report.fp);
+	}
+	threadpool_destroy(tp);
 	bwa_seq_close(ks);
 }
 
 int bwa_aln(int argc, char *argv[])
 {
-	int c, opte = -1;
+	int c, opte = -1, load_flags = 0, pipeline = 0, sai_flags = 0, n_out = 0;
+	const char **fn_out, *fn_report = 0;
 	gap_opt_t *opt;
 
 	opt = gap_init_opt();
-	while ((c = getopt(argc, argv, "n:o:e:i:d:l:k:cLR:m:t:NM:O:E:q:f:b012IB:")) >= 0) {
+	fn_out = (const char**)calloc(argc, sizeof(char*));
+	while ((c = getopt(argc, argv, "n:o:e:i:d:l:k:cLR:m:t:NM:O:E:q:f:b012IB:Z:PzS:")) >= 0) {
 		switch (c) {
 		case 'n':
 			if (strstr(optarg, ".")) opt->fnr = atof(optarg), opt->max_diff = -1;
@@ -268,13 +456,17 @@ int bwa_aln(int argc, char *argv[])
 		case 'q': opt->trim_qual = atoi(optarg); break;
 		case 'c': opt->mode &= ~BWA_MODE_COMPREAD; break;
 		case 'N': opt->mode |= BWA_MODE_NONSTOP; opt->max_top2 = 0x7fffffff; break;
-		case 'f': xreopen(optarg, "wb", stdout); break;
+		case 'f': fn_out[n_out++] = optarg; break;
 		case 'b': opt->mode |= BWA_MODE_BAM; break;
 		case '0': opt->mode |= BWA_MODE_BAM_SE; break;
 		case '1': opt->mode |= BWA_MODE_BAM_READ1; break;
 		case '2': opt->mode |= BWA_MODE_BAM_READ2; break;
 		case 'I': opt->mode |= BWA_MODE_IL13; break;
 		case 'B': opt->mode |= atoi(optarg) << 24; break;
+		case 'Z': load_flags = bwt_load_flags(atoi(optarg)); break;
+		case 'P': pipeline = 1; break;
+		case 'z': sai_flags |= SAI_F_COMPRESS; break;
+		case 'S': fn_report = optarg; break;
 		default: return 1;
 		}
 	}
@@ -285,7 +477,7 @@ int bwa_aln(int argc, char *argv[])
 
 	if (optind + 2 > argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   bwa aln [options] <prefix> <in.fq>\n\n");
+		fprintf(stderr, "Usage:   bwa aln [options] <prefix> [<prefix2> ...] <in.fq>\n\n");
 		fprintf(stderr, "Options: -n NUM    max #diff (int) or missing prob under %.2f err rate (float) [%.2f]\n",
 				BWA_AVG_ERR, opt->fnr);
 		fprintf(stderr, "         -o INT    maximum number or fraction of gap opens [%d]\n", opt->max_gapo);
@@ -301,8 +493,12 @@ int bwa_aln(int argc, char *argv[])
 		fprintf(stderr, "         -E INT    gap extension penalty [%d]\n", opt->s_gape);
 		fprintf(stderr, "         -R INT    stop searching when there are >INT equally best hits [%d]\n", opt->max_top2);
 		fprintf(stderr, "         -q INT    quality threshold for read trimming down to %dbp [%d]\n", BWA_MIN_RDLEN, opt->trim_qual);
-        fprintf(stderr, "         -f FILE   file to write output to instead of stdout\n");
+        fprintf(stderr, "         -f FILE   file to write output to instead of stdout; one per prefix with several\n");
 		fprintf(stderr, "         -B INT    length of barcode\n");
+		fprintf(stderr, "         -Z INT    index loading: 0 read into memory, 1 mmap, 2 mmap and prefetch [0]\n");
+		fprintf(stderr, "         -P        read, align and write in separate threads\n");
+		fprintf(stderr, "         -z        compress the .sai output\n");
+		fprintf(stderr, "         -S FILE   write the queue size and stop reason of each read's search to FILE\n");
 		fprintf(stderr, "         -c        input sequences are in the color space\n");
 		fprintf(stderr, "         -L        log-scaled gap penalty for long deletions\n");
 		fprintf(stderr, "         -N        non-iterative mode: search for all n-difference hits (slooow)\n");
@@ -314,6 +510,10 @@ int bwa_aln(int argc, char *argv[])
 		fprintf(stderr, "\n");
 		return 1;
 	}
+	if (n_out > 1 || argc - optind > 2) {
+		if (n_out != argc - optind - 1)
+			err_fatal(__func__, "%d index prefixes but %d output files; give one -f per prefix.", argc - optind - 1, n_out);
+	}
 	if (opt->fnr > 0.0) {
 		int i, k;
 		for (i = 17, k = 0; i <= 250; ++i) {
@@ -322,7 +522,8 @@ int bwa_aln(int argc, char *argv[])
 			k = l;
 		}
 	}
-	bwa_aln_core(argv[optind], argv[optind+1], opt);
+	bwa_aln_core(argc - optind - 1, (const char**)argv + optind, argv[argc-1], n_out? fn_out : 0, fn_report, opt, load_flags, pipeline, sai_flags);
+	free(fn_out);
 	free(opt);
 	return 0;
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include "bwt.h"
+#include "rng.h"
+#include "arena.h"
 
 #define BWA_TYPE_NO_MATCH 0
 #define BWA_TYPE_UNIQUE 1
@@ -69,6 +71,7 @@ typedef struct {
 	// alignments in SA coordinates
 	int n_aln;
 	bwt_aln1_t *aln;
+	int *n_aln_db; // aligned against several indices, how many of aln are against each, in order
 	// multiple hits
 	int n_multi;
 	bwt_multi1_t *multi;
@@ -90,8 +93,39 @@ typedef struct {
 	// NM and MD tags
 	uint32_t full_len:20, nm:12;
 	char *md;
+	uint64_t id; // index of the read in its input
+	bwa_rng_t rng; // random numbers of the read, keyed by id; see rng.h
+	bwa_arena_t *arena; // of the batch; holds name, seq, rseq, qual, cigar, md and multi
 } bwa_seq_t;
 
+#define GAP_STOP_ENTRIES 1 // the queue grew beyond -m
+#define GAP_STOP_TOP2    2 // more than -R equally best hits
+
+// how the gap search of a read went, summed over the indices
+typedef struct {
+	uint32_t n_push, max_entries; // entries pushed, largest queue
+	uint32_t stop; // GAP_STOP_*
+} gap_stat_t;
+
+/* A batch of reads as aln sees them: arrays rather than bwa_seq_t, so that
+ * the kernel only touches what it needs. The bases of read i, reversed as
+ * in bwa_seq_t.seq, are packed two to a byte from byte off[i] of nt;
+ * rseq is their complement and is made when the read is unpacked. The
+ * hits of read i go to aln[i], split by index in n_aln_db[i] when the
+ * reads are aligned against several. */
+typedef struct {
+	int n, m, max_len, is_comp;
+	uint32_t *len;
+	uint64_t *off;
+	size_t l_nt, m_nt;
+	uint8_t *nt;
+	int *n_aln;
+	bwt_aln1_t **aln;
+	int **n_aln_db;
+	bwa_arena_t *arena; // holds aln[] and n_aln_db[]
+	gap_stat_t *stat; // if not NULL, the search of each read
+} bwa_seqbatch_t;
+
 #define BWA_MODE_GAPE       0x01
 #define BWA_MODE_COMPREAD   0x02
 #define BWA_MODE_LOGGAP     0x04
@@ -101,6 +135,13 @@ typedef struct {
 #define BWA_MODE_BAM_READ1  0x80
 #define BWA_MODE_BAM_READ2  0x100
 #define BWA_MODE_IL13       0x200
+#define BWA_MODE_64BIT      0x400 // .sai written with 64-bit bwtint_t
+
+#ifdef BWA_64BIT
+#define BWA_MODE_BWTINT     BWA_MODE_64BIT
+#else
+#define BWA_MODE_BWTINT     0
+#endif
 
 typedef struct {
 	int s_mm, s_gapo, s_gape;
@@ -124,28 +165,49 @@ typedef struct {
 	int n_threads;
 	int type, is_sw, is_preload;
 	int remapping;
+	int load_flags; // BWT_LOAD_*
+	int is_bam; // write BAM instead of SAM
+	uint64_t cache_size; // bytes for cached SA positions; 0 for no limit
 	double ap_prior;
 } pe_opt_t;
 
 struct __bwa_seqio_t;
 typedef struct __bwa_seqio_t bwa_seqio_t;
+struct _threadpool_t;
+struct gap_ws_s;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	gap_opt_t *gap_init_opt();
-	void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt);
+	void bwa_aln_core(int n_db, const char **prefix, const char *fn_fa, const char **fn_out, const char *fn_report,
+					  const gap_opt_t *opt, int load_flags, int pipeline, int sai_flags);
+	void bwa_check_sai_opt(const gap_opt_t *opt, const char *fn_sa);
 
-	bwa_seqio_t *bwa_seq_open(const char *fn);
-	bwa_seqio_t *bwa_bam_open(const char *fn, int which);
+	// n_threads > 1 inflates BGZF input in the background
+	bwa_seqio_t *bwa_seq_open(const char *fn, int n_threads);
+	bwa_seqio_t *bwa_bam_open(const char *fn, int which, int n_threads);
 	void bwa_seq_close(bwa_seqio_t *bs);
 	void seq_reverse(int len, ubyte_t *seq, int is_comp);
 	bwa_seq_t *bwa_read_seq(bwa_seqio_t *seq, int n_needed, int *n, int mode, int trim_qual);
 	void bwa_free_read_seq(int n_seqs, bwa_seq_t *seqs);
 
+	bwa_seqbatch_t *bwa_seqbatch_init(int is_comp);
+	void bwa_seqbatch_add(bwa_seqbatch_t *b, int n_seqs, const bwa_seq_t *seqs); // packs the bases of seqs
+	void bwa_seqbatch_destroy(bwa_seqbatch_t *b);
+	// up to n_needed reads, without keeping names and qualities; NULL at the end
+	bwa_seqbatch_t *bwa_read_seqbatch(bwa_seqio_t *seq, int n_needed, int mode, int trim_qual);
+	// the bases of read i, and their complement in rseq if it is not NULL
+	void bwa_seqbatch_get(const bwa_seqbatch_t *b, int i, ubyte_t *seq, ubyte_t *rseq);
+
 	int bwa_cal_maxdiff(int l, double err, double thres);
-	void bwa_cal_sa_reg_gap(int tid, bwt_t *const bwt[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt);
+	// ws: a gap_ws_t from gap_ws_init(), kept by the caller from batch to batch
+	void bwa_cal_sa_reg_gap(bwt_t *const bwt[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt, struct gap_ws_s *ws);
+	/* aligns a batch against n_db indices on tp as aln does, keeping the bases
+	 * for sampe; ws holds a workspace per thread of tp, as for bwa_cal_sa_reg_gap() */
+	void bwa_aln_seqs(struct _threadpool_t *tp, int n_db, bwt_t *const (*bwt)[2], int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt,
+					  struct gap_ws_s *const *ws);
 
 
 	/* rgoya: Temporary clone of aln_path2cigar to accomodate for bwa_cigar_t,
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bwt.h"
+#include "bwtocc.h"
+#include "filter_alignments.h"
+#include "main.h"
+#include "utils.h"
+
+/* Micro-benchmarks of the Occ primitives underlying backward search. The
+ * lookups are spread uniformly over the whole index, so the numbers are
+ * dominated by cache misses on the Occ blocks and reflect the cost of the
+ * block layout (e.g. 32-bit vs 64-bit bwtint_t) as much as the counting
+ * kernel. Each kernel supported by the CPU is timed in turn and must give
+ * the same checksums. -P times the counting of distinct hit positions in
+ * sampe instead (see filter_alignments.cpp). */
+
+typedef struct {
+	int n;
+	bwtint_t *k, *l;
+	ubyte_t *c;
+} bench_query_t;
+
+static inline uint64_t bench_rand(uint64_t *x) // xorshift64*
+{
+	*x ^= *x >> 12; *x ^= *x << 25; *x ^= *x >> 27;
+	return *x * 2685821657736338717ull;
+}
+
+static bench_query_t *bench_query_init(const bwt_t *bwt, int n, uint64_t seed)
+{
+	bench_query_t *q;
+	int i;
+	q = (bench_query_t*)calloc(1, sizeof(bench_query_t));
+	q->n = n;
+	q->k = (bwtint_t*)calloc(n, sizeof(bwtint_t));
+	q->l = (bwtint_t*)calloc(n, sizeof(bwtint_t));
+	q->c = (ubyte_t*)calloc(n, 1);
+	for (i = 0; i < n; ++i) {
+		uint64_t x = bench_rand(&seed);
+		q->k[i] = x % (bwt->seq_len + 1);
+		// intervals in backward search are usually narrow; l-k < 64 keeps most pairs in one block
+		q->l[i] = q->k[i] + (x >> 58);
+		if (q->l[i] > bwt->seq_len) q->l[i] = bwt->seq_len;
+		q->c[i] = x >> 56 & 3;
+	}
+	return q;
+}
+
+static void bench_query_destroy(bench_query_t *q)
+{
+	free(q->k); free(q->l); free(q->c); free(q);
+}
+
+static void bench_report(const char *name, int n, double t, uint64_t sum)
+{
+	fprintf(stderr, "[bwa_bench] %-8s %-6s %10.2f Mlookups/sec (%.3f sec; checksum %llx)\n",
+			bwt_occ_kernel->name, name, n / t * 1e-6, t, (unsigned long long)sum);
+}
+
+static void bench_occ(const bwt_t *bwt, const bench_query_t *q, uint64_t sums[4])
+{
+	int i;
+	uint64_t sum;
+	double t;
+
+	t = realtime();
+	for (i = 0, sum = 0; i < q->n; ++i)
+		sum += bwt_occ(bwt, q->k[i], q->c[i]);
+	bench_report("occ", q->n, realtime() - t, sum);
+	sums[0] = sum;
+
+	t = realtime();
+	for (i = 0, sum = 0; i < q->n; ++i) {
+		bwtint_t ok, ol;
+		bwt_2occ(bwt, q->k[i], q->l[i], q->c[i], &ok, &ol);
+		sum += ok ^ ol;
+	}
+	bench_report("2occ", q->n, realtime() - t, sum);
+	sums[1] = sum;
+
+	t = realtime();
+	for (i = 0, sum = 0; i < q->n; ++i) {
+		bwtint_t cnt[4];
+		bwt_occ4(bwt, q->k[i], cnt);
+		sum += cnt[0] ^ cnt[1] ^ cnt[2] ^ cnt[3];
+	}
+	bench_report("occ4", q->n, realtime() - t, sum);
+	sums[2] = sum;
+
+	t = realtime();
+	for (i = 0, sum = 0; i < q->n; ++i) {
+		bwtint_t cntk[4], cntl[4];
+		bwt_2occ4(bwt, q->k[i], q->l[i], cntk, cntl);
+		sum += cntk[0] ^ cntk[3] ^ cntl[1] ^ cntl[2];
+	}
+	bench_report("2occ4", q->n, realtime() - t, sum);
+	sums[3] = sum;
+}
+
+int bwa_bench(int argc, char *argv[])
+{
+	int c, n = 10000000, n_reads = 0, load_flags = 0;
+	uint64_t seed = 11, sums[4], sums0[4];
+	const bwt_occ_kernel_t *kernel, *best = bwt_occ_kernel;
+	char *name = 0;
+	bench_query_t *q;
+	bwt_t *bwt;
+
+	while ((c = getopt(argc, argv, "n:s:Z:k:P:")) >= 0) {
+		switch (c) {
+		case 'n': n = atoi(optarg); break;
+		case 'k': name = optarg; break;
+		case 's': seed = atol(optarg); break;
+		case 'Z': load_flags = bwt_load_flags(atoi(optarg)); break;
+		case 'P': n_reads = atoi(optarg); break;
+		default: return 1;
+		}
+	}
+	if (seed == 0) seed = 11; // xorshift is stuck at zero
+	if (n_reads > 0) {
+		coord_count_bench(n_reads, seed);
+		return 0;
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   bwa bench [options] <in.bwt>\n\n");
+		fprintf(stderr, "Options: -n INT   number of random lookups per kernel [%d]\n", n);
+		fprintf(stderr, "         -s INT   random seed [%llu]\n", (unsigned long long)seed);
+		fprintf(stderr, "         -k STR   only time this Occ kernel [all supported]\n");
+		fprintf(stderr, "         -Z INT   index loading: 0 read into memory, 1 mmap, 2 mmap and prefetch [0]\n");
+		fprintf(stderr, "         -P INT   instead, time how sampe counts the distinct hits of INT synthetic\n");
+		fprintf(stderr, "                  repeat-heavy reads; needs no index\n\n");
+		return 1;
+	}
+	bwt = bwt_restore_bwt_core(argv[optind], load_flags);
+	xassert(bwt_has_occ(bwt), "the BWT has not been updated with Occ (see `bwa bwtupdate').");
+	fprintf(stderr, "[bwa_bench] %llu bases; %d-bit bwtint_t; %d-byte Occ blocks of %d bases; %.1f MB\n",
+			(unsigned long long)bwt->seq_len, (int)sizeof(bwtint_t) * 8, (int)(OCC_BLOCK_WORDS * 4), OCC_INTERVAL,
+			bwt->bwt_size * 4.0 / 1024 / 1024);
+	fprintf(stderr, "[bwa_bench] Occ kernels:");
+	for (kernel = bwt_occ_kernels; kernel->name; ++kernel)
+		fprintf(stderr, " %s%s", kernel->name, kernel == best? " (in use)" : kernel->supported()? "" : " (unsupported)");
+	fputc('\n', stderr);
+	q = bench_query_init(bwt, n, seed);
+	for (kernel = bwt_occ_kernels, c = 0; kernel->name; ++kernel) {
+		if (name && strcmp(name, kernel->name) != 0) continue;
+		if (bwt_occ_set_kernel(kernel->name) < 0) continue;
+		bench_occ(bwt, q, c? sums : sums0);
+		if (c++ && memcmp(sums, sums0, sizeof(sums)) != 0)
+			err_fatal(__func__, "kernel '%s' disagrees with '%s'.", kernel->name, bwt_occ_kernels[0].name);
+	}
+	if (c == 0) err_fatal(__func__, "kernel '%s' is unknown or not supported by this CPU.", name);
+	bwt_occ_kernel = best;
+	bench_query_destroy(q);
+	bwt_destroy(bwt);
+	return 0;
+}
@@ -3,144 +3,247 @@
 #include "utils.h"
 #include "khash.h"
 
+#include <string.h>
 #include <pthread.h>
 
 #define psafe(expr, msg) xassert((expr)==0, msg)
 
-KHASH_MAP_INIT_INT64(64, bwtcache_itm_t)
-
-struct _bwtcache_t {
-    kh_64_t *hash;
-
+/* SA intervals are keyed on (k,l) as a pair: packing them into one 64-bit
+ * integer only works while bwtint_t is 32 bits wide. The same (k,l) means
+ * different positions on the two strands, and on the reverse strand the
+ * positions depend on the read length, so both are part of the key. */
+typedef struct {
+    bwtint_t k, l;
+    uint32_t a, len; // len is 0 on the forward strand
+} sa_intv_t;
+
+#define sa_intv_hash(x) kh_int64_hash_func((uint64_t)(x).k<<32 ^ (uint64_t)(x).l ^ (uint64_t)(x).len<<33 ^ (x).a)
+#define sa_intv_equal(x, y) ((x).k == (y).k && (x).l == (y).l && (x).a == (y).a && (x).len == (y).len)
+KHASH_INIT(sa, sa_intv_t, bwtcache_itm_t, 1, sa_intv_hash, sa_intv_equal)
+
+#define BWTCACHE_SHARDS 64 // a power of 2
+
+/* The table is split into shards by the high bits of the key hash, each
+ * with its own lock and condition variable, so that threads looking up
+ * different intervals rarely meet and an insert only wakes the waiters of
+ * its own shard. The padding keeps shards on separate cache lines.
+ *
+ * With a budget, the bytes held by all shards are counted together. An
+ * insert that goes over the budget evicts from its own shard and, if that
+ * is not enough, from the others in turn, one lock at a time. A shard
+ * evicts by CLOCK: the hand sweeps the buckets of the table, clearing the
+ * reference bit of entries used since it last passed and evicting the
+ * others. */
+typedef struct {
+    kh_sa_t *hash;
 #ifdef HAVE_PTHREAD
     pthread_mutex_t mtx;
-    pthread_mutex_t cond_mtx;
     pthread_cond_t cond;
 #endif /* HAVE_PTHREAD */
+    khint_t hand;
+    uint64_t hits, misses, waits, evictions;
+    double wait_time;
+    char pad[64];
+} bwtcache_shard_t;
 
-    uint64_t cache_waits;
+struct _bwtcache_t {
+    bwtcache_shard_t shard[BWTCACHE_SHARDS];
+    uint64_t max_bytes; // 0 for no limit
+    uint64_t bytes, peak; // held by all shards; changed atomically
+    uint64_t bypasses;
 };
 
-static bwtcache_itm_t bwtcache_get(bwtcache_t *c, uint64_t key);
-static void bwtcache_put(bwtcache_t *c, uint64_t key, bwtcache_itm_t *value);
-static bwtcache_itm_t bwtcache_wait(bwtcache_t *c, uint64_t key);
+// what an entry of n positions is charged against the budget
+#define bwtcache_cost(n) ((n) * sizeof(uint64_t) + sizeof(sa_intv_t) + sizeof(bwtcache_itm_t))
 
+static inline bwtcache_shard_t *bwtcache_shard(bwtcache_t *c, sa_intv_t key) {
+    return &c->shard[sa_intv_hash(key) >> 16 & (BWTCACHE_SHARDS - 1)];
+}
 
+static void poslist_copy(poslist_t *dst, const poslist_t *src) {
+    if (src->n > dst->m) {
+        dst->m = src->n;
+        dst->a = (uint64_t*)realloc(dst->a, dst->m * sizeof(uint64_t));
+    }
+    memcpy(dst->a, src->a, src->n * sizeof(uint64_t));
+    dst->n = src->n;
+}
 
 bwtcache_t *bwtcache_create() {
     bwtcache_t *c = calloc(1, sizeof(bwtcache_t));
-    c->hash = kh_init(64);
- 
+    int i;
+    for (i = 0; i < BWTCACHE_SHARDS; ++i) {
+        bwtcache_shard_t *s = &c->shard[i];
+        s->hash = kh_init(sa);
 #ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_init(&c->mtx, NULL), "failed to initialize cache mutex");
-    psafe(pthread_mutex_init(&c->cond_mtx, NULL), "failed to initialize cache cond mutex");
-    psafe(pthread_cond_init(&c->cond, NULL), "failed to initialize condition variable");
+        psafe(pthread_mutex_init(&s->mtx, NULL), "failed to initialize cache mutex");
+        psafe(pthread_cond_init(&s->cond, NULL), "failed to initialize condition variable");
 #endif /* HAVE_PTHREAD */
-
+    }
     return c;
 }
 
-poslist_t bwt_cached_sa(uint64_t offset, bwtcache_t *c, const bwt_t * const bwt[2], const bwt_aln1_t *a, uint32_t seqlen) {
-    bwtint_t l;
-    bwtcache_itm_t itm;
-    uint64_t key = (uint64_t)a->k<<32 | a->l;
-    itm = bwtcache_get(c, key);
-    if (itm.state == eUNINITIALIZED) {
-        itm.pos.n = a->l - a->k + 1;
-        itm.pos.a = (uint64_t*)malloc(sizeof(uint64_t) * itm.pos.n);
-        for (l = a->k; l <= a->l; ++l)
-            itm.pos.a[l - a->k] = offset + (a->a? bwt_sa(bwt[0], l) : bwt[1]->seq_len - (bwt_sa(bwt[1], l) + seqlen));
-        bwtcache_put(c, key, &itm);
-    } else if (itm.state == eLOADING) {
-        return bwtcache_wait(c, key).pos;
-    }
-
-    return itm.pos;
-} 
-
-void bwtcache_destroy(bwtcache_t *c) {
-	khint_t iter;
-
-#ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_destroy(&c->mtx), "failed to destroy mutex");
-    psafe(pthread_mutex_destroy(&c->cond_mtx), "failed to destroy mutex");
-    psafe(pthread_cond_destroy(&c->cond), "failed to destroy condition variable");
-#endif /* HAVE_PTHREAD */
+void bwtcache_set_limit(bwtcache_t *c, uint64_t max_bytes) {
+    c->max_bytes = max_bytes;
+}
 
-    fprintf(stderr, "[%s] %lu cache waits encountered\n", __func__, c->cache_waits);
-	for (iter = kh_begin(c->hash); iter != kh_end(c->hash); ++iter)
-		if (kh_exist(c->hash, iter)) free(kh_val(c->hash, iter).pos.a);
-	kh_destroy(64, c->hash);
-    free(c);
+static inline int bwtcache_over(const bwtcache_t *c) {
+    return *(volatile const uint64_t*)&c->bytes > c->max_bytes;
 }
 
-static bwtcache_itm_t bwtcache_get(bwtcache_t* c, uint64_t key) {
+/* 1 with the positions of key copied to *pos; 0 if the caller is to compute
+ * them and bwtcache_put() them. An entry being loaded by another thread is
+ * waited for; if it is evicted before we wake, we load it ourselves. */
+static int bwtcache_get(bwtcache_shard_t *s, sa_intv_t key, poslist_t *pos) {
     khint_t iter;
-    int ret;
-    bwtcache_itm_t *item; 
-    bwtcache_itm_t rv; 
+    int ret, found = 0;
+    double t = -1.0;
 
 #ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_lock(&c->mtx), "failed to lock mutex");
+    psafe(pthread_mutex_lock(&s->mtx), "failed to lock mutex");
+#endif /* HAVE_PTHREAD */
+    for (;;) {
+        bwtcache_itm_t *item;
+        iter = kh_put(sa, s->hash, key, &ret);
+        item = &kh_val(s->hash, iter);
+        if (ret) {
+            ++s->misses;
+            item->state = eLOADING;
+            item->pos.n = item->pos.m = 0; item->pos.a = 0;
+            break;
+        }
+        if (item->state == eINITIALIZED) {
+            ++s->hits;
+            item->ref = 1;
+            poslist_copy(pos, &item->pos);
+            found = 1;
+            break;
+        }
+        if (t < 0.0) {
+            ++s->waits;
+            t = realtime();
+        }
+#ifdef HAVE_PTHREAD
+        psafe(pthread_cond_wait(&s->cond, &s->mtx), "failed to wait on condition variable");
 #endif /* HAVE_PTHREAD */
-
-    iter = kh_put(64, c->hash, key, &ret);
-    item = &kh_val(c->hash, iter);
-    rv = *item;
-    if (ret) {
-        item->state = eLOADING;
-        rv.state = eUNINITIALIZED;
-    } else {
-        rv = kh_val(c->hash, iter);
     }
+    if (t >= 0.0) s->wait_time += realtime() - t;
 #ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_unlock(&c->mtx), "failed to unlock mutex");    
+    psafe(pthread_mutex_unlock(&s->mtx), "failed to unlock mutex");
 #endif /* HAVE_PTHREAD */
-    return rv;
+    return found;
 }
 
-static void bwtcache_put(bwtcache_t *c, uint64_t key, bwtcache_itm_t *value) {
-    khint_t iter;
-    int ret;
-    bwtcache_itm_t *item; 
-#ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_lock(&c->mtx), "failed to lock mutex");
-#endif /* HAVE_PTHREAD */
-    iter = kh_put(64, c->hash, key, &ret);
-    item = &kh_val(c->hash, iter);
-    if (item->state == eINITIALIZED) {
-        free(value->pos.a);
-    } else {
-        psafe(pthread_mutex_lock(&c->cond_mtx), "failed to lock mutex");
-        *item = *value;
-        item->state = eINITIALIZED;
-        pthread_cond_broadcast(&c->cond);
-        psafe(pthread_mutex_unlock(&c->cond_mtx), "failed to unlock mutex");    
+// evict from s, whose lock is held, until the cache is within its budget or s is empty
+static void bwtcache_evict(bwtcache_t *c, bwtcache_shard_t *s) {
+    kh_sa_t *h = s->hash;
+    uint64_t steps = 0;
+    while (bwtcache_over(c) && steps++ < 2 * (uint64_t)kh_end(h)) { // twice round the table at most
+        bwtcache_itm_t *item;
+        khint_t iter;
+        if (s->hand >= kh_end(h)) s->hand = 0;
+        iter = s->hand++;
+        if (!kh_exist(h, iter)) continue;
+        item = &kh_val(h, iter);
+        if (item->state != eINITIALIZED) continue;
+        if (item->ref) {
+            item->ref = 0;
+            continue;
+        }
+        __sync_fetch_and_sub(&c->bytes, bwtcache_cost(item->pos.n));
+        free(item->pos.a);
+        kh_del(sa, h, iter);
+        ++s->evictions;
     }
-#ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_unlock(&c->mtx), "failed to unlock mutex");    
-#endif /* HAVE_PTHREAD */
 }
 
-static bwtcache_itm_t bwtcache_wait(bwtcache_t *c, uint64_t key) {
-    khint_t iter;
+static void bwtcache_put(bwtcache_t *c, bwtcache_shard_t *s, sa_intv_t key, const poslist_t *pos) {
     bwtcache_itm_t *item;
-    int ret;
-    ++c->cache_waits;
+    uint64_t bytes, peak;
+    int i;
+#ifdef HAVE_PTHREAD
+    psafe(pthread_mutex_lock(&s->mtx), "failed to lock mutex");
+#endif /* HAVE_PTHREAD */
+    item = &kh_val(s->hash, kh_get(sa, s->hash, key));
+    poslist_copy(&item->pos, pos);
+    item->pos.m = item->pos.n;
+    item->state = eINITIALIZED;
+    item->ref = 1; // not the first to go
+    bytes = __sync_add_and_fetch(&c->bytes, bwtcache_cost(pos->n));
+    while ((peak = c->peak) < bytes && !__sync_bool_compare_and_swap(&c->peak, peak, bytes));
+    if (c->max_bytes) bwtcache_evict(c, s);
 #ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_lock(&c->cond_mtx), "failed to lock mutex");
+    pthread_cond_broadcast(&s->cond);
+    psafe(pthread_mutex_unlock(&s->mtx), "failed to unlock mutex");
 #endif /* HAVE_PTHREAD */
-    iter = kh_put(64, c->hash, key, &ret);
-    item = &kh_val(c->hash, iter);
-    while (item->state != eINITIALIZED) {
+    for (i = 1; c->max_bytes && bwtcache_over(c) && i < BWTCACHE_SHARDS; ++i) { // then from the other shards
+        bwtcache_shard_t *t = &c->shard[(s - c->shard + i) & (BWTCACHE_SHARDS - 1)];
 #ifdef HAVE_PTHREAD
-        psafe(pthread_cond_wait(&c->cond, &c->cond_mtx), "failed to wait on condition variable");
+        psafe(pthread_mutex_lock(&t->mtx), "failed to lock mutex");
 #endif /* HAVE_PTHREAD */
-        iter = kh_put(64, c->hash, key, &ret);
-        item = &kh_val(c->hash, iter);
+        bwtcache_evict(c, t);
+#ifdef HAVE_PTHREAD
+        psafe(pthread_mutex_unlock(&t->mtx), "failed to unlock mutex");
+#endif /* HAVE_PTHREAD */
+    }
+}
+
+void bwt_cached_sa(uint64_t offset, bwtcache_t *c, const bwt_t * const bwt[2], const bwt_aln1_t *a, uint32_t seqlen, poslist_t *pos) {
+    bwtint_t l;
+    bwtcache_shard_t *s;
+    sa_intv_t key;
+    int is_cached;
+    key.k = a->k; key.l = a->l;
+    key.a = a->a; key.len = a->a? 0 : seqlen;
+    s = bwtcache_shard(c, key);
+    // an interval larger than the whole budget is not cached
+    is_cached = c->max_bytes == 0 || bwtcache_cost(a->l - a->k + 1) <= c->max_bytes;
+    if (is_cached && bwtcache_get(s, key, pos)) return;
+    if (!is_cached) __sync_fetch_and_add(&c->bypasses, 1);
+    pos->n = a->l - a->k + 1;
+    if (pos->n > pos->m) {
+        pos->m = pos->n;
+        pos->a = (uint64_t*)realloc(pos->a, pos->m * sizeof(uint64_t));
     }
+    for (l = a->k; l <= a->l; ++l)
+        pos->a[l - a->k] = offset + (a->a? bwt_sa(bwt[0], l) : bwt[1]->seq_len - (bwt_sa(bwt[1], l) + seqlen));
+    if (is_cached) bwtcache_put(c, s, key, pos);
+}
+
+void bwtcache_stat(const bwtcache_t *c, bwtcache_stat_t *st) {
+    int i;
+    memset(st, 0, sizeof(bwtcache_stat_t));
+    for (i = 0; i < BWTCACHE_SHARDS; ++i) {
+        const bwtcache_shard_t *s = &c->shard[i];
+        st->hits += s->hits; st->misses += s->misses; st->waits += s->waits;
+        st->evictions += s->evictions;
+        st->wait_time += s->wait_time;
+    }
+    st->misses += c->bypasses;
+    st->bytes = c->bytes; st->peak = c->peak;
+}
+
+void bwtcache_destroy(bwtcache_t *c) {
+    bwtcache_stat_t st;
+    khint_t iter;
+    int i;
+
+    bwtcache_stat(c, &st);
+    if (st.hits + st.misses > 0) {
+        fprintf(stderr, "[%s] %llu hits, %llu misses (%.1f%% hit rate); %llu evictions; at most %.1f MB\n", __func__,
+                (unsigned long long)st.hits, (unsigned long long)st.misses, 100.0 * st.hits / (st.hits + st.misses),
+                (unsigned long long)st.evictions, st.peak / 1048576.0);
+    }
+    fprintf(stderr, "[%s] %llu cache waits encountered (%.3f sec)\n", __func__, (unsigned long long)st.waits, st.wait_time);
+    for (i = 0; i < BWTCACHE_SHARDS; ++i) {
+        bwtcache_shard_t *s = &c->shard[i];
 #ifdef HAVE_PTHREAD
-    psafe(pthread_mutex_unlock(&c->cond_mtx), "failed to unlock mutex");    
+        psafe(pthread_mutex_destroy(&s->mtx), "failed to destroy mutex");
+        psafe(pthread_cond_destroy(&s->cond), "failed to destroy condition variable");
 #endif /* HAVE_PTHREAD */
-    return *item; 
+        for (iter = kh_begin(s->hash); iter != kh_end(s->hash); ++iter)
+            if (kh_exist(s->hash, iter)) free(kh_val(s->hash, iter).pos.a);
+        kh_destroy(sa, s->hash);
+    }
+    free(c);
 }
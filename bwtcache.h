@@ -7,6 +7,9 @@
 
 #include <stdint.h>
 
+// the narrowest interval sampe looks up through the caches; narrower ones are walked directly
+#define MIN_HASH_WIDTH 1000
+
 typedef struct _bwtcache_t bwtcache_t;
 
 typedef enum {
@@ -16,23 +19,33 @@ typedef enum {
 } cache_item_state_t;
 
 typedef struct {
-    uint64_t n;
+    uint64_t n, m;
     uint64_t *a;
 } poslist_t;
 
 typedef struct {
     cache_item_state_t state;
+    int ref; // used since the eviction hand last passed
     poslist_t pos;
 } bwtcache_itm_t;
 
+typedef struct {
+    uint64_t hits, misses, waits; // waits: lookups of an interval another thread was loading
+    uint64_t evictions, bytes, peak; // bytes: held now; peak: the most held at once
+    double wait_time; // seconds spent in those waits, summed over threads
+} bwtcache_stat_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-    poslist_t bwt_cached_sa(uint64_t offset, bwtcache_t *c, const bwt_t *const bwt[2], const bwt_aln1_t *a, uint32_t seqlen);
+    // the positions of the hits of a, copied to *pos, which grows as needed
+    void bwt_cached_sa(uint64_t offset, bwtcache_t *c, const bwt_t *const bwt[2], const bwt_aln1_t *a, uint32_t seqlen, poslist_t *pos);
 
     bwtcache_t *bwtcache_create();
+    void bwtcache_set_limit(bwtcache_t *c, uint64_t max_bytes); // 0 for no limit; before any lookup
     void bwtcache_destroy(bwtcache_t *c);
+    void bwtcache_stat(const bwtcache_t *c, bwtcache_stat_t *st); // not synchronised; call when idle
 
 #ifdef __cplusplus
 }
@@ -10,36 +10,98 @@
 
 #define aln_score(m,o,e,p) ((m)*(p)->s_mm + (o)*(p)->s_gapo + (e)*(p)->s_gape)
 
-gap_stack_t *gap_init_stack(int max_mm, int max_gapo, int max_gape, const gap_opt_t *opt)
+#define occ_words(n) (((n) + 63) >> 6)
+
+static void gap_resize_stack(gap_stack_t *stack, int max_mm, int max_gapo, int max_gape, const gap_opt_t *opt)
 {
 	int i;
-	gap_stack_t *stack;
-	stack = (gap_stack_t*)calloc(1, sizeof(gap_stack_t));
 	stack->n_stacks = aln_score(max_mm+1, max_gapo+1, max_gape+1, opt);
-	stack->stacks = (gap_stack1_t*)calloc(stack->n_stacks, sizeof(gap_stack1_t));
-	for (i = 0; i != stack->n_stacks; ++i) {
+	if (stack->n_stacks <= stack->m_stacks) return;
+	stack->stacks = (gap_stack1_t*)realloc(stack->stacks, stack->n_stacks * sizeof(gap_stack1_t));
+	for (i = stack->m_stacks; i != stack->n_stacks; ++i) {
 		gap_stack1_t *p = stack->stacks + i;
-		p->m_entries = 4;
+		p->n_entries = 0; p->m_entries = 4;
 		p->stack = (gap_entry_t*)calloc(p->m_entries, sizeof(gap_entry_t));
 	}
+	stack->occ = (uint64_t*)realloc(stack->occ, occ_words(stack->n_stacks) * sizeof(uint64_t));
+	for (i = occ_words(stack->m_stacks); i < occ_words(stack->n_stacks); ++i) stack->occ[i] = 0;
+	stack->m_stacks = stack->n_stacks;
+}
+
+gap_stack_t *gap_init_stack(int max_mm, int max_gapo, int max_gape, const gap_opt_t *opt)
+{
+	gap_stack_t *stack;
+	stack = (gap_stack_t*)calloc(1, sizeof(gap_stack_t));
+	gap_resize_stack(stack, max_mm, max_gapo, max_gape, opt);
 	return stack;
 }
 
 void gap_destroy_stack(gap_stack_t *stack)
 {
 	int i;
-	for (i = 0; i != stack->n_stacks; ++i) free(stack->stacks[i].stack);
-	free(stack->stacks);
+	for (i = 0; i != stack->m_stacks; ++i) free(stack->stacks[i].stack);
+	free(stack->stacks); free(stack->occ);
 	free(stack);
 }
 
+gap_ws_t *gap_ws_init()
+{
+	gap_ws_t *ws = (gap_ws_t*)calloc(1, sizeof(gap_ws_t));
+	ws->stack = (gap_stack_t*)calloc(1, sizeof(gap_stack_t));
+	ws->max_len = ws->seed_len = -1;
+	return ws;
+}
+
+void gap_ws_destroy(gap_ws_t *ws)
+{
+	int a;
+	if (ws == 0) return;
+	gap_destroy_stack(ws->stack);
+	for (a = 0; a < 2; ++a) {
+		free(ws->w[a]); free(ws->seed_w[a]); free(ws->seq[a]);
+	}
+	free(ws->aln);
+	free(ws);
+}
+
+void gap_ws_reserve(gap_ws_t *ws, int max_len, int seed_len, const gap_opt_t *opt)
+{
+	int a;
+	gap_resize_stack(ws->stack, opt->max_diff, opt->max_gapo, opt->max_gape, opt);
+	if (max_len > ws->max_len) {
+		ws->max_len = max_len;
+		for (a = 0; a < 2; ++a) {
+			ws->w[a] = (bwt_width_t*)realloc(ws->w[a], (max_len + 1) * sizeof(bwt_width_t));
+			ws->seq[a] = (ubyte_t*)realloc(ws->seq[a], max_len + 1);
+		}
+	}
+	if (seed_len > ws->seed_len) {
+		ws->seed_len = seed_len;
+		for (a = 0; a < 2; ++a)
+			ws->seed_w[a] = (bwt_width_t*)realloc(ws->seed_w[a], (seed_len + 1) * sizeof(bwt_width_t));
+	}
+}
+
+// the first non-empty sub-stack from 'from' on, or n_stacks
+static inline int gap_next_stack(const gap_stack_t *stack, int from)
+{
+	int i = from >> 6, n = occ_words(stack->n_stacks);
+	uint64_t x = stack->occ[i] & ~0ULL << (from & 63);
+	while (x == 0 && ++i < n) x = stack->occ[i];
+	return x? i << 6 | __builtin_ctzll(x) : stack->n_stacks;
+}
+
 static void gap_reset_stack(gap_stack_t *stack)
 {
 	int i;
-	for (i = 0; i != stack->n_stacks; ++i)
-		stack->stacks[i].n_entries = 0;
+	for (i = 0; i < occ_words(stack->m_stacks); ++i) { // entries may be left by an early stop, maybe with a larger n_stacks
+		while (stack->occ[i]) {
+			stack->stacks[i << 6 | __builtin_ctzll(stack->occ[i])].n_entries = 0;
+			stack->occ[i] &= stack->occ[i] - 1;
+		}
+	}
 	stack->best = stack->n_stacks;
-	stack->n_entries = 0;
+	stack->n_entries = 0; stack->n_push = 0;
 }
 
 static inline void gap_push(gap_stack_t *stack, int a, int i, bwtint_t k, bwtint_t l, int n_mm, int n_gapo, int n_gape,
@@ -56,10 +118,10 @@ static inline void gap_push(gap_stack_t *stack, int a, int i, bwtint_t k, bwtint
 	}
 	p = q->stack + q->n_entries;
 	p->info = (u_int32_t)score<<21 | a<<20 | i; p->k = k; p->l = l;
-	p->n_mm = n_mm; p->n_gapo = n_gapo; p->n_gape = n_gape; p->state = state;
+	p->n_mm = n_mm; p->n_gapo = n_gapo; p->n_gape = n_gape; p->state = state; p->exact = 0;
 	if (is_diff) p->last_diff_pos = i;
-	++(q->n_entries);
-	++(stack->n_entries);
+	if (q->n_entries++ == 0) stack->occ[score >> 6] |= 1ULL << (score & 63);
+	++(stack->n_entries); ++(stack->n_push);
 	if (stack->best > score) stack->best = score;
 }
 
@@ -70,12 +132,10 @@ static inline void gap_pop(gap_stack_t *stack, gap_entry_t *e)
 	*e = q->stack[q->n_entries - 1];
 	--(q->n_entries);
 	--(stack->n_entries);
-	if (q->n_entries == 0 && stack->n_entries) { // reset best
-		int i;
-		for (i = stack->best + 1; i < stack->n_stacks; ++i)
-			if (stack->stacks[i].n_entries != 0) break;
-		stack->best = i;
-	} else if (stack->n_entries == 0) stack->best = stack->n_stacks;
+	if (q->n_entries == 0) { // reset best
+		stack->occ[stack->best >> 6] &= ~(1ULL << (stack->best & 63));
+		stack->best = stack->n_entries? gap_next_stack(stack, stack->best) : stack->n_stacks;
+	}
 }
 
 static inline void gap_shadow(int x, int len, bwtint_t max, int last_diff_pos, bwt_width_t *w)
@@ -90,6 +150,54 @@ static inline void gap_shadow(int x, int len, bwtint_t max, int last_diff_pos, b
 	}
 }
 
+#define GAP_EXACT_BATCH 16
+#define GAP_EXACT_SCAN  32
+
+// the number of differences still allowed to e, as in bwt_match_gap()
+static inline int gap_diff_left(const gap_entry_t *e, int max_diff, const gap_opt_t *opt)
+{
+	int m = max_diff - (e->n_mm + e->n_gapo);
+	if (opt->mode & BWA_MODE_GAPE) m -= e->n_gape;
+	return m;
+}
+
+/* Exact match for e, which bwt_match_gap() has just popped, together with
+ * the entries it will pop next from the same bucket and that also go to
+ * exact matching. max_diff never increases, so each of them is either
+ * matched exactly or skipped when popped; the results are cached in the
+ * entries. Exact matching does not depend on anything else, which keeps
+ * the output identical to matching them one by one. */
+static void gap_match_exact(gap_stack_t *stack, bwt_t *const bwts[2], const ubyte_t *seq[2], bwt_width_t *w[2],
+							gap_entry_t *e, int max_diff, const gap_opt_t *opt)
+{
+	bwt_search_t s[GAP_EXACT_BATCH];
+	gap_entry_t *x[GAP_EXACT_BATCH];
+	gap_stack1_t *q = stack->stacks + stack->best;
+	int j, n = 0, a;
+
+	x[n++] = e;
+	if (stack->best < stack->n_stacks) {
+		for (j = q->n_entries - 1; j >= 0 && j >= q->n_entries - GAP_EXACT_SCAN && n < GAP_EXACT_BATCH; --j) {
+			gap_entry_t *p = q->stack + j;
+			int i = p->info&0xffff;
+			a = p->info>>20&1;
+			if (p->exact || i == 0 || gap_diff_left(p, max_diff, opt) != 0 || w[a][i-1].bid > 0) continue;
+			if (p->state == STATE_M || (opt->mode&BWA_MODE_GAPE) || p->n_gape == opt->max_gape)
+				x[n++] = p;
+		}
+	}
+	for (j = 0; j < n; ++j) {
+		a = x[j]->info>>20&1;
+		s[j].bwt = bwts[1-a]; s[j].str = seq[a]; s[j].len = x[j]->info&0xffff;
+		s[j].k = x[j]->k; s[j].l = x[j]->l;
+	}
+	bwt_match_exact_batch(n, s);
+	for (j = 0; j < n; ++j) {
+		x[j]->exact = s[j].k <= s[j].l? 1 : 2;
+		x[j]->k = s[j].k; x[j]->l = s[j].l;
+	}
+}
+
 static inline int int_log2(uint32_t v)
 {
 	int c = 0;
@@ -101,25 +209,20 @@ static inline int int_log2(uint32_t v)
 	return c;
 }
 
-bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2], bwt_width_t *w[2],
-						  bwt_width_t *seed_w[2], const gap_opt_t *opt, int *_n_aln, gap_stack_t *stack)
+int bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2], bwt_width_t *w[2],
+				  bwt_width_t *seed_w[2], const gap_opt_t *opt, gap_ws_t *ws)
 {
 	int best_score = aln_score(opt->max_diff+1, opt->max_gapo+1, opt->max_gape+1, opt);
 	int best_diff = opt->max_diff + 1, max_diff = opt->max_diff;
 	int best_cnt = 0;
-	int max_entries = 0, j, _j, n_aln, m_aln;
-	bwt_aln1_t *aln;
-
-	m_aln = 4; n_aln = 0;
-	aln = (bwt_aln1_t*)calloc(m_aln, sizeof(bwt_aln1_t));
+	int max_entries = 0, j, _j, n_aln = 0;
+	gap_stack_t *stack = ws->stack;
+	bwt_aln1_t *aln = ws->aln + ws->n_aln; // moves when ws->aln grows
 
 	// check whether there are too many N
 	for (j = _j = 0; j < len; ++j)
 		if (seq[0][j] > 3) ++_j;
-	if (_j > max_diff) {
-		*_n_aln = n_aln;
-		return aln;
-	}
+	if (_j > max_diff) return 0;
 
 	//for (j = 0; j != len; ++j) printf("#0 %d: [%d,%u]\t[%d,%u]\n", j, w[0][j].bid, w[0][j].w, w[1][j].bid, w[1][j].w);
 	gap_reset_stack(stack); // reset stack
@@ -136,14 +239,16 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2],
 		bwt_width_t *width;
 
 		if (max_entries < stack->n_entries) max_entries = stack->n_entries;
-		if (stack->n_entries > opt->max_entries) break;
+		if (stack->n_entries > opt->max_entries) {
+			ws->stat.stop |= GAP_STOP_ENTRIES;
+			break;
+		}
 		gap_pop(stack, &e); // get the best entry
 		k = e.k; l = e.l; // SA interval
 		a = e.info>>20&1; i = e.info&0xffff; // strand, length
 		if (!(opt->mode & BWA_MODE_NONSTOP) && e.info>>21 > best_score + opt->s_mm) break; // no need to proceed
 
-		m = max_diff - (e.n_mm + e.n_gapo);
-		if (opt->mode & BWA_MODE_GAPE) m -= e.n_gape;
+		m = gap_diff_left(&e, max_diff, opt);
 		if (m < 0) continue;
 		bwt = bwts[1-a]; str = seq[a]; width = w[a];
 		if (seed_w) { // apply seeding
@@ -158,8 +263,9 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2],
 		hit_found = 0;
 		if (i == 0) hit_found = 1;
 		else if (m == 0 && (e.state == STATE_M || (opt->mode&BWA_MODE_GAPE) || e.n_gape == opt->max_gape)) { // no diff allowed
-			if (bwt_match_exact_alt(bwt, i, str, &k, &l)) hit_found = 1;
-			else continue; // no hit, skip
+			if (e.exact == 0) gap_match_exact(stack, bwts, seq, w, &e, max_diff, opt);
+			if (e.exact == 2) continue; // no hit, skip
+			k = e.k; l = e.l; hit_found = 1;
 		}
 
 		if (hit_found) { // action for found hits
@@ -174,7 +280,10 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2],
 					max_diff = (best_diff + 1 > opt->max_diff)? opt->max_diff : best_diff + 1; // top2 behaviour
 			}
 			if (score == best_score) best_cnt += l - k + 1;
-			else if (best_cnt > opt->max_top2) break; // top2b behaviour
+			else if (best_cnt > opt->max_top2) { // top2b behaviour
+				ws->stat.stop |= GAP_STOP_TOP2;
+				break;
+			}
 			if (e.n_gapo) { // check whether the hit has been found. this may happen when a gap occurs in a tandem repeat
 				for (j = 0; j != n_aln; ++j)
 					if (aln[j].k == k && aln[j].l == l) break;
@@ -183,12 +292,13 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2],
 			if (do_add) { // append
 				bwt_aln1_t *p;
 				gap_shadow(l - k + 1, len, bwt->seq_len, e.last_diff_pos, width);
-				if (n_aln == m_aln) {
-					m_aln <<= 1;
-					aln = (bwt_aln1_t*)realloc(aln, m_aln * sizeof(bwt_aln1_t));
-					memset(aln + m_aln/2, 0, m_aln/2*sizeof(bwt_aln1_t));
+				if (ws->n_aln + n_aln == ws->m_aln) {
+					ws->m_aln = ws->m_aln? ws->m_aln << 1 : 16;
+					ws->aln = (bwt_aln1_t*)realloc(ws->aln, ws->m_aln * sizeof(bwt_aln1_t));
+					aln = ws->aln + ws->n_aln;
 				}
 				p = aln + n_aln;
+				memset(p, 0, sizeof(bwt_aln1_t));
 				p->n_mm = e.n_mm; p->n_gapo = e.n_gapo; p->n_gape = e.n_gape; p->a = a;
 				p->k = k; p->l = l;
 				p->score = score;
@@ -258,7 +368,8 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwts[2], int len, const ubyte_t *seq[2],
 		}
 	}
 
-	*_n_aln = n_aln;
-	//fprintf(stderr, "max_entries = %d\n", max_entries);
-	return aln;
+	ws->n_aln += n_aln;
+	ws->stat.n_push += stack->n_push;
+	if (ws->stat.max_entries < (uint32_t)max_entries) ws->stat.max_entries = max_entries;
+	return n_aln;
 }
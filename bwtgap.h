@@ -6,7 +6,7 @@
 
 typedef struct { // recursion stack
 	u_int32_t info; // score<<21 | a<<20 | i
-	u_int32_t n_mm:8, n_gapo:8, n_gape:8, state:2, n_seed_mm:6;
+	u_int32_t n_mm:8, n_gapo:8, n_gape:8, state:2, exact:2, n_seed_mm:4; // exact: 1 if [k,l] already holds the exact hit, 2 if there is none
 	bwtint_t k, l; // (k,l) is the SA region of [i,n-1]
 	int last_diff_pos;
 } gap_entry_t;
@@ -16,19 +16,42 @@ typedef struct {
 	gap_entry_t *stack;
 } gap_stack1_t;
 
+/* One LIFO per score; bit s of occ is set while stacks[s] is not empty, so
+ * that the best non-empty one is found a word at a time. */
 typedef struct {
-	int n_stacks, best, n_entries;
+	int n_stacks, m_stacks, best, n_entries; // sub-stacks beyond n_stacks keep their entries for later
+	uint32_t n_push;
 	gap_stack1_t *stacks;
+	uint64_t *occ;
 } gap_stack_t;
 
+/* What a thread needs to align reads: the stack, the widths, room for a
+ * read unpacked on both strands and for its hits. The buffers only grow,
+ * so once the longest read and the largest stack have been seen, aligning
+ * a read allocates nothing. */
+typedef struct gap_ws_s {
+	gap_stack_t *stack;
+	int max_len, seed_len; // capacities of the buffers below
+	bwt_width_t *w[2], *seed_w[2];
+	ubyte_t *seq[2];
+	int n_aln, m_aln;
+	bwt_aln1_t *aln;
+	gap_stat_t stat; // added to by bwt_match_gap()
+} gap_ws_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	gap_stack_t *gap_init_stack(int max_mm, int max_gapo, int max_gape, const gap_opt_t *opt);
 	void gap_destroy_stack(gap_stack_t *stack);
-	bwt_aln1_t *bwt_match_gap(bwt_t *const bwt[2], int len, const ubyte_t *seq[2], bwt_width_t *w[2],
-							  bwt_width_t *seed_w[2], const gap_opt_t *opt, int *_n_aln, gap_stack_t *stack);
+	gap_ws_t *gap_ws_init();
+	void gap_ws_destroy(gap_ws_t *ws);
+	// makes room for reads of up to max_len and for the stack of opt
+	void gap_ws_reserve(gap_ws_t *ws, int max_len, int seed_len, const gap_opt_t *opt);
+	// appends the hits to ws->aln and returns their number; the search is added to ws->stat
+	int bwt_match_gap(bwt_t *const bwt[2], int len, const ubyte_t *seq[2], bwt_width_t *w[2],
+					  bwt_width_t *seed_w[2], const gap_opt_t *opt, gap_ws_t *ws);
 	void bwa_aln2seq(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s);
 
 #ifdef __cplusplus
@@ -42,10 +42,10 @@ void bwa_pac_rev_core(const char *fn, const char *fn_rev);
 int bwa_index(int argc, char *argv[])
 {
 	char *prefix = 0, *str, *str2, *str3;
-	int c, algo_type = 3, is_color = 0;
+	int c, algo_type = 3, is_color = 0, sa_intv = 32;
 	clock_t t;
 
-	while ((c = getopt(argc, argv, "ca:p:")) >= 0) {
+	while ((c = getopt(argc, argv, "ca:p:i:")) >= 0) {
 		switch (c) {
 		case 'a':
 			if (strcmp(optarg, "div") == 0) algo_type = 1;
@@ -55,15 +55,19 @@ int bwa_index(int argc, char *argv[])
 			break;
 		case 'p': prefix = strdup(optarg); break;
 		case 'c': is_color = 1; break;
+		case 'i': sa_intv = atoi(optarg); break;
 		default: return 1;
 		}
 	}
+	if (sa_intv <= 0) err_fatal(__func__, "the SA interval must be positive.");
 
 	if (optind + 1 > argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   bwa index [-a bwtsw|div|is] [-c] <in.fasta>\n\n");
+		fprintf(stderr, "Usage:   bwa index [-a bwtsw|div|is] [-i INT] [-c] <in.fasta>\n\n");
 		fprintf(stderr, "Options: -a STR    BWT construction algorithm: bwtsw or is [is]\n");
 		fprintf(stderr, "         -p STR    prefix of the index [same as fasta name]\n");
+		fprintf(stderr, "         -i INT    SA sampling interval; a larger INT gives smaller .sa/.rsa files\n");
+		fprintf(stderr, "                   but slower lookups of hit positions [%d]\n", sa_intv);
 		fprintf(stderr, "         -c        build color-space index\n\n");
 		fprintf(stderr,	"Warning: `-a bwtsw' does not work for short genomes, while `-a is' and\n");
 		fprintf(stderr, "         `-a div' do not work not for long genomes. Please choose `-a'\n");
@@ -164,7 +168,7 @@ int bwa_index(int argc, char *argv[])
 		t = clock();
 		fprintf(stderr, "[bwa_index] Construct SA from BWT and Occ... ");
 		bwt = bwt_restore_bwt(str);
-		bwt_cal_sa(bwt, 32);
+		bwt_cal_sa(bwt, sa_intv);
 		bwt_dump_sa(str3, bwt);
 		bwt_destroy(bwt);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
@@ -176,7 +180,7 @@ int bwa_index(int argc, char *argv[])
 		t = clock();
 		fprintf(stderr, "[bwa_index] Construct SA from reverse BWT and Occ... ");
 		bwt = bwt_restore_bwt(str);
-		bwt_cal_sa(bwt, 32);
+		bwt_cal_sa(bwt, sa_intv);
 		bwt_dump_sa(str3, bwt);
 		bwt_destroy(bwt);
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
@@ -1,42 +1,118 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "bwt.h"
 #include "utils.h"
 
+int bwt_load_flags(int level)
+{
+	if (level <= 0) return 0;
+	return level == 1? BWT_LOAD_MMAP : BWT_LOAD_MMAP | BWT_LOAD_POPULATE;
+}
+
+/* Map the whole of fn privately. Pages that are never written stay shared
+ * with every other process mapping the same file. */
+static void *bwt_mmap_file(const char *fn, int prot, int flags, size_t *len)
+{
+	struct stat st;
+	void *p;
+	int fd, mflags = MAP_PRIVATE;
+
+	if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		err_fatal(__func__, "fail to open file '%s'.", fn);
+	*len = st.st_size;
+#ifdef MAP_POPULATE
+	if (flags & BWT_LOAD_POPULATE) mflags |= MAP_POPULATE;
+#endif
+	p = mmap(0, *len, prot, mflags, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) err_fatal(__func__, "fail to map file '%s'.", fn);
+#ifdef MADV_WILLNEED
+	if (flags & BWT_LOAD_POPULATE) madvise(p, *len, MADV_WILLNEED);
+#endif
+	return p;
+}
+
+/* A .bwt with Occ starts with a 64-byte header so that the Occ blocks stay
+ * aligned to cache lines when the file is mapped:
+ *
+ *   magic, bits<<32|OCC_INTERVAL, primary, L2[1..4], 0    (all uint64_t)
+ *
+ * The raw BWT written by bwt_gen and pac2bwt, and .bwt files from before the
+ * cache-line layout, have a header of primary and L2[1..4] in bwtint_t. The
+ * first word of the magic is 0xffffffff, which can never be such a primary. */
+#define BWT_HDR_MAGIC 0x314c4354ffffffffull
+#define BWT_HDR_TAG   ((uint64_t)sizeof(bwtint_t) * 8 << 32 | OCC_INTERVAL)
+#define BWT_HDR_BYTES OCC_LINE_BYTES
+
+#define OCC_INTERVAL_V1 0x80 // the Occ interval of the old layout; blocks are not padded
+#define bwt_occ_size_v1(len) ((((len) + 15) >> 4) + (((len) + OCC_INTERVAL_V1 - 1) / OCC_INTERVAL_V1 + 1) * OCC_CNT_WORDS)
+
 void bwt_dump_bwt(const char *fn, const bwt_t *bwt)
 {
 	FILE *fp;
 	fp = xopen(fn, "wb");
-	fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
-	fwrite(bwt->L2+1, sizeof(bwtint_t), 4, fp);
-	fwrite(bwt->bwt, sizeof(bwtint_t), bwt->bwt_size, fp);
+	if (bwt_has_occ(bwt)) {
+		uint64_t h[BWT_HDR_BYTES / 8];
+		int i;
+		memset(h, 0, BWT_HDR_BYTES);
+		h[0] = BWT_HDR_MAGIC; h[1] = BWT_HDR_TAG; h[2] = bwt->primary;
+		for (i = 1; i <= 4; ++i) h[2+i] = bwt->L2[i];
+		fwrite(h, 1, BWT_HDR_BYTES, fp);
+	} else {
+		fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+		fwrite(bwt->L2+1, sizeof(bwtint_t), 4, fp);
+	}
+	fwrite(bwt->bwt, 4, bwt->bwt_size, fp);
 	fclose(fp);
 }
 
 void bwt_dump_sa(const char *fn, const bwt_t *bwt)
 {
 	FILE *fp;
+	bwtint_t sa_intv = bwt->sa_intv;
 	fp = xopen(fn, "wb");
 	fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
 	fwrite(bwt->L2+1, sizeof(bwtint_t), 4, fp);
-	fwrite(&bwt->sa_intv, sizeof(bwtint_t), 1, fp);
+	fwrite(&sa_intv, sizeof(bwtint_t), 1, fp);
 	fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
 	fwrite(bwt->sa + 1, sizeof(bwtint_t), bwt->n_sa - 1, fp);
 	fclose(fp);
 }
 
-void bwt_restore_sa(const char *fn, bwt_t *bwt)
+void bwt_restore_sa_core(const char *fn, bwt_t *bwt, int flags)
 {
 	char skipped[256];
 	FILE *fp;
 	bwtint_t primary;
 
+	if (flags & (BWT_LOAD_MMAP|BWT_LOAD_POPULATE)) {
+		bwtint_t *p;
+		// the SA header is 7 words and sa[1] is stored right after it
+		p = (bwtint_t*)bwt_mmap_file(fn, PROT_READ|PROT_WRITE, flags, &bwt->sa_mm_len);
+		bwt->sa_mm = p;
+		xassert(bwt->sa_mm_len >= 7 * sizeof(bwtint_t), "truncated SA file.");
+		xassert(p[0] == bwt->primary, "SA-BWT inconsistency: primary is not the same.");
+		bwt->sa_intv = p[5];
+		xassert(p[6] == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
+		bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
+		xassert(bwt->sa_mm_len >= (bwt->n_sa + 6) * sizeof(bwtint_t), "truncated SA file.");
+		bwt->sa = p + 6;
+		bwt->sa[0] = -1; // this only copies the first page
+		return;
+	}
+
 	fp = xopen(fn, "rb");
 	fread(&primary, sizeof(bwtint_t), 1, fp);
 	xassert(primary == bwt->primary, "SA-BWT inconsistency: primary is not the same.");
 	fread(skipped, sizeof(bwtint_t), 4, fp); // skip
-	fread(&bwt->sa_intv, sizeof(bwtint_t), 1, fp);
+	fread(&primary, sizeof(bwtint_t), 1, fp);
+	bwt->sa_intv = primary;
 	fread(&primary, sizeof(bwtint_t), 1, fp);
 	xassert(primary == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
 
@@ -48,30 +124,92 @@ void bwt_restore_sa(const char *fn, bwt_t *bwt)
 	fclose(fp);
 }
 
-bwt_t *bwt_restore_bwt(const char *fn)
+void bwt_restore_sa(const char *fn, bwt_t *bwt)
+{
+	bwt_restore_sa_core(fn, bwt, 0);
+}
+
+// extract the raw BWT from the old layout, where Occ blocks are OCC_INTERVAL_V1 bases and not padded
+static void bwt_strip_occ_v1(bwt_t *bwt)
+{
+	bwtint_t i, n;
+	uint32_t *raw;
+	n = (bwt->seq_len + 15) >> 4;
+	raw = (uint32_t*)calloc(n, 4);
+	for (i = 0; i < n; ++i)
+		raw[i] = bwt->bwt[i / (OCC_INTERVAL_V1/16) * (OCC_CNT_WORDS + OCC_INTERVAL_V1/16) + OCC_CNT_WORDS + i % (OCC_INTERVAL_V1/16)];
+	free(bwt->bwt);
+	bwt->bwt = raw; bwt->bwt_size = n;
+}
+
+bwt_t *bwt_restore_bwt_core(const char *fn, int flags)
 {
 	bwt_t *bwt;
 	FILE *fp;
+	uint64_t h[BWT_HDR_BYTES / 8];
+	long len;
+	int i;
 
 	bwt = (bwt_t*)calloc(1, sizeof(bwt_t));
 	fp = xopen(fn, "rb");
 	fseek(fp, 0, SEEK_END);
-	bwt->bwt_size = (ftell(fp) - sizeof(bwtint_t) * 5) >> 2;
-	bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (len >= BWT_HDR_BYTES && fread(h, 1, BWT_HDR_BYTES, fp) == BWT_HDR_BYTES && h[0] == BWT_HDR_MAGIC) {
+		if (h[1] != BWT_HDR_TAG)
+			err_fatal(__func__, "'%s' was built with %d-bit bwtint_t but this build uses %d bits.", fn, (int)(h[1]>>32), (int)sizeof(bwtint_t) * 8);
+		bwt->primary = h[2];
+		for (i = 1; i <= 4; ++i) bwt->L2[i] = h[2+i];
+		bwt->seq_len = bwt->L2[4];
+		bwt->bwt_size = (len - BWT_HDR_BYTES) >> 2;
+		if (bwt->bwt_size != bwt_occ_size(bwt->seq_len))
+			err_fatal(__func__, "'%s' is truncated or corrupted.", fn);
+		if (flags & (BWT_LOAD_MMAP|BWT_LOAD_POPULATE)) {
+			fclose(fp);
+			bwt->bwt_mm = bwt_mmap_file(fn, PROT_READ, flags, &bwt->bwt_mm_len);
+			bwt->bwt = (uint32_t*)((uint8_t*)bwt->bwt_mm + BWT_HDR_BYTES);
+		} else {
+			bwt->bwt = bwt_alloc_occ(bwt->bwt_size);
+			fread(bwt->bwt, 4, bwt->bwt_size, fp);
+			fclose(fp);
+		}
+		bwt_gen_cnt_table(bwt);
+		return bwt;
+	}
+	// the raw BWT or the old layout
 	fseek(fp, 0, SEEK_SET);
+	bwt->bwt_size = (len - sizeof(bwtint_t) * 5) >> 2;
 	fread(&bwt->primary, sizeof(bwtint_t), 1, fp);
 	fread(bwt->L2+1, sizeof(bwtint_t), 4, fp);
-	fread(bwt->bwt, 4, bwt->bwt_size, fp);
 	bwt->seq_len = bwt->L2[4];
+	if (bwt_has_occ(bwt) && bwt->bwt_size != bwt_occ_size_v1(bwt->seq_len))
+		err_fatal(__func__, "'%s' is corrupted or was built with a different bwtint_t width (this build uses %d bits).",
+				  fn, (int)sizeof(bwtint_t) * 8);
+	bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
+	fread(bwt->bwt, 4, bwt->bwt_size, fp);
 	fclose(fp);
+	if (bwt_has_occ(bwt)) {
+		fprintf(stderr, "[%s] '%s' has the old Occ layout and is converted while loading%s. "
+				"Run `bwa bwtupdate' on it to avoid this.\n", __func__, fn,
+				flags & (BWT_LOAD_MMAP|BWT_LOAD_POPULATE)? " rather than mapped" : "");
+		bwt_strip_occ_v1(bwt);
+		bwt_bwtupdate_core(bwt);
+	}
 	bwt_gen_cnt_table(bwt);
-
 	return bwt;
 }
 
+bwt_t *bwt_restore_bwt(const char *fn)
+{
+	return bwt_restore_bwt_core(fn, 0);
+}
+
 void bwt_destroy(bwt_t *bwt)
 {
 	if (bwt == 0) return;
-	free(bwt->sa); free(bwt->bwt);
+	if (bwt->sa_mm) munmap(bwt->sa_mm, bwt->sa_mm_len);
+	else free(bwt->sa);
+	if (bwt->bwt_mm) munmap(bwt->bwt_mm, bwt->bwt_mm_len);
+	else free(bwt->bwt);
 	free(bwt);
 }
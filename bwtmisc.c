@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include "bntseq.h"
 #include "utils.h"
 #include "main.h"
@@ -57,7 +58,7 @@ bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is)
 {
 	bwt_t *bwt;
 	ubyte_t *buf, *buf2;
-	int i, pac_size;
+	bwtint_t i, pac_size;
 	FILE *fp;
 
 	// initialization
@@ -71,7 +72,7 @@ bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is)
 	buf2 = (ubyte_t*)calloc(pac_size, 1);
 	fread(buf2, 1, pac_size, fp);
 	fclose(fp);
-	memset(bwt->L2, 0, 5 * 4);
+	memset(bwt->L2, 0, 5 * sizeof(bwtint_t));
 	buf = (ubyte_t*)calloc(bwt->seq_len + 1, 1);
 	for (i = 0; i < bwt->seq_len; ++i) {
 		buf[i] = buf2[i>>2] >> ((3 - (i&3)) << 1) & 3;
@@ -80,7 +81,9 @@ bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is)
 	for (i = 2; i <= 4; ++i) bwt->L2[i] += bwt->L2[i-1];
 	free(buf2);
 
-	// Burrows-Wheeler Transform
+	// Burrows-Wheeler Transform; both algorithms keep the suffix array in 32-bit integers
+	if (bwt->seq_len >= 0x7fffffff)
+		err_fatal(__func__, "the sequence is too long for `-a is' or `-a div'; please use `-a bwtsw'.");
 	if (use_is) {
 		bwt->primary = is_bwt(buf, bwt->seq_len);
 	} else {
@@ -124,21 +127,23 @@ void bwt_bwtupdate_core(bwt_t *bwt)
 	bwtint_t i, k, c[4], n_occ;
 	uint32_t *buf;
 
+	xassert(bwt->bwt_mm == 0, "bwt_t::bwt is memory-mapped and cannot be updated in place.");
 	n_occ = (bwt->seq_len + OCC_INTERVAL - 1) / OCC_INTERVAL + 1;
-	bwt->bwt_size += n_occ * 4; // the new size
-	buf = (uint32_t*)calloc(bwt->bwt_size, 4); // will be the new bwt
+	bwt->bwt_size = n_occ * OCC_BLOCK_WORDS; // the new size
+	buf = bwt_alloc_occ(bwt->bwt_size); // will be the new bwt
+	memset(buf, 0, bwt->bwt_size * 4);
 	c[0] = c[1] = c[2] = c[3] = 0;
 	for (i = k = 0; i < bwt->seq_len; ++i) {
 		if (i % OCC_INTERVAL == 0) {
+			k = i / OCC_INTERVAL * OCC_BLOCK_WORDS;
 			memcpy(buf + k, c, sizeof(bwtint_t) * 4);
-			k += 4;
+			k += OCC_CNT_WORDS;
 		}
 		if (i % 16 == 0) buf[k++] = bwt->bwt[i/16];
 		++c[bwt_B00(bwt, i)];
 	}
 	// the last element
-	memcpy(buf + k, c, sizeof(bwtint_t) * 4);
-	xassert(k + 4 == bwt->bwt_size, "inconsistent bwt_size");
+	memcpy(buf + (n_occ - 1) * OCC_BLOCK_WORDS, c, sizeof(bwtint_t) * 4);
 	// update bwt
 	free(bwt->bwt); bwt->bwt = buf;
 }
@@ -151,7 +156,7 @@ int bwa_bwtupdate(int argc, char *argv[])
 		return 1;
 	}
 	bwt = bwt_restore_bwt(argv[1]);
-	bwt_bwtupdate_core(bwt);
+	if (!bwt_has_occ(bwt)) bwt_bwtupdate_core(bwt); // otherwise an old layout has been converted on loading
 	bwt_dump_bwt(argv[1], bwt);
 	bwt_destroy(bwt);
 	return 0;
@@ -265,3 +270,40 @@ int bwa_bwt2sa(int argc, char *argv[])
 	bwt_destroy(bwt);
 	return 0;
 }
+
+int bwa_sa_resample(int argc, char *argv[])
+{
+	bwt_t *bwt;
+	char *fn_bwt, *fn_sa;
+	int c, j, old_intv, sa_intv = 32;
+	while ((c = getopt(argc, argv, "i:")) >= 0) {
+		switch (c) {
+		case 'i': sa_intv = atoi(optarg); break;
+		default: return 1;
+		}
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "Usage: bwa sa_resample [-i %d] <prefix>\n\n", sa_intv);
+		fprintf(stderr, "Rewrite <prefix>.sa and <prefix>.rsa with the SA sampled every INT positions. This\n");
+		fprintf(stderr, "is fast if INT is a multiple of the current interval.\n");
+		return 1;
+	}
+	if (sa_intv <= 0) err_fatal(__func__, "the SA interval must be positive.");
+	fn_bwt = (char*)calloc(strlen(argv[optind]) + 10, 1);
+	fn_sa = (char*)calloc(strlen(argv[optind]) + 10, 1);
+	for (j = 0; j < 2; ++j) {
+		clock_t t = clock();
+		strcat(strcpy(fn_bwt, argv[optind]), j? ".rbwt" : ".bwt");
+		strcat(strcpy(fn_sa, argv[optind]), j? ".rsa" : ".sa");
+		bwt = bwt_restore_bwt(fn_bwt);
+		bwt_restore_sa(fn_sa, bwt);
+		old_intv = bwt->sa_intv;
+		bwt_resample_sa(bwt, sa_intv);
+		bwt_dump_sa(fn_sa, bwt);
+		bwt_destroy(bwt);
+		fprintf(stderr, "[%s] re-sampled '%s' from interval %d to %d in %.2f sec\n", __func__, fn_sa, old_intv,
+				sa_intv, (float)(clock() - t) / CLOCKS_PER_SEC);
+	}
+	free(fn_bwt); free(fn_sa);
+	return 0;
+}
@@ -0,0 +1,356 @@
+#include <string.h>
+#include "bwtocc.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BWT_OCC_X86
+#include <immintrin.h>
+#if __GNUC__ >= 8 || defined(__clang__)
+#define BWT_OCC_AVX512 // VPOPCNTQ intrinsics
+#endif
+#endif
+
+/* With hi and lo the high and low bits of each 2-bit base, moved to the even
+ * bit positions, a base is c=3 if hi&lo, c=2 if hi&~lo, c=1 if ~hi&lo and c=0
+ * otherwise. Bits of the bases beyond n are cleared to zero on loading, so
+ * they look like A; A is therefore counted as n minus the other three, and
+ * the kernels below count "non-A" (hi|lo) when asked for c=0. For occ4 they
+ * count a[0]=hi&lo, a[1]=hi and a[2]=lo. */
+
+#define OCC_M1 0x5555555555555555ull
+
+static inline void occ4_finish(int n, const int a[3], int cnt[4])
+{
+	cnt[0] = n - a[1] - a[2] + a[0]; cnt[1] = a[2] - a[0]; cnt[2] = a[1] - a[0]; cnt[3] = a[0];
+}
+
+// SIMD kernels pack the three counts (each at most 256) into one integer to reduce them together
+static inline void occ_unpack3(uint64_t s, int a[3])
+{
+	a[0] = s & 0xffff; a[1] = s >> 16 & 0xffff; a[2] = s >> 32;
+}
+
+/*** scalar kernels: 32 bases per 64-bit word ***/
+
+// the next min(n,32) bases at p; p[1] is read only if it is needed
+static inline uint64_t occ_load64(const uint32_t *p, int n)
+{
+	uint64_t x;
+	if (n >= 32) return (uint64_t)p[0]<<32 | p[1];
+	x = n > 16? (uint64_t)p[0]<<32 | p[1] : (uint64_t)p[0]<<32;
+	return x & ~0ull << ((32 - n) << 1);
+}
+
+// number of 1s in y, where only even bits may be set
+static inline int occ_pop_even(uint64_t y)
+{
+	y = (y & 0x3333333333333333ull) + (y >> 2 & 0x3333333333333333ull);
+	return ((y + (y >> 4)) & 0xf0f0f0f0f0f0f0full) * 0x101010101010101ull >> 56;
+}
+
+#define OCC_SCALAR_KERNEL(name, attr, pop)								\
+	attr static inline int occ1_##name(uint64_t x, int c)				\
+	{																	\
+		uint64_t hi = x >> 1 & OCC_M1, lo = x & OCC_M1;					\
+		return c? pop((c&2? hi : ~hi) & (c&1? lo : ~lo) & OCC_M1) : pop(hi | lo); \
+	}																	\
+	attr static inline void occ41_##name(uint64_t x, int a[3])			\
+	{																	\
+		uint64_t hi = x >> 1 & OCC_M1, lo = x & OCC_M1;					\
+		a[0] += pop(hi & lo); a[1] += pop(hi); a[2] += pop(lo);			\
+	}																	\
+	attr static int occ_##name(const uint32_t *p, int n, int c)			\
+	{																	\
+		int i, m = 0;													\
+		for (i = 0; i + 32 <= n; i += 32, p += 2) m += occ1_##name(occ_load64(p, 32), c); \
+		if (i < n) m += occ1_##name(occ_load64(p, n - i), c);			\
+		return c? m : n - m;											\
+	}																	\
+	attr static void occ_kl_##name(const uint32_t *p, int nk, int nl, int c, int cnt[2]) \
+	{																	\
+		int i, m = 0;													\
+		for (i = 0; i + 32 <= nk; i += 32, p += 2) m += occ1_##name(occ_load64(p, 32), c); \
+		cnt[0] = i < nk? m + occ1_##name(occ_load64(p, nk - i), c) : m; \
+		for (; i + 32 <= nl; i += 32, p += 2) m += occ1_##name(occ_load64(p, 32), c); \
+		cnt[1] = i < nl? m + occ1_##name(occ_load64(p, nl - i), c) : m; \
+		if (c == 0) cnt[0] = nk - cnt[0], cnt[1] = nl - cnt[1];			\
+	}																	\
+	attr static void occ4_##name(const uint32_t *p, int n, int cnt[4])	\
+	{																	\
+		int i, a[3] = {0, 0, 0};										\
+		for (i = 0; i + 32 <= n; i += 32, p += 2) occ41_##name(occ_load64(p, 32), a); \
+		if (i < n) occ41_##name(occ_load64(p, n - i), a);				\
+		occ4_finish(n, a, cnt);											\
+	}																	\
+	attr static void occ4_kl_##name(const uint32_t *p, int nk, int nl, int cntk[4], int cntl[4]) \
+	{																	\
+		int i, a[3] = {0, 0, 0}, b[3];									\
+		for (i = 0; i + 32 <= nk; i += 32, p += 2) occ41_##name(occ_load64(p, 32), a); \
+		memcpy(b, a, sizeof(a));										\
+		if (i < nk) occ41_##name(occ_load64(p, nk - i), b);				\
+		occ4_finish(nk, b, cntk);										\
+		for (; i + 32 <= nl; i += 32, p += 2) occ41_##name(occ_load64(p, 32), a); \
+		if (i < nl) occ41_##name(occ_load64(p, nl - i), a);				\
+		occ4_finish(nl, a, cntl);										\
+	}
+
+static int occ_supported_generic(void) { return 1; }
+OCC_SCALAR_KERNEL(generic, , occ_pop_even)
+
+#ifdef BWT_OCC_X86
+
+static int occ_supported_popcnt(void) { return __builtin_cpu_supports("popcnt"); }
+OCC_SCALAR_KERNEL(popcnt, __attribute__((target("popcnt"))), __builtin_popcountll)
+
+/*** AVX2: 128 bases per vector; popcount by nibble lookup ***/
+
+static int occ_supported_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+// the number of bases kept in each word of a vector when the first n are kept
+__attribute__((target("avx2"))) static inline __m256i occ_keep_avx2(int n)
+{
+	__m256i r;
+	r = _mm256_sub_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112));
+	return _mm256_min_epi32(_mm256_max_epi32(r, _mm256_setzero_si256()), _mm256_set1_epi32(16));
+}
+
+__attribute__((target("avx2"))) static inline __m256i occ_mask_avx2(__m256i r)
+{
+	return _mm256_sllv_epi32(_mm256_set1_epi32(-1), _mm256_sub_epi32(_mm256_set1_epi32(32), _mm256_add_epi32(r, r)));
+}
+
+// the next min(n,128) bases at p; words beyond them are not read
+__attribute__((target("avx2"))) static inline __m256i occ_load_avx2(const uint32_t *p, int n)
+{
+	__m256i r = occ_keep_avx2(n);
+	return _mm256_and_si256(_mm256_maskload_epi32((const int*)p, _mm256_cmpgt_epi32(r, _mm256_setzero_si256())), occ_mask_avx2(r));
+}
+
+__attribute__((target("avx2"))) static inline __m256i occ_popb_avx2(__m256i x) // per-byte popcount
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+										 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m4 = _mm256_set1_epi8(0x0f);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, m4)),
+						   _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), m4)));
+}
+
+__attribute__((target("avx2"))) static inline uint64_t occ_hsum_avx2(__m256i x) // sum of the four 64-bit lanes
+{
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	return _mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1);
+}
+
+__attribute__((target("avx2"))) static inline int occ_sum_avx2(__m256i x) // sum of bytes
+{
+	return occ_hsum_avx2(_mm256_sad_epu8(x, _mm256_setzero_si256()));
+}
+
+// sum the bytes of a[0], a[1] and a[2] with one horizontal add
+__attribute__((target("avx2"))) static inline void occ_sum3_avx2(const __m256i a[3], int b[3])
+{
+	const __m256i zero = _mm256_setzero_si256();
+	occ_unpack3(occ_hsum_avx2(_mm256_add_epi64(_mm256_sad_epu8(a[0], zero),
+		_mm256_add_epi64(_mm256_slli_epi64(_mm256_sad_epu8(a[1], zero), 16), _mm256_slli_epi64(_mm256_sad_epu8(a[2], zero), 32)))), b);
+}
+
+__attribute__((target("avx2"))) static inline __m256i occ1_avx2(__m256i x, int c)
+{
+	const __m256i m1 = _mm256_set1_epi32(0x55555555);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi32(x, 1), m1), lo = _mm256_and_si256(x, m1);
+	return c? _mm256_and_si256(c&2? hi : _mm256_andnot_si256(hi, m1), c&1? lo : _mm256_andnot_si256(lo, m1))
+		: _mm256_or_si256(hi, lo);
+}
+
+// per-byte counts are at most 4 per vector, so up to 63 vectors can be accumulated
+__attribute__((target("avx2"))) static inline void occ41_avx2(__m256i x, __m256i a[3])
+{
+	const __m256i m1 = _mm256_set1_epi32(0x55555555);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi32(x, 1), m1), lo = _mm256_and_si256(x, m1);
+	a[0] = _mm256_add_epi8(a[0], occ_popb_avx2(_mm256_and_si256(hi, lo)));
+	a[1] = _mm256_add_epi8(a[1], occ_popb_avx2(hi));
+	a[2] = _mm256_add_epi8(a[2], occ_popb_avx2(lo));
+}
+
+__attribute__((target("avx2"))) static int occ_avx2(const uint32_t *p, int n, int c)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int i, m;
+	for (i = 0; i < n; i += 128, p += 8)
+		acc = _mm256_add_epi8(acc, occ_popb_avx2(occ1_avx2(occ_load_avx2(p, n - i), c)));
+	m = occ_sum_avx2(acc);
+	return c? m : n - m;
+}
+
+__attribute__((target("avx2"))) static void occ_kl_avx2(const uint32_t *p, int nk, int nl, int c, int cnt[2])
+{
+	__m256i ak = _mm256_setzero_si256(), al = ak;
+	int i;
+	for (i = 0; i < nl; i += 128, p += 8) {
+		__m256i y = occ1_avx2(occ_load_avx2(p, nl - i), c);
+		al = _mm256_add_epi8(al, occ_popb_avx2(y));
+		if (i < nk) ak = _mm256_add_epi8(ak, occ_popb_avx2(_mm256_and_si256(y, occ_mask_avx2(occ_keep_avx2(nk - i)))));
+	}
+	cnt[0] = occ_sum_avx2(ak); cnt[1] = occ_sum_avx2(al);
+	if (c == 0) cnt[0] = nk - cnt[0], cnt[1] = nl - cnt[1];
+}
+
+__attribute__((target("avx2"))) static void occ4_avx2(const uint32_t *p, int n, int cnt[4])
+{
+	__m256i acc[3];
+	int i, a[3];
+	acc[0] = acc[1] = acc[2] = _mm256_setzero_si256();
+	for (i = 0; i < n; i += 128, p += 8)
+		occ41_avx2(occ_load_avx2(p, n - i), acc);
+	occ_sum3_avx2(acc, a);
+	occ4_finish(n, a, cnt);
+}
+
+__attribute__((target("avx2"))) static void occ4_kl_avx2(const uint32_t *p, int nk, int nl, int cntk[4], int cntl[4])
+{
+	__m256i acck[3], accl[3];
+	int i, a[3];
+	acck[0] = acck[1] = acck[2] = accl[0] = accl[1] = accl[2] = _mm256_setzero_si256();
+	for (i = 0; i < nl; i += 128, p += 8) {
+		__m256i x = occ_load_avx2(p, nl - i);
+		occ41_avx2(x, accl);
+		if (i < nk) occ41_avx2(_mm256_and_si256(x, occ_mask_avx2(occ_keep_avx2(nk - i))), acck);
+	}
+	occ_sum3_avx2(acck, a);
+	occ4_finish(nk, a, cntk);
+	occ_sum3_avx2(accl, a);
+	occ4_finish(nl, a, cntl);
+}
+
+#ifdef BWT_OCC_AVX512
+
+/*** AVX-512: 256 bases, i.e. a whole Occ block, per vector; VPOPCNTQ ***/
+
+static int occ_supported_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+}
+
+__attribute__((target("avx512f"))) static inline __m512i occ_keep_avx512(int n)
+{
+	__m512i r;
+	r = _mm512_sub_epi32(_mm512_set1_epi32(n), _mm512_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112,
+																  128, 144, 160, 176, 192, 208, 224, 240));
+	return _mm512_min_epi32(_mm512_max_epi32(r, _mm512_setzero_si512()), _mm512_set1_epi32(16));
+}
+
+__attribute__((target("avx512f"))) static inline __m512i occ_mask_avx512(__m512i r)
+{
+	return _mm512_sllv_epi32(_mm512_set1_epi32(-1), _mm512_sub_epi32(_mm512_set1_epi32(32), _mm512_add_epi32(r, r)));
+}
+
+// the next min(n,256) bases at p; masked-off words are not read
+__attribute__((target("avx512f"))) static inline __m512i occ_load_avx512(const uint32_t *p, int n)
+{
+	__m512i r = occ_keep_avx512(n);
+	return _mm512_and_si512(_mm512_maskz_loadu_epi32(_mm512_cmpgt_epi32_mask(r, _mm512_setzero_si512()), p), occ_mask_avx512(r));
+}
+
+__attribute__((target("avx512f"))) static inline __m512i occ1_avx512(__m512i x, int c)
+{
+	const __m512i m1 = _mm512_set1_epi32(0x55555555);
+	__m512i hi = _mm512_and_si512(_mm512_srli_epi32(x, 1), m1), lo = _mm512_and_si512(x, m1);
+	return c? _mm512_and_si512(c&2? hi : _mm512_andnot_si512(hi, m1), c&1? lo : _mm512_andnot_si512(lo, m1))
+		: _mm512_or_si512(hi, lo);
+}
+
+// the counts of hi&lo, hi and lo in bits 0-15, 16-31 and 32-47 of each 64-bit lane
+__attribute__((target("avx512f,avx512vpopcntdq"))) static inline __m512i occ41_avx512(__m512i x)
+{
+	const __m512i m1 = _mm512_set1_epi32(0x55555555);
+	__m512i hi = _mm512_and_si512(_mm512_srli_epi32(x, 1), m1), lo = _mm512_and_si512(x, m1);
+	return _mm512_add_epi64(_mm512_popcnt_epi64(_mm512_and_si512(hi, lo)),
+		_mm512_add_epi64(_mm512_slli_epi64(_mm512_popcnt_epi64(hi), 16), _mm512_slli_epi64(_mm512_popcnt_epi64(lo), 32)));
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static int occ_avx512(const uint32_t *p, int n, int c)
+{
+	__m512i acc = _mm512_setzero_si512();
+	int i, m;
+	for (i = 0; i < n; i += 256, p += 16)
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(occ1_avx512(occ_load_avx512(p, n - i), c)));
+	m = _mm512_reduce_add_epi64(acc);
+	return c? m : n - m;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void occ_kl_avx512(const uint32_t *p, int nk, int nl, int c, int cnt[2])
+{
+	__m512i ak = _mm512_setzero_si512(), al = ak;
+	int i;
+	for (i = 0; i < nl; i += 256, p += 16) {
+		__m512i y = occ1_avx512(occ_load_avx512(p, nl - i), c);
+		al = _mm512_add_epi64(al, _mm512_popcnt_epi64(y));
+		if (i < nk) ak = _mm512_add_epi64(ak, _mm512_popcnt_epi64(_mm512_and_si512(y, occ_mask_avx512(occ_keep_avx512(nk - i)))));
+	}
+	cnt[0] = _mm512_reduce_add_epi64(ak); cnt[1] = _mm512_reduce_add_epi64(al);
+	if (c == 0) cnt[0] = nk - cnt[0], cnt[1] = nl - cnt[1];
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void occ4_avx512(const uint32_t *p, int n, int cnt[4])
+{
+	__m512i acc = _mm512_setzero_si512();
+	int i, a[3];
+	for (i = 0; i < n; i += 256, p += 16)
+		acc = _mm512_add_epi64(acc, occ41_avx512(occ_load_avx512(p, n - i)));
+	occ_unpack3(_mm512_reduce_add_epi64(acc), a);
+	occ4_finish(n, a, cnt);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void occ4_kl_avx512(const uint32_t *p, int nk, int nl, int cntk[4], int cntl[4])
+{
+	__m512i acck = _mm512_setzero_si512(), accl = acck;
+	int i, a[3];
+	for (i = 0; i < nl; i += 256, p += 16) {
+		__m512i x = occ_load_avx512(p, nl - i);
+		accl = _mm512_add_epi64(accl, occ41_avx512(x));
+		if (i < nk) acck = _mm512_add_epi64(acck, occ41_avx512(_mm512_and_si512(x, occ_mask_avx512(occ_keep_avx512(nk - i)))));
+	}
+	occ_unpack3(_mm512_reduce_add_epi64(acck), a);
+	occ4_finish(nk, a, cntk);
+	occ_unpack3(_mm512_reduce_add_epi64(accl), a);
+	occ4_finish(nl, a, cntl);
+}
+
+#endif /* BWT_OCC_AVX512 */
+#endif /* BWT_OCC_X86 */
+
+#define OCC_KERNEL(name) { #name, occ_supported_##name, occ_##name, occ4_##name, occ_kl_##name, occ4_kl_##name }
+
+const bwt_occ_kernel_t bwt_occ_kernels[] = {
+	OCC_KERNEL(generic),
+#ifdef BWT_OCC_X86
+	OCC_KERNEL(popcnt),
+	OCC_KERNEL(avx2),
+#ifdef BWT_OCC_AVX512
+	OCC_KERNEL(avx512),
+#endif
+#endif
+	{ 0, 0, 0, 0, 0, 0 }
+};
+
+const bwt_occ_kernel_t *bwt_occ_kernel = bwt_occ_kernels;
+
+int bwt_occ_set_kernel(const char *name)
+{
+	const bwt_occ_kernel_t *k, *best = 0;
+#ifdef BWT_OCC_X86
+	__builtin_cpu_init(); // may be called before the constructor of libgcc
+#endif
+	for (k = bwt_occ_kernels; k->name; ++k)
+		if ((name == 0 || strcmp(k->name, name) == 0) && k->supported())
+			best = k;
+	if (best == 0) return -1;
+	bwt_occ_kernel = best;
+	return 0;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor)) static void bwt_occ_init(void)
+{
+	bwt_occ_set_kernel(0);
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef BWA_BWTOCC_H
+#define BWA_BWTOCC_H
+
+#include <stdint.h>
+
+/* Kernels counting nucleotides in a packed BWT: 16 bases per uint32_t, the
+ * first base in the two most significant bits. The kernel in use is the
+ * fastest one supported by the CPU, chosen when the program starts. */
+
+#define BWT_OCC_KERNEL_MAX 256 // the largest n accepted by the kernels
+
+typedef struct {
+	const char *name;
+	int (*supported)(void);
+	// occurrences of c among the first n bases at p; 1 <= n <= BWT_OCC_KERNEL_MAX
+	int (*occ)(const uint32_t *p, int n, int c);
+	// occurrences of each base among the first n bases at p
+	void (*occ4)(const uint32_t *p, int n, int cnt[4]);
+	// occ() and occ4() for both nk and nl in one pass; nk <= nl
+	void (*occ_kl)(const uint32_t *p, int nk, int nl, int c, int cnt[2]);
+	void (*occ4_kl)(const uint32_t *p, int nk, int nl, int cntk[4], int cntl[4]);
+} bwt_occ_kernel_t;
+
+extern const bwt_occ_kernel_t bwt_occ_kernels[]; // from the slowest; ends with a null name
+extern const bwt_occ_kernel_t *bwt_occ_kernel;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// select a kernel by name, or the fastest supported one if name is NULL; return -1 if it is not supported
+	int bwt_occ_set_kernel(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #include "bntseq.h"
 #include "bwt_lite.h"
 #include "bwt.h"
+#include "rng.h"
 
 typedef struct {
 	int a, b, q, r, t, qr, bw;
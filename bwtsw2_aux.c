@@ -4,15 +4,13 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
-#ifdef HAVE_PTHREAD
-#include <pthread.h>
-#endif
 #include "bntseq.h"
 #include "bwt_lite.h"
 #include "utils.h"
 #include "bwtsw2.h"
 #include "stdaln.h"
 #include "kstring.h"
+#include "threadblock.h"
 
 #include "kseq.h"
 KSEQ_INIT(gzFile, gzread)
@@ -43,7 +41,7 @@ unsigned char nt_comp_table[256] = {
 };
 
 extern int bsw2_resolve_duphits(const bwt_t *bwt, bwtsw2_t *b, int IS);
-extern int bsw2_resolve_query_overlaps(bwtsw2_t *b, float mask_level);
+extern int bsw2_resolve_query_overlaps(bwtsw2_t *b, float mask_level, bwa_rng_t *rng);
 
 bsw2opt_t *bsw2_init_opt()
 {
@@ -250,7 +248,7 @@ static void merge_hits(bwtsw2_t *b[2], int l, int is_reverse)
 }
 /* seq[0] is the forward sequence and seq[1] is the reverse complement. */
 static bwtsw2_t *bsw2_aln1_core(const bsw2opt_t *opt, const bntseq_t *bns, uint8_t *pac, const bwt_t *target,
-								int l, uint8_t *seq[2], int is_rev, bsw2global_t *pool)
+								int l, uint8_t *seq[2], int is_rev, bsw2global_t *pool, bwa_rng_t *rng)
 {
 	extern void bsw2_chain_filter(const bsw2opt_t *opt, int len, bwtsw2_t *b[2]);
 	bwtsw2_t *b[2], **bb[2];
@@ -271,7 +269,7 @@ static bwtsw2_t *bsw2_aln1_core(const bsw2opt_t *opt, const bntseq_t *bns, uint8
 		free(bb[k]);		
 	}
 	merge_hits(b, l, 1); // again, b[1] is merged to b[0]
-	bsw2_resolve_query_overlaps(b[0], opt->mask_level);
+	bsw2_resolve_query_overlaps(b[0], opt->mask_level, rng);
 	return b[0];
 }
 
@@ -300,7 +298,8 @@ static void flag_fr(bwtsw2_t *b[2])
 }
 
 typedef struct {
-	int l, tid;
+	int l;
+	uint64_t id; // index of the read in the input; keys its random numbers
 	char *name, *seq, *qual, *sam;
 } bsw2seq1_t;
 
@@ -309,10 +308,6 @@ typedef struct {
 	bsw2seq1_t *seq;
 } bsw2seq_t;
 
-#ifdef HAVE_PTHREAD
-static pthread_mutex_t g_dbwtsw_lock = PTHREAD_MUTEX_INITIALIZER;
-#endif
-
 static int fix_cigar(const char *qname, const bntseq_t *bns, bsw2hit_t *p, int n_cigar, uint32_t *cigar)
 {
 	// FIXME: this routine does not work if the query bridge three reference sequences
@@ -454,31 +449,20 @@ static void print_hits(const bntseq_t *bns, const bsw2opt_t *opt, bsw2seq1_t *ks
 	free(ks->name); ks->name = 0;
 }
 
-/* Core routine to align reads in _seq. It is separated from
- * process_seqs() to realize multi-threading */ 
-static void bsw2_aln_core(int tid, bsw2seq_t *_seq, const bsw2opt_t *_opt, const bntseq_t *bns, uint8_t *pac, bwt_t * const target[2])
+/* Core routine to align the n reads in _seq. It is separated from
+ * bsw2_aln() to run on the thread pool */
+static void bsw2_aln_core(bsw2global_t *pool, int n, bsw2seq1_t *_seq, const bsw2opt_t *_opt, const bntseq_t *bns, uint8_t *pac, bwt_t * const target[2])
 {
 	int x;
 	bsw2opt_t opt = *_opt;
-	bsw2global_t *pool = bsw2_global_init();
-	for (x = 0; x < _seq->n; ++x) {
-		bsw2seq1_t *p = _seq->seq + x;
+	for (x = 0; x < n; ++x) {
+		bsw2seq1_t *p = _seq + x;
 		uint8_t *seq[2], *rseq[2];
 		int i, l, k;
 		bwtsw2_t *b[2];
+		bwa_rng_t rng;
 		l = p->l;
-
-#ifdef HAVE_PTHREAD
-		if (_opt->n_threads > 1) {
-			pthread_mutex_lock(&g_dbwtsw_lock);
-			if (p->tid < 0) p->tid = tid;
-			else if (p->tid != tid) {
-				pthread_mutex_unlock(&g_dbwtsw_lock);
-				continue;
-			} // in pinciple else should not happen
-			pthread_mutex_unlock(&g_dbwtsw_lock);
-		}
-#endif
+		bwa_rng_init(&rng, bns->seed, p->id);
 
 		// set opt->t
 		opt.t = _opt->t;
@@ -502,7 +486,7 @@ static void bsw2_aln_core(int tid, bsw2seq_t *_seq, const bsw2opt_t *_opt, const
 		// convert sequences to 2-bit representation
 		for (i = k = 0; i < l; ++i) {
 			int c = nst_nt4_table[(int)p->seq[i]];
-			if (c >= 4) { c = (int)(drand48() * 4); ++k; } // FIXME: ambiguous bases are not properly handled
+			if (c >= 4) { c = (int)(bwa_rng_drand(&rng) * 4); ++k; } // FIXME: ambiguous bases are not properly handled
 			seq[0][i] = c;
 			seq[1][l-1-i] = 3 - c;
 			rseq[0][l-1-i] = c;
@@ -513,11 +497,11 @@ static void bsw2_aln_core(int tid, bsw2seq_t *_seq, const bsw2opt_t *_opt, const
 			free(seq[0]); continue;
 		}
 		// alignment
-		b[0] = bsw2_aln1_core(&opt, bns, pac, target[0], l, seq, 0, pool);
+		b[0] = bsw2_aln1_core(&opt, bns, pac, target[0], l, seq, 0, pool, &rng);
 		for (k = 0; k < b[0]->n; ++k)
 			if (b[0]->hits[k].n_seeds < opt.t_seeds) break;
 		if (k < b[0]->n) {
-			b[1] = bsw2_aln1_core(&opt, bns, pac, target[1], l, rseq, 1, pool);
+			b[1] = bsw2_aln1_core(&opt, bns, pac, target[1], l, rseq, 1, pool, &rng);
 			for (i = 0; i < b[1]->n; ++i) {
 				bsw2hit_t *p = b[1]->hits + i;
 				int x = p->beg;
@@ -528,7 +512,7 @@ static void bsw2_aln_core(int tid, bsw2seq_t *_seq, const bsw2opt_t *_opt, const
 			flag_fr(b);
 			merge_hits(b, l, 0);
 			bsw2_resolve_duphits(0, b[0], 0);
-			bsw2_resolve_query_overlaps(b[0], opt.mask_level);
+			bsw2_resolve_query_overlaps(b[0], opt.mask_level, &rng);
 		} else b[1] = 0;
 		// generate CIGAR and print SAM
 		gen_cigar(&opt, l, seq, pac, b[0]);
@@ -537,65 +521,34 @@ static void bsw2_aln_core(int tid, bsw2seq_t *_seq, const bsw2opt_t *_opt, const
 		free(seq[0]);
 		bsw2_destroy(b[0]);
 	}
-	bsw2_global_destroy(pool);
 }
 
-#ifdef HAVE_PTHREAD
 typedef struct {
-	int tid;
 	bsw2seq_t *_seq;
 	const bsw2opt_t *_opt;
 	const bntseq_t *bns;
 	uint8_t *pac;
 	bwt_t *target[2];
+	bsw2global_t **pool; // working space of each worker
 } thread_aux_t;
 
-/* another interface to bsw2_aln_core() to facilitate pthread_create() */
-static void *worker(void *data)
+/* another interface to bsw2_aln_core() to run it on the thread pool */
+static void worker(uint32_t tid, uint32_t beg, uint32_t end, void *data)
 {
 	thread_aux_t *p = (thread_aux_t*)data;
-	bsw2_aln_core(p->tid, p->_seq, p->_opt, p->bns, p->pac, p->target);
-	return 0;
+	bsw2_aln_core(p->pool[tid], end - beg, p->_seq->seq + beg, p->_opt, p->bns, p->pac, p->target);
 }
-#endif
 
-/* process sequences stored in _seq, generate SAM lines for these
- * sequences and reset _seq afterwards. */
-static void process_seqs(bsw2seq_t *_seq, const bsw2opt_t *opt, const bntseq_t *bns, uint8_t *pac, bwt_t * const target[2])
+/* print the SAM lines of the sequences in _seq, which have been aligned,
+ * and reset _seq afterwards. */
+static void print_seqs(bsw2seq_t *_seq)
 {
 	int i;
-
-#ifdef HAVE_PTHREAD
-	if (opt->n_threads <= 1) {
-		bsw2_aln_core(0, _seq, opt, bns, pac, target);
-	} else {
-		pthread_t *tid;
-		pthread_attr_t attr;
-		thread_aux_t *data;
-		int j;
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		data = (thread_aux_t*)calloc(opt->n_threads, sizeof(thread_aux_t));
-		tid = (pthread_t*)calloc(opt->n_threads, sizeof(pthread_t));
-		for (j = 0; j < opt->n_threads; ++j) {
-			thread_aux_t *p = data + j;
-			p->tid = j; p->_seq = _seq; p->_opt = opt; p->bns = bns;
-			p->pac = pac; p->target[0] = target[0]; p->target[1] = target[1];
-			pthread_create(&tid[j], &attr, worker, p);
-		}
-		for (j = 0; j < opt->n_threads; ++j) pthread_join(tid[j], 0);
-		free(data); free(tid);
-	}
-#else
-	bsw2_aln_core(0, _seq, opt, bns, pac, target);
-#endif
-
-	// print and reset
 	for (i = 0; i < _seq->n; ++i) {
 		bsw2seq1_t *p = _seq->seq + i;
 		if (p->sam) printf("%s", p->sam);
 		free(p->name); free(p->seq); free(p->qual); free(p->sam);
-		p->tid = -1; p->l = 0;
+		p->l = 0;
 		p->name = p->seq = p->qual = p->sam = 0;
 	}
 	fflush(stdout);
@@ -606,9 +559,12 @@ void bsw2_aln(const bsw2opt_t *opt, const bntseq_t *bns, bwt_t * const target[2]
 {
 	gzFile fp;
 	kseq_t *ks;
-	int l, size = 0;
+	int l, size = 0, cur = 0, busy = 0;
+	uint64_t n_read = 0;
 	uint8_t *pac;
-	bsw2seq_t *_seq;
+	bsw2seq_t *_seq[2];
+	threadpool_t *tp;
+	thread_aux_t aux;
 
 	pac = calloc(bns->l_pac/4+1, 1);
 	if (pac == 0) {
@@ -620,30 +576,55 @@ void bsw2_aln(const bsw2opt_t *opt, const bntseq_t *bns, bwt_t * const target[2]
 	fread(pac, 1, bns->l_pac/4+1, bns->fp_pac);
 	fp = xzopen(fn, "r");
 	ks = kseq_init(fp);
-	_seq = calloc(1, sizeof(bsw2seq_t));
+	tp = threadpool_create(opt->n_threads);
+	aux._opt = opt; aux.bns = bns; aux.pac = pac;
+	aux.target[0] = target[0]; aux.target[1] = target[1];
+	aux.pool = calloc(threadpool_size(tp), sizeof(bsw2global_t*));
+	for (l = 0; l < (int)threadpool_size(tp); ++l) aux.pool[l] = bsw2_global_init();
+	_seq[0] = calloc(1, sizeof(bsw2seq_t));
+	_seq[1] = calloc(1, sizeof(bsw2seq_t));
+	// _seq[cur] is being read while _seq[!cur] is aligned by the pool
 	while ((l = kseq_read(ks)) >= 0) {
 		bsw2seq1_t *p;
-		if (_seq->n == _seq->max) {
-			_seq->max = _seq->max? _seq->max<<1 : 1024;
-			_seq->seq = realloc(_seq->seq, _seq->max * sizeof(bsw2seq1_t));
+		bsw2seq_t *s = _seq[cur];
+		if (s->n == s->max) {
+			s->max = s->max? s->max<<1 : 1024;
+			s->seq = realloc(s->seq, s->max * sizeof(bsw2seq1_t));
 		}
-		p = &_seq->seq[_seq->n++];
-		p->tid = -1;
+		p = &s->seq[s->n++];
 		p->l = l;
+		p->id = n_read++;
 		p->name = strdup(ks->name.s);
 		p->seq = strdup(ks->seq.s);
 		p->qual = ks->qual.l? strdup(ks->qual.s) : 0;
 		p->sam = 0;
 		size += l;
 		if (size > opt->chunk_size) {
-			fprintf(stderr, "[bsw2_aln] read %d sequences (%d bp)...\n", _seq->n, size);
-			process_seqs(_seq, opt, bns, pac, target);
+			fprintf(stderr, "[bsw2_aln] read %d sequences (%d bp)...\n", s->n, size);
+			if (busy) {
+				threadpool_wait(tp);
+				print_seqs(_seq[!cur]);
+			}
+			aux._seq = s;
+			threadpool_start(tp, s->n, 1, worker, &aux);
+			busy = 1; cur = !cur;
 			size = 0;
 		}
 	}
-	fprintf(stderr, "[bsw2_aln] read %d sequences (%d bp)...\n", _seq->n, size);
-	process_seqs(_seq, opt, bns, pac, target);
-	free(_seq->seq); free(_seq);
+	fprintf(stderr, "[bsw2_aln] read %d sequences (%d bp)...\n", _seq[cur]->n, size);
+	if (busy) {
+		threadpool_wait(tp);
+		print_seqs(_seq[!cur]);
+	}
+	aux._seq = _seq[cur];
+	threadpool_exec(tp, _seq[cur]->n, 1, worker, &aux);
+	print_seqs(_seq[cur]);
+	for (l = 0; l < (int)threadpool_size(tp); ++l) bsw2_global_destroy(aux.pool[l]);
+	free(aux.pool);
+	threadpool_destroy(tp);
+	for (l = 0; l < 2; ++l) {
+		free(_seq[l]->seq); free(_seq[l]);
+	}
 	kseq_destroy(ks);
 	gzclose(fp);
 	free(pac);
@@ -326,7 +326,7 @@ int bsw2_resolve_duphits(const bwt_t *bwt, bwtsw2_t *b, int IS)
 	return b->n;
 }
 
-int bsw2_resolve_query_overlaps(bwtsw2_t *b, float mask_level)
+int bsw2_resolve_query_overlaps(bwtsw2_t *b, float mask_level, bwa_rng_t *rng)
 {
 	int i, j, n;
 	if (b->n == 0) return 0;
@@ -335,7 +335,7 @@ int bsw2_resolve_query_overlaps(bwtsw2_t *b, float mask_level)
 		int G0 = b->hits[0].G;
 		for (i = 1; i < b->n; ++i)
 			if (b->hits[i].G != G0) break;
-		j = (int)(i * drand48());
+		j = (int)(i * bwa_rng_drand(rng));
 		if (j) {
 			bsw2hit_t tmp;
 			tmp = b->hits[0]; b->hits[0] = b->hits[j]; b->hits[j] = tmp;
@@ -475,7 +475,7 @@ bwtsw2_t **bsw2_core(const bsw2opt_t *opt, const bwtl_t *target, const bwt_t *qu
 		// get Occ for the DAG
 		bwtl_2occ4(target, v->tk - 1, v->tl, tcntk, tcntl);
 		for (tj = 0; tj != 4; ++tj) { // descend to the children
-			uint32_t qcntk[4], qcntl[4];
+			bwtint_t qcntk[4], qcntl[4]; // query is the bwt_t side; bwa_bwtsw2() keeps it below 4Gbp
 			int qj, *curr_score_mat = score_mat + tj * 4;
 			khiter_t iter;
 			bsw2entry_t *u;
@@ -526,7 +526,7 @@ bwtsw2_t **bsw2_core(const bsw2opt_t *opt, const bwtl_t *target, const bwt_t *qu
 				}
 				if ((x->G > opt->qr && x->G >= -heap[0]) || i < old_n) { // good node in u, or in v
 					if (p->cpos[0] == -1 || p->cpos[1] == -1 || p->cpos[2] == -1 || p->cpos[3] == -1) {
-						bwt_2occ4(query, p->qk - 1, p->ql, qcntk, qcntl);
+						bwt_2occ4(query, (bwtint_t)p->qk - 1, p->ql, qcntk, qcntl);
 						for (qj = 0; qj != 4; ++qj) { // descend to the prefix trie
 							if (p->cpos[qj] != -1) continue; // this node will be visited later
 							k = query->L2[qj] + qcntk[qj] + 1;
@@ -13,11 +13,10 @@ int bwa_bwtsw2(int argc, char *argv[])
 	bwt_t *target[2];
 	char buf[1024];
 	bntseq_t *bns;
-	int c;
+	int c, load_flags = 0;
 
 	opt = bsw2_init_opt();
-	srand48(11);
-	while ((c = getopt(argc, argv, "q:r:a:b:t:T:w:d:z:m:y:s:c:N:Hf:")) >= 0) {
+	while ((c = getopt(argc, argv, "q:r:a:b:t:T:w:d:z:m:y:s:c:N:Hf:Z:")) >= 0) {
 		switch (c) {
 		case 'q': opt->q = atoi(optarg); break;
 		case 'r': opt->r = atoi(optarg); break;
@@ -34,6 +33,7 @@ int bwa_bwtsw2(int argc, char *argv[])
 		case 'N': opt->t_seeds = atoi(optarg); break;
 		case 'H': opt->hard_clip = 1; break;
 		case 'f': xreopen(optarg, "w", stdout); break;
+		case 'Z': load_flags = bwt_load_flags(atoi(optarg)); break;
 		}
 	}
 	opt->qr = opt->q + opt->r;
@@ -59,7 +59,8 @@ int bwa_bwtsw2(int argc, char *argv[])
 		fprintf(stderr, "         -N INT   # seeds to trigger reverse alignment [%d]\n", opt->t_seeds);
 		fprintf(stderr, "         -c FLOAT coefficient of length-threshold adjustment [%.1f]\n", opt->coef);
 		fprintf(stderr, "         -H       in SAM output, use hard clipping rather than soft\n");
-        fprintf(stderr, "         -f FILE  file to output results to instead of stdout\n\n");
+        fprintf(stderr, "         -f FILE  file to output results to instead of stdout\n");
+        fprintf(stderr, "         -Z INT   index loading: 0 read into memory, 1 mmap, 2 mmap and prefetch [0]\n\n");
 		fprintf(stderr, "Note: For long Illumina, 454 and Sanger reads, assembly contigs, fosmids and\n");
 		fprintf(stderr, "      BACs, the default setting usually works well. For the current PacBio\n");
 		fprintf(stderr, "      reads (end of 2010), '-b5 -q2 -r1 -z10' is recommended. One may also\n");
@@ -82,10 +83,13 @@ int bwa_bwtsw2(int argc, char *argv[])
 	opt->t *= opt->a;
 	opt->coef *= opt->a;
 
-	strcpy(buf, argv[optind]); target[0] = bwt_restore_bwt(strcat(buf, ".bwt"));
-	strcpy(buf, argv[optind]); bwt_restore_sa(strcat(buf, ".sa"), target[0]);
-	strcpy(buf, argv[optind]); target[1] = bwt_restore_bwt(strcat(buf, ".rbwt"));
-	strcpy(buf, argv[optind]); bwt_restore_sa(strcat(buf, ".rsa"), target[1]);
+	strcpy(buf, argv[optind]); target[0] = bwt_restore_bwt_core(strcat(buf, ".bwt"), load_flags);
+	strcpy(buf, argv[optind]); bwt_restore_sa_core(strcat(buf, ".sa"), target[0], load_flags);
+	strcpy(buf, argv[optind]); target[1] = bwt_restore_bwt_core(strcat(buf, ".rbwt"), load_flags);
+	strcpy(buf, argv[optind]); bwt_restore_sa_core(strcat(buf, ".rsa"), target[1], load_flags);
+	// BWA-SW packs target SA intervals and coordinates into 32-bit integers
+	if (target[0]->seq_len > 0xffffffffu)
+		err_fatal(__func__, "BWA-SW does not support references longer than 4Gbp.");
 	bns = bns_restore(argv[optind]);
 
 	bsw2_aln(opt, bns, target, argv[optind+1]);
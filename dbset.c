@@ -61,9 +61,9 @@ static void bwtdb_load_sa(bwtdb_t *db, int which) {
     }
 
     strcpy(path, db->prefix); strcat(path, bwt_suffix);
-    db->bwt[which] = bwt_restore_bwt(path);
+    db->bwt[which] = bwt_restore_bwt_core(path, db->load_flags);
     strcpy(path, db->prefix); strcat(path, sa_suffix);
-    bwt_restore_sa(path, db->bwt[which]);
+    bwt_restore_sa_core(path, db->bwt[which], db->load_flags);
 }
 
 static void bwtdb_unload_sa(bwtdb_t *db, int which) {
@@ -76,6 +76,7 @@ static void bwtdb_destroy(bwtdb_t *db) {
     bwtdb_unload_sa(db, 0);
     bwtdb_unload_sa(db, 1);
     bwtcache_destroy(db->bwtcache);
+    sapc_close(db->sapc);
     free(db);
 }
 
@@ -132,7 +133,7 @@ static void seq_destroy(seq_t *s) {
     free(s);
 }
 
-dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload, int remap) {
+dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload, int remap, int load_flags) {
     int i;
     dbset_t *dbs = calloc(1, sizeof(dbset_t));
     dbs->count = count;
@@ -145,6 +146,7 @@ dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload,
 
     for (i = 0; i < count; ++i) {
         dbs->db[i] = bwtdb_load(prefixes[i]);
+        dbs->db[i]->load_flags = load_flags;
         dbs->db[i]->offset = dbs->l_pac;
         dbs->bns[i] = seq_restore(prefixes[i], "", remap);
         dbs->db[i]->bns = dbs->bns[i];
@@ -154,6 +156,7 @@ dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload,
 /* TODO: get rid of these, we just need the length of the bwt */
         bwtdb_load_sa(dbs->db[i], 0);
         bwtdb_load_sa(dbs->db[i], 1);
+        dbs->db[i]->sapc = sapc_open(prefixes[i], (const bwt_t *const*)dbs->db[i]->bwt);
 
         dbs->total_bwt_seq_len[0] += dbs->db[i]->bwt[0]->seq_len;
         dbs->total_bwt_seq_len[1] += dbs->db[i]->bwt[1]->seq_len;
@@ -237,7 +240,7 @@ void dbset_unload_ntpac(dbset_t *dbs) {
         seq_unload_pac(dbs->ntbns[i]);
 }
 
-uint64_t bwtdb_sa2seq(const bwtdb_t *db, int strand, uint32_t sa, uint32_t seq_len) {
+uint64_t bwtdb_sa2seq(const bwtdb_t *db, int strand, bwtint_t sa, uint32_t seq_len) {
     if (strand) {
         return db->offset + bwt_sa(db->bwt[0], sa);
     } else {
@@ -254,8 +257,23 @@ int dbset_coor_pac2real(const dbset_t *dbs, int64_t pac_coor, int len, int32_t *
     return bns_coor_pac2real(*bns, pac_coor - *offset, len, real_seq);
 }
 
-poslist_t bwtdb_cached_sa2seq(const bwtdb_t *db, const bwt_aln1_t* aln, uint32_t seq_len) {
-    return bwt_cached_sa(db->offset, db->bwtcache, (const bwt_t **const)db->bwt, aln, seq_len);
+int32_t dbset_seq_for_pos(const dbset_t *dbs, int64_t pac_coor, const bntseq_t **bns, uint64_t *offset)
+{
+    int idx = coord2idx(dbs, pac_coor);
+    *bns = dbs->bns[idx]->bns;
+    *offset = dbs->db[idx]->offset;
+    return bns_seq_for_pos(*bns, pac_coor - *offset);
+}
+
+void bwtdb_cached_sa2seq(const bwtdb_t *db, const bwt_aln1_t* aln, uint32_t seq_len, poslist_t *pos) {
+    if (db->sapc && sapc_get(db->sapc, db->offset, aln, seq_len, pos)) return;
+    bwt_cached_sa(db->offset, db->bwtcache, (const bwt_t **const)db->bwt, aln, seq_len, pos);
+}
+
+void dbset_cache_limit(dbset_t *dbs, uint64_t max_bytes) {
+    int i;
+    for (i = 0; i < dbs->count; ++i)
+        bwtcache_set_limit(dbs->db[i]->bwtcache, max_bytes? (uint64_t)((double)max_bytes * dbs->db[i]->bwt[0]->seq_len / dbs->total_bwt_seq_len[0]) + 1 : 0);
 }
 
 uint32_t dbset_extract_remapped(const dbset_t *dbs, seq_t **seqs, uint32_t dbidx, int32_t seqid, ubyte_t* ref_seq, uint64_t beg, uint32_t len) {
@@ -324,16 +342,16 @@ uint32_t dbset_extract_sequence(const dbset_t *dbs, seq_t **seqs, ubyte_t* ref_s
     return total;
 }
 
-void dbset_print_sam_SQ(const dbset_t *dbs) {
+void dbset_sam_SQ(const dbset_t *dbs, kstring_t *str) {
     int i, j;
     for (i = 0; i < dbs->count; ++i) {
         seq_t *s = dbs->bns[i];
         for (j = 0; j < s->bns->n_seqs; ++j) {
             if (!s->mappings || s->mappings[j] == NULL) {
-                printf("@SQ\tSN:%s\tLN:%d\n",
+                ksprintf(str, "@SQ\tSN:%s\tLN:%d\n",
                     s->bns->anns[j].name, s->bns->anns[j].len);
             }
         }
     }
-    if (bwa_rg_line) printf("%s\n", bwa_rg_line);
+    if (bwa_rg_line) ksprintf(str, "%s\n", bwa_rg_line);
 }
@@ -5,7 +5,9 @@
 #include "bwt.h"
 #include "bwtaln.h"
 #include "bwtcache.h"
+#include "sapc.h"
 #include "bwaremap.h"
+#include "kstring.h"
 
 #include <stdint.h>
 
@@ -13,6 +15,8 @@ typedef struct {
     const char *prefix;
     bwt_t *bwt[2]; 
     bwtcache_t *bwtcache;
+    sapc_t *sapc; // <prefix>.sapc, if there is one
+    int load_flags; /* BWT_LOAD_* */
     uint64_t offset;
     seq_t *bns;
     seq_t *ntbns;
@@ -35,7 +39,7 @@ extern "C" {
 #endif /* __cplusplus */
 
     int coord2idx(const dbset_t *dbs, int64_t pos);
-    dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload, int remap);
+    dbset_t *dbset_restore(int count, const char **prefixes, int mode, int preload, int remap, int load_flags);
     void dbset_destroy(dbset_t *dbs);
 
     void dbset_load_sa(dbset_t *dbs, int which);
@@ -51,11 +55,15 @@ extern "C" {
     uint32_t dbset_extract_sequence(const dbset_t *dbs, seq_t **seqs, ubyte_t* ref_seq, uint64_t beg, uint32_t len);
     int dbset_coor_pac2real(const dbset_t *dbs, int64_t pac_coor, int len, int32_t *real_seq, 
                             const bntseq_t **bns, uint64_t *offset);
+    // as dbset_coor_pac2real(), without counting ambiguous bases
+    int32_t dbset_seq_for_pos(const dbset_t *dbs, int64_t pac_coor, const bntseq_t **bns, uint64_t *offset);
 
-    uint64_t bwtdb_sa2seq(const bwtdb_t *db, int strand, uint32_t sa, uint32_t seq_len);
-    poslist_t bwtdb_cached_sa2seq(const bwtdb_t *db, const bwt_aln1_t* aln, uint32_t seq_len);
+    uint64_t bwtdb_sa2seq(const bwtdb_t *db, int strand, bwtint_t sa, uint32_t seq_len);
+    void bwtdb_cached_sa2seq(const bwtdb_t *db, const bwt_aln1_t* aln, uint32_t seq_len, poslist_t *pos);
+    // bounds the SA position caches of all databases to max_bytes, shared by the sizes of their BWTs
+    void dbset_cache_limit(dbset_t *dbs, uint64_t max_bytes);
 
-    void dbset_print_sam_SQ(const dbset_t *dbs);
+    void dbset_sam_SQ(const dbset_t *dbs, kstring_t *str); // appends the @SQ and @RG header lines
 
 #ifdef __cplusplus
 }
@@ -1,13 +1,16 @@
 #include "filter_alignments.h"
 #include "bwaremap.h"
 #include "bwase.h"
+#include "rng.h"
+#include "utils.h"
 
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <stdint.h>
 #include <limits>
 #include <map>
-
-#define MIN_HASH_WIDTH 1000
+#include <vector>
 
 using namespace std;
 
@@ -50,37 +53,73 @@ namespace {
 	} while (0);
 
 
+/* The number of distinct positions among the n hits at a, split by
+ * whether the best hit at a position has the best score of the read: a
+ * position hit by several alignments counts once. */
+static void count_distinct(coord_buf_t* buf, const position_t* a, size_t n, int min_score, uint32_t* c1, uint32_t* c2)
+{
+    *c1 = *c2 = 0;
+    if (n == 0) return;
+    if (n * 2 > (size_t)1 << buf->bits) { // keep the load at most 1/2
+        while (n * 2 > (size_t)1 << buf->bits)
+            buf->bits = buf->bits? buf->bits + 1 : 10;
+        free(buf->slot);
+        buf->slot = (pos_slot_t*)calloc((size_t)1 << buf->bits, sizeof(pos_slot_t));
+        buf->gen = 0;
+    }
+    if (++buf->gen == 0) {
+        memset(buf->slot, 0, sizeof(pos_slot_t) << buf->bits);
+        buf->gen = 1;
+    }
+
+    const uint64_t mask = ((uint64_t)1 << buf->bits) - 1;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t key = a[i].remapped_pos;
+        uint32_t best = a[i].score == min_score;
+        uint64_t h = key * 0x9e3779b97f4a7c15ULL >> (64 - buf->bits);
+        pos_slot_t* q;
+        while ((q = &buf->slot[h])->gen == buf->gen && q->pos != key)
+            h = (h + 1) & mask;
+        if (q->gen != buf->gen) {
+            q->gen = buf->gen;
+            q->pos = key;
+            q->best = best;
+            ++*(best? c1 : c2);
+        } else if (best && !q->best) {
+            q->best = 1;
+            ++*c1; --*c2;
+        }
+    }
+}
+
 void compute_seq_coords_and_counts(
     const dbset_t* dbs,
     int do_remap,
     const alngrp_t aln[2],
-    pos_arr_t* out_arr,
+    coord_buf_t* buf,
     bwa_seq_t** p
     )
 {
-    struct db_and_score {
-        int dbidx;
-        int score;
-    };
-
+    pos_arr_t* out_arr = &buf->arr;
     out_arr->n = 0;
     for (int j = 0; j < 2; ++j) {
-        typedef map<uint64_t, alignment_t*> P2SMapType;
-        map<uint64_t, alignment_t*> pos2score;
+        size_t start = out_arr->n;
         int min_score = numeric_limits<int>::max();
+        for (unsigned k = 0; k < aln[j].n; ++k)
+            min_score = std::min(min_score, aln[j].a[k].aln.score);
+
         for (unsigned k = 0; k < aln[j].n; ++k) {
             alignment_t *ar = &aln[j].a[k];
-            min_score = std::min(min_score, ar->aln.score);
             int remap_status = 0;
 
             bwtint_t l;
             if (ar->aln.l - ar->aln.k + 1 >= MIN_HASH_WIDTH) { // then check hash table
                 bwtdb_t* db = dbs->db[ar->dbidx];
                 /* TODO: cache remappings */
-                poslist_t pos = bwtdb_cached_sa2seq(dbs->db[ar->dbidx], &ar->aln, p[j]->len);
-                for (l = 0; l < pos.n; ++l) {
+                bwtdb_cached_sa2seq(dbs->db[ar->dbidx], &ar->aln, p[j]->len, &buf->pos);
+                for (l = 0; l < buf->pos.n; ++l) {
                     position_t alnpos = {0};
-                    alnpos.pos = pos.a[l];
+                    alnpos.pos = buf->pos.a[l];
                     if (alnpos.pos < db->offset || alnpos.pos >= db->offset + db->bns->bns->l_pac)
                         continue;
                     alnpos.len = p[j]->len;
@@ -93,12 +132,6 @@ void compute_seq_coords_and_counts(
 
                     alnpos.idx_and_end = k<<1 | j;
                     kv_push(position_t, *out_arr, alnpos);
-
-                    pair<P2SMapType::iterator, bool> inserted = pos2score.insert(make_pair(alnpos.remapped_pos, ar));
-                    if (!inserted.second) {
-                        if (ar->aln.score < inserted.first->second->aln.score)
-                            inserted.first->second = ar;
-                    }
                 }
             } else { // then calculate on the fly
                 bwtdb_t* db = dbs->db[ar->dbidx];
@@ -117,27 +150,84 @@ void compute_seq_coords_and_counts(
                     
                     alnpos.idx_and_end = k<<1 | j;
                     kv_push(position_t, *out_arr, alnpos);
-                    pair<P2SMapType::iterator, bool> inserted = pos2score.insert(make_pair(alnpos.remapped_pos, ar));
-                    if (!inserted.second) {
-                        if (ar->aln.score < inserted.first->second->aln.score)
-                            inserted.first->second = ar;
-                    }
                 }
             }
         }
 
-        size_t totalReadCounts[2] = {0};
-        size_t primaryReadCounts[2] = {0};
-        for (P2SMapType::const_iterator i = pos2score.begin(); i != pos2score.end(); ++i) {
-            int idx = i->second->aln.score == min_score ? 0 : 1;
-            ++totalReadCounts[idx];
-            if (i->second->dbidx == 0)
-                ++primaryReadCounts[idx];
-        }
-
-        p[j]->c1 = totalReadCounts[0];
-        p[j]->c2 = totalReadCounts[1];
+        uint32_t c1, c2;
+        count_distinct(buf, out_arr->a + start, out_arr->n - start, min_score, &c1, &c2);
+        p[j]->c1 = c1;
+        p[j]->c2 = c2;
         if (p[j]->c1 != 0)
             p[j]->type = p[j]->c1 > 1 ? BWA_TYPE_REPEAT : BWA_TYPE_UNIQUE;
     }
 }
+
+void coord_buf_destroy(coord_buf_t* buf)
+{
+    kv_destroy(buf->arr);
+    free(buf->pos.a);
+    free(buf->slot);
+    memset(buf, 0, sizeof(coord_buf_t));
+}
+
+/* The benchmark: reads of up to 4096 hits, about half of them at positions
+ * hit before, as when several alignments of a repeat remap to one place. */
+
+// what compute_seq_coords_and_counts() did before: a map from position to its best hit
+static void count_distinct_map(const position_t* a, size_t n, int min_score, uint32_t* c1, uint32_t* c2)
+{
+    typedef map<uint64_t, int> P2SMapType;
+    P2SMapType pos2score;
+    for (size_t i = 0; i < n; ++i) {
+        pair<P2SMapType::iterator, bool> inserted = pos2score.insert(make_pair(a[i].remapped_pos, a[i].score));
+        if (!inserted.second && a[i].score < inserted.first->second)
+            inserted.first->second = a[i].score;
+    }
+    *c1 = *c2 = 0;
+    for (P2SMapType::const_iterator i = pos2score.begin(); i != pos2score.end(); ++i)
+        ++*(i->second == min_score? c1 : c2);
+}
+
+void coord_count_bench(int n, uint64_t seed)
+{
+    coord_buf_t buf;
+    vector<size_t> beg;
+    vector<position_t> hits;
+    uint64_t n_hits = 0, sum[2] = {0, 0};
+    bwa_rng_t rng;
+
+    memset(&buf, 0, sizeof(coord_buf_t));
+    bwa_rng_init(&rng, seed, 0);
+    for (int i = 0; i < n; ++i) {
+        size_t m = 1 + bwa_rng_next(&rng) % 4096;
+        beg.push_back(hits.size());
+        for (size_t k = 0; k < m; ++k) {
+            position_t x = position_t();
+            uint64_t r = bwa_rng_next(&rng);
+            x.remapped_pos = (r >> 8) % (m / 2 + 1) * 1000;
+            x.score = r & 3;
+            hits.push_back(x);
+        }
+    }
+    beg.push_back(hits.size());
+    n_hits = hits.size();
+    fprintf(stderr, "[%s] %d reads, %llu hits\n", __func__, n, (unsigned long long)n_hits);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        double t = realtime();
+        uint64_t s = 0;
+        for (int i = 0; i < n; ++i) {
+            uint32_t c1, c2;
+            if (pass == 0) count_distinct_map(&hits[beg[i]], beg[i+1] - beg[i], 0, &c1, &c2);
+            else count_distinct(&buf, &hits[beg[i]], beg[i+1] - beg[i], 0, &c1, &c2);
+            s = s * 31 + ((uint64_t)c1 << 32 | c2);
+        }
+        t = realtime() - t;
+        sum[pass] = s;
+        fprintf(stderr, "[%s] %-6s %10.2f Mhits/sec (%.3f sec; checksum %llx)\n", __func__,
+                pass == 0? "map" : "hash", n_hits / t * 1e-6, t, (unsigned long long)s);
+    }
+    coord_buf_destroy(&buf);
+    if (sum[0] != sum[1]) err_fatal(__func__, "the counts disagree.");
+}
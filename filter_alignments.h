@@ -6,17 +6,40 @@
 #include "saiset.h"
 #include "bwapair.h"
 
+typedef struct {
+    uint64_t pos;
+    uint32_t gen, best;
+} pos_slot_t;
+
+/* Scratch space of compute_seq_coords_and_counts(), one per thread and kept
+ * across pairs, so that placing a pair does not touch the heap once it has
+ * grown. Hits are told apart in an open-addressing table; a slot is empty
+ * unless it is of the current generation, so the table is never cleared.
+ * Zero-initialise it. */
+typedef struct {
+    pos_arr_t arr; // the positions of both ends of the pair
+    poslist_t pos; // the positions of a wide SA interval
+    uint32_t gen;
+    int bits;
+    pos_slot_t *slot; // 1<<bits slots
+} coord_buf_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    // fills buf->arr with the positions of both ends and sets their c1, c2 and type
     void compute_seq_coords_and_counts(
         const dbset_t* dbs,
         int do_remap,
         const alngrp_t aln[2],
-        pos_arr_t* out_arr,
+        coord_buf_t* buf,
         bwa_seq_t** p
         );
+    void coord_buf_destroy(coord_buf_t* buf);
+
+    // times the counting against a std::map on synthetic repeat-heavy reads
+    void coord_count_bench(int n, uint64_t seed);
 
 #ifdef __cplusplus
 }
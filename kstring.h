@@ -41,6 +41,62 @@ static inline int kputc(int c, kstring_t *s)
 	return c;
 }
 
+static inline int kputsn(const char *p, int l, kstring_t *s)
+{
+	if (s->l + l + 1 >= s->m) {
+		s->m = s->l + l + 2;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	memcpy(s->s + s->l, p, l);
+	s->l += l;
+	s->s[s->l] = 0;
+	return l;
+}
+
+// decimal integers without going through printf
+static inline int kputl(long long c, kstring_t *s)
+{
+	char buf[24];
+	unsigned long long x = c < 0? -(unsigned long long)c : (unsigned long long)c;
+	int l = 0, i;
+	do buf[l++] = x%10 + '0'; while ((x /= 10) > 0);
+	if (c < 0) buf[l++] = '-';
+	if (s->l + l + 1 >= s->m) {
+		s->m = s->l + l + 2;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
+	s->s[s->l] = 0;
+	return l;
+}
+
+static inline int kputw(int c, kstring_t *s)
+{
+	char buf[16];
+	unsigned x = c < 0? -(unsigned)c : (unsigned)c;
+	int l = 0, i;
+	do buf[l++] = x%10 + '0'; while ((x /= 10) > 0);
+	if (c < 0) buf[l++] = '-';
+	if (s->l + l + 1 >= s->m) {
+		s->m = s->l + l + 2;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
+	s->s[s->l] = 0;
+	return l;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 int ksprintf(kstring_t *s, const char *fmt, ...);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
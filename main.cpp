@@ -13,6 +13,7 @@ static int usage()
 	fprintf(stderr, "         aln           gapped/ungapped alignment\n");
 	fprintf(stderr, "         samse         generate alignment (single ended)\n");
 	fprintf(stderr, "         sampe         generate alignment (paired ended)\n");
+	fprintf(stderr, "         alnpe         aln and sampe in one pass, without .sai files\n");
 	fprintf(stderr, "         bwasw         BWA-SW for long queries\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "         fa2pac        convert FASTA to PAC format\n");
@@ -21,15 +22,18 @@ static int usage()
 	fprintf(stderr, "         bwtupdate     update .bwt to the new format\n");
 	fprintf(stderr, "         pac_rev       generate reverse PAC\n");
 	fprintf(stderr, "         bwt2sa        generate SA from BWT and Occ\n");
+	fprintf(stderr, "         sa_resample   change the SA sampling interval of an index\n");
 	fprintf(stderr, "         pac2cspac     convert PAC to color-space PAC\n");
 	fprintf(stderr, "         stdsw         standard SW/NW alignment\n");
+	fprintf(stderr, "         bench         benchmark Occ lookups on a .bwt\n");
+	fprintf(stderr, "         sapc          cache the SA values of repeat intervals hit in .sai files\n");
 	fprintf(stderr, "\n");
 	return 1;
 }
 
-void bwa_print_sam_PG()
+void bwa_sam_PG(kstring_t *s)
 {
-	printf("@PG\tID:bwa\tPN:bwa\tVN:%s\n", __g_prog_version);
+	ksprintf(s, "@PG\tID:bwa\tPN:bwa\tVN:%s\n", __g_prog_version);
 }
 
 int main(int argc, char *argv[])
@@ -41,16 +45,20 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "bwtupdate") == 0) return bwa_bwtupdate(argc-1, argv+1);
 	else if (strcmp(argv[1], "pac_rev") == 0) return bwa_pac_rev(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwt2sa") == 0) return bwa_bwt2sa(argc-1, argv+1);
+	else if (strcmp(argv[1], "sa_resample") == 0) return bwa_sa_resample(argc-1, argv+1);
 	else if (strcmp(argv[1], "index") == 0) return bwa_index(argc-1, argv+1);
 	else if (strcmp(argv[1], "aln") == 0) return bwa_aln(argc-1, argv+1);
 	else if (strcmp(argv[1], "sw") == 0) return bwa_stdsw(argc-1, argv+1);
 	else if (strcmp(argv[1], "samse") == 0) return bwa_sai2sam_se(argc-1, argv+1);
 	else if (strcmp(argv[1], "sampe") == 0) return bwa_sai2sam_pe(argc-1, argv+1);
+	else if (strcmp(argv[1], "alnpe") == 0) return bwa_alnpe(argc-1, argv+1);
 	else if (strcmp(argv[1], "pac2cspac") == 0) return bwa_pac2cspac(argc-1, argv+1);
 	else if (strcmp(argv[1], "stdsw") == 0) return bwa_stdsw(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwtsw2") == 0) return bwa_bwtsw2(argc-1, argv+1);
 	else if (strcmp(argv[1], "dbwtsw") == 0) return bwa_bwtsw2(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwasw") == 0) return bwa_bwtsw2(argc-1, argv+1);
+	else if (strcmp(argv[1], "bench") == 0) return bwa_bench(argc-1, argv+1);
+	else if (strcmp(argv[1], "sapc") == 0) return bwa_sapc(argc-1, argv+1);
 	else {
 		fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]);
 		return 1;
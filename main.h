@@ -1,11 +1,13 @@
 #ifndef BWA_MAIN_H
 #define BWA_MAIN_H
 
+#include "kstring.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-    void bwa_print_sam_PG();
+    void bwa_sam_PG(kstring_t *s); // appends the @PG header line
 
 	int bwa_fa2pac(int argc, char *argv[]);
 	int bwa_pac_rev(int argc, char *argv[]);
@@ -13,17 +15,22 @@ extern "C" {
 	int bwa_pac2bwt(int argc, char *argv[]);
 	int bwa_bwtupdate(int argc, char *argv[]);
 	int bwa_bwt2sa(int argc, char *argv[]);
+	int bwa_sa_resample(int argc, char *argv[]);
 	int bwa_index(int argc, char *argv[]);
 	int bwa_aln(int argc, char *argv[]);
 	int bwt_bwtgen_main(int argc, char *argv[]);
 
 	int bwa_sai2sam_se(int argc, char *argv[]);
 	int bwa_sai2sam_pe(int argc, char *argv[]);
+	int bwa_alnpe(int argc, char *argv[]);
 
 	int bwa_stdsw(int argc, char *argv[]);
 
 	int bwa_bwtsw2(int argc, char *argv[]);
 
+	int bwa_bench(int argc, char *argv[]);
+	int bwa_sapc(int argc, char *argv[]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,39 @@
+#ifndef BWA_RNG_H
+#define BWA_RNG_H
+
+#include <stdint.h>
+
+/* Counter-based random numbers. A stream is keyed by a seed and an id,
+ * usually the index of a read in its input, and the n-th number is a hash
+ * of the key and n. The choices made for a read thus do not depend on
+ * which thread handles it, or on the reads before it. */
+
+typedef struct {
+	uint64_t key, ctr;
+} bwa_rng_t;
+
+static inline uint64_t bwa_rng_mix(uint64_t x) // the splitmix64 finalizer
+{
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	return x ^ x >> 31;
+}
+
+static inline void bwa_rng_init(bwa_rng_t *r, uint64_t seed, uint64_t id)
+{
+	r->key = bwa_rng_mix(seed ^ bwa_rng_mix(id + 0x9e3779b97f4a7c15ULL));
+	r->ctr = 0;
+}
+
+static inline uint64_t bwa_rng_next(bwa_rng_t *r)
+{
+	return bwa_rng_mix(r->key + ++r->ctr * 0x9e3779b97f4a7c15ULL);
+}
+
+// uniform in [0,1), a drop-in for drand48()
+static inline double bwa_rng_drand(bwa_rng_t *r)
+{
+	return (bwa_rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
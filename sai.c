@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "sai.h"
+#include "kstring.h"
+#include "utils.h"
+
+#define SAI_MAGIC     "BSAI"
+#define SAI_N_OPT     16
+#define SAI_BLK_HDR   8
+#define SAI_ZBLK_HDR  12
+#define SAI_IDX_SIZE  24
+#define SAI_FOOT_SIZE 16
+
+static inline uint32_t sai_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline uint64_t sai_u64(const uint8_t *p)
+{
+    return (uint64_t)sai_u32(p) | (uint64_t)sai_u32(p + 4)<<32;
+}
+
+static inline void sai_put_u32(uint8_t *p, uint32_t x)
+{
+    p[0] = x; p[1] = x>>8; p[2] = x>>16; p[3] = x>>24;
+}
+
+static inline void sai_put_u64(uint8_t *p, uint64_t x)
+{
+    sai_put_u32(p, (uint32_t)x); sai_put_u32(p + 4, (uint32_t)(x>>32));
+}
+
+static inline uint8_t *sai_put_varint(uint8_t *p, uint64_t x)
+{
+    for (; x >= 0x80; x >>= 7) *p++ = (uint8_t)x | 0x80;
+    *p++ = (uint8_t)x;
+    return p;
+}
+
+// 0 if the varint runs past end
+static inline const uint8_t *sai_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *x)
+{
+    int shift;
+    for (*x = 0, shift = 0; p < end && shift < 64; shift += 7) {
+        *x |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) return p;
+    }
+    return 0;
+}
+
+static inline uint64_t sai_zigzag(int64_t x) { return (uint64_t)x<<1 ^ (uint64_t)(x>>63); }
+static inline int64_t sai_unzigzag(uint64_t x) { return (int64_t)(x>>1) ^ -(int64_t)(x&1); }
+
+static void sai_opt2words(const gap_opt_t *opt, uint32_t *w)
+{
+    union { float f; uint32_t u; } fnr;
+    fnr.f = opt->fnr;
+    w[0] = opt->s_mm; w[1] = opt->s_gapo; w[2] = opt->s_gape; w[3] = opt->mode;
+    w[4] = opt->indel_end_skip; w[5] = opt->max_del_occ; w[6] = opt->max_entries; w[7] = fnr.u;
+    w[8] = opt->max_diff; w[9] = opt->max_gapo; w[10] = opt->max_gape; w[11] = opt->max_seed_diff;
+    w[12] = opt->seed_len; w[13] = opt->n_threads; w[14] = opt->max_top2; w[15] = opt->trim_qual;
+}
+
+static void sai_words2opt(const uint32_t *w, gap_opt_t *opt)
+{
+    union { float f; uint32_t u; } fnr;
+    fnr.u = w[7];
+    opt->s_mm = w[0]; opt->s_gapo = w[1]; opt->s_gape = w[2]; opt->mode = w[3];
+    opt->indel_end_skip = w[4]; opt->max_del_occ = w[5]; opt->max_entries = w[6]; opt->fnr = fnr.f;
+    opt->max_diff = w[8]; opt->max_gapo = w[9]; opt->max_gape = w[10]; opt->max_seed_diff = w[11];
+    opt->seed_len = w[12]; opt->n_threads = w[13]; opt->max_top2 = w[14]; opt->trim_qual = w[15];
+}
+
+static void sai_fwrite(sai_writer_t *w, const void *p, size_t l)
+{
+    if (fwrite(p, 1, l, w->fp) != l) err_fatal_simple("failed to write the .sai file.");
+    w->offset += l;
+}
+
+/*********
+ * write *
+ *********/
+
+sai_writer_t *sai_open_w(FILE *fp, const gap_opt_t *opt, int flags)
+{
+    sai_writer_t *w = (sai_writer_t*)calloc(1, sizeof(sai_writer_t));
+    uint8_t h[16 + SAI_N_OPT * 4];
+    uint32_t words[SAI_N_OPT];
+    int i;
+    w->fp = fp;
+    w->flags = flags;
+    memcpy(h, SAI_MAGIC, 4);
+    sai_put_u32(h + 4, SAI_VERSION);
+    sai_put_u32(h + 8, flags);
+    sai_put_u32(h + 12, SAI_N_OPT);
+    sai_opt2words(opt, words);
+    for (i = 0; i < SAI_N_OPT; ++i) sai_put_u32(h + 16 + i * 4, words[i]);
+    sai_fwrite(w, h, sizeof(h));
+    return w;
+}
+
+static void sai_flush_block(sai_writer_t *w)
+{
+    uint8_t h[SAI_ZBLK_HDR];
+    sai_index_t *idx;
+    uLongf size = w->l;
+    if (w->n == 0) return;
+    if (w->n_index == w->m_index) {
+        w->m_index = w->m_index? w->m_index<<1 : 64;
+        w->index = (sai_index_t*)realloc(w->index, w->m_index * sizeof(sai_index_t));
+    }
+    if (w->flags & SAI_F_COMPRESS) {
+        size = compressBound(w->l);
+        if (size > w->m_z) {
+            w->m_z = size;
+            w->z = (uint8_t*)realloc(w->z, w->m_z);
+        }
+        if (compress2(w->z, &size, w->buf, w->l, Z_BEST_SPEED) != Z_OK)
+            err_fatal_simple("failed to deflate a block.");
+    }
+    idx = &w->index[w->n_index++];
+    idx->offset = w->offset; idx->first = w->n_reads - w->n;
+    idx->n = w->n; idx->size = size;
+    sai_put_u32(h, w->n); sai_put_u32(h + 4, size);
+    if (w->flags & SAI_F_COMPRESS) {
+        sai_put_u32(h + 8, w->l);
+        sai_fwrite(w, h, SAI_ZBLK_HDR);
+        sai_fwrite(w, w->z, size);
+    } else {
+        sai_fwrite(w, h, SAI_BLK_HDR);
+        sai_fwrite(w, w->buf, w->l);
+    }
+    w->n = 0; w->l = 0;
+}
+
+// append the record of one read to w->buf
+static void sai_put_rec(sai_writer_t *w, int n_aln, const bwt_aln1_t *aln)
+{
+    size_t max = w->flags & SAI_F_COMPRESS? 10 + (size_t)n_aln * 40 : 4 + (size_t)n_aln * SAI_ALN_SIZE;
+    uint8_t *p;
+    int i;
+    if (w->l + max > w->m) {
+        w->m = w->l + max;
+        kroundup32(w->m);
+        w->buf = (uint8_t*)realloc(w->buf, w->m);
+    }
+    p = w->buf + w->l;
+    if (w->flags & SAI_F_COMPRESS) {
+        uint64_t last = 0;
+        p = sai_put_varint(p, n_aln);
+        for (i = 0; i < n_aln; ++i) {
+            const bwt_aln1_t *a = aln + i;
+            p = sai_put_varint(p, a->n_mm<<1 | a->a);
+            p = sai_put_varint(p, a->n_gapo);
+            p = sai_put_varint(p, a->n_gape);
+            p = sai_put_varint(p, sai_zigzag(a->score));
+            p = sai_put_varint(p, sai_zigzag((int64_t)((uint64_t)a->k - last)));
+            p = sai_put_varint(p, (uint64_t)a->l - (uint64_t)a->k);
+            last = a->k;
+        }
+    } else {
+        sai_put_u32(p, n_aln); p += 4;
+        for (i = 0; i < n_aln; ++i, p += SAI_ALN_SIZE) {
+            const bwt_aln1_t *a = aln + i;
+            p[0] = a->n_mm; p[1] = a->n_gapo; p[2] = a->n_gape; p[3] = a->a;
+            sai_put_u32(p + 4, (uint32_t)a->score);
+            sai_put_u64(p + 8, a->k);
+            sai_put_u64(p + 16, a->l);
+        }
+    }
+    w->l = p - w->buf;
+    ++w->n;
+}
+
+void sai_write1(sai_writer_t *w, int n_aln, const bwt_aln1_t *aln)
+{
+    sai_put_rec(w, n_aln, aln);
+    ++w->n_reads;
+    if (w->n == SAI_BLOCK_READS) sai_flush_block(w);
+}
+
+void sai_close_w(sai_writer_t *w)
+{
+    uint8_t h[SAI_IDX_SIZE];
+    uint64_t off;
+    int i;
+    if (w == 0) return;
+    sai_flush_block(w);
+    memset(h, 0, SAI_ZBLK_HDR);
+    sai_fwrite(w, h, w->flags & SAI_F_COMPRESS? SAI_ZBLK_HDR : SAI_BLK_HDR); // the end of the blocks
+    off = w->offset;
+    for (i = 0; i < w->n_index; ++i) {
+        const sai_index_t *idx = w->index + i;
+        sai_put_u64(h, idx->offset); sai_put_u64(h + 8, idx->first);
+        sai_put_u32(h + 16, idx->n); sai_put_u32(h + 20, idx->size);
+        sai_fwrite(w, h, SAI_IDX_SIZE);
+    }
+    sai_put_u64(h, off); sai_put_u32(h + 8, w->n_index); memcpy(h + 12, SAI_MAGIC, 4);
+    sai_fwrite(w, h, SAI_FOOT_SIZE);
+    fflush(w->fp);
+    free(w->buf); free(w->z); free(w->index);
+    free(w);
+}
+
+/********
+ * read *
+ ********/
+
+// the index at the end of the file, if it can seek there
+static void sai_read_index(sai_t *f)
+{
+    uint8_t foot[SAI_FOOT_SIZE], *buf;
+    off_t here = ftello(f->fp);
+    uint64_t off;
+    int i, n;
+    if (here < 0 || fseeko(f->fp, -SAI_FOOT_SIZE, SEEK_END) != 0) return; // a pipe
+    if (fread(foot, 1, SAI_FOOT_SIZE, f->fp) != SAI_FOOT_SIZE || memcmp(foot + 12, SAI_MAGIC, 4) != 0)
+        err_fatal(__func__, "'%s' is truncated.", f->fn);
+    off = sai_u64(foot); n = sai_u32(foot + 8);
+    buf = (uint8_t*)malloc((size_t)n * SAI_IDX_SIZE + 1);
+    if (fseeko(f->fp, off, SEEK_SET) != 0 || fread(buf, SAI_IDX_SIZE, n, f->fp) != (size_t)n)
+        err_fatal(__func__, "failed to read the index of '%s'.", f->fn);
+    f->n_index = n;
+    f->index = (sai_index_t*)calloc(n + 1, sizeof(sai_index_t));
+    for (i = 0; i < n; ++i) {
+        const uint8_t *p = buf + i * SAI_IDX_SIZE;
+        f->index[i].offset = sai_u64(p); f->index[i].first = sai_u64(p + 8);
+        f->index[i].n = sai_u32(p + 16); f->index[i].size = sai_u32(p + 20);
+    }
+    free(buf);
+    fseeko(f->fp, here, SEEK_SET);
+}
+
+sai_t *sai_open(const char *fn)
+{
+    sai_t *f = (sai_t*)calloc(1, sizeof(sai_t));
+    uint8_t h[12];
+    f->fn = strdup(fn);
+    f->fp = strcmp(fn, "-") == 0? stdin : xopen(fn, "rb");
+    if (fread(h, 1, 4, f->fp) != 4) err_fatal(__func__, "'%s' is empty.", fn);
+    if (memcmp(h, SAI_MAGIC, 4) == 0) {
+        uint32_t words[SAI_N_OPT];
+        uint8_t w[4];
+        int i, n_opt;
+        if (fread(h + 4, 1, 4, f->fp) != 4) err_fatal(__func__, "'%s' is truncated.", fn);
+        f->version = sai_u32(h + 4);
+        if (f->version < 2 || f->version > SAI_VERSION)
+            err_fatal(__func__, "'%s' is of version %d of the .sai format; this build reads up to version %d.", fn, f->version, SAI_VERSION);
+        if (f->version >= 3) {
+            if (fread(w, 1, 4, f->fp) != 4) err_fatal(__func__, "'%s' is truncated.", fn);
+            f->flags = sai_u32(w);
+            if (f->flags & ~SAI_F_COMPRESS) err_fatal(__func__, "'%s' uses unknown features (flags %#x).", fn, f->flags);
+        }
+        if (fread(h + 8, 1, 4, f->fp) != 4) err_fatal(__func__, "'%s' is truncated.", fn);
+        n_opt = sai_u32(h + 8);
+        memset(words, 0, sizeof(words));
+        for (i = 0; i < n_opt; ++i) { // options added later are skipped by older readers
+            if (fread(w, 1, 4, f->fp) != 4) err_fatal(__func__, "'%s' is truncated.", fn);
+            if (i < SAI_N_OPT) words[i] = sai_u32(w);
+        }
+        sai_words2opt(words, &f->opt);
+        f->opt.mode = (f->opt.mode & ~BWA_MODE_64BIT) | BWA_MODE_BWTINT; // positions are 64-bit in the file
+        if (f->fp != stdin) sai_read_index(f);
+    } else { // the old format starts with gap_opt_t
+        f->version = 1;
+        memcpy(&f->opt, h, 4);
+        if (fread((uint8_t*)&f->opt + 4, 1, sizeof(gap_opt_t) - 4, f->fp) != sizeof(gap_opt_t) - 4)
+            err_fatal(__func__, "'%s' is truncated.", fn);
+        bwa_check_sai_opt(&f->opt, fn);
+    }
+    return f;
+}
+
+static void sai_free_blk(sai_blk_t *b)
+{
+    free(b->data); free(b->off);
+}
+
+void sai_close(sai_t *f)
+{
+    int i;
+    if (f == 0) return;
+    for (i = 0; i < f->n_blk; ++i) sai_free_blk(f->blk + i);
+    if (f->fp != stdin) fclose(f->fp);
+    free(f->blk); free(f->index); free(f->fn);
+    free(f);
+}
+
+// set b->off[] from the records in b->data
+static void sai_scan_blk(const sai_t *f, sai_blk_t *b)
+{
+    uint32_t i, pos = 0;
+    b->off = (uint32_t*)malloc((b->n + 1) * sizeof(uint32_t));
+    for (i = 0; i < b->n; ++i) {
+        if (pos + 4 > b->size) break;
+        b->off[i] = pos;
+        pos += 4 + sai_rec_n(b->data + pos) * SAI_ALN_SIZE;
+    }
+    if (i < b->n || pos != b->size) err_fatal("sai_fetch", "corrupted block in '%s'.", f->fn);
+}
+
+// inflate z, the packed records of b, and expand them to b->data
+static void sai_unpack_blk(const sai_t *f, sai_blk_t *b, const uint8_t *z, uint32_t z_size, uint32_t raw_size)
+{
+    uint8_t *raw = (uint8_t*)malloc(raw_size + 1);
+    const uint8_t *p, *end = raw + raw_size;
+    uLongf l = raw_size;
+    size_t m = (size_t)b->n * (4 + SAI_ALN_SIZE) + 1;
+    uint8_t *q;
+    uint32_t i;
+    if (uncompress(raw, &l, z, z_size) != Z_OK || l != raw_size)
+        err_fatal("sai_fetch", "corrupted block in '%s'.", f->fn);
+    b->data = (uint8_t*)malloc(m);
+    b->size = 0;
+    for (i = 0, p = raw; i < b->n; ++i) {
+        uint64_t n_aln, x[6], k = 0;
+        int j, t;
+        if ((p = sai_get_varint(p, end, &n_aln)) == 0 || n_aln > raw_size) break;
+        if (b->size + 4 + n_aln * SAI_ALN_SIZE > m) {
+            m = b->size + 4 + n_aln * SAI_ALN_SIZE;
+            kroundup32(m);
+            b->data = (uint8_t*)realloc(b->data, m);
+        }
+        q = b->data + b->size;
+        sai_put_u32(q, n_aln); q += 4;
+        for (j = 0; j < (int)n_aln && p; ++j, q += SAI_ALN_SIZE) {
+            for (t = 0; t < 6 && p; ++t) p = sai_get_varint(p, end, &x[t]);
+            if (p == 0) break;
+            k += sai_unzigzag(x[4]);
+            q[0] = x[0]>>1; q[1] = x[1]; q[2] = x[2]; q[3] = x[0]&1;
+            sai_put_u32(q + 4, (uint32_t)sai_unzigzag(x[3]));
+            sai_put_u64(q + 8, k);
+            sai_put_u64(q + 16, k + x[5]);
+        }
+        if (p == 0) break;
+        b->size = q - b->data;
+    }
+    if (i < b->n || p != end) err_fatal("sai_fetch", "corrupted block in '%s'.", f->fn);
+    free(raw);
+}
+
+// a new block whose first read is the first-th of the file
+static sai_blk_t *sai_new_blk(sai_t *f, uint64_t first)
+{
+    sai_blk_t *b;
+    if (f->n_blk == f->m_blk) {
+        f->m_blk = f->m_blk? f->m_blk<<1 : 4;
+        f->blk = (sai_blk_t*)realloc(f->blk, f->m_blk * sizeof(sai_blk_t));
+    }
+    b = &f->blk[f->n_blk++];
+    memset(b, 0, sizeof(sai_blk_t));
+    b->first = first;
+    return b;
+}
+
+// the next block of a pipe, starting at read first; 0 at the end
+static int sai_read_blk(sai_t *f, uint64_t first)
+{
+    uint8_t h[SAI_ZBLK_HDR], *data;
+    int l_hdr = f->flags & SAI_F_COMPRESS? SAI_ZBLK_HDR : SAI_BLK_HDR;
+    sai_blk_t *b;
+    if (fread(h, 1, l_hdr, f->fp) != (size_t)l_hdr) err_fatal("sai_fetch", "'%s' is truncated.", f->fn);
+    if (sai_u32(h) == 0) return 0;
+    b = sai_new_blk(f, first);
+    b->n = sai_u32(h); b->size = sai_u32(h + 4);
+    data = (uint8_t*)malloc(b->size + 1);
+    if (fread(data, 1, b->size, f->fp) != b->size) err_fatal("sai_fetch", "'%s' is truncated.", f->fn);
+    if (f->flags & SAI_F_COMPRESS) {
+        sai_unpack_blk(f, b, data, b->size, sai_u32(h + 8));
+        free(data);
+    } else b->data = data;
+    sai_scan_blk(f, b);
+    return 1;
+}
+
+// up to n reads of the old format from read first on, re-encoded as a block; 0 at the end
+static int sai_read_blk_v1(sai_t *f, uint64_t first, uint64_t n)
+{
+    sai_writer_t w;
+    bwt_aln1_t *aln = 0;
+    int n_aln, m_aln = 0;
+    sai_blk_t *b;
+    memset(&w, 0, sizeof(sai_writer_t));
+    while (w.n < n && fread(&n_aln, 4, 1, f->fp) == 1) {
+        if (n_aln > m_aln) {
+            m_aln = n_aln;
+            aln = (bwt_aln1_t*)realloc(aln, m_aln * sizeof(bwt_aln1_t));
+        }
+        if (fread(aln, sizeof(bwt_aln1_t), n_aln, f->fp) != (size_t)n_aln)
+            err_fatal("sai_fetch", "'%s' is truncated.", f->fn);
+        sai_put_rec(&w, n_aln, aln);
+    }
+    free(aln);
+    if (w.n == 0) { free(w.buf); return 0; }
+    b = sai_new_blk(f, first);
+    b->n = w.n; b->size = w.l; b->data = w.buf;
+    sai_scan_blk(f, b);
+    return 1;
+}
+
+typedef struct {
+    const sai_t *f;
+    sai_blk_t *blk;
+    const sai_index_t *index;
+} sai_load_t;
+
+static void sai_load_worker(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
+    sai_load_t *d = (sai_load_t*)data;
+    int fd = fileno(d->f->fp);
+    for (; beg < end; ++beg) {
+        sai_blk_t *b = d->blk + beg;
+        const sai_index_t *idx = d->index + beg;
+        b->first = idx->first; b->n = idx->n; b->size = idx->size;
+        if (d->f->flags & SAI_F_COMPRESS) { // the header too, for the inflated size
+            uint8_t *z = (uint8_t*)malloc(SAI_ZBLK_HDR + b->size);
+            if (pread(fd, z, SAI_ZBLK_HDR + b->size, idx->offset) != (ssize_t)(SAI_ZBLK_HDR + b->size))
+                err_fatal("sai_fetch", "failed to read '%s'.", d->f->fn);
+            sai_unpack_blk(d->f, b, z + SAI_ZBLK_HDR, b->size, sai_u32(z + 8));
+            free(z);
+        } else {
+            b->data = (uint8_t*)malloc(b->size + 1);
+            if (pread(fd, b->data, b->size, idx->offset + SAI_BLK_HDR) != (ssize_t)b->size)
+                err_fatal("sai_fetch", "failed to read '%s'.", d->f->fn);
+        }
+        sai_scan_blk(d->f, b);
+    }
+}
+
+void sai_fetch(sai_t *f, int n, threadpool_t *tp, const uint8_t **rec)
+{
+    uint64_t end = f->cur + n;
+    int i, k;
+    // drop the blocks before the range
+    for (i = 0; i < f->n_blk && f->blk[i].first + f->blk[i].n <= f->cur; ++i)
+        sai_free_blk(f->blk + i);
+    if (i) {
+        memmove(f->blk, f->blk + i, (f->n_blk - i) * sizeof(sai_blk_t));
+        f->n_blk -= i;
+    }
+    // load the blocks up to the end of the range
+    if (f->index) {
+        int n_new;
+        sai_load_t d;
+        for (k = f->next; k < f->n_index && f->index[k].first < end; ++k);
+        n_new = k - f->next;
+        if (n_new > 0) {
+            if (f->n_blk + n_new > f->m_blk) {
+                f->m_blk = f->n_blk + n_new;
+                f->blk = (sai_blk_t*)realloc(f->blk, f->m_blk * sizeof(sai_blk_t));
+            }
+            d.f = f; d.blk = f->blk + f->n_blk; d.index = f->index + f->next;
+            if (tp) threadpool_exec(tp, n_new, 1, sai_load_worker, &d);
+            else sai_load_worker(0, 0, n_new, &d);
+            f->n_blk += n_new; f->next = k;
+        }
+    } else {
+        while (!f->is_eof && (f->n_blk == 0 || f->blk[f->n_blk - 1].first + f->blk[f->n_blk - 1].n < end)) {
+            uint64_t last = f->n_blk? f->blk[f->n_blk - 1].first + f->blk[f->n_blk - 1].n : f->cur;
+            if (!(f->version == 1? sai_read_blk_v1(f, last, end - last) : sai_read_blk(f, last)))
+                f->is_eof = 1;
+        }
+    }
+    // point into the blocks
+    for (i = k = 0; i < n; ++i) {
+        uint64_t r = f->cur + i;
+        while (k < f->n_blk && f->blk[k].first + f->blk[k].n <= r) ++k;
+        if (k == f->n_blk || f->blk[k].first > r)
+            err_fatal("sai_fetch", "'%s' has fewer reads than the input.", f->fn);
+        rec[i] = f->blk[k].data + f->blk[k].off[r - f->blk[k].first];
+    }
+    f->cur = end;
+}
+
+void sai_get(const uint8_t *rec, int i, bwt_aln1_t *a)
+{
+    const uint8_t *p = rec + 4 + (size_t)i * SAI_ALN_SIZE;
+    uint64_t k = sai_u64(p + 8), l = sai_u64(p + 16);
+    a->n_mm = p[0]; a->n_gapo = p[1]; a->n_gape = p[2]; a->a = p[3];
+    a->score = (int32_t)sai_u32(p + 4);
+    a->k = k; a->l = l;
+    if (a->k != k || a->l != l)
+        err_fatal_simple("the .sai file needs a 64-bit build (BWA_64BIT).");
+}
+
+int sai_decode(const uint8_t *rec, bwt_aln1_t *aln)
+{
+    int i, n = sai_rec_n(rec);
+    for (i = 0; i < n; ++i) sai_get(rec, i, aln + i);
+    return n;
+}
+
+int sai_read1(sai_t *f, bwt_aln1_t **aln, int *m_aln)
+{
+    const uint8_t *rec;
+    int n;
+    // one read at a time, but a block is loaded at once
+    if (f->n_blk == 0 || f->cur >= f->blk[f->n_blk - 1].first + f->blk[f->n_blk - 1].n) {
+        if (f->is_eof || (f->index && f->next == f->n_index)) return -1;
+        if (f->index == 0 && !(f->version == 1? sai_read_blk_v1(f, f->cur, SAI_BLOCK_READS) : sai_read_blk(f, f->cur))) {
+            f->is_eof = 1;
+            return -1;
+        }
+    }
+    sai_fetch(f, 1, 0, &rec);
+    n = sai_rec_n(rec);
+    if (n > *m_aln) {
+        *m_aln = n;
+        *aln = (bwt_aln1_t*)realloc(*aln, n * sizeof(bwt_aln1_t));
+    }
+    return sai_decode(rec, *aln);
+}
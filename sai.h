@@ -0,0 +1,105 @@
+#ifndef SAI_H
+#define SAI_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bwtaln.h"
+#include "threadblock.h"
+
+/* .sai files, version 3. All integers are little-endian.
+ *
+ *   header   "BSAI", u32 version, u32 flags, u32 n_opt, n_opt u32 words of
+ *            gap_opt_t (version 2 has no flags)
+ *   blocks   u32 n_reads, u32 size, then the records of n_reads reads in
+ *            size bytes; a block with n_reads == 0 ends the list. With
+ *            SAI_F_COMPRESS, a u32 with the inflated size follows size and
+ *            the records are packed, then deflated.
+ *   index    per block: u64 offset of its header, u64 first read, u32
+ *            n_reads, u32 size
+ *   footer   u64 offset of the index, u32 number of blocks, "BSAI"
+ *
+ * A record is u32 n_aln followed by n_aln alignments of 24 bytes: u8
+ * n_mm, n_gapo, n_gape, strand, i32 score, u64 k, u64 l. Positions are
+ * 64-bit whatever bwtint_t is, so 32- and 64-bit builds share files.
+ * Packed, a record is varint n_aln and, per alignment, varints of
+ * n_mm<<1|strand, n_gapo, n_gape, zigzag score, the zigzag difference of k
+ * from the k before it in the read, and l-k. Readers unpack the blocks to
+ * the plain layout when they load them.
+ *
+ * The index is read when the file can seek. It lets sai_fetch() load the
+ * blocks of a range of reads on several threads at once; pipes are read
+ * block by block. Files of the old format, a raw gap_opt_t followed by raw
+ * bwt_aln1_t, are still read. */
+
+#define SAI_VERSION     3
+#define SAI_F_COMPRESS  0x1 // packed and deflated blocks
+#define SAI_BLOCK_READS 0x1000 // reads per block written
+#define SAI_ALN_SIZE    24 // bytes per alignment in a record
+
+typedef struct {
+    uint64_t offset, first;
+    uint32_t n, size;
+} sai_index_t;
+
+typedef struct {
+    uint64_t first;
+    uint32_t n, size;
+    uint8_t *data;
+    uint32_t *off; // off[i] is where the record of read first+i starts
+} sai_blk_t;
+
+typedef struct {
+    int version, flags;
+    gap_opt_t opt;
+    char *fn;
+    FILE *fp;
+    int n_index;
+    sai_index_t *index; // NULL for pipes and the old format
+    int next; // the next block to load
+    uint64_t cur; // the next read to fetch
+    int n_blk, m_blk;
+    sai_blk_t *blk; // loaded blocks, in order
+    int is_eof;
+} sai_t;
+
+typedef struct {
+    FILE *fp;
+    int flags;
+    uint64_t n_reads, offset;
+    uint32_t n; // reads in the block being filled
+    size_t l, m;
+    uint8_t *buf; // its records
+    size_t m_z;
+    uint8_t *z; // the deflated block
+    int n_index, m_index;
+    sai_index_t *index;
+} sai_writer_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    sai_writer_t *sai_open_w(FILE *fp, const gap_opt_t *opt, int flags);
+    void sai_write1(sai_writer_t *w, int n_aln, const bwt_aln1_t *aln);
+    void sai_close_w(sai_writer_t *w); // writes the last block and the index; does not close fp
+
+    sai_t *sai_open(const char *fn);
+    void sai_close(sai_t *f);
+    // the alignments of the next read, in *aln of capacity *m_aln; -1 at the end of the file
+    int sai_read1(sai_t *f, bwt_aln1_t **aln, int *m_aln);
+    /* the records of the next n reads in rec[]; they stay valid until the
+     * next call. tp may be NULL to load on the calling thread. */
+    void sai_fetch(sai_t *f, int n, threadpool_t *tp, const uint8_t **rec);
+    void sai_get(const uint8_t *rec, int i, bwt_aln1_t *a); // the i-th alignment of a record
+    int sai_decode(const uint8_t *rec, bwt_aln1_t *aln); // aln has room for sai_rec_n(rec)
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline int sai_rec_n(const uint8_t *rec)
+{
+    return (int)((uint32_t)rec[0] | (uint32_t)rec[1]<<8 | (uint32_t)rec[2]<<16 | (uint32_t)rec[3]<<24);
+}
+
+#endif /* SAI_H */
@@ -16,48 +16,75 @@ saiset_t *saiset_create(int n, const char **files[]) {
     int i, j;
     saiset_t *s = calloc(1, sizeof(saiset_t));
     s->count = n;
-    s->fp[0] = calloc(n, sizeof(FILE*));
-    s->fp[1] = calloc(n, sizeof(FILE*));
+    s->sai[0] = calloc(n, sizeof(sai_t*));
+    s->sai[1] = calloc(n, sizeof(sai_t*));
 
     for (i = 0; i < 2; ++i) {
         for (j = 0; j < n; ++j) {
-            if (!(s->fp[i][j] = xopen(files[j][i], "r"))) {
-                fprintf(stderr, "[saiset_create] failed to open sai file %s\n", files[j][i]);
-            }
+            s->sai[i][j] = sai_open(files[j][i]);
             /* TODO: verify opt records match! */
-            fread(&s->opt[i], sizeof(gap_opt_t), 1, s->fp[i][j]);
+            s->opt[i] = s->sai[i][j]->opt;
         }
     }
     return s;
 }
 
+saiset_t *saiset_init(int n, const gap_opt_t *opt) {
+    saiset_t *s = calloc(1, sizeof(saiset_t));
+    s->count = n;
+    s->sai[0] = calloc(n, sizeof(sai_t*));
+    s->sai[1] = calloc(n, sizeof(sai_t*));
+    s->opt[0] = s->opt[1] = *opt;
+    return s;
+}
+
 void saiset_destroy(saiset_t *s) {
     int i, j;
     for (i = 0; i < 2; ++i) {
         for (j = 0; j < s->count; ++j) {
-            fclose(s->fp[i][j]);
+            sai_close(s->sai[i][j]);
         }
-        free(s->fp[i]);
+        free(s->sai[i]);
+        free(s->rec[i]);
     }
     free(s);
 }
 
-alngrp_t *alngrp_create(const dbset_t *dbs, const saiset_t *s, int which) {
+void saiset_fetch(saiset_t *s, int n, threadpool_t *tp) {
     int i, j;
-    uint32_t count = 0;
+    s->n = n;
+    for (i = 0; i < 2; ++i) {
+        s->rec[i] = realloc(s->rec[i], (size_t)s->count * n * sizeof(uint8_t*));
+        for (j = 0; j < s->count; ++j)
+            sai_fetch(s->sai[i][j], n, tp, s->rec[i] + (size_t)j * n);
+    }
+}
+
+void saiset_attach(saiset_t *s, int n, bwa_seq_t *seqs[2]) {
+    s->n = n;
+    s->seqs[0] = seqs[0];
+    s->seqs[1] = seqs[1];
+}
+
+alngrp_t *alngrp_create(const dbset_t *dbs, const saiset_t *s, int which, int idx) {
+    int i, j, off = 0;
     alngrp_t *ag = (alngrp_t*)calloc(1, sizeof(alngrp_t));
     int best_score;
 
     for (i = 0; i < s->count; ++i) {
-        fread(&count, 4, 1, s->fp[which][i]);
+        const bwa_seq_t *p = s->seqs[which]? s->seqs[which] + idx : 0;
+        const uint8_t *rec = p? 0 : s->rec[which][(size_t)i * s->n + idx];
+        int count = p? (s->count > 1? p->n_aln_db[i] : p->n_aln) : sai_rec_n(rec);
         kv_resize(alignment_t, *ag, ag->n+count);
         for (j = 0; j < count; ++j) {
-            fread(&ag->a[ag->n].aln, sizeof(bwt_aln1_t), 1, s->fp[which][i]);
+            if (p) ag->a[ag->n].aln = p->aln[off + j];
+            else sai_get(rec, j, &ag->a[ag->n].aln);
             ag->a[ag->n].db = dbs->db[i];
             ag->a[ag->n].dbidx = i;
             ag->a[ag->n].remapped = 0;
             ++ag->n;
         }
+        off += count;
     }
 
     /* only need to do this if we have multiple sai streams */
@@ -95,11 +122,11 @@ void select_sai(const alngrp_t *ag, bwa_seq_t *s, int *main_idx) {
         for (i = cnt = 0; i < ag->n; ++i) {
             const bwt_aln1_t *p = &ag->a[i].aln;
             if (p->score > best) break;
-            if (drand48() * (p->l - p->k + 1 + cnt) > (double)cnt) {
+            if (bwa_rng_drand(&s->rng) * (p->l - p->k + 1 + cnt) > (double)cnt) {
                 *main_idx = i;
                 s->n_mm = p->n_mm; s->n_gapo = p->n_gapo; s->n_gape = p->n_gape; s->strand = p->a;
                 s->score = p->score;
-                s->sa = p->k + (bwtint_t)((p->l - p->k + 1) * drand48());
+                s->sa = p->k + (bwtint_t)((p->l - p->k + 1) * bwa_rng_drand(&s->rng));
             }
             cnt += p->l - p->k + 1;
         }
@@ -116,7 +143,6 @@ void select_sai_multi(const alngrp_t *ag, bwa_seq_t *s, int n_multi) {
         const bwt_aln1_t *q = &ag->a[k].aln ;
         n_occ += q->l - q->k + 1;
     }
-    if (s->multi) free(s->multi); 
     if (n_occ > n_multi + 1) { // if there are too many hits, generate none of them
         s->multi = 0; s->n_multi = 0;
         return;
@@ -126,7 +152,7 @@ void select_sai_multi(const alngrp_t *ag, bwa_seq_t *s, int n_multi) {
      * simply output all hits, but the following samples "rest"
      * number of random hits. */
     rest = n_occ > n_multi + 1? n_multi + 1 : n_occ; // find one additional for ->sa
-    s->multi = calloc(rest, sizeof(bwt_multi1_t));
+    s->multi = bwa_arena_calloc(s->arena, rest, sizeof(bwt_multi1_t));
     for (k = 0; k < ag->n; ++k) {
         const bwtdb_t *db = ag->a[k].db;
         const bwt_aln1_t *q = &ag->a[k].aln;
@@ -142,7 +168,7 @@ void select_sai_multi(const alngrp_t *ag, bwa_seq_t *s, int n_multi) {
         } else { // Random sampling (http://code.activestate.com/recipes/272884/). In fact, we never come here. 
             int j, i, k;
             for (j = rest, i = q->l - q->k + 1, k = 0; j > 0; --j) {
-                double p = 1.0, x = drand48();
+                double p = 1.0, x = bwa_rng_drand(&s->rng);
                 while (x < p) p -= p * j / (i--);
                 s->multi[z].pos = bwtdb_sa2seq(db, q->a, q->l-1, s->len);
                 s->multi[z].gap = q->n_gapo + q->n_gape;
@@ -6,6 +6,8 @@
 #include "bwtaln.h"
 #include "kvec.h"
 #include "dbset.h"
+#include "sai.h"
+#include "threadblock.h"
 
 typedef struct {
     bwt_aln1_t aln;
@@ -17,8 +19,10 @@ typedef struct {
 typedef kvec_t(alignment_t) alngrp_t;
 
 typedef struct {
-    int count;
-    FILE **fp[2];
+    int count, n;
+    sai_t **sai[2];
+    const uint8_t **rec[2]; // rec[which][j*n+i] is read i of the last fetch in file j
+    bwa_seq_t *seqs[2]; // without files, the reads aligned in this process
     gap_opt_t opt[2];
 } saiset_t;
 
@@ -27,9 +31,16 @@ extern "C" {
 #endif
 
     saiset_t *saiset_create(int n, const char **files[]);
+    // a set without files, fed by saiset_attach() with reads aligned against n databases
+    saiset_t *saiset_init(int n, const gap_opt_t *opt);
     void saiset_destroy(saiset_t *saiset);
 
-    alngrp_t *alngrp_create(const dbset_t *dbs, const saiset_t *saiset, int which);
+    // make the records of the next n reads of both ends available to alngrp_create()
+    void saiset_fetch(saiset_t *saiset, int n, threadpool_t *tp);
+    // use the alignments in seqs[which][i].aln, as left by bwa_aln_seqs(), instead
+    void saiset_attach(saiset_t *saiset, int n, bwa_seq_t *seqs[2]);
+    // the alignments of read i of the last fetch against all databases; safe to call from several threads
+    alngrp_t *alngrp_create(const dbset_t *dbs, const saiset_t *saiset, int which, int i);
     void alngrp_destroy(alngrp_t *ag);
 
     void select_sai(const alngrp_t *aln, bwa_seq_t *s, int *main_idx);
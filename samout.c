@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "samout.h"
+#include "bamlite.h"
+#include "kstring.h"
+#include "khash.h"
+#include "utils.h"
+
+KHASH_MAP_INIT_STR(tid, int)
+
+#define SAMOUT_BUF_SIZE 0x100000 // records are written out in chunks of about this size
+
+struct __samout_t {
+	int is_bam, is_buffer;
+	kstring_t buf; // records not written yet, as SAM text or BAM bytes
+	kstring_t tmp; // see samout_tmp()
+	// BAM
+	bamFile fp;
+	bam1_t *b;
+	khash_t(tid) *tid; // shared with buffers
+	bam_header_t *h;
+	const char *last_rname; // most records name the same reference as the last one
+	int last_tid;
+};
+
+samout_t *samout_open(const char *fn, int is_bam, int n_threads)
+{
+	samout_t *o = (samout_t*)calloc(1, sizeof(samout_t));
+	o->is_bam = is_bam;
+	if (is_bam) {
+		o->fp = bam_open_w(fn, n_threads);
+		o->b = bam_init1();
+		o->tid = kh_init(tid);
+	} else if (strcmp(fn, "-") != 0) xreopen(fn, "w", stdout);
+	return o;
+}
+
+samout_t *samout_buffer(const samout_t *o)
+{
+	samout_t *b = (samout_t*)calloc(1, sizeof(samout_t));
+	b->is_bam = o->is_bam;
+	b->is_buffer = 1;
+	if (b->is_bam) {
+		b->b = bam_init1();
+		b->tid = o->tid;
+	}
+	return b;
+}
+
+static void samout_write(samout_t *o, kstring_t *s)
+{
+	if (s->l == 0) return;
+	if (o->is_bam) bam_write(o->fp, s->s, s->l);
+	else if (fwrite(s->s, 1, s->l, stdout) != s->l)
+		err_fatal_simple("failed to write SAM output.");
+	s->l = 0;
+}
+
+void samout_append(samout_t *o, samout_t *b)
+{
+	samout_write(o, &o->buf);
+	samout_write(o, &b->buf);
+}
+
+void samout_close(samout_t *o)
+{
+	if (o == 0) return;
+	if (!o->is_buffer) samout_write(o, &o->buf);
+	if (o->is_bam) {
+		bam_destroy1(o->b);
+		if (!o->is_buffer) {
+			bam_close(o->fp);
+			kh_destroy(tid, o->tid);
+			bam_header_destroy(o->h);
+		}
+	} else if (!o->is_buffer) fflush(stdout);
+	free(o->buf.s); free(o->tmp.s);
+	free(o);
+}
+
+kstring_t *samout_tmp(samout_t *o)
+{
+	o->tmp.l = 0;
+	if (o->tmp.s) o->tmp.s[0] = 0;
+	return &o->tmp;
+}
+
+void samout_header(samout_t *o, const char *text)
+{
+	const char *p, *q;
+	bam_header_t *h;
+	int i;
+	if (!o->is_bam) {
+		kputs(text, &o->buf);
+		samout_write(o, &o->buf);
+		return;
+	}
+	o->h = h = bam_header_init();
+	h->l_text = strlen(text);
+	h->text = strdup(text);
+	for (p = text; *p; p = *q? q + 1 : q) {
+		const char *sn, *ln;
+		q = strchr(p, '\n');
+		if (q == 0) q = p + strlen(p);
+		if (strncmp(p, "@SQ\t", 4) != 0) continue;
+		for (sn = p; sn < q && strncmp(sn, "\tSN:", 4) != 0; ++sn);
+		for (ln = p; ln < q && strncmp(ln, "\tLN:", 4) != 0; ++ln);
+		if (sn == q || ln == q) err_fatal(__func__, "@SQ line without SN or LN.");
+		h->target_name = (char**)realloc(h->target_name, sizeof(char*) * (h->n_targets + 1));
+		h->target_len = (uint32_t*)realloc(h->target_len, sizeof(uint32_t) * (h->n_targets + 1));
+		sn += 4;
+		h->target_name[h->n_targets] = strndup(sn, strcspn(sn, "\t\n"));
+		h->target_len[h->n_targets] = strtoul(ln + 4, 0, 10);
+		++h->n_targets;
+	}
+	for (i = 0; i < h->n_targets; ++i) {
+		int absent;
+		khint_t k = kh_put(tid, o->tid, h->target_name[i], &absent);
+		if (absent) kh_val(o->tid, k) = i; // the first of duplicated names wins
+	}
+	bam_header_write(o->fp, h);
+}
+
+static int samout_tid(samout_t *o, const char *rname)
+{
+	khint_t k;
+	if (rname == o->last_rname) return o->last_tid;
+	if (strcmp(rname, "*") == 0) return -1;
+	k = kh_get(tid, o->tid, rname);
+	if (k == kh_end(o->tid)) err_fatal(__func__, "reference '%s' is not in the header.", rname);
+	o->last_rname = rname;
+	return o->last_tid = kh_val(o->tid, k);
+}
+
+static inline void samout_put(bam1_t *b, const void *data, int len)
+{
+	if (b->data_len + len > b->m_data) {
+		b->m_data = b->data_len + len;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+	}
+	memcpy(b->data + b->data_len, data, len);
+	b->data_len += len;
+}
+
+void samout_begin(samout_t *o, const char *qname, int flag, const char *rname, int pos, int mapq)
+{
+	if (o->is_bam) {
+		bam1_core_t *c = &o->b->core;
+		memset(c, 0, sizeof(bam1_core_t));
+		o->b->data_len = 0;
+		c->tid = samout_tid(o, rname);
+		c->pos = pos - 1;
+		c->qual = mapq;
+		c->flag = flag;
+		c->l_qname = strlen(qname) + 1;
+		samout_put(o->b, qname, c->l_qname);
+	} else {
+		kstring_t *s = &o->buf;
+		kputs(qname, s); kputc('\t', s);
+		kputw(flag, s); kputc('\t', s);
+		kputs(rname, s); kputc('\t', s);
+		kputw(pos, s); kputc('\t', s);
+		kputw(mapq, s); kputc('\t', s);
+	}
+}
+
+void samout_cigar(samout_t *o, int n_cigar, const bwa_cigar_t *cigar)
+{
+	int i;
+	if (o->is_bam) {
+		static const int bam_op[] = { BAM_CMATCH, BAM_CINS, BAM_CDEL, BAM_CSOFT_CLIP, BAM_CREF_SKIP };
+		for (i = 0; i < n_cigar; ++i) {
+			uint32_t x = __cigar_len(cigar[i]) << BAM_CIGAR_SHIFT | bam_op[__cigar_op(cigar[i])];
+			samout_put(o->b, &x, 4);
+		}
+		o->b->core.n_cigar = n_cigar;
+	} else if (n_cigar == 0) kputc('*', &o->buf);
+	else {
+		for (i = 0; i < n_cigar; ++i) {
+			kputw(__cigar_len(cigar[i]), &o->buf);
+			kputc("MIDSN"[__cigar_op(cigar[i])], &o->buf);
+		}
+	}
+}
+
+void samout_mate(samout_t *o, const char *rname, int pos, int64_t isize)
+{
+	if (o->is_bam) {
+		bam1_core_t *c = &o->b->core;
+		c->mtid = strcmp(rname, "=") == 0? c->tid : samout_tid(o, rname);
+		c->mpos = pos - 1;
+		c->isize = isize;
+	} else {
+		kstring_t *s = &o->buf;
+		kputc('\t', s); kputs(rname, s);
+		kputc('\t', s); kputw(pos, s);
+		kputc('\t', s); kputl(isize, s);
+		kputc('\t', s);
+	}
+}
+
+void samout_seq(samout_t *o, int len, const ubyte_t *seq, int is_rev, const char *qual)
+{
+	int i;
+	if (o->is_bam) {
+		static const uint8_t nt16[] = { 1, 2, 4, 8, 15 };
+		bam1_t *b = o->b;
+		int l_qual = qual? strlen(qual) : 0;
+		uint8_t *s;
+		b->core.l_qseq = len;
+		if (b->data_len + (len + 1)/2 + len > b->m_data) {
+			b->m_data = b->data_len + (len + 1)/2 + len;
+			kroundup32(b->m_data);
+			b->data = (uint8_t*)realloc(b->data, b->m_data);
+		}
+		s = b->data + b->data_len;
+		memset(s, 0, (len + 1)/2);
+		for (i = 0; i < len; ++i) {
+			int c = is_rev? (seq[len - 1 - i] > 3? 4 : 3 - seq[len - 1 - i]) : seq[i];
+			s[i>>1] |= nt16[c > 4? 4 : c] << ((~i&1)<<2);
+		}
+		s += (len + 1)/2;
+		for (i = 0; i < len; ++i) s[i] = l_qual >= len? qual[i] - 33 : 0xff;
+		b->data_len += (len + 1)/2 + len;
+	} else {
+		kstring_t *s = &o->buf;
+		char *p;
+		if (s->l + len + 2 >= s->m) {
+			s->m = s->l + len + 2;
+			kroundup32(s->m);
+			s->s = (char*)realloc(s->s, s->m);
+		}
+		p = s->s + s->l;
+		if (is_rev) for (i = 0; i < len; ++i) p[i] = "TGCAN"[seq[len - 1 - i]];
+		else for (i = 0; i < len; ++i) p[i] = "ACGTN"[seq[i]];
+		s->l += len;
+		kputc('\t', s);
+		if (qual) kputs(qual, &o->buf);
+		else kputc('*', &o->buf);
+	}
+}
+
+void samout_tag_A(samout_t *o, const char tag[2], char c)
+{
+	if (o->is_bam) {
+		uint8_t x[4];
+		x[0] = tag[0]; x[1] = tag[1]; x[2] = 'A'; x[3] = c;
+		samout_put(o->b, x, 4);
+	} else {
+		char x[6];
+		x[0] = '\t'; x[1] = tag[0]; x[2] = tag[1]; x[3] = ':'; x[4] = 'A'; x[5] = ':';
+		kputsn(x, 6, &o->buf);
+		kputc(c, &o->buf);
+	}
+}
+
+void samout_tag_i(samout_t *o, const char tag[2], int64_t v)
+{
+	if (o->is_bam) { // the smallest type that holds v, as samtools does
+		uint8_t x[3];
+		x[0] = tag[0]; x[1] = tag[1];
+		if (v < 0) {
+			if (v >= -128) {
+				int8_t y = v;
+				x[2] = 'c'; samout_put(o->b, x, 3); samout_put(o->b, &y, 1);
+			} else if (v >= -32768) {
+				int16_t y = v;
+				x[2] = 's'; samout_put(o->b, x, 3); samout_put(o->b, &y, 2);
+			} else {
+				int32_t y = v;
+				x[2] = 'i'; samout_put(o->b, x, 3); samout_put(o->b, &y, 4);
+			}
+		} else {
+			if (v <= 255) {
+				uint8_t y = v;
+				x[2] = 'C'; samout_put(o->b, x, 3); samout_put(o->b, &y, 1);
+			} else if (v <= 65535) {
+				uint16_t y = v;
+				x[2] = 'S'; samout_put(o->b, x, 3); samout_put(o->b, &y, 2);
+			} else {
+				uint32_t y = v;
+				x[2] = 'I'; samout_put(o->b, x, 3); samout_put(o->b, &y, 4);
+			}
+		}
+	} else {
+		char x[6];
+		x[0] = '\t'; x[1] = tag[0]; x[2] = tag[1]; x[3] = ':'; x[4] = 'i'; x[5] = ':';
+		kputsn(x, 6, &o->buf);
+		kputl(v, &o->buf);
+	}
+}
+
+void samout_tag_Z(samout_t *o, const char tag[2], const char *s)
+{
+	if (o->is_bam) {
+		uint8_t x[3];
+		x[0] = tag[0]; x[1] = tag[1]; x[2] = 'Z';
+		samout_put(o->b, x, 3);
+		samout_put(o->b, s, strlen(s) + 1);
+	} else {
+		char x[6];
+		x[0] = '\t'; x[1] = tag[0]; x[2] = tag[1]; x[3] = ':'; x[4] = 'Z'; x[5] = ':';
+		kputsn(x, 6, &o->buf);
+		kputs(s, &o->buf);
+	}
+}
+
+void samout_end(samout_t *o)
+{
+	if (o->is_bam) {
+		bam1_t *b = o->b;
+		bam1_core_t *c = &b->core;
+		const uint8_t *cigar = (const uint8_t*)bam1_cigar(b);
+		uint32_t end = c->pos, i, x;
+		for (i = 0; i < c->n_cigar; ++i) {
+			int op;
+			memcpy(&x, cigar + i * 4, 4); // the CIGAR follows the read name and need not be 4-byte aligned
+			op = x & BAM_CIGAR_MASK;
+			if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP)
+				end += x >> BAM_CIGAR_SHIFT;
+		}
+		if (end == (uint32_t)c->pos) ++end;
+		c->bin = c->pos < 0? 4680 : bam_reg2bin(c->pos, end);
+		b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq + 1)/2;
+		bam_encode1(b, &o->buf);
+	} else kputc('\n', &o->buf);
+	if (!o->is_buffer && o->buf.l >= SAMOUT_BUF_SIZE) samout_write(o, &o->buf);
+}
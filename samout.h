@@ -0,0 +1,48 @@
+#ifndef BWA_SAMOUT_H
+#define BWA_SAMOUT_H
+
+#include <stdint.h>
+#include "bwtaln.h"
+#include "kstring.h"
+
+/* Alignment output in SAM or BAM. A record is built by samout_begin(),
+ * samout_cigar(), samout_mate() and samout_seq(), in this order, then any
+ * number of samout_tag_*() and finally samout_end(). Records are formatted
+ * into a buffer that is written out in large chunks; BAM is compressed on
+ * n_threads threads.
+ *
+ * Threads format records into their own buffers from samout_buffer(),
+ * which are written out, in whatever order the caller wants, with
+ * samout_append(). */
+typedef struct __samout_t samout_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	samout_t *samout_open(const char *fn, int is_bam, int n_threads); // "-" for stdout
+	void samout_close(samout_t *o);
+	// the @SQ lines in text are the references of BAM records, in that order
+	void samout_header(samout_t *o, const char *text);
+	// a buffer that formats records like o; create it after samout_header() and close it before o
+	samout_t *samout_buffer(const samout_t *o);
+	void samout_append(samout_t *o, samout_t *b); // write out and empty b
+	// an empty string owned by o for building tag values; valid until the next call
+	kstring_t *samout_tmp(samout_t *o);
+
+	// rname is "*" and pos 0 for an unplaced read; pos is 1-based
+	void samout_begin(samout_t *o, const char *qname, int flag, const char *rname, int pos, int mapq);
+	void samout_cigar(samout_t *o, int n_cigar, const bwa_cigar_t *cigar); // "*" if n_cigar is 0
+	void samout_mate(samout_t *o, const char *rname, int pos, int64_t isize); // rname may be "="
+	// seq[] is in 0-4; is_rev outputs its reverse complement. qual is printable, or NULL for "*"
+	void samout_seq(samout_t *o, int len, const ubyte_t *seq, int is_rev, const char *qual);
+	void samout_tag_A(samout_t *o, const char tag[2], char c);
+	void samout_tag_i(samout_t *o, const char tag[2], int64_t v);
+	void samout_tag_Z(samout_t *o, const char tag[2], const char *s);
+	void samout_end(samout_t *o);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
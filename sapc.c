@@ -0,0 +1,348 @@
+#include "sapc.h"
+
+#include "sai.h"
+#include "rng.h"
+#include "khash.h"
+#include "threadblock.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define SAPC_MAGIC "BSPC"
+#define SAPC_HDR_BYTES 32
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t fingerprint, n_intv, n_sa;
+} sapc_hdr_t;
+
+/* The fingerprint covers the lengths, primaries and C() of both BWTs, and
+ * every one of their characters; it reads the BWT words through bwt_bwt(),
+ * past the interleaved Occ counts, so updating the index with bwtupdate
+ * keeps the cache valid. It costs one pass over the BWTs, at open and at
+ * write time. */
+uint64_t sapc_fingerprint(const bwt_t *const bwt[2]) {
+    uint64_t h = bwa_rng_mix(SAPC_VERSION);
+    bwtint_t k;
+    int i, j;
+    for (i = 0; i < 2; ++i) {
+        const bwt_t *b = bwt[i];
+        h = bwa_rng_mix(h ^ b->seq_len);
+        h = bwa_rng_mix(h ^ b->primary);
+        for (j = 1; j < 5; ++j)
+            h = bwa_rng_mix(h ^ b->L2[j]);
+        for (k = 0; k < b->seq_len; k += 16) {
+            uint32_t w = bwt_bwt(b, k);
+            if (b->seq_len - k < 16) w &= ~0u << ((16 - (b->seq_len - k)) << 1); // the unused tail of the last word
+            h = bwa_rng_mix(h ^ w);
+        }
+    }
+    return h;
+}
+
+static int intv_cmp(uint32_t a, uint64_t k, uint64_t l, const sapc_intv_t *p) {
+    if (a != p->a) return a < p->a? -1 : 1;
+    if (k != p->k) return k < p->k? -1 : 1;
+    if (l != p->l) return l < p->l? -1 : 1;
+    return 0;
+}
+
+// the index of interval (a,k,l) in the cache, or -1
+static int64_t sapc_find(const sapc_t *pc, uint32_t a, uint64_t k, uint64_t l) {
+    int64_t left = 0, right = pc->n_intv;
+    while (left < right) {
+        int64_t mid = (left + right) >> 1;
+        int c = intv_cmp(a, k, l, &pc->intv[mid]);
+        if (c == 0) return mid;
+        if (c < 0) right = mid;
+        else left = mid + 1;
+    }
+    return -1;
+}
+
+sapc_t *sapc_open(const char *prefix, const bwt_t *const bwt[2]) {
+    char path[PATH_MAX];
+    struct stat st;
+    const sapc_hdr_t *hdr;
+    sapc_t *pc;
+    void *p;
+    int fd;
+
+    strcat(strcpy(path, prefix), ".sapc");
+    if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+    if (fstat(fd, &st) < 0) err_fatal(__func__, "fail to stat file '%s'.", path);
+    if (st.st_size < SAPC_HDR_BYTES) err_fatal(__func__, "file '%s' is truncated.", path);
+    p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) err_fatal(__func__, "fail to map file '%s'.", path);
+
+    hdr = (const sapc_hdr_t*)p;
+    if (memcmp(hdr->magic, SAPC_MAGIC, 4) != 0 || hdr->version != SAPC_VERSION)
+        err_fatal(__func__, "'%s' is not a version %d SA cache.", path, SAPC_VERSION);
+    if ((uint64_t)st.st_size != SAPC_HDR_BYTES + hdr->n_intv * sizeof(sapc_intv_t) + hdr->n_sa * sizeof(uint64_t))
+        err_fatal(__func__, "file '%s' is truncated.", path);
+    if (hdr->fingerprint != sapc_fingerprint(bwt)) {
+        fprintf(stderr, "[%s] '%s' was built for another index; ignored.\n", __func__, path);
+        munmap(p, st.st_size);
+        return NULL;
+    }
+
+    pc = (sapc_t*)calloc(1, sizeof(sapc_t));
+    pc->fn = strdup(path);
+    pc->seq_len = bwt[1]->seq_len;
+    pc->fingerprint = hdr->fingerprint;
+    pc->n_intv = hdr->n_intv;
+    pc->n_sa = hdr->n_sa;
+    pc->intv = (const sapc_intv_t*)((const uint8_t*)p + SAPC_HDR_BYTES);
+    pc->sa = (const uint64_t*)(pc->intv + pc->n_intv);
+    pc->mm = p;
+    pc->mm_len = st.st_size;
+    fprintf(stderr, "[%s] %llu intervals, %.1f MB of SA values in '%s'\n", __func__,
+            (unsigned long long)pc->n_intv, pc->n_sa * 8.0 / 1048576.0, path);
+    return pc;
+}
+
+void sapc_close(sapc_t *pc) {
+    if (pc == NULL) return;
+    if (pc->n_hits)
+        fprintf(stderr, "[%s] %llu lookups answered by '%s'\n", __func__, (unsigned long long)pc->n_hits, pc->fn);
+    munmap(pc->mm, pc->mm_len);
+    free(pc->fn);
+    free(pc);
+}
+
+int sapc_get(sapc_t *pc, uint64_t offset, const bwt_aln1_t *a, uint32_t seqlen, poslist_t *pos) {
+    const sapc_intv_t *p;
+    const uint64_t *sa;
+    int64_t i = sapc_find(pc, a->a, a->k, a->l);
+    uint64_t j;
+    if (i < 0) return 0;
+    p = &pc->intv[i];
+    sa = pc->sa + p->off;
+    pos->n = p->l - p->k + 1;
+    if (pos->n > pos->m) {
+        pos->m = pos->n;
+        pos->a = (uint64_t*)realloc(pos->a, pos->m * sizeof(uint64_t));
+    }
+    for (j = 0; j < pos->n; ++j)
+        pos->a[j] = offset + (a->a? sa[j] : pc->seq_len - (sa[j] + seqlen));
+    __sync_fetch_and_add(&pc->n_hits, 1);
+    return 1;
+}
+
+/* `bwa sapc': count the wide intervals hit in .sai files and keep the SA
+ * values of those that save the most LF steps, count times width, within
+ * the budget. Intervals already in the cache stay, so running it again on
+ * new .sai files warms the cache. */
+
+typedef struct {
+    uint64_t k, l;
+    uint32_t a;
+} sapc_key_t;
+
+#define sapc_key_hash(x) kh_int64_hash_func((x).k<<32 ^ (x).l ^ (uint64_t)(x).a<<63)
+#define sapc_key_equal(x, y) ((x).k == (y).k && (x).l == (y).l && (x).a == (y).a)
+KHASH_INIT(sapc, sapc_key_t, uint64_t, 1, sapc_key_hash, sapc_key_equal)
+
+#define SAPC_KEEP UINT64_MAX // the count of an interval already in the cache
+
+typedef struct {
+    sapc_intv_t intv;
+    uint64_t score;
+} sapc_cand_t;
+
+typedef struct {
+    const bwt_t *const *bwt;
+    const sapc_t *old;
+    const sapc_intv_t *intv;
+    uint64_t *sa;
+} sapc_fill_t;
+
+static void sapc_fill(uint32_t tid, uint32_t beg, uint32_t end, void *data) {
+    sapc_fill_t *f = (sapc_fill_t*)data;
+    uint32_t i;
+    for (i = beg; i < end; ++i) {
+        const sapc_intv_t *p = &f->intv[i];
+        uint64_t *sa = f->sa + p->off, j, n = p->l - p->k + 1;
+        int64_t o = f->old? sapc_find(f->old, p->a, p->k, p->l) : -1;
+        if (o >= 0) {
+            memcpy(sa, f->old->sa + f->old->intv[o].off, n * sizeof(uint64_t));
+            continue;
+        }
+        for (j = 0; j < n; ++j)
+            sa[j] = bwt_sa(p->a? f->bwt[0] : f->bwt[1], p->k + j);
+    }
+}
+
+static int cand_score_gt(const void *x, const void *y) {
+    const sapc_cand_t *a = (const sapc_cand_t*)x, *b = (const sapc_cand_t*)y;
+    return a->score > b->score? -1 : a->score < b->score? 1 : 0;
+}
+
+static int cand_intv_lt(const void *x, const void *y) {
+    const sapc_intv_t *a = &((const sapc_cand_t*)x)->intv, *b = &((const sapc_cand_t*)y)->intv;
+    return intv_cmp(a->a, a->k, a->l, b);
+}
+
+static bwt_t *sapc_load_bwt(const char *prefix, const char *bwt_suffix, const char *sa_suffix) {
+    char path[PATH_MAX];
+    bwt_t *bwt;
+    strcat(strcpy(path, prefix), bwt_suffix);
+    bwt = bwt_restore_bwt_core(path, 0);
+    strcat(strcpy(path, prefix), sa_suffix);
+    bwt_restore_sa_core(path, bwt, 0);
+    return bwt;
+}
+
+static void sapc_write(const char *fn, uint64_t fingerprint, uint64_t n_intv, const sapc_intv_t *intv, uint64_t n_sa, const uint64_t *sa) {
+    sapc_hdr_t hdr;
+    FILE *fp = xopen(fn, "wb");
+    memcpy(hdr.magic, SAPC_MAGIC, 4);
+    hdr.version = SAPC_VERSION;
+    hdr.fingerprint = fingerprint;
+    hdr.n_intv = n_intv;
+    hdr.n_sa = n_sa;
+    fwrite(&hdr, SAPC_HDR_BYTES, 1, fp);
+    fwrite(intv, sizeof(sapc_intv_t), n_intv, fp);
+    fwrite(sa, sizeof(uint64_t), n_sa, fp);
+    if (ferror(fp) | fclose(fp)) err_fatal(__func__, "fail to write file '%s'.", fn);
+}
+
+int bwa_sapc(int argc, char *argv[]) {
+    int c, i, n_threads = 1;
+    uint64_t max_bytes = 1ull<<30, min_width = MIN_HASH_WIDTH, n_reads = 0, n_hits = 0, n_cand, n_intv, n_sa, bytes, j;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    const char *prefix;
+    bwt_t *bwt[2];
+    sapc_t *old;
+    kh_sapc_t *h;
+    khint_t k;
+    sapc_cand_t *cand;
+    sapc_intv_t *intv;
+    uint64_t *sa;
+    sapc_fill_t f;
+    threadpool_t *tp;
+
+    while ((c = getopt(argc, argv, "m:w:t:")) >= 0) {
+        switch (c) {
+        case 'm':
+            if ((max_bytes = bwa_parse_size(optarg)) == 0)
+                err_fatal(__func__, "invalid cache size '%s'.", optarg);
+            break;
+        case 'w': min_width = atol(optarg); break;
+        case 't': n_threads = atoi(optarg); break;
+        default: return 1;
+        }
+    }
+    if (optind + 2 > argc) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Usage:   bwa sapc [options] <prefix> <in.sai> [...]\n\n");
+        fprintf(stderr, "Options: -m SIZE  size of the cache, with an optional K, M or G suffix [1G]\n");
+        fprintf(stderr, "         -w INT   only cache intervals of at least INT positions [%llu]\n", (unsigned long long)min_width);
+        fprintf(stderr, "         -t INT   number of threads [%d]\n\n", n_threads);
+        fprintf(stderr, "Builds <prefix>.sapc, which sampe and alnpe use to skip the BWT walks of\n");
+        fprintf(stderr, "the repeat intervals hit most often in the .sai files. Intervals already in\n");
+        fprintf(stderr, "the file are kept.\n\n");
+        return 1;
+    }
+    if (min_width < MIN_HASH_WIDTH) {
+        fprintf(stderr, "[%s] sampe does not look up intervals of fewer than %d positions in the cache; -w raised to %d.\n",
+                __func__, MIN_HASH_WIDTH, MIN_HASH_WIDTH);
+        min_width = MIN_HASH_WIDTH;
+    }
+    prefix = argv[optind];
+
+    bwt[0] = sapc_load_bwt(prefix, ".bwt", ".sa");
+    bwt[1] = sapc_load_bwt(prefix, ".rbwt", ".rsa");
+    old = sapc_open(prefix, (const bwt_t *const*)bwt);
+
+    h = kh_init(sapc);
+    if (old) {
+        for (j = 0; j < old->n_intv; ++j) {
+            sapc_key_t key;
+            int ret;
+            key.k = old->intv[j].k; key.l = old->intv[j].l; key.a = old->intv[j].a;
+            k = kh_put(sapc, h, key, &ret);
+            kh_val(h, k) = SAPC_KEEP;
+        }
+    }
+    for (i = optind + 1; i < argc; ++i) {
+        sai_t *fp = sai_open(argv[i]);
+        bwt_aln1_t *aln = 0;
+        int m_aln = 0, n_aln, a;
+        while ((n_aln = sai_read1(fp, &aln, &m_aln)) >= 0) {
+            ++n_reads;
+            for (a = 0; a < n_aln; ++a) {
+                sapc_key_t key;
+                int ret;
+                if (aln[a].l - aln[a].k + 1 < min_width) continue;
+                key.k = aln[a].k; key.l = aln[a].l; key.a = aln[a].a;
+                k = kh_put(sapc, h, key, &ret);
+                if (ret) kh_val(h, k) = 0;
+                if (kh_val(h, k) != SAPC_KEEP) ++kh_val(h, k);
+                ++n_hits;
+            }
+        }
+        free(aln);
+        sai_close(fp);
+    }
+    fprintf(stderr, "[%s] %llu reads; %llu hits to %llu intervals of at least %llu positions\n", __func__,
+            (unsigned long long)n_reads, (unsigned long long)n_hits, (unsigned long long)kh_size(h), (unsigned long long)min_width);
+
+    // rank by the LF steps saved and fill the budget; the old intervals come first
+    cand = (sapc_cand_t*)calloc(kh_size(h) + 1, sizeof(sapc_cand_t));
+    for (k = kh_begin(h), n_cand = 0; k != kh_end(h); ++k) {
+        sapc_cand_t *p;
+        if (!kh_exist(h, k)) continue;
+        p = &cand[n_cand++];
+        p->intv.k = kh_key(h, k).k; p->intv.l = kh_key(h, k).l; p->intv.a = kh_key(h, k).a;
+        p->score = kh_val(h, k) == SAPC_KEEP? SAPC_KEEP : kh_val(h, k) * (p->intv.l - p->intv.k + 1);
+    }
+    kh_destroy(sapc, h);
+    qsort(cand, n_cand, sizeof(sapc_cand_t), cand_score_gt);
+    for (j = 0, n_intv = bytes = 0; j < n_cand; ++j) {
+        uint64_t cost = sizeof(sapc_intv_t) + (cand[j].intv.l - cand[j].intv.k + 1) * sizeof(uint64_t);
+        if (bytes + cost > max_bytes) continue;
+        bytes += cost;
+        cand[n_intv++] = cand[j];
+    }
+    qsort(cand, n_intv, sizeof(sapc_cand_t), cand_intv_lt);
+    intv = (sapc_intv_t*)calloc(n_intv + 1, sizeof(sapc_intv_t));
+    for (j = 0, n_sa = 0; j < n_intv; ++j) {
+        intv[j] = cand[j].intv;
+        intv[j].off = n_sa;
+        n_sa += intv[j].l - intv[j].k + 1;
+    }
+    free(cand);
+
+    sa = (uint64_t*)malloc((n_sa + 1) * sizeof(uint64_t));
+    f.bwt = (const bwt_t *const*)bwt;
+    f.old = old;
+    f.intv = intv;
+    f.sa = sa;
+    tp = threadpool_create(n_threads > 0? n_threads : 1);
+    threadpool_exec(tp, n_intv, 1, sapc_fill, &f);
+    threadpool_destroy(tp);
+
+    strcat(strcpy(path, prefix), ".sapc");
+    strcat(strcpy(tmp, path), ".tmp");
+    sapc_write(tmp, old? old->fingerprint : sapc_fingerprint((const bwt_t *const*)bwt), n_intv, intv, n_sa, sa);
+    sapc_close(old);
+    if (rename(tmp, path) != 0) err_fatal(__func__, "fail to rename '%s' to '%s'.", tmp, path);
+    fprintf(stderr, "[%s] wrote %llu intervals, %.1f MB of SA values, to '%s'\n", __func__,
+            (unsigned long long)n_intv, n_sa * 8.0 / 1048576.0, path);
+
+    free(intv);
+    free(sa);
+    bwt_destroy(bwt[0]);
+    bwt_destroy(bwt[1]);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef SAPC_H
+#define SAPC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bwt.h"
+#include "bwtaln.h"
+#include "bwtcache.h"
+
+/* A persistent cache of the SA values of frequently hit wide intervals, in
+ * <prefix>.sapc. It is built, or warmed, from .sai files by `bwa sapc' and
+ * consulted by sampe before the intervals are walked through the BWT. The
+ * file is tied to its index by a checksum of the two BWTs.
+ *
+ *   header   "BSPC", u32 version, u64 fingerprint, u64 n_intv, u64 n_sa
+ *   index    n_intv sapc_intv_t, sorted by (strand, k, l)
+ *   values   n_sa u64; those of an interval start at its off
+ *
+ * SA values rather than positions are kept, as on the reverse strand the
+ * position depends on the read length too. Integers are in host order, as
+ * in the index files. */
+
+#define SAPC_VERSION 2
+
+typedef struct {
+    uint64_t k, l, off;
+    uint32_t a, dummy; // a as in bwt_aln1_t
+} sapc_intv_t;
+
+typedef struct {
+    char *fn;
+    uint64_t seq_len; // of the reverse BWT
+    uint64_t fingerprint;
+    uint64_t n_intv, n_sa;
+    const sapc_intv_t *intv;
+    const uint64_t *sa;
+    void *mm;
+    size_t mm_len;
+    uint64_t n_hits;
+} sapc_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // a checksum of every character of the two BWTs, and of their lengths, primaries and C()
+    uint64_t sapc_fingerprint(const bwt_t *const bwt[2]);
+    // the cache of prefix; NULL if there is none or it belongs to another index
+    sapc_t *sapc_open(const char *prefix, const bwt_t *const bwt[2]);
+    void sapc_close(sapc_t *pc);
+    // 1 with the positions of a, plus offset, in *pos if a is in the cache; safe from several threads
+    int sapc_get(sapc_t *pc, uint64_t offset, const bwt_aln1_t *a, uint32_t seqlen, poslist_t *pos);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAPC_H */
@@ -0,0 +1,31 @@
+#!/bin/sh
+# sai_pipe.sh BWA DIR: sampe must read .sai files from pipes, which have no
+# block index, past the first batch of 0x40000 pairs as it reads them from
+# files.
+set -e
+BWA=$1; DIR=$2; N=300000
+mkdir -p "$DIR"; cd "$DIR"
+awk -v n=$N 'BEGIN {
+	srand(1); b = "ACGT"; comp["A"] = "T"; comp["C"] = "G"; comp["G"] = "C"; comp["T"] = "A";
+	for (i = 0; i < 20000; ++i) g = g substr(b, int(rand() * 4) + 1, 1);
+	print ">ref" > "ref.fa";
+	for (i = 1; i <= length(g); i += 60) print substr(g, i, 60) > "ref.fa";
+	q = "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII";
+	for (i = 0; i < n; ++i) {
+		p = int(rand() * (length(g) - 300)) + 1;
+		r = ""; s = substr(g, p + 200, 35);
+		for (j = 35; j >= 1; --j) r = r comp[substr(s, j, 1)];
+		printf("@p%d/1\n%s\n+\n%s\n", i, substr(g, p, 35), q) > "r1.fq";
+		printf("@p%d/2\n%s\n+\n%s\n", i, r, q) > "r2.fq";
+	}
+}'
+"$BWA" index ref.fa 2>/dev/null
+"$BWA" aln ref.fa r1.fq > r1.sai 2>/dev/null
+"$BWA" aln ref.fa r2.fq > r2.sai 2>/dev/null
+"$BWA" sampe ref.fa r1.sai r2.sai r1.fq r2.fq 2>/dev/null | grep -v '^@' > file.sam
+rm -f r1.pipe r2.pipe; mkfifo r1.pipe r2.pipe
+cat r1.sai > r1.pipe & cat r2.sai > r2.pipe &
+"$BWA" sampe ref.fa r1.pipe r2.pipe r1.fq r2.fq 2>/dev/null | grep -v '^@' > pipe.sam
+wait
+test "$(wc -l < file.sam)" -eq $((2 * N))
+cmp file.sam pipe.sam
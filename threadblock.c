@@ -7,45 +7,332 @@
 #include <pthread.h>
 #endif /* HAVE_PTHREAD */
 
+#define psafe(expr, msg) xassert((expr)==0, msg)
+
+/* the share of a job left to a worker, packed as beg<<32|end so that it can
+ * be claimed and stolen with a single compare-and-swap */
 typedef struct {
-    pthread_t tid;
-    uint32_t size;
-    uint32_t idx;
+    volatile uint64_t r;
+    char pad[64 - sizeof(uint64_t)]; // one cache line per worker
+} __threadpool_range_t;
+
+#define range_beg(x) ((uint32_t)((x)>>32))
+#define range_end(x) ((uint32_t)(x))
+#define range_pack(b, e) ((uint64_t)(b)<<32 | (e))
+
+typedef struct {
+    threadpool_t *tp;
+    uint32_t tid;
+} __threadpool_worker_t;
+
+struct _threadpool_t {
+    uint32_t n_threads;
+    __threadpool_range_t *range;
+
+    // the current job
+    threadrangefn_t func;
     void *data;
+    uint32_t chunk;
+
+#ifdef HAVE_PTHREAD
+    pthread_t *tid;
+    __threadpool_worker_t *worker;
+    pthread_mutex_t mtx;
+    pthread_cond_t cv_job, cv_done;
+    uint64_t job_id;
+    uint32_t n_busy;
+    int quit;
+#endif /* HAVE_PTHREAD */
+};
+
+// take up to 'chunk' items from the front of r
+static int range_claim(volatile uint64_t *r, uint32_t chunk, uint32_t *beg, uint32_t *end)
+{
+    for (;;) {
+        uint64_t x = *r;
+        uint32_t b = range_beg(x), e = range_end(x), m;
+        if (b >= e) return 0;
+        m = e - b > chunk? b + chunk : e;
+        if (__sync_bool_compare_and_swap(r, x, range_pack(m, e))) {
+            *beg = b; *end = m;
+            return 1;
+        }
+    }
+}
+
+// take the back half of r, but at least 'chunk' items
+static int range_steal(volatile uint64_t *r, uint32_t chunk, uint32_t *beg, uint32_t *end)
+{
+    for (;;) {
+        uint64_t x = *r;
+        uint32_t b = range_beg(x), e = range_end(x), m;
+        if (b >= e) return 0;
+        m = e - b > chunk? e - ((e - b) / 2 > chunk? (e - b) / 2 : chunk) : b;
+        if (__sync_bool_compare_and_swap(r, x, range_pack(b, m))) {
+            *beg = m; *end = e;
+            return 1;
+        }
+    }
+}
+
+static void __threadpool_run(threadpool_t *tp, uint32_t tid)
+{
+    volatile uint64_t *own = &tp->range[tid].r;
+    uint32_t beg = 0, end = 0, i;
+    for (;;) {
+        while (range_claim(own, tp->chunk, &beg, &end))
+            tp->func(tid, beg, end, tp->data);
+        // our share is done; steal from the others, starting with the next worker
+        for (i = 1; i < tp->n_threads; ++i)
+            if (range_steal(&tp->range[(tid + i) % tp->n_threads].r, tp->chunk, &beg, &end)) break;
+        if (i == tp->n_threads) return;
+        // only we write to our own share once it is empty, but thieves may still be reading it
+        __sync_lock_test_and_set(own, range_pack(beg, end));
+    }
+}
+
+#ifdef HAVE_PTHREAD
+static void *__threadpool_worker(void *data)
+{
+    __threadpool_worker_t *w = (__threadpool_worker_t*)data;
+    threadpool_t *tp = w->tp;
+    uint64_t job_id = 0;
+    for (;;) {
+        psafe(pthread_mutex_lock(&tp->mtx), "failed to lock mutex");
+        while (!tp->quit && tp->job_id == job_id)
+            psafe(pthread_cond_wait(&tp->cv_job, &tp->mtx), "failed to wait on condition variable");
+        job_id = tp->job_id;
+        psafe(pthread_mutex_unlock(&tp->mtx), "failed to unlock mutex");
+        if (tp->quit) break;
+
+        __threadpool_run(tp, w->tid);
+
+        psafe(pthread_mutex_lock(&tp->mtx), "failed to lock mutex");
+        if (--tp->n_busy == 0) pthread_cond_broadcast(&tp->cv_done);
+        psafe(pthread_mutex_unlock(&tp->mtx), "failed to unlock mutex");
+    }
+    return NULL;
+}
+#endif /* HAVE_PTHREAD */
+
+threadpool_t *threadpool_create(uint32_t n_threads)
+{
+    threadpool_t *tp = calloc(1, sizeof(threadpool_t));
+#ifndef HAVE_PTHREAD
+    n_threads = 1;
+#endif /* HAVE_PTHREAD */
+    tp->n_threads = n_threads > 0? n_threads : 1;
+    if (posix_memalign((void**)&tp->range, 64, tp->n_threads * sizeof(__threadpool_range_t)) != 0)
+        err_fatal_simple("failed to allocate the thread pool.");
+#ifdef HAVE_PTHREAD
+    if (tp->n_threads > 1) {
+        uint32_t i;
+        psafe(pthread_mutex_init(&tp->mtx, NULL), "failed to initialize pool mutex");
+        psafe(pthread_cond_init(&tp->cv_job, NULL), "failed to initialize condition variable");
+        psafe(pthread_cond_init(&tp->cv_done, NULL), "failed to initialize condition variable");
+        tp->tid = calloc(tp->n_threads, sizeof(pthread_t));
+        tp->worker = calloc(tp->n_threads, sizeof(__threadpool_worker_t));
+        for (i = 0; i < tp->n_threads; ++i) {
+            tp->worker[i].tp = tp;
+            tp->worker[i].tid = i;
+            if (pthread_create(&tp->tid[i], NULL, __threadpool_worker, tp->worker + i) != 0)
+                err_fatal_simple("thread creation failed.");
+        }
+    }
+#endif /* HAVE_PTHREAD */
+    return tp;
+}
+
+void threadpool_destroy(threadpool_t *tp)
+{
+    if (tp == NULL) return;
+#ifdef HAVE_PTHREAD
+    if (tp->n_threads > 1) {
+        uint32_t i;
+        threadpool_wait(tp);
+        psafe(pthread_mutex_lock(&tp->mtx), "failed to lock mutex");
+        tp->quit = 1;
+        pthread_cond_broadcast(&tp->cv_job);
+        psafe(pthread_mutex_unlock(&tp->mtx), "failed to unlock mutex");
+        for (i = 0; i < tp->n_threads; ++i)
+            pthread_join(tp->tid[i], NULL);
+        psafe(pthread_mutex_destroy(&tp->mtx), "failed to destroy mutex");
+        psafe(pthread_cond_destroy(&tp->cv_job), "failed to destroy condition variable");
+        psafe(pthread_cond_destroy(&tp->cv_done), "failed to destroy condition variable");
+        free(tp->tid); free(tp->worker);
+    }
+#endif /* HAVE_PTHREAD */
+    free(tp->range);
+    free(tp);
+}
+
+uint32_t threadpool_size(const threadpool_t *tp)
+{
+    return tp->n_threads;
+}
+
+void threadpool_start(threadpool_t *tp, uint32_t n, uint32_t chunk, threadrangefn_t func, void *data)
+{
+    uint32_t i;
+    tp->func = func; tp->data = data;
+    tp->chunk = chunk > 0? chunk : 1;
+    for (i = 0; i < tp->n_threads; ++i)
+        tp->range[i].r = range_pack((uint64_t)n * i / tp->n_threads, (uint64_t)n * (i + 1) / tp->n_threads);
+#ifdef HAVE_PTHREAD
+    if (tp->n_threads > 1) {
+        psafe(pthread_mutex_lock(&tp->mtx), "failed to lock mutex");
+        xassert(tp->n_busy == 0, "a job is already running in the pool.");
+        tp->n_busy = tp->n_threads;
+        ++tp->job_id;
+        pthread_cond_broadcast(&tp->cv_job);
+        psafe(pthread_mutex_unlock(&tp->mtx), "failed to unlock mutex");
+        return;
+    }
+#endif /* HAVE_PTHREAD */
+    __threadpool_run(tp, 0); /* run inline */
+}
+
+void threadpool_wait(threadpool_t *tp)
+{
+#ifdef HAVE_PTHREAD
+    if (tp->n_threads > 1) {
+        psafe(pthread_mutex_lock(&tp->mtx), "failed to lock mutex");
+        while (tp->n_busy)
+            psafe(pthread_cond_wait(&tp->cv_done, &tp->mtx), "failed to wait on condition variable");
+        psafe(pthread_mutex_unlock(&tp->mtx), "failed to unlock mutex");
+    }
+#endif /* HAVE_PTHREAD */
+}
+
+void threadpool_exec(threadpool_t *tp, uint32_t n, uint32_t chunk, threadrangefn_t func, void *data)
+{
+    threadpool_start(tp, n, chunk, func, data);
+    threadpool_wait(tp);
+}
+
+static threadpool_t *g_shared_pool;
+
+static void __threadpool_free_shared(void)
+{
+    threadpool_destroy(g_shared_pool);
+}
+
+threadpool_t *threadpool_shared(uint32_t n_threads)
+{
+    if (g_shared_pool && g_shared_pool->n_threads != (n_threads > 0? n_threads : 1)) {
+        threadpool_destroy(g_shared_pool);
+        g_shared_pool = NULL;
+    }
+    if (g_shared_pool == NULL) {
+        static int registered = 0;
+        if (!registered && atexit(__threadpool_free_shared) != 0)
+            err_fatal_simple("failed to register the pool for destruction.");
+        registered = 1;
+        g_shared_pool = threadpool_create(n_threads);
+    }
+    return g_shared_pool;
+}
+
+typedef struct {
     threadblockfn_t func;
+    uint32_t size;
+    void *data;
 } __threadblock_t;
 
-static void *__threadblock_dispatch(void *data) {
+static void __threadblock_dispatch(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+{
     __threadblock_t *tb = (__threadblock_t*)data;
-    tb->func(tb->idx, tb->size, tb->data);
-    return NULL;
+    for (; beg < end; ++beg)
+        tb->func(beg, tb->size, tb->data);
 }
 
 void threadblock_exec(uint32_t size, threadblockfn_t func, void *data)
 {
-    uint32_t i;
+    __threadblock_t tb;
+    tb.func = func; tb.size = size; tb.data = data;
+    threadpool_exec(threadpool_shared(size), size, 1, __threadblock_dispatch, &tb);
+}
+
+struct _threadqueue_t {
+    void **items;
+    uint32_t capacity, head, n;
+    int closed;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t mtx;
+    pthread_cond_t cv_push, cv_pop;
+#endif /* HAVE_PTHREAD */
+};
 
-    __threadblock_t *tb = calloc(size, sizeof(__threadblock_t));
-    for (i = 0; i < size; ++i) {
-        tb[i].size = size;
-        tb[i].idx = i;
-        tb[i].data = data;
-        tb[i].func = func;
+threadqueue_t *threadqueue_create(uint32_t capacity)
+{
+    threadqueue_t *q = calloc(1, sizeof(threadqueue_t));
+    q->capacity = capacity > 0? capacity : 1;
+    q->items = calloc(q->capacity, sizeof(void*));
+#ifdef HAVE_PTHREAD
+    psafe(pthread_mutex_init(&q->mtx, NULL), "failed to initialize queue mutex");
+    psafe(pthread_cond_init(&q->cv_push, NULL), "failed to initialize condition variable");
+    psafe(pthread_cond_init(&q->cv_pop, NULL), "failed to initialize condition variable");
+#endif /* HAVE_PTHREAD */
+    return q;
+}
 
+void threadqueue_destroy(threadqueue_t *q)
+{
+    if (q == NULL) return;
 #ifdef HAVE_PTHREAD
-        if (size > 1) {
-            if (pthread_create(&tb[i].tid, NULL, __threadblock_dispatch, tb+i) != 0)
-                err_fatal_simple("thread creation failed.");
-        } else
+    psafe(pthread_mutex_destroy(&q->mtx), "failed to destroy mutex");
+    psafe(pthread_cond_destroy(&q->cv_push), "failed to destroy condition variable");
+    psafe(pthread_cond_destroy(&q->cv_pop), "failed to destroy condition variable");
 #endif /* HAVE_PTHREAD */
-            __threadblock_dispatch(tb+i); /* dispatch inline */
-    }
+    free(q->items);
+    free(q);
+}
 
+void threadqueue_push(threadqueue_t *q, void *item)
+{
 #ifdef HAVE_PTHREAD
-    if (size > 1) {
-        for (i = 0; i < size; ++i)
-            pthread_join(tb[i].tid, NULL);
+    psafe(pthread_mutex_lock(&q->mtx), "failed to lock mutex");
+    while (q->n == q->capacity && !q->closed)
+        psafe(pthread_cond_wait(&q->cv_pop, &q->mtx), "failed to wait on condition variable");
+#endif /* HAVE_PTHREAD */
+    xassert(!q->closed, "push to a closed queue.");
+    xassert(q->n < q->capacity, "push to a full queue.");
+    q->items[(q->head + q->n++) % q->capacity] = item;
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal(&q->cv_push);
+    psafe(pthread_mutex_unlock(&q->mtx), "failed to unlock mutex");
+#endif /* HAVE_PTHREAD */
+}
+
+void *threadqueue_pop(threadqueue_t *q)
+{
+    void *item = NULL;
+#ifdef HAVE_PTHREAD
+    psafe(pthread_mutex_lock(&q->mtx), "failed to lock mutex");
+    while (q->n == 0 && !q->closed)
+        psafe(pthread_cond_wait(&q->cv_push, &q->mtx), "failed to wait on condition variable");
+#endif /* HAVE_PTHREAD */
+    if (q->n) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        --q->n;
     }
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal(&q->cv_pop);
+    psafe(pthread_mutex_unlock(&q->mtx), "failed to unlock mutex");
+#endif /* HAVE_PTHREAD */
+    return item;
+}
+
+void threadqueue_close(threadqueue_t *q)
+{
+#ifdef HAVE_PTHREAD
+    psafe(pthread_mutex_lock(&q->mtx), "failed to lock mutex");
+#endif /* HAVE_PTHREAD */
+    q->closed = 1;
+#ifdef HAVE_PTHREAD
+    pthread_cond_broadcast(&q->cv_push);
+    pthread_cond_broadcast(&q->cv_pop);
+    psafe(pthread_mutex_unlock(&q->mtx), "failed to unlock mutex");
 #endif /* HAVE_PTHREAD */
-    free(tb);
 }
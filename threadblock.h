@@ -14,6 +14,59 @@
  */
 
 typedef void (*threadblockfn_t)(uint32_t, uint32_t, void*);
-void threadblock_exec(uint32_t size, threadblockfn_t func, void *data);
+
+/* range functions look like:
+ *
+ * void myfunc(uint32_t tid, uint32_t beg, uint32_t end, void *data)
+ *
+ * and process items [beg,end) of a job on worker 'tid' of the pool. A worker
+ * calls it many times per job, so per-worker state is best kept in an
+ * array indexed by tid.
+ */
+
+typedef void (*threadrangefn_t)(uint32_t, uint32_t, uint32_t, void*);
+
+/* A pool of worker threads that live as long as the pool. A job of n items
+ * is split evenly between the workers; each worker claims 'chunk' items at
+ * a time from its own share and, once that is done, steals half of what is
+ * left of another worker's share. Claiming and stealing are lock-free. */
+typedef struct _threadpool_t threadpool_t;
+
+/* A bounded FIFO of pointers that hands work from one pipeline stage to
+ * the next. threadqueue_push() blocks while the queue is full and
+ * threadqueue_pop() while it is empty; once the queue is closed, pop
+ * returns NULL after the remaining items have been taken. */
+typedef struct _threadqueue_t threadqueue_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    threadpool_t *threadpool_create(uint32_t n_threads);
+    void threadpool_destroy(threadpool_t *tp);
+    uint32_t threadpool_size(const threadpool_t *tp);
+
+    /* threadpool_start() returns at once so that the caller can do I/O while
+     * the job runs; threadpool_wait() blocks until it is finished. One job
+     * runs at a time. With a single worker, the job runs in the caller. */
+    void threadpool_start(threadpool_t *tp, uint32_t n, uint32_t chunk, threadrangefn_t func, void *data);
+    void threadpool_wait(threadpool_t *tp);
+    void threadpool_exec(threadpool_t *tp, uint32_t n, uint32_t chunk, threadrangefn_t func, void *data);
+
+    /* the pool shared by threadblock_exec() and other callers that do not keep
+     * their own; created on first use and re-created if n_threads changes */
+    threadpool_t *threadpool_shared(uint32_t n_threads);
+
+    void threadblock_exec(uint32_t size, threadblockfn_t func, void *data);
+
+    threadqueue_t *threadqueue_create(uint32_t capacity);
+    void threadqueue_destroy(threadqueue_t *q);
+    void threadqueue_push(threadqueue_t *q, void *item);
+    void *threadqueue_pop(threadqueue_t *q);
+    void threadqueue_close(threadqueue_t *q);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* THREADBLOCK_H */
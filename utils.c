@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#include <sys/time.h>
 #include "utils.h"
 
 FILE *err_xopen_core(const char *func, const char *fn, const char *mode)
@@ -80,3 +81,20 @@ void err_fatal_simple_core(const char *func, const char *msg)
 	fprintf(stderr, "[%s] %s Abort!\n", func, msg);
 	abort();
 }
+
+double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+uint64_t bwa_parse_size(const char *s)
+{
+	char *p;
+	double x = strtod(s, &p);
+	if (*p == 'K' || *p == 'k') x *= 1024.0, ++p;
+	else if (*p == 'M' || *p == 'm') x *= 1024.0 * 1024.0, ++p;
+	else if (*p == 'G' || *p == 'g') x *= 1024.0 * 1024.0 * 1024.0, ++p;
+	return *p || x < 0.0? 0 : (uint64_t)x;
+}
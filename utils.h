@@ -29,6 +29,7 @@
 #define LH3_UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <zlib.h>
 
 #define err_fatal_simple(msg) err_fatal_simple_core(__func__, msg)
@@ -46,6 +47,8 @@ extern "C" {
 	FILE *err_xopen_core(const char *func, const char *fn, const char *mode);
 	FILE *err_xreopen_core(const char *func, const char *fn, const char *mode, FILE *fp);
 	gzFile err_xzopen_core(const char *func, const char *fn, const char *mode);
+	uint64_t bwa_parse_size(const char *s); // bytes, with an optional K, M or G suffix; 0 if malformed
+	double realtime(); // wall-clock seconds
 
 #ifdef __cplusplus
 }